@@ -339,6 +339,7 @@ static config_var_t option_vars_[] = {
   V(CircuitsAvailableTimeout,    INTERVAL, "0"),
   V(CircuitStreamTimeout,        INTERVAL, "0"),
   V(CircuitPriorityHalflife,     DOUBLE,  "-1.0"), /*negative:'Use default'*/
+  V(CircuitPriorityWheel,        AUTOBOOL, "auto"),
   V(ClientDNSRejectInternalAddresses, BOOL,"1"),
   V(ClientOnly,                  BOOL,     "0"),
   V(ClientPreferIPv6ORPort,      AUTOBOOL, "auto"),
@@ -409,6 +410,9 @@ static config_var_t option_vars_[] = {
   V(DoSConnectionDefenseType,    INT,      "0"),
   /* DoS single hop client options. */
   V(DoSRefuseSingleHopClientRendezvous,    AUTOBOOL, "auto"),
+  /* DoS early rejection options. */
+  V(DoSRejectMarkedAddresses,    AUTOBOOL, "auto"),
+  V(DoSRejectHelper,             FILENAME, NULL),
   V(DownloadExtraInfo,           BOOL,     "0"),
   V(TestingEnableConnBwEvent,    BOOL,     "0"),
   V(TestingEnableCellStatsEvent, BOOL,     "0"),
@@ -596,6 +600,7 @@ static config_var_t option_vars_[] = {
   V(RejectPlaintextPorts,        CSV,      ""),
   V(RelayBandwidthBurst,         MEMUNIT,  "0"),
   V(RelayBandwidthRate,          MEMUNIT,  "0"),
+  V(RelayCryptoOffload,          BOOL,     "0"),
   V(RendPostPeriod,              INTERVAL, "1 hour"),
   V(RephistTrackTime,            INTERVAL, "24 hours"),
   V(RunAsDaemon,                 BOOL,     "0"),
@@ -616,8 +621,11 @@ static config_var_t option_vars_[] = {
   OBSOLETE("SchedulerHighWaterMark__"),
   OBSOLETE("SchedulerMaxFlushCells__"),
   V(KISTSchedRunInterval,        MSEC_INTERVAL, "0 msec"),
+  V(KISTSchedQuantum,            INT,      "0"),
+  V(KISTSockInfoMaxAge,          INT,      "-1"),
   V(KISTSockBufSizeFactor,       DOUBLE,   "1.0"),
   V(Schedulers,                  CSV,      "KIST,KISTLite,Vanilla"),
+  V(SchedulerStats,              BOOL,     "0"),
   V(ShutdownWaitLength,          INTERVAL, "30 seconds"),
   OBSOLETE("SocksListenAddress"),
   V(SocksPolicy,                 LINELIST, NULL),
@@ -3255,6 +3263,21 @@ options_validate_scheduler(or_options_t *options, char **msg)
     return -1;
   }
 
+  /* Zero means "use the consensus value". */
+  if (options->KISTSchedQuantum < 0 ||
+      options->KISTSchedQuantum > KIST_SCHED_QUANTUM_MAX) {
+    tor_asprintf(msg, "KISTSchedQuantum must be between 0 and %d (cells)",
+                 KIST_SCHED_QUANTUM_MAX);
+    return -1;
+  }
+
+  /* Negative values mean "use the consensus value". */
+  if (options->KISTSockInfoMaxAge > KIST_SOCK_INFO_MAX_AGE_MAX) {
+    tor_asprintf(msg, "KISTSockInfoMaxAge must not be more than %d (runs)",
+                 KIST_SOCK_INFO_MAX_AGE_MAX);
+    return -1;
+  }
+
   return 0;
 }
 
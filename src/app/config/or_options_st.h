@@ -378,6 +378,8 @@ struct or_options_t {
   uint64_t PerConnBWRate; /**< Long-term bw on a single TLS conn, if set. */
   uint64_t PerConnBWBurst; /**< Allowed burst on a single TLS conn, if set. */
   int NumCPUs; /**< How many CPUs should we try to use? */
+  /** If true, do the relay crypto for busy circuits on the cpuworkers. */
+  int RelayCryptoOffload;
   struct config_line_t *RendConfigLines; /**< List of configuration lines
                                           * for rendezvous services. */
   struct config_line_t *HidServAuth; /**< List of configuration lines for
@@ -391,6 +393,9 @@ struct or_options_t {
                         * have passed. */
   int MainloopStats; /**< Log main loop statistics as part of the
                       * heartbeat messages. */
+  int SchedulerStats; /**< Keep histograms of cell queueing delay and
+                       * scheduler runs, and log them as part of the
+                       * heartbeat messages. */
 
   char *HTTPProxy; /**< hostname[:port] to use as http proxy, if any. */
   tor_addr_t HTTPProxyAddr; /**< Parsed IPv4 addr for http proxy, if any. */
@@ -858,6 +863,11 @@ struct or_options_t {
    */
   double CircuitPriorityHalflife;
 
+  /** If 1, keep track of the circuits on each new connection with a wheel of
+   * buckets rather than a heap, when picking which one to relay from. If 0,
+   * use the heap. If -1, do what the consensus says. */
+  int CircuitPriorityWheel;
+
   /** Set to true if the TestingTorNetwork configuration option is set.
    * This is used so that options_validate() has a chance to realize that
    * the defaults have changed. */
@@ -1033,6 +1043,17 @@ struct or_options_t {
    * set to "10 msec" if the consensus doesn't say anything. */
   int KISTSchedRunInterval;
 
+  /** How many cells the KIST scheduler flushes from a channel each time it
+   * picks that channel. If zero, do what the consensus says, and fall back to
+   * 8 cells if the consensus doesn't say anything. */
+  int KISTSchedQuantum;
+
+  /** For how many KIST scheduler runs we may keep using a socket's write
+   * limit without asking the kernel again. If negative, do what the
+   * consensus says, and fall back to 0 (ask every run) if the consensus
+   * doesn't say anything. */
+  int KISTSockInfoMaxAge;
+
   /** A multiplier for the KIST per-socket limit calculation. */
   double KISTSockBufSizeFactor;
 
@@ -1079,6 +1100,13 @@ struct or_options_t {
   /** Autobool: Do we refuse single hop client rendezvous? */
   int DoSRefuseSingleHopClientRendezvous;
 
+  /** Autobool: Do we refuse new connections from client addresses that the
+   * circuit creation mitigation has marked? */
+  int DoSRejectMarkedAddresses;
+  /** If set, a program that we tell about every address that we start
+   * refusing, so that it can block them before they reach us. */
+  char *DoSRejectHelper;
+
   /** Interval: how long without activity does it take for a client
    * to become dormant?
    **/
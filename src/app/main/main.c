@@ -332,6 +332,7 @@ dumpmemusage(int severity)
       (rephist_total_alloc), rephist_total_num);
   dump_routerlist_mem_usage(severity);
   dump_cell_pool_usage(severity);
+  buf_dump_freelist_sizes(severity);
   dump_dns_mem_usage(severity);
   tor_log_mallinfo(severity);
 }
@@ -771,6 +772,7 @@ tor_free_all(int postfork)
   dns_free_all();
   clear_pending_onions();
   circuit_free_all();
+  packed_cell_pool_shrink();
   circpad_machines_free();
   entry_guards_free_all();
   pt_free_all();
@@ -820,6 +822,10 @@ tor_free_all(int postfork)
   if (!postfork) {
     esc_router_info(NULL);
   }
+
+  /* Last: everything above (including the process subsystem) may have
+   * returned buffer chunks to the freelists. */
+  buf_shrink_freelists(1);
 }
 
 /**
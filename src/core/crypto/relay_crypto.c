@@ -151,15 +151,37 @@ relay_decrypt_cell(circuit_t *circ, cell_t *cell,
       log_fn(LOG_PROTOCOL_WARN, LD_OR,
              "Incoming cell at client not recognized. Closing.");
       return -1;
-    } else {
-      relay_crypto_t *crypto = &TO_OR_CIRCUIT(circ)->crypto;
-      /* We're in the middle. Encrypt one layer. */
-      relay_crypt_one_payload(crypto->b_crypto, cell->payload);
     }
+  }
+  relay_crypto_decrypt_at_relay(&TO_OR_CIRCUIT(circ)->crypto, cell,
+                                cell_direction, recognized);
+  return 0;
+}
+
+/** Do the en/decryption for <b>cell</b>, arriving in direction
+ * <b>cell_direction</b> at a relay (not at the origin) that shares the keys
+ * in <b>crypto</b> with the client.
+ *
+ * Inbound cells get one layer of encryption, and are never recognized.
+ * Outbound cells get one layer of decryption; if the result is for us, set
+ * *<b>recognized</b> to 1.
+ *
+ * This function only touches <b>cell</b> and <b>crypto</b>, so it is safe
+ * to call from a worker thread, as long as nobody else is using
+ * <b>crypto</b> at the same time.
+ */
+void
+relay_crypto_decrypt_at_relay(relay_crypto_t *crypto, cell_t *cell,
+                              cell_direction_t cell_direction,
+                              char *recognized)
+{
+  relay_header_t rh;
+
+  if (cell_direction == CELL_DIRECTION_IN) {
+    /* We're in the middle. Encrypt one layer. */
+    relay_crypt_one_payload(crypto->b_crypto, cell->payload);
   } else /* cell_direction == CELL_DIRECTION_OUT */ {
     /* We're in the middle. Decrypt one layer. */
-    relay_crypto_t *crypto = &TO_OR_CIRCUIT(circ)->crypto;
-
     relay_crypt_one_payload(crypto->f_crypto, cell->payload);
 
     relay_header_unpack(&rh, cell->payload);
@@ -167,11 +189,9 @@ relay_decrypt_cell(circuit_t *circ, cell_t *cell,
       /* it's possibly recognized. have to check digest to be sure. */
       if (relay_digest_matches(crypto->f_digest, cell)) {
         *recognized = 1;
-        return 0;
       }
     }
   }
-  return 0;
 }
 
 /**
@@ -211,9 +231,21 @@ void
 relay_encrypt_cell_inbound(cell_t *cell,
                            or_circuit_t *or_circ)
 {
-  relay_set_digest(or_circ->crypto.b_digest, cell);
+  relay_crypto_encrypt_cell_inbound(&or_circ->crypto, cell);
+}
+
+/**
+ * As relay_encrypt_cell_inbound(), but use the keys in <b>crypto</b>.
+ *
+ * Like relay_crypto_decrypt_at_relay(), this is safe to call from a worker
+ * thread.
+ */
+void
+relay_crypto_encrypt_cell_inbound(relay_crypto_t *crypto, cell_t *cell)
+{
+  relay_set_digest(crypto->b_digest, cell);
   /* encrypt one layer */
-  relay_crypt_one_payload(or_circ->crypto.b_crypto, cell->payload);
+  relay_crypt_one_payload(crypto->b_crypto, cell->payload);
 }
 
 /**
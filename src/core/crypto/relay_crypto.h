@@ -23,6 +23,12 @@ void relay_encrypt_cell_outbound(cell_t *cell, origin_circuit_t *or_circ,
                             crypt_path_t *layer_hint);
 void relay_encrypt_cell_inbound(cell_t *cell, or_circuit_t *or_circ);
 
+void relay_crypto_decrypt_at_relay(relay_crypto_t *crypto, cell_t *cell,
+                                   cell_direction_t cell_direction,
+                                   char *recognized);
+void relay_crypto_encrypt_cell_inbound(relay_crypto_t *crypto,
+                                       cell_t *cell);
+
 void relay_crypto_clear(relay_crypto_t *crypto);
 
 void relay_crypto_assert_ok(const relay_crypto_t *crypto);
@@ -624,6 +624,7 @@ connection_free_minimal(connection_t *conn)
   if (!connection_is_listener(conn)) {
     buf_free(conn->inbuf);
     buf_free(conn->outbuf);
+    connection_clear_sendfile_source(conn);
   } else {
     if (conn->socket_family == AF_UNIX) {
       /* For now only control and SOCKS ports can be Unix domain sockets
@@ -867,6 +868,7 @@ connection_close_immediate(connection_t *conn)
   if (conn->outbuf)
     buf_clear(conn->outbuf);
   conn->outbuf_flushlen = 0;
+  connection_clear_sendfile_source(conn);
 }
 
 /** Mark <b>conn</b> to be closed next time we loop through
@@ -3142,12 +3144,12 @@ connection_bucket_write_limit(connection_t *conn, time_t now)
 {
   int base = RELAY_PAYLOAD_SIZE;
   int priority = conn->type != CONN_TYPE_DIR;
-  size_t conn_bucket = conn->outbuf_flushlen;
+  size_t conn_bucket = conn->outbuf_flushlen + conn->sendfile_remaining;
   size_t global_bucket_val = token_bucket_rw_get_write(&global_bucket);
 
   if (!connection_is_rate_limited(conn)) {
     /* be willing to write to local conns even if our buckets are empty */
-    return conn->outbuf_flushlen;
+    return conn_bucket;
   }
 
   if (connection_speaks_cells(conn)) {
@@ -3891,12 +3893,124 @@ connection_fetch_from_buf_http(connection_t *conn,
                              body_out, body_used, max_bodylen, force_complete);
 }
 
-/** Return conn-\>outbuf_flushlen: how many bytes conn wants to flush
- * from its outbuf. */
+/** Return true iff <b>conn</b> has anything to flush: either bytes on its
+ * outbuf, or bytes still to send from a file. */
 int
 connection_wants_to_flush(connection_t *conn)
 {
-  return conn->outbuf_flushlen > 0;
+  return conn->outbuf_flushlen > 0 || conn->sendfile_remaining > 0;
+}
+
+/** Return true iff we can send data on <b>conn</b> straight from a file
+ * with connection_set_sendfile_source(): that is, if this platform can,
+ * and <b>conn</b> has a socket of its own that we write to without TLS. */
+int
+connection_can_sendfile(const connection_t *conn)
+{
+#ifdef TOR_HAVE_SENDFILE
+  return SOCKET_OK(conn->s) && !conn->linked &&
+    !connection_speaks_cells(conn);
+#else
+  (void)conn;
+  return 0;
+#endif /* defined(TOR_HAVE_SENDFILE) */
+}
+
+/** Arrange for <b>conn</b> to send <b>len</b> bytes of the file <b>fd</b>,
+ * starting at <b>offset</b>, straight to its socket once it has flushed its
+ * outbuf.  Take ownership of <b>fd</b>.
+ *
+ * The caller must check connection_can_sendfile() first, and must not add
+ * anything to the outbuf until connection_wants_to_flush() says that these
+ * bytes have been sent, or they'll go out before the file does. */
+void
+connection_set_sendfile_source(connection_t *conn, int fd, off_t offset,
+                               size_t len)
+{
+  tor_assert(conn->sendfile_remaining == 0);
+  tor_assert(connection_can_sendfile(conn));
+
+  if (len == 0) {
+    close(fd);
+    return;
+  }
+  conn->sendfile_fd = fd;
+  conn->sendfile_offset = offset;
+  conn->sendfile_remaining = len;
+  connection_start_writing(conn);
+}
+
+/** Stop sending from <b>conn</b>'s file, if it was sending from one, and
+ * close the file. */
+void
+connection_clear_sendfile_source(connection_t *conn)
+{
+  if (conn->sendfile_remaining == 0)
+    return;
+  close(conn->sendfile_fd);
+  conn->sendfile_fd = -1;
+  conn->sendfile_remaining = 0;
+}
+
+/** Helper: send up to <b>max_to_write</b> bytes from <b>conn</b>'s file to
+ * its socket.  Return the number of bytes sent, or -1 on error.
+ *
+ * If the file is shorter than we were told (say, because it was truncated
+ * on disk), that's an error too: otherwise we would keep trying to send the
+ * rest forever. */
+static ssize_t
+connection_flush_sendfile_source(connection_t *conn, size_t max_to_write)
+{
+  size_t n = MIN(max_to_write, conn->sendfile_remaining);
+  ssize_t r;
+
+  if (BUG(n == 0))
+    return 0; // LCOV_EXCL_LINE
+  r = tor_sendfile(conn->s, conn->sendfile_fd, &conn->sendfile_offset, n);
+  if (r < 0) {
+    if (ERRNO_IS_EAGAIN(errno) || errno == EINTR)
+      return 0;
+    log_info(LD_NET, "sendfile() failed on fd %d: %s",
+             (int)conn->s, strerror(errno));
+    return -1;
+  }
+  if (r == 0) {
+    log_info(LD_NET, "File ended with %"TOR_PRIuSZ" bytes still to send "
+             "on fd %d.", conn->sendfile_remaining, (int)conn->s);
+    return -1;
+  }
+  if (BUG((size_t)r > n))
+    return -1; // LCOV_EXCL_LINE
+
+  conn->sendfile_remaining -= r;
+  if (conn->sendfile_remaining == 0) {
+    close(conn->sendfile_fd);
+    conn->sendfile_fd = -1;
+  }
+  return r;
+}
+
+/** Send up to <b>max_to_write</b> bytes from <b>conn</b>'s outbuf to its
+ * socket, and then, once the outbuf is empty, from the file it is sending
+ * with sendfile.  Return the number of bytes sent, or -1 on error.
+ *
+ * <b>conn</b> must have a socket of its own that we write to without
+ * TLS. */
+int
+connection_flush_to_socket(connection_t *conn, ssize_t max_to_write)
+{
+  int result = buf_flush_to_socket(conn->outbuf, conn->s,
+                                   MIN(max_to_write,
+                                       (ssize_t)conn->outbuf_flushlen),
+                                   &conn->outbuf_flushlen);
+  /* Once the outbuf is empty, we can send straight from a file. */
+  if (result >= 0 && conn->sendfile_remaining &&
+      !conn->outbuf_flushlen && result < max_to_write) {
+    ssize_t r = connection_flush_sendfile_source(conn,
+                                                 max_to_write - result);
+    result = (r < 0) ? -1 : result + (int)r;
+  }
+  return result;
 }
 
 /** Are there too many bytes on edge connection <b>conn</b>'s outbuf to
@@ -4032,7 +4146,8 @@ connection_handle_write_impl(connection_t *conn, int force)
       return -1;
   }
 
-  max_to_write = force ? (ssize_t)conn->outbuf_flushlen
+  max_to_write = force ?
+    (ssize_t)(conn->outbuf_flushlen + conn->sendfile_remaining)
     : connection_bucket_write_limit(conn, now);
 
   if (connection_speaks_cells(conn) &&
@@ -4128,8 +4243,7 @@ connection_handle_write_impl(connection_t *conn, int force)
     result = (int)(initial_size-buf_datalen(conn->outbuf));
   } else {
     CONN_LOG_PROTECT(conn,
-                     result = buf_flush_to_socket(conn->outbuf, conn->s,
-                                        max_to_write, &conn->outbuf_flushlen));
+                     result = connection_flush_to_socket(conn, max_to_write));
     if (result < 0) {
       if (CONN_IS_EDGE(conn))
         connection_edge_end_errno(TO_EDGE_CONN(conn));
@@ -217,6 +217,11 @@ int connection_fetch_from_buf_http(connection_t *conn,
                                size_t max_bodylen, int force_complete);
 
 int connection_wants_to_flush(connection_t *conn);
+int connection_can_sendfile(const connection_t *conn);
+void connection_set_sendfile_source(connection_t *conn, int fd, off_t offset,
+                                    size_t len);
+void connection_clear_sendfile_source(connection_t *conn);
+int connection_flush_to_socket(connection_t *conn, ssize_t max_to_write);
 int connection_outbuf_too_full(connection_t *conn);
 int connection_handle_write(connection_t *conn, int force);
 int connection_flush(connection_t *conn);
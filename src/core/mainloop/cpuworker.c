@@ -17,6 +17,7 @@
  *      <li>and for calculating diffs and compressing them in consdiffmgr.c.
  *  </ul>
  **/
+#define CPUWORKER_PRIVATE
 #include "core/or/or.h"
 #include "core/or/channel.h"
 #include "core/or/circuitbuild.h"
@@ -35,8 +36,7 @@
 
 #include "core/or/or_circuit_st.h"
 #include "lib/intmath/weakrng.h"
-
-static void queue_pending_tasks(void);
+#include "lib/math/histogram.h"
 
 typedef struct worker_state_s {
   int generation;
@@ -78,6 +78,12 @@ static tor_weak_rng_t request_sample_rng = TOR_WEAK_RNG_INIT;
 
 static int total_pending_tasks = 0;
 static int max_pending_tasks = 128;
+/** How many threads are in the threadpool? */
+static int n_cpuworker_threads = 1;
+
+/** Largest number of cpuworker replies that we handle in one go, before we
+ * let the main loop attend to our connections again. */
+#define CPUWORKER_MAX_REPLIES_PER_CALLBACK 256
 
 /** Initialize the cpuworker subsystem. It is OK to call this more than once
  * during Tor's lifetime.
@@ -87,6 +93,8 @@ cpu_init(void)
 {
   if (!replyqueue) {
     replyqueue = replyqueue_new(0);
+    replyqueue_set_max_per_process(replyqueue,
+                                   CPUWORKER_MAX_REPLIES_PER_CALLBACK);
   }
   if (!threadpool) {
     /*
@@ -96,6 +104,7 @@ cpu_init(void)
       least one thread of each kind.
     */
     const int n_threads = get_num_cpus(get_options()) + 1;
+    n_cpuworker_threads = n_threads;
     threadpool = threadpool_new(n_threads,
                                 replyqueue,
                                 worker_state_new,
@@ -112,65 +121,28 @@ cpu_init(void)
   crypto_seed_weak_rng(&request_sample_rng);
 }
 
-/** Magic numbers to make sure our cpuworker_requests don't grow any
- * mis-framing bugs. */
-#define CPUWORKER_REQUEST_MAGIC 0xda4afeed
-#define CPUWORKER_REPLY_MAGIC 0x5eedf00d
-
-/** A request sent to a cpuworker. */
-typedef struct cpuworker_request_t {
-  /** Magic number; must be CPUWORKER_REQUEST_MAGIC. */
-  uint32_t magic;
-
-  /** Flag: Are we timing this request? */
-  unsigned timed : 1;
-  /** If we're timing this request, when was it sent to the cpuworker? */
-  struct timeval started_at;
-
-  /** A create cell for the cpuworker to process. */
-  create_cell_t create_cell;
-
-  /* Turn the above into a tagged union if needed. */
-} cpuworker_request_t;
-
-/** A reply sent by a cpuworker. */
-typedef struct cpuworker_reply_t {
-  /** Magic number; must be CPUWORKER_REPLY_MAGIC. */
-  uint32_t magic;
-
-  /** True iff we got a successful request. */
-  uint8_t success;
-
-  /** Are we timing this request? */
-  unsigned int timed : 1;
-  /** What handshake type was the request? (Used for timing) */
-  uint16_t handshake_type;
-  /** When did we send the request to the cpuworker? */
-  struct timeval started_at;
-  /** Once the cpuworker received the request, how many microseconds did it
-   * take? (This shouldn't overflow; 4 billion micoseconds is over an hour,
-   * and we'll never have an onion handshake that takes so long.) */
-  uint32_t n_usec;
-
-  /** Output of processing a create cell
-   *
-   * @{
-   */
-  /** The created cell to send back. */
-  created_cell_t created_cell;
-  /** The keys to use on this circuit. */
-  uint8_t keys[CPATH_KEY_MATERIAL_LEN];
-  /** Input to use for authenticating introduce1 cells. */
-  uint8_t rend_auth_material[DIGEST_LEN];
-} cpuworker_reply_t;
-
-typedef struct cpuworker_job_u {
-  or_circuit_t *circ;
-  union {
-    cpuworker_request_t request;
-    cpuworker_reply_t reply;
-  } u;
-} cpuworker_job_t;
+/** Allocate and return a new batch with room for <b>n</b> jobs. */
+static cpuworker_batch_t *
+cpuworker_batch_new(int n)
+{
+  tor_assert(n >= 1 && n <= CPUWORKER_MAX_ONIONSKIN_BATCH);
+  return tor_malloc_zero(offsetof(cpuworker_batch_t, jobs) +
+                         n * sizeof(cpuworker_job_t));
+}
+
+#define cpuworker_batch_free(batch) \
+  FREE_AND_NULL(cpuworker_batch_t, cpuworker_batch_free_, (batch))
+
+/** Wipe and release all storage held in <b>batch</b>. */
+static void
+cpuworker_batch_free_(cpuworker_batch_t *batch)
+{
+  if (!batch)
+    return;
+  memwipe(batch, 0xe0, offsetof(cpuworker_batch_t, jobs) +
+          batch->n_jobs * sizeof(cpuworker_job_t));
+  tor_free(batch);
+}
 
 static workqueue_reply_t
 update_state_threadfn(void *state_, void *work_)
@@ -219,6 +191,36 @@ static uint64_t onionskins_usec_internal[MAX_ONION_HANDSHAKE_TYPE+1];
  */
 static uint64_t onionskins_usec_roundtrip[MAX_ONION_HANDSHAKE_TYPE+1];
 
+/** How much weight each new timing gets in the moving average of an
+ * onionskin type's cost. */
+#define ONIONSKIN_COST_EWMA_WEIGHT (1.0/32)
+/** Once the histogram of an onionskin type's costs holds this many timings,
+ * we halve it, so that its percentiles follow the current load. */
+#define ONIONSKIN_COST_HIST_MAX 4096
+/** Until we have timed this many onionskins of a type, we assume that each
+ * one takes a millisecond. */
+#define ONIONSKIN_COST_MIN_SAMPLES 100
+
+/** A model of how long a cpuworker takes to answer one kind of onionskin,
+ * kept up to date from the onionskins that we time. */
+typedef struct onionskin_cost_t {
+  /** How many onionskins of this type have we timed? */
+  uint64_t n_timed;
+  /** Exponentially weighted moving average of how many microseconds each
+   * one took. */
+  double ewma_usec;
+  /** Histogram of how many microseconds recent ones took. */
+  log_histogram_t usec;
+} onionskin_cost_t;
+
+/** Indexed by handshake type: our model of how long each type takes. */
+static onionskin_cost_t onionskin_cost[MAX_ONION_HANDSHAKE_TYPE+1];
+/** Indexed by handshake type: how many onionskins have we handed to the
+ * cpuworkers without getting an answer back yet? */
+static int onionskins_n_pending[MAX_ONION_HANDSHAKE_TYPE+1];
+/** How many batches of onionskins have the cpuworkers not answered yet? */
+static int onionskin_batches_n_pending = 0;
+
 /** If any onionskin takes longer than this, we clip them to this
  * time. (microseconds) */
 #define MAX_BELIEVABLE_ONIONSKIN_DELAY (2*1000*1000)
@@ -235,33 +237,124 @@ should_time_request(uint16_t onionskin_type)
    * sample */
   if (onionskins_n_processed[onionskin_type] < 4096)
     return 1;
-  /** Otherwise, measure with P=1/128.  We avoid doing this for every
-   * handshake, since the measurement itself can take a little time. */
-  return tor_weak_random_one_in_n(&request_sample_rng, 128);
+  /** Otherwise, measure with P=1/16.  We avoid doing this for every
+   * handshake, since the measurement itself can take a little time, but we
+   * want enough timings that our cost model keeps up with a sudden rush of
+   * requests. */
+  return tor_weak_random_one_in_n(&request_sample_rng, 16);
+}
+
+/** Note that a cpuworker took <b>usec</b> microseconds to answer an
+ * onionskin of type <b>onionskin_type</b>, and update our model of how long
+ * those take. */
+STATIC void
+cpuworker_note_onionskin_usec(uint16_t onionskin_type, uint32_t usec)
+{
+  onionskin_cost_t *cost;
+  double weight;
+
+  if (onionskin_type > MAX_ONION_HANDSHAKE_TYPE) /* should be impossible */
+    return;
+  cost = &onionskin_cost[onionskin_type];
+
+  /* Until we have enough timings for the moving average to mean anything,
+   * weigh them all the same. */
+  ++cost->n_timed;
+  weight = MAX(1.0 / cost->n_timed, ONIONSKIN_COST_EWMA_WEIGHT);
+  cost->ewma_usec += (usec - cost->ewma_usec) * weight;
+
+  if (cost->usec.n >= ONIONSKIN_COST_HIST_MAX)
+    log_histogram_halve(&cost->usec);
+  log_histogram_add(&cost->usec, usec);
 }
 
+#ifdef TOR_UNIT_TESTS
+/** Forget everything that our cost model has learned. */
+STATIC void
+cpuworker_reset_onionskin_costs(void)
+{
+  memset(onionskin_cost, 0, sizeof(onionskin_cost));
+}
+
+/** Pretend that we have <b>n_threads</b> cpuworkers, and that we should
+ * hand them no more than <b>max_pending</b> onionskins at once. */
+STATIC void
+cpuworker_set_limits_for_testing(int n_threads, int max_pending)
+{
+  n_cpuworker_threads = n_threads;
+  max_pending_tasks = max_pending;
+}
+#endif /* defined(TOR_UNIT_TESTS) */
+
 /** Return an estimate of how many microseconds we will need for a single
  * cpuworker to process <b>n_requests</b> onionskins of type
  * <b>onionskin_type</b>. */
 uint64_t
 estimated_usec_for_onionskins(uint32_t n_requests, uint16_t onionskin_type)
 {
+  const onionskin_cost_t *cost;
+
   if (onionskin_type > MAX_ONION_HANDSHAKE_TYPE) /* should be impossible */
     return 1000 * (uint64_t)n_requests;
-  if (PREDICT_UNLIKELY(onionskins_n_processed[onionskin_type] < 100)) {
-    /* Until we have 100 data points, just asssume everything takes 1 msec. */
+  cost = &onionskin_cost[onionskin_type];
+  if (PREDICT_UNLIKELY(cost->n_timed < ONIONSKIN_COST_MIN_SAMPLES)) {
+    /* Until we have enough data points, just asssume everything takes 1
+     * msec. */
     return 1000 * (uint64_t)n_requests;
   } else {
-    /* This can't overflow: we'll never have more than 500000 onionskins
-     * measured in onionskin_usec_internal, and they won't take anything near
-     * 1 sec each, and we won't have anything like 1 million queued
-     * onionskins.  But that's 5e5 * 1e6 * 1e6, which is still less than
-     * UINT64_MAX. */
-    return (onionskins_usec_internal[onionskin_type] * n_requests) /
-      onionskins_n_processed[onionskin_type];
+    /* Every timing is clipped to MAX_BELIEVABLE_ONIONSKIN_DELAY, so this
+     * can't overflow. */
+    return (uint64_t)(cost->ewma_usec * n_requests);
   }
 }
 
+/** Return an estimate of how many microseconds a single onionskin of type
+ * <b>onionskin_type</b> takes in the slowest 1% of cases. */
+uint64_t
+estimated_p99_usec_for_onionskin(uint16_t onionskin_type)
+{
+  if (onionskin_type > MAX_ONION_HANDSHAKE_TYPE ||
+      onionskin_cost[onionskin_type].n_timed < ONIONSKIN_COST_MIN_SAMPLES)
+    return 1000;
+  return log_histogram_percentile(&onionskin_cost[onionskin_type].usec, 99);
+}
+
+/** Return an estimate of how many microseconds the cpuworkers need to
+ * answer all the onionskins that we have already handed them.
+ *
+ * Each batch goes to a single thread, so when there are fewer batches out
+ * than CPUs, some CPUs are idle and the work takes longer than it would if
+ * it were spread out evenly. */
+uint64_t
+cpuworker_estimated_usec_in_flight(void)
+{
+  const int num_cpus = get_num_cpus(get_options());
+  uint64_t usec = 0;
+  int type, n_busy;
+
+  for (type = 0; type <= MAX_ONION_HANDSHAKE_TYPE; ++type)
+    usec += estimated_usec_for_onionskins(onionskins_n_pending[type],
+                                          (uint16_t) type);
+  n_busy = CLAMP(1, onionskin_batches_n_pending, num_cpus);
+  return usec / n_busy;
+}
+
+/** Adjust our counts of the onionskins that the cpuworkers have not answered
+ * yet by <b>delta</b> times the contents of <b>batch</b>. */
+static void
+cpuworker_batch_note_pending(const cpuworker_batch_t *batch, int delta)
+{
+  int i;
+
+  for (i = 0; i < batch->n_jobs; ++i) {
+    tor_assert(batch->jobs[i].handshake_type <= MAX_ONION_HANDSHAKE_TYPE);
+    onionskins_n_pending[batch->jobs[i].handshake_type] += delta;
+    tor_assert(onionskins_n_pending[batch->jobs[i].handshake_type] >= 0);
+  }
+  onionskin_batches_n_pending += delta;
+  tor_assert(onionskin_batches_n_pending >= 0);
+}
+
 /** Compute the absolute and relative overhead of using the cpuworker
  * framework for onionskins of type <b>onionskin_type</b>.*/
 static int
@@ -310,17 +403,45 @@ cpuworker_log_onionskin_overhead(int severity, int onionskin_type,
          onionskin_type_name, (unsigned)overhead, relative_overhead*100);
 }
 
-/** Handle a reply from the worker threads. */
+/** Implementation helper for GETINFO: answers questions about our model of
+ * how long the cpuworkers take to answer onionskins. */
+int
+getinfo_helper_onionskin_cost(control_connection_t *conn,
+                              const char *question, char **answer,
+                              const char **errmsg)
+{
+  const onionskin_cost_t *cost;
+  uint16_t type;
+
+  (void) conn;
+  (void) errmsg;
+
+  if (!strcmp(question, "onionskin-cost/tap"))
+    type = ONION_HANDSHAKE_TYPE_TAP;
+  else if (!strcmp(question, "onionskin-cost/ntor"))
+    type = ONION_HANDSHAKE_TYPE_NTOR;
+  else
+    return 0;
+
+  cost = &onionskin_cost[type];
+  tor_asprintf(answer, "timed=%"PRIu64" ewma-usec=%"PRIu64
+               " p50-usec=%"PRIu32" p99-usec=%"PRIu32
+               " pending=%d queued=%d queue-delay-usec=%"PRIu64,
+               cost->n_timed, (uint64_t) cost->ewma_usec,
+               log_histogram_percentile(&cost->usec, 50),
+               log_histogram_percentile(&cost->usec, 99),
+               onionskins_n_pending[type], onion_num_pending(type),
+               onion_estimated_queue_delay_usec(type));
+  return 0;
+}
+
+/** Handle the reply to a single <b>job</b> from the worker threads. */
 static void
-cpuworker_onion_handshake_replyfn(void *work_)
+cpuworker_onion_handshake_reply_one(cpuworker_job_t *job)
 {
-  cpuworker_job_t *job = work_;
   cpuworker_reply_t rpl;
   or_circuit_t *circ = NULL;
 
-  tor_assert(total_pending_tasks > 0);
-  --total_pending_tasks;
-
   /* Could avoid this, but doesn't matter. */
   memcpy(&rpl, &job->u.reply, sizeof(rpl));
 
@@ -337,6 +458,7 @@ cpuworker_onion_handshake_replyfn(void *work_)
     usec_roundtrip = ((int64_t)tv_diff.tv_sec)*1000000 + tv_diff.tv_usec;
     if (usec_roundtrip >= 0 &&
         usec_roundtrip < MAX_BELIEVABLE_ONIONSKIN_DELAY) {
+      cpuworker_note_onionskin_usec(rpl.handshake_type, rpl.n_usec);
       ++onionskins_n_processed[rpl.handshake_type];
       onionskins_usec_internal[rpl.handshake_type] += rpl.n_usec;
       onionskins_usec_roundtrip[rpl.handshake_type] += usec_roundtrip;
@@ -356,13 +478,10 @@ cpuworker_onion_handshake_replyfn(void *work_)
             "Unpacking cpuworker reply %p, circ=%p, success=%d",
             job, circ, rpl.success);
 
-  if (circ->base_.magic == DEAD_CIRCUIT_MAGIC) {
-    /* The circuit was supposed to get freed while the reply was
-     * pending. Instead, it got left for us to free so that we wouldn't freak
-     * out when the job->circ field wound up pointing to nothing. */
-    log_debug(LD_OR, "Circuit died while reply was pending. Freeing memory.");
-    circ->base_.magic = 0;
-    tor_free(circ);
+  if (!circ) {
+    /* The handshake was cancelled after a worker had already started on
+     * its batch. */
+    log_debug(LD_OR, "Circuit went away while reply was pending.");
     goto done_processing;
   }
 
@@ -394,20 +513,33 @@ cpuworker_onion_handshake_replyfn(void *work_)
 
  done_processing:
   memwipe(&rpl, 0, sizeof(rpl));
-  memwipe(job, 0, sizeof(*job));
-  tor_free(job);
-  queue_pending_tasks();
 }
 
-/** Implementation function for onion handshake requests. */
-static workqueue_reply_t
-cpuworker_onion_handshake_threadfn(void *state_, void *work_)
+/** Handle a reply from the worker threads. */
+STATIC void
+cpuworker_onion_handshake_replyfn(void *work_)
 {
-  worker_state_t *state = state_;
-  cpuworker_job_t *job = work_;
+  cpuworker_batch_t *batch = work_;
+  int i;
+
+  tor_assert(total_pending_tasks >= batch->n_jobs);
+  total_pending_tasks -= batch->n_jobs;
+  cpuworker_batch_note_pending(batch, -1);
+
+  for (i = 0; i < batch->n_jobs; ++i)
+    cpuworker_onion_handshake_reply_one(&batch->jobs[i]);
+
+  cpuworker_batch_free(batch);
+  queue_pending_tasks();
+}
 
-  /* variables for onion processing */
-  server_onion_keys_t *onion_keys = state->onion_keys;
+/** Answer the onionskin in a single <b>job</b>, using <b>onion_keys</b>.
+ * Return 0 on success (even if the handshake failed), or -1 if the request
+ * was malformed. */
+static int
+cpuworker_onion_handshake_one(server_onion_keys_t *onion_keys,
+                              cpuworker_job_t *job)
+{
   cpuworker_request_t req;
   cpuworker_reply_t rpl;
 
@@ -449,7 +581,7 @@ cpuworker_onion_handshake_threadfn(void *state_, void *work_)
       cell_out->cell_type = CELL_CREATED_FAST; break;
     default:
       tor_assert(0);
-      return WQ_RPL_SHUTDOWN;
+      return -1;
     }
     rpl.success = 1;
   }
@@ -469,25 +601,132 @@ cpuworker_onion_handshake_threadfn(void *state_, void *work_)
   memcpy(&job->u.reply, &rpl, sizeof(rpl));
 
   memwipe(&req, 0, sizeof(req));
-  memwipe(&rpl, 0, sizeof(req));
+  memwipe(&rpl, 0, sizeof(rpl));
+  return 0;
+}
+
+/** Implementation function for onion handshake requests. */
+static workqueue_reply_t
+cpuworker_onion_handshake_threadfn(void *state_, void *work_)
+{
+  worker_state_t *state = state_;
+  cpuworker_batch_t *batch = work_;
+  int i;
+
+  for (i = 0; i < batch->n_jobs; ++i) {
+    if (cpuworker_onion_handshake_one(state->onion_keys,
+                                      &batch->jobs[i]) < 0)
+      return WQ_RPL_SHUTDOWN;
+  }
   return WQ_RPL_REPLY;
 }
 
-/** Take pending tasks from the queue and assign them to cpuworkers. */
+/** Return how many of the queued onionskins we should put into the next
+ * batch.  We want big batches when we're busy, but we don't want to leave
+ * any of the cpuworkers idle while another one works through a batch. */
+static int
+onionskin_batch_size(void)
+{
+  int n_queued = onion_num_pending(ONION_HANDSHAKE_TYPE_TAP) +
+    onion_num_pending(ONION_HANDSHAKE_TYPE_NTOR);
+  int n = (n_queued + n_cpuworker_threads - 1) / n_cpuworker_threads;
+
+  n = MIN(n, max_pending_tasks - total_pending_tasks);
+  return CLAMP(1, n, CPUWORKER_MAX_ONIONSKIN_BATCH);
+}
+
+/** Fill in <b>job</b> so that a cpuworker will answer <b>onionskin</b> for
+ * <b>circ</b>.  Takes ownership of <b>onionskin</b>. */
 static void
+cpuworker_job_init(cpuworker_job_t *job, or_circuit_t *circ,
+                   create_cell_t *onionskin)
+{
+  cpuworker_request_t *req = &job->u.request;
+
+  if (!channel_is_client(circ->p_chan))
+    rep_hist_note_circuit_handshake_assigned(onionskin->handshake_type);
+
+  memset(req, 0, sizeof(*req));
+  req->magic = CPUWORKER_REQUEST_MAGIC;
+  job->handshake_type = onionskin->handshake_type;
+  req->timed = should_time_request(onionskin->handshake_type);
+
+  memcpy(&req->create_cell, onionskin, sizeof(create_cell_t));
+
+  tor_free(onionskin);
+
+  if (req->timed)
+    tor_gettimeofday(&req->started_at);
+
+  job->circ = circ;
+}
+
+/** Hand <b>batch</b> to the cpuworkers.  Return 0 on success, or -1 (and
+ * free <b>batch</b>) on failure. */
+static int
+queue_onionskin_batch(cpuworker_batch_t *batch)
+{
+  workqueue_entry_t *queue_entry;
+  int i;
+
+  batch->n_live = batch->n_jobs;
+  total_pending_tasks += batch->n_jobs;
+  queue_entry = cpuworker_queue_work(WQ_PRI_HIGH,
+                                     cpuworker_onion_handshake_threadfn,
+                                     cpuworker_onion_handshake_replyfn,
+                                     batch);
+  if (!queue_entry) {
+    log_warn(LD_BUG, "Couldn't queue work on threadpool");
+    total_pending_tasks -= batch->n_jobs;
+    cpuworker_batch_free(batch);
+    return -1;
+  }
+
+  cpuworker_batch_note_pending(batch, 1);
+  log_debug(LD_OR, "Queued batch %p of %d tasks (qe=%p)",
+            batch, batch->n_jobs, queue_entry);
+
+  for (i = 0; i < batch->n_jobs; ++i)
+    batch->jobs[i].circ->workqueue_entry = queue_entry;
+
+  return 0;
+}
+
+/** Take pending tasks from the queue and assign them to cpuworkers, a batch
+ * at a time. */
+STATIC void
 queue_pending_tasks(void)
 {
-  or_circuit_t *circ;
+  or_circuit_t *circ = NULL;
   create_cell_t *onionskin = NULL;
+  cpuworker_batch_t *batch;
+  int batch_size;
 
   while (total_pending_tasks < max_pending_tasks) {
-    circ = onion_next_task(&onionskin);
+    batch_size = onionskin_batch_size();
+    batch = cpuworker_batch_new(batch_size);
+
+    while (batch->n_jobs < batch_size) {
+      circ = onion_next_task(&onionskin);
+      if (!circ)
+        break;
+
+      if (!circ->p_chan) {
+        log_info(LD_OR,"circ->p_chan gone. Failing circ.");
+        tor_free(onionskin);
+        continue;
+      }
+      cpuworker_job_init(&batch->jobs[batch->n_jobs++], circ, onionskin);
+    }
 
-    if (!circ)
+    if (batch->n_jobs == 0) {
+      cpuworker_batch_free(batch);
       return;
-
-    if (assign_onionskin_to_cpuworker(circ, onionskin) < 0)
+    }
+    if (queue_onionskin_batch(batch) < 0)
       log_info(LD_OR,"assign_to_cpuworker failed. Ignoring.");
+    if (!circ)
+      return;
   }
 }
 
@@ -516,10 +755,7 @@ int
 assign_onionskin_to_cpuworker(or_circuit_t *circ,
                               create_cell_t *onionskin)
 {
-  workqueue_entry_t *queue_entry;
-  cpuworker_job_t *job;
-  cpuworker_request_t req;
-  int should_time;
+  cpuworker_batch_t *batch;
 
   tor_assert(threadpool);
 
@@ -538,63 +774,47 @@ assign_onionskin_to_cpuworker(or_circuit_t *circ,
     return 0;
   }
 
-  if (!channel_is_client(circ->p_chan))
-    rep_hist_note_circuit_handshake_assigned(onionskin->handshake_type);
-
-  should_time = should_time_request(onionskin->handshake_type);
-  memset(&req, 0, sizeof(req));
-  req.magic = CPUWORKER_REQUEST_MAGIC;
-  req.timed = should_time;
-
-  memcpy(&req.create_cell, onionskin, sizeof(create_cell_t));
-
-  tor_free(onionskin);
-
-  if (should_time)
-    tor_gettimeofday(&req.started_at);
-
-  job = tor_malloc_zero(sizeof(cpuworker_job_t));
-  job->circ = circ;
-  memcpy(&job->u.request, &req, sizeof(req));
-  memwipe(&req, 0, sizeof(req));
-
-  ++total_pending_tasks;
-  queue_entry = threadpool_queue_work_priority(threadpool,
-                                      WQ_PRI_HIGH,
-                                      cpuworker_onion_handshake_threadfn,
-                                      cpuworker_onion_handshake_replyfn,
-                                      job);
-  if (!queue_entry) {
-    log_warn(LD_BUG, "Couldn't queue work on threadpool");
-    tor_free(job);
-    return -1;
-  }
-
-  log_debug(LD_OR, "Queued task %p (qe=%p, circ=%p)",
-            job, queue_entry, job->circ);
-
-  circ->workqueue_entry = queue_entry;
+  batch = cpuworker_batch_new(1);
+  cpuworker_job_init(&batch->jobs[batch->n_jobs++], circ, onionskin);
 
-  return 0;
+  return queue_onionskin_batch(batch);
 }
 
 /** If <b>circ</b> has a pending handshake that hasn't been processed yet,
- * remove it from the worker queue. */
+ * remove it from the worker queue.
+ *
+ * Other circuits may share the same batch, so we only forget about this
+ * circuit's answer, unless nobody is waiting for any answer in the batch
+ * any more.  Either way, the circuit no longer refers to the batch when this
+ * function returns. */
 void
 cpuworker_cancel_circ_handshake(or_circuit_t *circ)
 {
-  cpuworker_job_t *job;
+  cpuworker_batch_t *batch;
+  int i;
+
   if (circ->workqueue_entry == NULL)
     return;
 
-  job = workqueue_entry_cancel(circ->workqueue_entry);
-  if (job) {
+  batch = workqueue_entry_get_arg(circ->workqueue_entry);
+  for (i = 0; i < batch->n_jobs; ++i) {
+    if (batch->jobs[i].circ == circ) {
+      batch->jobs[i].circ = NULL;
+      --batch->n_live;
+      break;
+    }
+  }
+  tor_assert(i < batch->n_jobs);
+
+  if (batch->n_live == 0 &&
+      workqueue_entry_cancel(circ->workqueue_entry)) {
     /* It successfully cancelled. */
-    memwipe(job, 0xe0, sizeof(*job));
-    tor_free(job);
-    tor_assert(total_pending_tasks > 0);
-    --total_pending_tasks;
-    /* if (!job), this is done in cpuworker_onion_handshake_replyfn. */
-    circ->workqueue_entry = NULL;
+    tor_assert(total_pending_tasks >= batch->n_jobs);
+    total_pending_tasks -= batch->n_jobs;
+    cpuworker_batch_note_pending(batch, -1);
+    cpuworker_batch_free(batch);
   }
+  /* If the batch is still live, cpuworker_onion_handshake_replyfn frees it,
+   * and discards our answer. */
+  circ->workqueue_entry = NULL;
 }
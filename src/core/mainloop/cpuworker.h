@@ -29,9 +29,108 @@ int assign_onionskin_to_cpuworker(or_circuit_t *circ,
 
 uint64_t estimated_usec_for_onionskins(uint32_t n_requests,
                                        uint16_t onionskin_type);
+uint64_t estimated_p99_usec_for_onionskin(uint16_t onionskin_type);
+uint64_t cpuworker_estimated_usec_in_flight(void);
+int getinfo_helper_onionskin_cost(control_connection_t *conn,
+                                  const char *question, char **answer,
+                                  const char **errmsg);
 void cpuworker_log_onionskin_overhead(int severity, int onionskin_type,
                                       const char *onionskin_type_name);
 void cpuworker_cancel_circ_handshake(or_circuit_t *circ);
 
+#ifdef CPUWORKER_PRIVATE
+#include "core/or/onion.h"
+
+/** Magic numbers to make sure our cpuworker_requests don't grow any
+ * mis-framing bugs. */
+#define CPUWORKER_REQUEST_MAGIC 0xda4afeed
+#define CPUWORKER_REPLY_MAGIC 0x5eedf00d
+
+/** A request sent to a cpuworker. */
+typedef struct cpuworker_request_t {
+  /** Magic number; must be CPUWORKER_REQUEST_MAGIC. */
+  uint32_t magic;
+
+  /** Flag: Are we timing this request? */
+  unsigned timed : 1;
+  /** If we're timing this request, when was it sent to the cpuworker? */
+  struct timeval started_at;
+
+  /** A create cell for the cpuworker to process. */
+  create_cell_t create_cell;
+
+  /* Turn the above into a tagged union if needed. */
+} cpuworker_request_t;
+
+/** A reply sent by a cpuworker. */
+typedef struct cpuworker_reply_t {
+  /** Magic number; must be CPUWORKER_REPLY_MAGIC. */
+  uint32_t magic;
+
+  /** True iff we got a successful request. */
+  uint8_t success;
+
+  /** Are we timing this request? */
+  unsigned int timed : 1;
+  /** What handshake type was the request? (Used for timing) */
+  uint16_t handshake_type;
+  /** When did we send the request to the cpuworker? */
+  struct timeval started_at;
+  /** Once the cpuworker received the request, how many microseconds did it
+   * take? (This shouldn't overflow; 4 billion micoseconds is over an hour,
+   * and we'll never have an onion handshake that takes so long.) */
+  uint32_t n_usec;
+
+  /** Output of processing a create cell
+   *
+   * @{
+   */
+  /** The created cell to send back. */
+  created_cell_t created_cell;
+  /** The keys to use on this circuit. */
+  uint8_t keys[CPATH_KEY_MATERIAL_LEN];
+  /** Input to use for authenticating introduce1 cells. */
+  uint8_t rend_auth_material[DIGEST_LEN];
+} cpuworker_reply_t;
+
+/** A single onionskin that we've handed to the cpuworkers. */
+typedef struct cpuworker_job_u {
+  /** The circuit that wants the answer, or NULL if it was cancelled.  Only
+   * the main thread looks at this field. */
+  or_circuit_t *circ;
+  /** The handshake type of the onionskin.  Only the main thread looks at
+   * this field. */
+  uint16_t handshake_type;
+  union {
+    cpuworker_request_t request;
+    cpuworker_reply_t reply;
+  } u;
+} cpuworker_job_t;
+
+/** Largest number of onionskins that we put into a single cpuworker job. */
+#define CPUWORKER_MAX_ONIONSKIN_BATCH 16
+
+/** A batch of onionskins that a cpuworker handles in a single workqueue
+ * entry, so that they share one trip through the queues and one reply. */
+typedef struct cpuworker_batch_t {
+  /** How many jobs are in this batch? */
+  int n_jobs;
+  /** How many of those jobs still have a circuit waiting for their answer?
+   * Only the main thread looks at this field. */
+  int n_live;
+  /** The jobs themselves. */
+  cpuworker_job_t jobs[FLEXIBLE_ARRAY_MEMBER];
+} cpuworker_batch_t;
+
+STATIC void cpuworker_note_onionskin_usec(uint16_t onionskin_type,
+                                          uint32_t usec);
+STATIC void queue_pending_tasks(void);
+#ifdef TOR_UNIT_TESTS
+STATIC void cpuworker_reset_onionskin_costs(void);
+STATIC void cpuworker_set_limits_for_testing(int n_threads, int max_pending);
+STATIC void cpuworker_onion_handshake_replyfn(void *work_);
+#endif
+#endif /* defined(CPUWORKER_PRIVATE) */
+
 #endif /* !defined(TOR_CPUWORKER_H) */
 
@@ -998,8 +998,7 @@ conn_close_if_marked(int i)
       } else
         retval = -1; /* never flush non-open broken tls connections */
     } else {
-      retval = buf_flush_to_socket(conn->outbuf, conn->s, sz,
-                                   &conn->outbuf_flushlen);
+      retval = connection_flush_to_socket(conn, sz);
     }
     if (retval >= 0 && /* Technically, we could survive things like
                           TLS_WANT_WRITE here. But don't bother for now. */
@@ -1353,6 +1352,7 @@ CALLBACK(check_ed_keys);
 CALLBACK(check_expired_networkstatus);
 CALLBACK(check_for_reachability_bw);
 CALLBACK(check_onion_keys_expiry_time);
+CALLBACK(clean_buffer_freelists);
 CALLBACK(clean_caches);
 CALLBACK(clean_consdiffmgr);
 CALLBACK(dirvote);
@@ -1413,6 +1413,7 @@ STATIC periodic_event_item_t periodic_events[] = {
   /* We need to do these if we're participating in the Tor network, and
    * immediately before we stop. */
   CALLBACK(clean_caches, NET_PARTICIPANT, FL(RUN_ON_DISABLE)),
+  CALLBACK(clean_buffer_freelists, NET_PARTICIPANT, FL(RUN_ON_DISABLE)),
   CALLBACK(save_state, NET_PARTICIPANT, FL(RUN_ON_DISABLE)),
   CALLBACK(write_stats_file, NET_PARTICIPANT, FL(RUN_ON_DISABLE)),
   CALLBACK(prune_old_routers, NET_PARTICIPANT, FL(RUN_ON_DISABLE)),
@@ -2318,10 +2319,25 @@ clean_caches_callback(time_t now, const or_options_t *options)
   hs_cache_clean_as_client(now);
   hs_cache_clean_as_dir(now);
   microdesc_cache_rebuild(NULL, 0);
+  dos_clean_clients(now);
 #define CLEAN_CACHES_INTERVAL (30*60)
   return CLEAN_CACHES_INTERVAL;
 }
 
+/**
+ * Periodic callback: Release the buffer chunks that have been sitting unused
+ * on the freelists since we last checked.
+ */
+static int
+clean_buffer_freelists_callback(time_t now, const or_options_t *options)
+{
+  (void)now;
+  (void)options;
+  buf_shrink_freelists(0);
+#define CLEAN_BUFFER_FREELISTS_INTERVAL 60
+  return CLEAN_BUFFER_FREELISTS_INTERVAL;
+}
+
 /**
  * Periodic callback: Clean the cache of failed hidden service lookups
  * frequently.
@@ -9,13 +9,21 @@
 
 #include "tor_queue.h"
 
-/** A cell as packed for writing to the network. */
+struct packed_cell_slab_t;
+
+/** A cell as packed for writing to the network.
+ *
+ * Packed cells are carved out of slabs (see relay.c) at cache-line aligned
+ * offsets, so the body comes first to keep it aligned too.  The remaining
+ * fields all fit in the body's last cache line. */
 struct packed_cell_t {
-  /** Next cell queued on this circuit. */
-  TOR_SIMPLEQ_ENTRY(packed_cell_t) next;
   char body[CELL_MAX_NETWORK_SIZE]; /**< Cell as packed for network. */
   uint32_t inserted_timestamp; /**< Time (in timestamp units) when this cell
                                 * was inserted */
+  /** Next cell queued on this circuit, or next free cell in our slab. */
+  TOR_SIMPLEQ_ENTRY(packed_cell_t) next;
+  /** The slab that this cell was allocated from. */
+  struct packed_cell_slab_t *slab;
 };
 
 /** A queue of cells on a circuit, waiting to be added to the
@@ -414,6 +414,10 @@ struct channel_s {
 
   /** For how many circuits are we n_chan?  What about p_chan? */
   unsigned int num_n_circuits, num_p_circuits;
+  /** The circuits for which we are n_chan, and those for which we are
+   * p_chan, so that we can find them without looking at every circuit. */
+  TOR_LIST_HEAD(, circuit_t) n_circuits;
+  TOR_LIST_HEAD(, or_circuit_t) p_circuits;
 
   /**
    * True iff this channel shouldn't get any new circs attached to it,
@@ -174,8 +174,9 @@ channel_tls_common_init(channel_tls_t *tlschan)
   chan->write_var_cell = channel_tls_write_var_cell_method;
 
   chan->cmux = circuitmux_alloc();
-  /* We only have one policy for now so always set it to EWMA. */
-  circuitmux_set_policy(chan->cmux, &ewma_policy);
+  /* Both of our policies are EWMA; the configuration says which one keeps
+   * track of the circuits. */
+  circuitmux_set_policy(chan->cmux, cmux_ewma_get_policy());
 }
 
 /**
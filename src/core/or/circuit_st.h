@@ -10,6 +10,7 @@
 #include "core/or/or.h"
 
 #include "core/or/cell_queue_st.h"
+#include "tor_queue.h"
 
 struct hs_token_t;
 struct circpad_machine_spec_t;
@@ -22,10 +23,6 @@ struct circpad_machine_state_t;
 #define ORIGIN_CIRCUIT_MAGIC 0x35315243u
 /** "magic" value for an or_circuit_t */
 #define OR_CIRCUIT_MAGIC 0x98ABC04Fu
-/** "magic" value for a circuit that would have been freed by circuit_free,
- * but which we're keeping around until a cpuworker reply arrives.  See
- * circuit_free() for more documentation. */
-#define DEAD_CIRCUIT_MAGIC 0xdeadc14c
 
 /**
  * A circuit is a path over the onion routing
@@ -56,6 +53,9 @@ struct circuit_t {
 
   /** The channel that is next in this circuit. */
   channel_t *n_chan;
+  /** Entry in the n_circuits list of n_chan, once we have added the circuit
+   * to the chan,circid map. */
+  TOR_LIST_ENTRY(circuit_t) n_chan_circuits;
 
   /**
    * The circuit_id used in the next (forward) hop of this circuit;
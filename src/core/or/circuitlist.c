@@ -28,6 +28,10 @@
  * circuit is not there any more.  For that case, we allow placeholder
  * entries in the table, using channel_mark_circid_unusable().
  *
+ * Each channel also keeps lists of the circuits that use it in each
+ * direction, so that when it closes, circuit_unlink_all_from_channel() only
+ * has to look at those.
+ *
  * To efficiently handle a channel that has just opened, we also maintain a
  * list of the circuits waiting for channels, so we can attach them as
  * needed without iterating through the whole list of circuits, using
@@ -64,6 +68,7 @@
 #include "core/or/circuitstats.h"
 #include "core/or/circuitpadding.h"
 #include "core/mainloop/connection.h"
+#include "core/mainloop/cpuworker.h"
 #include "app/config/config.h"
 #include "core/or/connection_edge.h"
 #include "core/or/connection_or.h"
@@ -85,6 +90,7 @@
 #include "core/or/policies.h"
 #include "core/or/relay.h"
 #include "core/crypto/relay_crypto.h"
+#include "core/or/relay_offload.h"
 #include "feature/rend/rendclient.h"
 #include "feature/rend/rendcommon.h"
 #include "feature/stats/predict_ports.h"
@@ -101,7 +107,7 @@
 #define OCIRC_EVENT_PRIVATE
 #include "core/or/ocirc_event.h"
 
-#include "ht.h"
+#include "siphash.h"
 
 #include "core/or/cpath_build_state_st.h"
 #include "core/or/crypt_path_reference_st.h"
@@ -172,57 +178,376 @@ CONST_TO_ORIGIN_CIRCUIT(const circuit_t *x)
   return DOWNCAST(origin_circuit_t, x);
 }
 
-/** A map from channel and circuit ID to circuit.  (Lookup performance is
- * very important here, since we need to do it every time a cell arrives.) */
-typedef struct chan_circid_circuit_map_t {
-  HT_ENTRY(chan_circid_circuit_map_t) node;
-  channel_t *chan;
+/** An entry in the map from channel and circuit ID to circuit.  (Lookup
+ * performance is very important here, since we need to do it every time a
+ * cell arrives.) */
+typedef struct chan_circid_entry_t {
+  /** The global identifier of the channel. We don't use the channel pointer,
+   * since it can get reused once the channel is freed. */
+  uint64_t chan_id;
   circid_t circ_id;
+  /** The circuit, or NULL if this is a placeholder entry. */
   circuit_t *circuit;
   /* For debugging 12184: when was this placeholder item added? */
   time_t made_placeholder_at;
-} chan_circid_circuit_map_t;
-
-/** Helper for hash tables: compare the channel and circuit ID for a and
- * b, and return less than, equal to, or greater than zero appropriately.
+} chan_circid_entry_t;
+
+/*
+ * The map is an open-addressing hash table, with a control byte for each
+ * slot. The control byte says whether the slot is empty, deleted, or full,
+ * and for full slots it holds 7 bits of the entry's hash. We probe the
+ * table a group of CHAN_CIRCID_GROUP_SIZE slots at a time, comparing all of
+ * their control bytes at once as a single 64-bit word, and only look at the
+ * entries whose hash bits match. Most lookups touch one word of control
+ * bytes and one entry.
+ *
+ * Removing an entry leaves a "deleted" marker behind, unless its group
+ * still has an empty slot (in which case no probe ever went past the group,
+ * so nothing can depend on it). We rebuild the table when the full and
+ * deleted slots together take more than 7/8 of it. Entries only move when
+ * we rebuild the table.
  */
+
+/** How many slots are there in each probe group? */
+#define CHAN_CIRCID_GROUP_SIZE 8
+/** How many slots does the map have when we first allocate it? */
+#define CHAN_CIRCID_MIN_SLOTS 64
+/** Control byte for a slot that has never held an entry. */
+#define CHAN_CIRCID_CTRL_EMPTY 0x80
+/** Control byte for a slot whose entry was removed. */
+#define CHAN_CIRCID_CTRL_DELETED 0xfe
+/** Control byte values below this one mark full slots. */
+#define CHAN_CIRCID_CTRL_FULL_MAX 0x7f
+
+/** A word with every byte set to 0x01. */
+#define BYTES_LSB UINT64_C(0x0101010101010101)
+/** A word with every byte set to 0x80. */
+#define BYTES_MSB UINT64_C(0x8080808080808080)
+
+/** The control bytes of the map, one for each slot. */
+static uint8_t *chan_circid_ctrl = NULL;
+/** The entries of the map. */
+static chan_circid_entry_t *chan_circid_slots = NULL;
+/** How many slots does the map have? Zero, or a power of two. */
+static unsigned chan_circid_n_slots = 0;
+/** How many slots hold entries? */
+static unsigned chan_circid_n_entries = 0;
+/** How many slots have the "deleted" marker? */
+static unsigned chan_circid_n_deleted = 0;
+
+/** The slot of the most recently returned entry from
+ * circuit_get_by_circid_channel_impl(), or -1; used to improve performance
+ * when many cells arrive in a row from the same circuit.  It stays valid
+ * until we rebuild the map; we check that the slot still holds the entry we
+ * want before we use it. */
+static int last_circid_chan_slot = -1;
+
+/** Helper: return a hash of the channel identifier <b>chan_id</b> and the
+ * circuit ID <b>circ_id</b>. */
+static inline uint32_t
+chan_circid_hash(uint64_t chan_id, circid_t circ_id)
+{
+  /* Try to squeze the siphash input into 8 bytes to save any extra siphash
+   * rounds.  This hash function is in the critical path.  Channel
+   * identifiers only go above 2^32 after a very long time, and then we
+   * still compare the whole identifier. */
+  uint32_t array[2];
+  array[0] = circ_id;
+  array[1] = (uint32_t) chan_id;
+  return (uint32_t) siphash24g(array, sizeof(array));
+}
+
+/** Return the control byte we use for a full slot whose entry has hash
+ * <b>hash</b>. */
+static inline uint8_t
+chan_circid_hash_ctrl(uint32_t hash)
+{
+  return hash & CHAN_CIRCID_CTRL_FULL_MAX;
+}
+
+/** Return the control bytes of the group that starts at slot <b>idx</b>, as
+ * a word whose most significant byte is the control byte for slot
+ * <b>idx</b>. */
+static inline uint64_t
+chan_circid_group_load(unsigned idx)
+{
+  return tor_ntohll(get_uint64(chan_circid_ctrl + idx));
+}
+
+/** Return a mask with the high bit set for each byte of <b>group</b> that is
+ * equal to <b>ctrl</b>.  The mask can also have the high bit set for a byte
+ * that isn't equal, but only if a less significant byte is; callers check
+ * the entries anyway. */
+static inline uint64_t
+chan_circid_group_match(uint64_t group, uint8_t ctrl)
+{
+  const uint64_t x = group ^ (BYTES_LSB * ctrl);
+  return (x - BYTES_LSB) & ~x & BYTES_MSB;
+}
+
+/** Return a mask with the high bit set for each byte of <b>group</b> that is
+ * CHAN_CIRCID_CTRL_EMPTY. */
+static inline uint64_t
+chan_circid_group_match_empty(uint64_t group)
+{
+  /* Only EMPTY has its high bit set and bit 1 clear. */
+  return group & ~(group << 6) & BYTES_MSB;
+}
+
+/** Return a mask with the high bit set for each byte of <b>group</b> that is
+ * CHAN_CIRCID_CTRL_EMPTY or CHAN_CIRCID_CTRL_DELETED. */
+static inline uint64_t
+chan_circid_group_match_free(uint64_t group)
+{
+  return group & BYTES_MSB;
+}
+
+/** Return the index within its group of the first slot that the nonzero
+ * mask <b>mask</b> has a bit set for. */
+static inline unsigned
+chan_circid_mask_first(uint64_t mask)
+{
+  unsigned i = 0;
+  if (!(mask >> 32)) {
+    i += 4;
+    mask <<= 32;
+  }
+  if (!(mask >> 48)) {
+    i += 2;
+    mask <<= 16;
+  }
+  if (!(mask >> 56)) {
+    i += 1;
+  }
+  return i;
+}
+
+/** Return <b>mask</b> without the bit for slot <b>i</b> within its group. */
+static inline uint64_t
+chan_circid_mask_clear(uint64_t mask, unsigned i)
+{
+  return mask & ~(UINT64_C(0x80) << (56 - 8 * i));
+}
+
+/** Return the index of the slot holding the entry for <b>chan_id</b> and
+ * <b>circ_id</b>, whose hash is <b>hash</b>, or -1 if there is none. */
 static inline int
-chan_circid_entries_eq_(chan_circid_circuit_map_t *a,
-                        chan_circid_circuit_map_t *b)
+chan_circid_find_slot(uint64_t chan_id, circid_t circ_id, uint32_t hash)
 {
-  return a->chan == b->chan && a->circ_id == b->circ_id;
+  const uint8_t ctrl = chan_circid_hash_ctrl(hash);
+  unsigned mask, idx, step = 0;
+
+  if (!chan_circid_n_slots)
+    return -1;
+
+  mask = chan_circid_n_slots - 1;
+  idx = (hash >> 7) & mask & ~(CHAN_CIRCID_GROUP_SIZE - 1);
+  for (;;) {
+    const uint64_t group = chan_circid_group_load(idx);
+    uint64_t match = chan_circid_group_match(group, ctrl);
+    while (match) {
+      const unsigned i = chan_circid_mask_first(match);
+      const chan_circid_entry_t *ent = &chan_circid_slots[idx + i];
+      if (ent->circ_id == circ_id && ent->chan_id == chan_id)
+        return (int) (idx + i);
+      match = chan_circid_mask_clear(match, i);
+    }
+    if (chan_circid_group_match_empty(group))
+      return -1;
+    /* Move on by 1, 2, 3... groups: this visits every group of a table whose
+     * size is a power of two. */
+    step += CHAN_CIRCID_GROUP_SIZE;
+    idx = (idx + step) & mask;
+  }
 }
 
-/** Helper: return a hash based on circuit ID and the pointer value of
- * chan in <b>a</b>. */
-static inline unsigned int
-chan_circid_entry_hash_(chan_circid_circuit_map_t *a)
+/** Return the index of the first free slot in the probe sequence for
+ * <b>hash</b>.  The map must have a free slot. */
+static unsigned
+chan_circid_find_free_slot(uint32_t hash)
 {
-  /* Try to squeze the siphash input into 8 bytes to save any extra siphash
-   * rounds.  This hash function is in the critical path. */
-  uintptr_t chan = (uintptr_t) (void*) a->chan;
-  uint32_t array[2];
-  array[0] = a->circ_id;
-  /* The low bits of the channel pointer are uninteresting, since the channel
-   * is a pretty big structure. */
-  array[1] = (uint32_t) (chan >> 6);
-  return (unsigned) siphash24g(array, sizeof(array));
-}
-
-/** Map from [chan,circid] to circuit. */
-static HT_HEAD(chan_circid_map, chan_circid_circuit_map_t)
-     chan_circid_map = HT_INITIALIZER();
-HT_PROTOTYPE(chan_circid_map, chan_circid_circuit_map_t, node,
-             chan_circid_entry_hash_, chan_circid_entries_eq_)
-HT_GENERATE2(chan_circid_map, chan_circid_circuit_map_t, node,
-             chan_circid_entry_hash_, chan_circid_entries_eq_, 0.6,
-             tor_reallocarray_, tor_free_)
-
-/** The most recently returned entry from circuit_get_by_circid_chan;
- * used to improve performance when many cells arrive in a row from the
- * same circuit.
- */
-static chan_circid_circuit_map_t *_last_circid_chan_ent = NULL;
+  const unsigned mask = chan_circid_n_slots - 1;
+  unsigned idx, step = 0;
+
+  idx = (hash >> 7) & mask & ~(CHAN_CIRCID_GROUP_SIZE - 1);
+  for (;;) {
+    const uint64_t free_slots =
+      chan_circid_group_match_free(chan_circid_group_load(idx));
+    if (free_slots)
+      return idx + chan_circid_mask_first(free_slots);
+    step += CHAN_CIRCID_GROUP_SIZE;
+    idx = (idx + step) & mask;
+  }
+}
+
+/** Rebuild the map with <b>n_slots</b> slots, dropping the deleted
+ * markers. */
+static void
+chan_circid_map_rebuild(unsigned n_slots)
+{
+  uint8_t *old_ctrl = chan_circid_ctrl;
+  chan_circid_entry_t *old_slots = chan_circid_slots;
+  const unsigned old_n_slots = chan_circid_n_slots;
+  unsigned i;
+
+  tor_assert(n_slots >= CHAN_CIRCID_MIN_SLOTS);
+  tor_assert((n_slots & (n_slots - 1)) == 0);
+
+  chan_circid_ctrl = tor_malloc(n_slots);
+  memset(chan_circid_ctrl, CHAN_CIRCID_CTRL_EMPTY, n_slots);
+  chan_circid_slots = tor_calloc(n_slots, sizeof(chan_circid_entry_t));
+  chan_circid_n_slots = n_slots;
+  chan_circid_n_deleted = 0;
+  last_circid_chan_slot = -1;
+
+  for (i = 0; i < old_n_slots; ++i) {
+    const chan_circid_entry_t *ent = &old_slots[i];
+    unsigned idx;
+    uint32_t hash;
+    if (old_ctrl[i] > CHAN_CIRCID_CTRL_FULL_MAX)
+      continue;
+    hash = chan_circid_hash(ent->chan_id, ent->circ_id);
+    idx = chan_circid_find_free_slot(hash);
+    chan_circid_ctrl[idx] = chan_circid_hash_ctrl(hash);
+    chan_circid_slots[idx] = *ent;
+  }
+
+  tor_free(old_ctrl);
+  tor_free(old_slots);
+}
+
+/** Return the entry for <b>chan</b> and <b>circ_id</b>, or NULL if there is
+ * none. */
+static chan_circid_entry_t *
+chan_circid_map_find(const channel_t *chan, circid_t circ_id)
+{
+  const uint64_t chan_id = chan->global_identifier;
+  int idx = chan_circid_find_slot(chan_id, circ_id,
+                                  chan_circid_hash(chan_id, circ_id));
+  return idx < 0 ? NULL : &chan_circid_slots[idx];
+}
+
+/** Return the entry for <b>chan</b> and <b>circ_id</b>, adding an empty one
+ * if there is none.  The entry stays where it is until we next add an entry
+ * to the map. */
+static chan_circid_entry_t *
+chan_circid_map_find_or_add(const channel_t *chan, circid_t circ_id)
+{
+  const uint64_t chan_id = chan->global_identifier;
+  const uint32_t hash = chan_circid_hash(chan_id, circ_id);
+  chan_circid_entry_t *ent;
+  int found;
+  unsigned idx;
+
+  found = chan_circid_find_slot(chan_id, circ_id, hash);
+  if (found >= 0)
+    return &chan_circid_slots[found];
+
+  /* Keep at least 1/8 of the slots empty, so that probes stay short. */
+  if ((chan_circid_n_entries + chan_circid_n_deleted + 1) * 8 >
+      chan_circid_n_slots * 7) {
+    unsigned n_slots = chan_circid_n_slots;
+    /* If the deleted markers take up most of the room, rebuilding at the
+     * same size is enough. */
+    if (!n_slots)
+      n_slots = CHAN_CIRCID_MIN_SLOTS;
+    else if ((chan_circid_n_entries + 1) * 16 > n_slots * 7)
+      n_slots *= 2;
+    chan_circid_map_rebuild(n_slots);
+  }
+
+  idx = chan_circid_find_free_slot(hash);
+  if (chan_circid_ctrl[idx] == CHAN_CIRCID_CTRL_DELETED)
+    --chan_circid_n_deleted;
+  chan_circid_ctrl[idx] = chan_circid_hash_ctrl(hash);
+  ++chan_circid_n_entries;
+
+  ent = &chan_circid_slots[idx];
+  memset(ent, 0, sizeof(*ent));
+  ent->chan_id = chan_id;
+  ent->circ_id = circ_id;
+  return ent;
+}
+
+/** Remove the entry <b>ent</b> from the map. */
+static void
+chan_circid_map_remove(chan_circid_entry_t *ent)
+{
+  const unsigned idx = (unsigned) (ent - chan_circid_slots);
+  const unsigned group_idx = idx & ~(CHAN_CIRCID_GROUP_SIZE - 1);
+
+  tor_assert(idx < chan_circid_n_slots);
+  tor_assert(chan_circid_ctrl[idx] <= CHAN_CIRCID_CTRL_FULL_MAX);
+
+  if (chan_circid_group_match_empty(chan_circid_group_load(group_idx))) {
+    chan_circid_ctrl[idx] = CHAN_CIRCID_CTRL_EMPTY;
+  } else {
+    chan_circid_ctrl[idx] = CHAN_CIRCID_CTRL_DELETED;
+    ++chan_circid_n_deleted;
+  }
+  --chan_circid_n_entries;
+  memset(ent, 0, sizeof(*ent));
+}
+
+/** Remove every entry from the map, and free it. */
+static void
+chan_circid_map_free_all(void)
+{
+  unsigned i;
+
+  for (i = 0; i < chan_circid_n_slots; ++i) {
+    if (chan_circid_ctrl[i] <= CHAN_CIRCID_CTRL_FULL_MAX)
+      tor_assert(chan_circid_slots[i].circuit == NULL);
+  }
+  tor_free(chan_circid_ctrl);
+  tor_free(chan_circid_slots);
+  chan_circid_n_slots = chan_circid_n_entries = chan_circid_n_deleted = 0;
+  last_circid_chan_slot = -1;
+}
+
+#ifdef TOR_UNIT_TESTS
+/** Return the number of entries in the map from channel and circuit ID to
+ * circuit, including placeholders. */
+STATIC unsigned
+chan_circid_map_n_entries(void)
+{
+  return chan_circid_n_entries;
+}
+#endif /* defined(TOR_UNIT_TESTS) */
+
+/** Remove <b>circ</b> from the list of circuits of the channel it uses in
+ * <b>direction</b>, if it is on one. */
+static void
+circuit_remove_from_chan_list(circuit_t *circ, int direction)
+{
+  if (direction == CELL_DIRECTION_OUT) {
+    if (!circ->n_chan_circuits.le_prev)
+      return;
+    TOR_LIST_REMOVE(circ, n_chan_circuits);
+    circ->n_chan_circuits.le_prev = NULL;
+    circ->n_chan_circuits.le_next = NULL;
+  } else {
+    or_circuit_t *or_circ = TO_OR_CIRCUIT(circ);
+    if (!or_circ->p_chan_circuits.le_prev)
+      return;
+    TOR_LIST_REMOVE(or_circ, p_chan_circuits);
+    or_circ->p_chan_circuits.le_prev = NULL;
+    or_circ->p_chan_circuits.le_next = NULL;
+  }
+}
+
+/** Add <b>circ</b> to the list of circuits that use <b>chan</b> in
+ * <b>direction</b>. */
+static void
+circuit_add_to_chan_list(circuit_t *circ, int direction, channel_t *chan)
+{
+  if (direction == CELL_DIRECTION_OUT) {
+    TOR_LIST_INSERT_HEAD(&chan->n_circuits, circ, n_chan_circuits);
+  } else {
+    TOR_LIST_INSERT_HEAD(&chan->p_circuits, TO_OR_CIRCUIT(circ),
+                         p_chan_circuits);
+  }
+}
 
 /** Implementation helper for circuit_set_{p,n}_circid_channel: A circuit ID
  * and/or channel for circ has just changed from <b>old_chan, old_id</b>
@@ -233,8 +558,7 @@ circuit_set_circid_chan_helper(circuit_t *circ, int direction,
                                circid_t id,
                                channel_t *chan)
 {
-  chan_circid_circuit_map_t search;
-  chan_circid_circuit_map_t *found;
+  chan_circid_entry_t *found;
   channel_t *old_chan, **chan_ptr;
   circid_t old_id, *circid_ptr;
   int make_active, attached = 0;
@@ -255,14 +579,6 @@ circuit_set_circid_chan_helper(circuit_t *circ, int direction,
   if (id == old_id && chan == old_chan)
     return;
 
-  if (_last_circid_chan_ent &&
-      ((old_id == _last_circid_chan_ent->circ_id &&
-        old_chan == _last_circid_chan_ent->chan) ||
-       (id == _last_circid_chan_ent->circ_id &&
-        chan == _last_circid_chan_ent->chan))) {
-    _last_circid_chan_ent = NULL;
-  }
-
   if (old_chan) {
     /*
      * If we're changing channels or ID and had an old channel and a non
@@ -277,11 +593,9 @@ circuit_set_circid_chan_helper(circuit_t *circ, int direction,
     }
 
     /* we may need to remove it from the conn-circid map */
-    search.circ_id = old_id;
-    search.chan = old_chan;
-    found = HT_REMOVE(chan_circid_map, &chan_circid_map, &search);
+    found = chan_circid_map_find(old_chan, old_id);
     if (found) {
-      tor_free(found);
+      chan_circid_map_remove(found);
       if (direction == CELL_DIRECTION_OUT) {
         /* One fewer circuits use old_chan as n_chan */
         --(old_chan->num_n_circuits);
@@ -292,6 +606,10 @@ circuit_set_circid_chan_helper(circuit_t *circ, int direction,
     }
   }
 
+  /* Callers sometimes set n_chan directly before they pick a circuit ID, so
+   * look at the list entry rather than at old_chan. */
+  circuit_remove_from_chan_list(circ, direction);
+
   /* Change the values only after we have possibly made the circuit inactive
    * on the previous chan. */
   *chan_ptr = chan;
@@ -300,20 +618,12 @@ circuit_set_circid_chan_helper(circuit_t *circ, int direction,
   if (chan == NULL)
     return;
 
+  circuit_add_to_chan_list(circ, direction, chan);
+
   /* now add the new one to the conn-circid map */
-  search.circ_id = id;
-  search.chan = chan;
-  found = HT_FIND(chan_circid_map, &chan_circid_map, &search);
-  if (found) {
-    found->circuit = circ;
-    found->made_placeholder_at = 0;
-  } else {
-    found = tor_malloc_zero(sizeof(chan_circid_circuit_map_t));
-    found->circ_id = id;
-    found->chan = chan;
-    found->circuit = circ;
-    HT_INSERT(chan_circid_map, &chan_circid_map, found);
-  }
+  found = chan_circid_map_find_or_add(chan, id);
+  found->circuit = circ;
+  found->made_placeholder_at = 0;
 
   /*
    * Attach to the circuitmux if we're changing channels or IDs and
@@ -349,30 +659,18 @@ circuit_set_circid_chan_helper(circuit_t *circ, int direction,
 void
 channel_mark_circid_unusable(channel_t *chan, circid_t id)
 {
-  chan_circid_circuit_map_t search;
-  chan_circid_circuit_map_t *ent;
+  chan_circid_entry_t *ent;
 
   /* See if there's an entry there. That wouldn't be good. */
-  memset(&search, 0, sizeof(search));
-  search.chan = chan;
-  search.circ_id = id;
-  ent = HT_FIND(chan_circid_map, &chan_circid_map, &search);
+  ent = chan_circid_map_find_or_add(chan, id);
 
-  if (ent && ent->circuit) {
+  if (ent->circuit) {
     /* we have a problem. */
     log_warn(LD_BUG, "Tried to mark %u unusable on %p, but there was already "
              "a circuit there.", (unsigned)id, chan);
-  } else if (ent) {
-    /* It's already marked. */
-    if (!ent->made_placeholder_at)
-      ent->made_placeholder_at = approx_time();
-  } else {
-    ent = tor_malloc_zero(sizeof(chan_circid_circuit_map_t));
-    ent->chan = chan;
-    ent->circ_id = id;
-    /* leave circuit at NULL. */
+  } else if (!ent->made_placeholder_at) {
+    /* It's either new, or already marked. Leave circuit at NULL. */
     ent->made_placeholder_at = approx_time();
-    HT_INSERT(chan_circid_map, &chan_circid_map, ent);
   }
 }
 
@@ -382,22 +680,17 @@ channel_mark_circid_unusable(channel_t *chan, circid_t id)
 void
 channel_mark_circid_usable(channel_t *chan, circid_t id)
 {
-  chan_circid_circuit_map_t search;
-  chan_circid_circuit_map_t *ent;
+  chan_circid_entry_t *ent;
 
   /* See if there's an entry there. That wouldn't be good. */
-  memset(&search, 0, sizeof(search));
-  search.chan = chan;
-  search.circ_id = id;
-  ent = HT_REMOVE(chan_circid_map, &chan_circid_map, &search);
+  ent = chan_circid_map_find(chan, id);
   if (ent && ent->circuit) {
     log_warn(LD_BUG, "Tried to mark %u usable on %p, but there was already "
              "a circuit there.", (unsigned)id, chan);
     return;
   }
-  if (_last_circid_chan_ent == ent)
-    _last_circid_chan_ent = NULL;
-  tor_free(ent);
+  if (ent)
+    chan_circid_map_remove(ent);
 }
 
 /** Called to indicate that a DESTROY is pending on <b>chan</b> with
@@ -1115,7 +1408,6 @@ circuit_free_(circuit_t *circ)
   circid_t n_circ_id = 0;
   void *mem;
   size_t memlen;
-  int should_free = 1;
   if (!circ)
     return;
 
@@ -1188,8 +1480,12 @@ circuit_free_(circuit_t *circ)
     memlen = sizeof(or_circuit_t);
     tor_assert(circ->magic == OR_CIRCUIT_MAGIC);
 
-    should_free = (ocirc->workqueue_entry == NULL);
+    /* Normally circuit_about_to_free() has already done this.  A batch
+     * that a cpuworker has already started just discards our answer. */
+    cpuworker_cancel_circ_handshake(ocirc);
 
+    /* If a cpuworker is still using our relay crypto, this hands it over. */
+    relay_offload_circuit_free(ocirc);
     relay_crypto_clear(&ocirc->crypto);
 
     if (ocirc->rend_splice) {
@@ -1235,18 +1531,8 @@ circuit_free_(circuit_t *circ)
   /* Free any circuit padding structures */
   circpad_circuit_free_all_machineinfos(circ);
 
-  if (should_free) {
-    memwipe(mem, 0xAA, memlen); /* poison memory */
-    tor_free(mem);
-  } else {
-    /* If we made it here, this is an or_circuit_t that still has a pending
-     * cpuworker request which we weren't able to cancel.  Instead, set up
-     * the magic value so that when the reply comes back, we'll know to discard
-     * the reply and free this structure.
-     */
-    memwipe(mem, 0xAA, memlen);
-    circ->magic = DEAD_CIRCUIT_MAGIC;
-  }
+  memwipe(mem, 0xAA, memlen); /* poison memory */
+  tor_free(mem);
 }
 
 /** Deallocate the linked list circ-><b>cpath</b>, and remove the cpath from
@@ -1311,19 +1597,7 @@ circuit_free_all(void)
   smartlist_free(circuits_pending_other_guards);
   circuits_pending_other_guards = NULL;
 
-  {
-    chan_circid_circuit_map_t **elt, **next, *c;
-    for (elt = HT_START(chan_circid_map, &chan_circid_map);
-         elt;
-         elt = next) {
-      c = *elt;
-      next = HT_NEXT_RMV(chan_circid_map, &chan_circid_map, elt);
-
-      tor_assert(c->circuit == NULL);
-      tor_free(c);
-    }
-  }
-  HT_CLEAR(chan_circid_map, &chan_circid_map);
+  chan_circid_map_free_all();
 }
 
 /** Deallocate space associated with the cpath node <b>victim</b>. */
@@ -1447,18 +1721,18 @@ static inline circuit_t *
 circuit_get_by_circid_channel_impl(circid_t circ_id, channel_t *chan,
                                    int *found_entry_out)
 {
-  chan_circid_circuit_map_t search;
-  chan_circid_circuit_map_t *found;
+  chan_circid_entry_t *found = NULL;
+  const int last = last_circid_chan_slot;
 
-  if (_last_circid_chan_ent &&
-      circ_id == _last_circid_chan_ent->circ_id &&
-      chan == _last_circid_chan_ent->chan) {
-    found = _last_circid_chan_ent;
+  if (last >= 0 &&
+      chan_circid_ctrl[last] <= CHAN_CIRCID_CTRL_FULL_MAX &&
+      chan_circid_slots[last].circ_id == circ_id &&
+      chan_circid_slots[last].chan_id == chan->global_identifier) {
+    found = &chan_circid_slots[last];
   } else {
-    search.circ_id = circ_id;
-    search.chan = chan;
-    found = HT_FIND(chan_circid_map, &chan_circid_map, &search);
-    _last_circid_chan_ent = found;
+    found = chan_circid_map_find(chan, circ_id);
+    if (found)
+      last_circid_chan_slot = (int) (found - chan_circid_slots);
   }
   if (found && found->circuit) {
     log_debug(LD_CIRC,
@@ -1556,14 +1830,9 @@ circuit_id_in_use_on_channel(circid_t circ_id, channel_t *chan)
 time_t
 circuit_id_when_marked_unusable_on_channel(circid_t circ_id, channel_t *chan)
 {
-  chan_circid_circuit_map_t search;
-  chan_circid_circuit_map_t *found;
-
-  memset(&search, 0, sizeof(search));
-  search.circ_id = circ_id;
-  search.chan = chan;
+  chan_circid_entry_t *found;
 
-  found = HT_FIND(chan_circid_map, &chan_circid_map, &search);
+  found = chan_circid_map_find(chan, circ_id);
 
   if (! found || found->circuit)
     return 0;
@@ -1593,10 +1862,31 @@ void
 circuit_unlink_all_from_channel(channel_t *chan, int reason)
 {
   smartlist_t *detached = smartlist_new();
+  circuit_t *n_circ;
+  or_circuit_t *p_circ;
 
 /* #define DEBUG_CIRCUIT_UNLINK_ALL */
 
-  channel_unlink_all_circuits(chan, detached);
+  /* Take the circuits from the channel's own lists, and detach each one
+   * from the channel's circuitmux: that costs as much as the channel has
+   * circuits, however many we have in all, and we never have to look up a
+   * channel or a circuit ID to find a circuit. */
+  TOR_LIST_FOREACH(n_circ, &chan->n_circuits, n_chan_circuits) {
+    circuitmux_detach_circuit(chan->cmux, n_circ);
+    smartlist_add(detached, n_circ);
+  }
+  TOR_LIST_FOREACH(p_circ, &chan->p_circuits, p_chan_circuits) {
+    /* If the circuit goes back out the same channel, this detaches its
+     * inbound half; don't list it twice. */
+    circuitmux_detach_circuit(chan->cmux, TO_CIRCUIT(p_circ));
+    if (TO_CIRCUIT(p_circ)->n_chan != chan)
+      smartlist_add(detached, TO_CIRCUIT(p_circ));
+  }
+
+  if (BUG(circuitmux_num_circuits(chan->cmux) > 0)) {
+    /* Some circuit was on the circuitmux but not on our lists. */
+    channel_unlink_all_circuits(chan, NULL);
+  }
 
 #ifdef DEBUG_CIRCUIT_UNLINK_ALL
   {
@@ -2675,7 +2965,9 @@ circuits_handle_oom(size_t current_allocation)
   int n_dirconns_killed=0;
   uint32_t now_ts;
   log_notice(LD_GENERAL, "We're low on memory (cell queues total alloc:"
-             " %"TOR_PRIuSZ" buffer total alloc: %" TOR_PRIuSZ ","
+             " %"TOR_PRIuSZ" cell pool idle alloc: %" TOR_PRIuSZ ","
+             " buffer total alloc: %" TOR_PRIuSZ ","
+             " buffer freelist total alloc: %" TOR_PRIuSZ ","
              " tor compress total alloc: %" TOR_PRIuSZ
              " (zlib: %" TOR_PRIuSZ ", zstd: %" TOR_PRIuSZ ","
              " lzma: %" TOR_PRIuSZ "),"
@@ -2683,7 +2975,9 @@ circuits_handle_oom(size_t current_allocation)
              " circuits withover-long queues. (This behavior is controlled by"
              " MaxMemInQueues.)",
              cell_queues_get_total_allocation(),
+             packed_cell_pool_get_idle_allocation(),
              buf_get_total_allocation(),
+             buf_get_freelist_allocation(),
              tor_compress_get_total_allocation(),
              tor_zlib_get_total_allocation(),
              tor_zstd_get_total_allocation(),
@@ -2760,6 +3054,8 @@ circuits_handle_oom(size_t current_allocation)
       circuit_mark_for_close(circ, END_CIRC_REASON_RESOURCELIMIT);
     }
     marked_circuit_free_cells(circ);
+    if (! CIRCUIT_IS_ORIGIN(circ))
+      mem_recovered += relay_offload_free_pending(TO_OR_CIRCUIT(circ));
     freed = marked_circuit_free_stream_bytes(circ);
 
     ++n_circuits_killed;
@@ -2773,6 +3069,9 @@ circuits_handle_oom(size_t current_allocation)
   } SMARTLIST_FOREACH_END(circ);
 
  done_recovering_mem:
+  /* The cells we just freed may have emptied some slabs completely; give
+   * those back now rather than keeping them around for reuse. */
+  packed_cell_pool_shrink();
 
   log_notice(LD_GENERAL, "Removed %"TOR_PRIuSZ" bytes by killing %d circuits; "
              "%d circuits remain alive. Also killed %d non-linked directory "
@@ -37,6 +37,7 @@
 #include "core/or/or.h"
 #include "core/or/circuitmux.h"
 #include "core/or/circuitmux_ewma.h"
+#include "core/or/circuitmux_ewma_wheel.h"
 #include "lib/crypt_ops/crypto_rand.h"
 #include "feature/nodelist/networkstatus.h"
 #include "app/config/or_options_st.h"
@@ -224,6 +225,10 @@ ewma_cmp_cmux(circuitmux_t *cmux_1, circuitmux_policy_data_t *pol_data_1,
  */
 static double ewma_scale_factor = 0.1;
 
+/** True iff new channels should use ewma_wheel_policy instead of
+ * ewma_policy. */
+static int ewma_use_wheel = 0;
+
 /*** EWMA circuitmux_policy_t method table ***/
 
 circuitmux_policy_t ewma_policy = {
@@ -654,6 +659,23 @@ cell_ewma_get_current_tick_and_fraction(double *remainder_out)
 #define CMUX_PRIORITY_HALFLIFE_MSEC_MIN 1
 #define CMUX_PRIORITY_HALFLIFE_MSEC_MAX INT32_MAX
 
+/* Default value for the CircuitPriorityWheel consensus parameter. */
+#define CMUX_PRIORITY_WHEEL_DEFAULT 0
+
+/* Return true iff we should use the wheel instead of the heap to keep track
+ * of active circuits, according to the options if they say, or else to the
+ * consensus. */
+static int
+get_circuit_priority_wheel(const or_options_t *options,
+                           const networkstatus_t *consensus)
+{
+  if (options && options->CircuitPriorityWheel != -1)
+    return options->CircuitPriorityWheel;
+
+  return networkstatus_get_param(consensus, "CircuitPriorityWheel",
+                                 CMUX_PRIORITY_WHEEL_DEFAULT, 0, 1);
+}
+
 /* Return the value of the circuit priority halflife from the options if
  * available or else from the consensus (in that order). If none can be found,
  * a default value is returned.
@@ -712,6 +734,8 @@ cmux_ewma_set_options(const or_options_t *options,
   /* Both options and consensus can be NULL. This assures us to either get a
    * valid configured value or the default one. */
   halflife = get_circuit_priority_halflife(options, consensus, &source);
+  cmux_ewma_wheel_set_halflife(halflife);
+  ewma_use_wheel = get_circuit_priority_wheel(options, consensus);
 
   /* convert halflife into halflife-per-tick. */
   halflife /= EWMA_TICK_LEN;
@@ -723,6 +747,13 @@ cmux_ewma_set_options(const or_options_t *options,
            source, ewma_scale_factor, EWMA_TICK_LEN);
 }
 
+/** Return the circuitmux policy that new channels should use. */
+circuitmux_policy_t *
+cmux_ewma_get_policy(void)
+{
+  return ewma_use_wheel ? &ewma_wheel_policy : &ewma_policy;
+}
+
 /** Return the multiplier necessary to convert the value of a cell sent in
  * 'from_tick' to one sent in 'to_tick'. */
 static inline double
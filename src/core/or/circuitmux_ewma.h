@@ -18,6 +18,7 @@ extern circuitmux_policy_t ewma_policy;
 /* Externally visible EWMA functions */
 void cmux_ewma_set_options(const or_options_t *options,
                            const networkstatus_t *consensus);
+circuitmux_policy_t *cmux_ewma_get_policy(void);
 
 void circuitmux_ewma_free_all(void);
 
@@ -0,0 +1,708 @@
+/* Copyright (c) 2019, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file circuitmux_ewma_wheel.c
+ * \brief EWMA circuit selection as a circuitmux_t policy, using a wheel of
+ * buckets instead of a heap.
+ *
+ * This policy makes the same choice as the one in circuitmux_ewma.c: it
+ * prefers the circuit that has sent the fewest cells recently, where a cell
+ * sent CircuitPriorityHalflife seconds ago counts for half as much as one
+ * sent now.  It differs in how it keeps track of the counts.
+ *
+ * Instead of keeping a cell count that we have to rescale every tick, we
+ * keep the natural logarithm of the count, as if every cell were weighted
+ * relative to the time when we started.  A cell sent at time t (in msec)
+ * then weighs exp(lambda * t), where lambda is ln(2) / halflife, so its
+ * logarithm is just lambda * t.  That number only grows linearly, so it
+ * can't overflow, and we never need to rescale anything: we can compare
+ * any two circuits' keys directly.  We store the keys as fixed-point
+ * integers.
+ *
+ * Each circuitmux keeps its active circuits on a wheel of
+ * EWMA_WHEEL_N_SLOTS slots.  Each slot holds the circuits whose keys fall
+ * in a small range, in FIFO order, and the wheel covers a window of
+ * consecutive ranges starting at the one that holds the best circuit.
+ * Circuits whose keys are beyond the window go into its last slot, and get
+ * moved when the window reaches them; a circuit whose key is before the
+ * window moves the window back.  Picking, adding, and removing a circuit
+ * take constant time, apart from those occasional moves.
+ *
+ * Circuits whose keys share a slot are treated as equals, and take turns.
+ *
+ * Keys computed with different halflives aren't comparable, so each
+ * circuitmux and each circuit remember which halflife their keys use.  When
+ * the halflife changes, we convert a key the next time we touch it, keeping
+ * the circuit's weighted cell count at that moment: the key for a count C
+ * at time now is log(C) + lambda * now, so it moves by
+ * (lambda_new - lambda_old) * now.
+ **/
+
+#define CIRCUITMUX_EWMA_WHEEL_PRIVATE
+
+#include "orconfig.h"
+
+#include <math.h>
+
+#include "core/or/or.h"
+#include "core/or/circuitmux.h"
+#include "core/or/circuitmux_ewma_wheel.h"
+#include "lib/intmath/bits.h"
+
+#include "ext/tor_queue.h"
+
+/*** EWMA wheel structures ***/
+
+typedef struct ewma_wheel_data_s ewma_wheel_data_t;
+typedef struct ewma_wheel_circ_data_s ewma_wheel_circ_data_t;
+
+struct ewma_wheel_circ_data_s {
+  circuitmux_policy_circ_data_t base_;
+
+  /** The logarithm of this circuit's weighted cell count, in units of
+   * 1/EWMA_WHEEL_KEY_SCALE, or EWMA_WHEEL_KEY_NONE if it hasn't sent any
+   * cells on this circuitmux. */
+  int64_t key;
+
+  /** The value of ewma_wheel_lambda that <b>key</b> was computed with,
+   * and the ewma_wheel_lambda_gen when it had that value. */
+  double lambda;
+  unsigned lambda_gen;
+
+  /** The slot of the wheel that holds this circuit, or -1 if the circuit
+   * isn't active. */
+  int slot;
+
+  /** Links to the other circuits in the same slot. */
+  TOR_TAILQ_ENTRY(ewma_wheel_circ_data_s) next_in_slot;
+
+  /** Pointer back to the circuit_t this is for. */
+  circuit_t *circ;
+};
+
+TOR_TAILQ_HEAD(ewma_wheel_slot_s, ewma_wheel_circ_data_s);
+
+struct ewma_wheel_data_s {
+  circuitmux_policy_data_t base_;
+
+  /** The wheel of active circuits.  Slot (b % EWMA_WHEEL_N_SLOTS) holds the
+   * circuits whose keys belong to bucket b, for every bucket b in the
+   * window that starts at <b>first_bucket</b>. */
+  struct ewma_wheel_slot_s slots[EWMA_WHEEL_N_SLOTS];
+
+  /** Bit i is set iff slots[i] is nonempty. */
+  uint64_t nonempty;
+
+  /** The first bucket in the window of the wheel.  No circuit is in an
+   * earlier bucket, except for those whose keys were earlier than this when
+   * we added them: those share the first bucket's slot. */
+  int64_t first_bucket;
+
+  /** How many circuits are on the wheel? */
+  int n_active;
+
+  /** The ewma_wheel_lambda_gen that the keys of the circuits on the wheel
+   * were computed in. */
+  unsigned lambda_gen;
+};
+
+#define EWMA_WHEEL_DATA_MAGIC 0x7b8e3d21U
+#define EWMA_WHEEL_CIRC_DATA_MAGIC 0x1e52c9a4U
+
+/** Mask to turn a bucket number into a slot index. */
+#define EWMA_WHEEL_SLOT_MASK (EWMA_WHEEL_N_SLOTS - 1)
+
+/*** Downcasts for the above types ***/
+
+/**
+ * Downcast a circuitmux_policy_data_t to an ewma_wheel_data_t and assert
+ * if the cast is impossible.
+ */
+static inline ewma_wheel_data_t *
+TO_EWMA_WHEEL_DATA(circuitmux_policy_data_t *pol)
+{
+  if (!pol) return NULL;
+  else {
+    tor_assert(pol->magic == EWMA_WHEEL_DATA_MAGIC);
+    return DOWNCAST(ewma_wheel_data_t, pol);
+  }
+}
+
+/**
+ * Downcast a circuitmux_policy_circ_data_t to an ewma_wheel_circ_data_t
+ * and assert if the cast is impossible.
+ */
+static inline ewma_wheel_circ_data_t *
+TO_EWMA_WHEEL_CIRC_DATA(circuitmux_policy_circ_data_t *pol)
+{
+  if (!pol) return NULL;
+  else {
+    tor_assert(pol->magic == EWMA_WHEEL_CIRC_DATA_MAGIC);
+    return DOWNCAST(ewma_wheel_circ_data_t, pol);
+  }
+}
+
+/*** Circuitmux policy methods ***/
+
+static circuitmux_policy_data_t *ewma_wheel_alloc_cmux_data(
+                                                     circuitmux_t *cmux);
+static void ewma_wheel_free_cmux_data(circuitmux_t *cmux,
+                                      circuitmux_policy_data_t *pol_data);
+static circuitmux_policy_circ_data_t *
+ewma_wheel_alloc_circ_data(circuitmux_t *cmux,
+                           circuitmux_policy_data_t *pol_data,
+                           circuit_t *circ, cell_direction_t direction,
+                           unsigned int cell_count);
+static void
+ewma_wheel_free_circ_data(circuitmux_t *cmux,
+                          circuitmux_policy_data_t *pol_data,
+                          circuit_t *circ,
+                          circuitmux_policy_circ_data_t *pol_circ_data);
+static void
+ewma_wheel_notify_circ_active(circuitmux_t *cmux,
+                              circuitmux_policy_data_t *pol_data,
+                              circuit_t *circ,
+                              circuitmux_policy_circ_data_t *pol_circ_data);
+static void
+ewma_wheel_notify_circ_inactive(circuitmux_t *cmux,
+                                circuitmux_policy_data_t *pol_data,
+                                circuit_t *circ,
+                              circuitmux_policy_circ_data_t *pol_circ_data);
+static void
+ewma_wheel_notify_xmit_cells(circuitmux_t *cmux,
+                             circuitmux_policy_data_t *pol_data,
+                             circuit_t *circ,
+                             circuitmux_policy_circ_data_t *pol_circ_data,
+                             unsigned int n_cells);
+static circuit_t *
+ewma_wheel_pick_active_circuit(circuitmux_t *cmux,
+                               circuitmux_policy_data_t *pol_data);
+static int
+ewma_wheel_cmp_cmux(circuitmux_t *cmux_1,
+                    circuitmux_policy_data_t *pol_data_1,
+                    circuitmux_t *cmux_2,
+                    circuitmux_policy_data_t *pol_data_2);
+
+/*** EWMA wheel global variables ***/
+
+/** How much the logarithm of a cell's weight grows per msec: ln(2) divided
+ * by the halflife in msec. */
+static double ewma_wheel_lambda = 0.69314718055994529 / 30000.0;
+/** Incremented every time ewma_wheel_lambda changes. */
+static unsigned ewma_wheel_lambda_gen = 0;
+
+/*** EWMA wheel circuitmux_policy_t method table ***/
+
+circuitmux_policy_t ewma_wheel_policy = {
+  /*.alloc_cmux_data =*/ ewma_wheel_alloc_cmux_data,
+  /*.free_cmux_data =*/ ewma_wheel_free_cmux_data,
+  /*.alloc_circ_data =*/ ewma_wheel_alloc_circ_data,
+  /*.free_circ_data =*/ ewma_wheel_free_circ_data,
+  /*.notify_circ_active =*/ ewma_wheel_notify_circ_active,
+  /*.notify_circ_inactive =*/ ewma_wheel_notify_circ_inactive,
+  /*.notify_set_n_cells =*/ NULL, /* We don't need this either */
+  /*.notify_xmit_cells =*/ ewma_wheel_notify_xmit_cells,
+  /*.pick_active_circuit =*/ ewma_wheel_pick_active_circuit,
+  /*.cmp_cmux =*/ ewma_wheel_cmp_cmux
+};
+
+/*** Key arithmetic ***/
+
+/** Return the result of adding <b>n_cells</b> cells, sent at
+ * <b>now_msec</b>, to a circuit whose key was <b>key</b>. */
+STATIC int64_t
+ewma_wheel_add_cells(int64_t key, unsigned int n_cells, uint64_t now_msec)
+{
+  double added, hi, lo;
+
+  tor_assert(n_cells > 0);
+
+  added = log((double)n_cells) + ((double)now_msec) * ewma_wheel_lambda;
+  added *= EWMA_WHEEL_KEY_SCALE;
+  if (key == EWMA_WHEEL_KEY_NONE)
+    return (int64_t) added;
+
+  /* log(e^a + e^b) = max(a,b) + log(1 + e^-|a-b|), which doesn't
+   * overflow. */
+  hi = MAX(added, (double)key);
+  lo = MIN(added, (double)key);
+  return (int64_t) (hi + EWMA_WHEEL_KEY_SCALE *
+                    log1p(exp((lo - hi) / EWMA_WHEEL_KEY_SCALE)));
+}
+
+/** Return <b>key</b>, computed with <b>old_lambda</b>, converted to
+ * <b>new_lambda</b> at <b>now_msec</b>, so that it stands for the same
+ * weighted cell count at that time. */
+STATIC int64_t
+ewma_wheel_rekey(int64_t key, double old_lambda, double new_lambda,
+                 uint64_t now_msec)
+{
+  double moved;
+
+  if (key == EWMA_WHEEL_KEY_NONE)
+    return key;
+
+  moved = (double)key +
+    (new_lambda - old_lambda) * ((double)now_msec) * EWMA_WHEEL_KEY_SCALE;
+  /* A count that has decayed below one cell is as good as a fresh one. */
+  return moved > 0 ? (int64_t) moved : 0;
+}
+
+/** Return the bucket that a circuit with <b>key</b> belongs in, on
+ * <b>pol</b>. */
+static inline int64_t
+ewma_wheel_key_to_bucket(const ewma_wheel_data_t *pol, int64_t key)
+{
+  /* A circuit that hasn't sent anything is as good as it gets. */
+  if (key < 0)
+    return pol->first_bucket;
+  return key >> EWMA_WHEEL_SLOT_BITS;
+}
+
+/*** The wheel ***/
+
+/** Return <b>pol</b>'s bitmap of nonempty slots, rotated so that bit 0 is
+ * the slot of its first bucket. */
+static inline uint64_t
+ewma_wheel_rotated_nonempty(const ewma_wheel_data_t *pol)
+{
+  int start = (int)(pol->first_bucket & EWMA_WHEEL_SLOT_MASK);
+  uint64_t rotated = pol->nonempty >> start;
+
+  if (start)
+    rotated |= pol->nonempty << (EWMA_WHEEL_N_SLOTS - start);
+  return rotated;
+}
+
+/** Return the index of the first nonempty slot on <b>pol</b>'s wheel,
+ * counting from the slot of its first bucket.  Requires that some slot is
+ * nonempty. */
+static inline int
+ewma_wheel_first_nonempty_offset(const ewma_wheel_data_t *pol)
+{
+  uint64_t rotated = ewma_wheel_rotated_nonempty(pol);
+
+  tor_assert(rotated);
+  /* Isolate the lowest set bit. */
+  return tor_log2(rotated & (~rotated + 1));
+}
+
+/** Move the window of <b>pol</b>'s wheel back so that it starts at
+ * <b>new_first</b>, which must be before its current first bucket.  Any
+ * circuits that fall off the end of the window go in its last slot, as if
+ * they had been beyond the window when we added them. */
+static void
+ewma_wheel_move_window_back(ewma_wheel_data_t *pol, int64_t new_first)
+{
+  int64_t new_last = new_first + EWMA_WHEEL_N_SLOTS - 1;
+  int64_t n_kept = new_last - pol->first_bucket + 1;
+  uint64_t rotated = ewma_wheel_rotated_nonempty(pol);
+  int last_slot = (int)(new_last & EWMA_WHEEL_SLOT_MASK);
+  int offset;
+
+  tor_assert(new_first < pol->first_bucket);
+
+  /* Look at every nonempty slot that is no longer in the window. */
+  if (n_kept > 0)
+    rotated &= ~((UINT64_C(1) << n_kept) - 1);
+  while (rotated) {
+    ewma_wheel_circ_data_t *cdata;
+    int slot;
+
+    offset = tor_log2(rotated & (~rotated + 1));
+    rotated &= rotated - 1;
+    slot = (int)((pol->first_bucket + offset) & EWMA_WHEEL_SLOT_MASK);
+    if (slot == last_slot)
+      continue; /* Already there. */
+    while ((cdata = TOR_TAILQ_FIRST(&pol->slots[slot]))) {
+      TOR_TAILQ_REMOVE(&pol->slots[slot], cdata, next_in_slot);
+      TOR_TAILQ_INSERT_TAIL(&pol->slots[last_slot], cdata, next_in_slot);
+      cdata->slot = last_slot;
+    }
+    pol->nonempty &= ~(UINT64_C(1) << slot);
+    pol->nonempty |= UINT64_C(1) << last_slot;
+  }
+
+  pol->first_bucket = new_first;
+}
+
+/** Put <b>cdata</b> on <b>pol</b>'s wheel, in the slot that its key
+ * belongs in.  If the key is beyond the window of the wheel, use the last
+ * slot inside it; if it's before the window, move the window back. */
+static void
+ewma_wheel_insert(ewma_wheel_data_t *pol, ewma_wheel_circ_data_t *cdata)
+{
+  int64_t bucket;
+  int slot;
+
+  tor_assert(cdata->slot == -1);
+
+  bucket = ewma_wheel_key_to_bucket(pol, cdata->key);
+  if (pol->n_active == 0) {
+    /* Nothing else on the wheel, so we can move the window. */
+    pol->first_bucket = bucket;
+  } else if (bucket < pol->first_bucket) {
+    ewma_wheel_move_window_back(pol, bucket);
+  }
+  bucket = MIN(bucket, pol->first_bucket + EWMA_WHEEL_N_SLOTS - 1);
+  slot = (int)(bucket & EWMA_WHEEL_SLOT_MASK);
+
+  TOR_TAILQ_INSERT_TAIL(&pol->slots[slot], cdata, next_in_slot);
+  pol->nonempty |= UINT64_C(1) << slot;
+  cdata->slot = slot;
+  ++pol->n_active;
+}
+
+/** Take <b>cdata</b> off <b>pol</b>'s wheel. */
+static void
+ewma_wheel_remove(ewma_wheel_data_t *pol, ewma_wheel_circ_data_t *cdata)
+{
+  int slot = cdata->slot;
+
+  tor_assert(slot >= 0 && slot < EWMA_WHEEL_N_SLOTS);
+  tor_assert(pol->n_active > 0);
+
+  TOR_TAILQ_REMOVE(&pol->slots[slot], cdata, next_in_slot);
+  if (TOR_TAILQ_EMPTY(&pol->slots[slot]))
+    pol->nonempty &= ~(UINT64_C(1) << slot);
+  cdata->slot = -1;
+  --pol->n_active;
+}
+
+/** Return the best circuit on <b>pol</b>'s wheel, or NULL if it has none.
+ * Advance the window of the wheel to its bucket, moving circuits that were
+ * only in their slot because they were beyond the window. */
+static ewma_wheel_circ_data_t *
+ewma_wheel_first(ewma_wheel_data_t *pol)
+{
+  while (pol->nonempty) {
+    ewma_wheel_circ_data_t *head, *cdata;
+    struct ewma_wheel_slot_s moving;
+    int slot;
+
+    pol->first_bucket += ewma_wheel_first_nonempty_offset(pol);
+    slot = (int)(pol->first_bucket & EWMA_WHEEL_SLOT_MASK);
+    head = TOR_TAILQ_FIRST(&pol->slots[slot]);
+    if (ewma_wheel_key_to_bucket(pol, head->key) <= pol->first_bucket)
+      return head;
+
+    /* The head of this slot was beyond the window when we added it.  If
+     * this is the only nonempty slot, we can jump the window ahead to the
+     * best circuit in it. Otherwise the window can't pass the next nonempty
+     * slot, but it will get there soon enough. */
+    if ((pol->nonempty & (pol->nonempty - 1)) == 0) {
+      int64_t best = INT64_MAX;
+      TOR_TAILQ_FOREACH(cdata, &pol->slots[slot], next_in_slot) {
+        best = MIN(best, ewma_wheel_key_to_bucket(pol, cdata->key));
+      }
+      pol->first_bucket = MAX(pol->first_bucket, best);
+    }
+
+    /* Now put every circuit in this slot where it belongs. */
+    TOR_TAILQ_INIT(&moving);
+    while ((cdata = TOR_TAILQ_FIRST(&pol->slots[slot]))) {
+      ewma_wheel_remove(pol, cdata);
+      TOR_TAILQ_INSERT_TAIL(&moving, cdata, next_in_slot);
+    }
+    while ((cdata = TOR_TAILQ_FIRST(&moving))) {
+      TOR_TAILQ_REMOVE(&moving, cdata, next_in_slot);
+      ewma_wheel_insert(pol, cdata);
+    }
+  }
+  return NULL;
+}
+
+/** Convert the key of <b>cdata</b> to the current halflife, if it was
+ * computed with some other one. */
+static void
+ewma_wheel_circ_update_lambda(ewma_wheel_circ_data_t *cdata)
+{
+  if (PREDICT_LIKELY(cdata->lambda_gen == ewma_wheel_lambda_gen))
+    return;
+  cdata->key = ewma_wheel_rekey(cdata->key, cdata->lambda, ewma_wheel_lambda,
+                                monotime_coarse_absolute_msec());
+  cdata->lambda = ewma_wheel_lambda;
+  cdata->lambda_gen = ewma_wheel_lambda_gen;
+}
+
+/** If the halflife has changed since the keys on <b>pol</b>'s wheel were
+ * computed, convert all of them, and put each circuit back in the slot where
+ * it now belongs. */
+static void
+ewma_wheel_update_lambda(ewma_wheel_data_t *pol)
+{
+  struct ewma_wheel_slot_s moving;
+  ewma_wheel_circ_data_t *cdata;
+  int i;
+
+  if (PREDICT_LIKELY(pol->lambda_gen == ewma_wheel_lambda_gen))
+    return;
+
+  TOR_TAILQ_INIT(&moving);
+  for (i = 0; i < EWMA_WHEEL_N_SLOTS; ++i) {
+    while ((cdata = TOR_TAILQ_FIRST(&pol->slots[i]))) {
+      ewma_wheel_remove(pol, cdata);
+      TOR_TAILQ_INSERT_TAIL(&moving, cdata, next_in_slot);
+    }
+  }
+  pol->lambda_gen = ewma_wheel_lambda_gen;
+  while ((cdata = TOR_TAILQ_FIRST(&moving))) {
+    TOR_TAILQ_REMOVE(&moving, cdata, next_in_slot);
+    ewma_wheel_circ_update_lambda(cdata);
+    ewma_wheel_insert(pol, cdata);
+  }
+}
+
+/*** Policy method implementations ***/
+
+/**
+ * Allocate an ewma_wheel_data_t and upcast it to a circuitmux_policy_data_t;
+ * this is called when setting the policy on a circuitmux_t to
+ * ewma_wheel_policy.
+ */
+static circuitmux_policy_data_t *
+ewma_wheel_alloc_cmux_data(circuitmux_t *cmux)
+{
+  ewma_wheel_data_t *pol = NULL;
+  int i;
+
+  tor_assert(cmux);
+
+  pol = tor_malloc_zero(sizeof(*pol));
+  pol->base_.magic = EWMA_WHEEL_DATA_MAGIC;
+  pol->lambda_gen = ewma_wheel_lambda_gen;
+  for (i = 0; i < EWMA_WHEEL_N_SLOTS; ++i)
+    TOR_TAILQ_INIT(&pol->slots[i]);
+
+  return TO_CMUX_POL_DATA(pol);
+}
+
+/**
+ * Free an ewma_wheel_data_t allocated with ewma_wheel_alloc_cmux_data()
+ */
+static void
+ewma_wheel_free_cmux_data(circuitmux_t *cmux,
+                          circuitmux_policy_data_t *pol_data)
+{
+  ewma_wheel_data_t *pol = NULL;
+
+  tor_assert(cmux);
+  if (!pol_data) return;
+
+  pol = TO_EWMA_WHEEL_DATA(pol_data);
+  tor_free(pol);
+}
+
+/**
+ * Allocate an ewma_wheel_circ_data_t and upcast it to a
+ * circuitmux_policy_circ_data_t; this is called when attaching a circuit to
+ * a circuitmux_t with ewma_wheel_policy.
+ */
+static circuitmux_policy_circ_data_t *
+ewma_wheel_alloc_circ_data(circuitmux_t *cmux,
+                           circuitmux_policy_data_t *pol_data,
+                           circuit_t *circ,
+                           cell_direction_t direction,
+                           unsigned int cell_count)
+{
+  ewma_wheel_circ_data_t *cdata = NULL;
+
+  tor_assert(cmux);
+  tor_assert(pol_data);
+  tor_assert(circ);
+  tor_assert(direction == CELL_DIRECTION_OUT ||
+             direction == CELL_DIRECTION_IN);
+  (void)cell_count;
+
+  cdata = tor_malloc_zero(sizeof(*cdata));
+  cdata->base_.magic = EWMA_WHEEL_CIRC_DATA_MAGIC;
+  cdata->circ = circ;
+  cdata->key = EWMA_WHEEL_KEY_NONE;
+  cdata->lambda = ewma_wheel_lambda;
+  cdata->lambda_gen = ewma_wheel_lambda_gen;
+  cdata->slot = -1;
+
+  return TO_CMUX_POL_CIRC_DATA(cdata);
+}
+
+/**
+ * Free an ewma_wheel_circ_data_t allocated with ewma_wheel_alloc_circ_data()
+ */
+static void
+ewma_wheel_free_circ_data(circuitmux_t *cmux,
+                          circuitmux_policy_data_t *pol_data,
+                          circuit_t *circ,
+                          circuitmux_policy_circ_data_t *pol_circ_data)
+{
+  ewma_wheel_circ_data_t *cdata = NULL;
+
+  tor_assert(cmux);
+  tor_assert(circ);
+  tor_assert(pol_data);
+
+  if (!pol_circ_data) return;
+
+  cdata = TO_EWMA_WHEEL_CIRC_DATA(pol_circ_data);
+  tor_free(cdata);
+}
+
+/**
+ * Handle circuit activation; this puts the circuit on the wheel.
+ */
+static void
+ewma_wheel_notify_circ_active(circuitmux_t *cmux,
+                              circuitmux_policy_data_t *pol_data,
+                              circuit_t *circ,
+                              circuitmux_policy_circ_data_t *pol_circ_data)
+{
+  ewma_wheel_data_t *pol = NULL;
+  ewma_wheel_circ_data_t *cdata = NULL;
+
+  tor_assert(cmux);
+  tor_assert(pol_data);
+  tor_assert(circ);
+  tor_assert(pol_circ_data);
+
+  pol = TO_EWMA_WHEEL_DATA(pol_data);
+  cdata = TO_EWMA_WHEEL_CIRC_DATA(pol_circ_data);
+
+  ewma_wheel_update_lambda(pol);
+  ewma_wheel_circ_update_lambda(cdata);
+  ewma_wheel_insert(pol, cdata);
+}
+
+/**
+ * Handle circuit deactivation; this takes the circuit off the wheel.
+ */
+static void
+ewma_wheel_notify_circ_inactive(circuitmux_t *cmux,
+                                circuitmux_policy_data_t *pol_data,
+                                circuit_t *circ,
+                                circuitmux_policy_circ_data_t *pol_circ_data)
+{
+  tor_assert(cmux);
+  tor_assert(pol_data);
+  tor_assert(circ);
+  tor_assert(pol_circ_data);
+
+  ewma_wheel_remove(TO_EWMA_WHEEL_DATA(pol_data),
+                    TO_EWMA_WHEEL_CIRC_DATA(pol_circ_data));
+}
+
+/**
+ * Update the key of this circuit after we've sent some cells on it, and
+ * move it to the slot where it now belongs.
+ */
+static void
+ewma_wheel_notify_xmit_cells(circuitmux_t *cmux,
+                             circuitmux_policy_data_t *pol_data,
+                             circuit_t *circ,
+                             circuitmux_policy_circ_data_t *pol_circ_data,
+                             unsigned int n_cells)
+{
+  ewma_wheel_data_t *pol = NULL;
+  ewma_wheel_circ_data_t *cdata = NULL;
+
+  tor_assert(cmux);
+  tor_assert(pol_data);
+  tor_assert(circ);
+  tor_assert(pol_circ_data);
+  tor_assert(n_cells > 0);
+
+  pol = TO_EWMA_WHEEL_DATA(pol_data);
+  cdata = TO_EWMA_WHEEL_CIRC_DATA(pol_circ_data);
+
+  ewma_wheel_update_lambda(pol);
+  ewma_wheel_remove(pol, cdata);
+  cdata->key = ewma_wheel_add_cells(cdata->key, n_cells,
+                                    monotime_coarse_absolute_msec());
+  ewma_wheel_insert(pol, cdata);
+}
+
+/**
+ * Pick the preferred circuit to send from; this will be the first one in
+ * the first nonempty slot of the wheel.
+ */
+static circuit_t *
+ewma_wheel_pick_active_circuit(circuitmux_t *cmux,
+                               circuitmux_policy_data_t *pol_data)
+{
+  ewma_wheel_data_t *pol = NULL;
+  ewma_wheel_circ_data_t *cdata;
+
+  tor_assert(cmux);
+  tor_assert(pol_data);
+
+  pol = TO_EWMA_WHEEL_DATA(pol_data);
+  ewma_wheel_update_lambda(pol);
+  cdata = ewma_wheel_first(pol);
+  return cdata ? cdata->circ : NULL;
+}
+
+/**
+ * Compare two EWMA wheel cmuxes, and return -1, 0 or 1 to indicate which
+ * should be more preferred - see circuitmux_compare_muxes() of circuitmux.c.
+ */
+static int
+ewma_wheel_cmp_cmux(circuitmux_t *cmux_1,
+                    circuitmux_policy_data_t *pol_data_1,
+                    circuitmux_t *cmux_2,
+                    circuitmux_policy_data_t *pol_data_2)
+{
+  ewma_wheel_circ_data_t *c1, *c2;
+
+  tor_assert(cmux_1);
+  tor_assert(pol_data_1);
+  tor_assert(cmux_2);
+  tor_assert(pol_data_2);
+
+  if (pol_data_1 == pol_data_2)
+    return 0;
+
+  ewma_wheel_update_lambda(TO_EWMA_WHEEL_DATA(pol_data_1));
+  ewma_wheel_update_lambda(TO_EWMA_WHEEL_DATA(pol_data_2));
+  c1 = ewma_wheel_first(TO_EWMA_WHEEL_DATA(pol_data_1));
+  c2 = ewma_wheel_first(TO_EWMA_WHEEL_DATA(pol_data_2));
+
+  if (c1 && c2) {
+    /* Pick whichever one has the better best circuit */
+    if (c1->key < c2->key)
+      return -1;
+    else if (c1->key > c2->key)
+      return 1;
+    else
+      return 0;
+  } else if (c1) {
+    return -1;
+  } else if (c2) {
+    return 1;
+  } else {
+    return 0;
+  }
+}
+
+#ifdef TOR_UNIT_TESTS
+/** Return the key of the circuit with policy data <b>pol_data</b>. */
+STATIC int64_t
+ewma_wheel_get_key(circuitmux_policy_circ_data_t *pol_data)
+{
+  tor_assert(pol_data);
+  return TO_EWMA_WHEEL_CIRC_DATA(pol_data)->key;
+}
+#endif /* defined(TOR_UNIT_TESTS) */
+
+/** Set the halflife (in seconds) to use when weighting cells.  Circuits
+ * that already have keys get converted the next time we touch them. */
+void
+cmux_ewma_wheel_set_halflife(double halflife)
+{
+  double lambda;
+
+  tor_assert(halflife > 0);
+  lambda = 0.69314718055994529 / (halflife * 1000.0);
+  if (lambda < ewma_wheel_lambda || lambda > ewma_wheel_lambda) {
+    ewma_wheel_lambda = lambda;
+    ++ewma_wheel_lambda_gen;
+  }
+}
@@ -0,0 +1,41 @@
+/* Copyright (c) 2019, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file circuitmux_ewma_wheel.h
+ * \brief Header file for circuitmux_ewma_wheel.c
+ **/
+
+#ifndef TOR_CIRCUITMUX_EWMA_WHEEL_H
+#define TOR_CIRCUITMUX_EWMA_WHEEL_H
+
+#include "core/or/or.h"
+#include "core/or/circuitmux.h"
+
+/* The public EWMA wheel policy callbacks object. */
+extern circuitmux_policy_t ewma_wheel_policy;
+
+void cmux_ewma_wheel_set_halflife(double halflife);
+
+#ifdef CIRCUITMUX_EWMA_WHEEL_PRIVATE
+/** How many slots are there on the wheel of each circuitmux? */
+#define EWMA_WHEEL_N_SLOTS 64
+/** How many key units correspond to a factor of e in the cell count? */
+#define EWMA_WHEEL_KEY_SCALE 65536.0
+/** Log2 of the number of key units that each slot of the wheel covers. With
+ * a key scale of 65536, that's 1/16 of a factor of e, so that circuits whose
+ * weighted cell counts are within about 6% of each other share a slot. */
+#define EWMA_WHEEL_SLOT_BITS 12
+/** Key value for a circuit that hasn't sent any cells yet. */
+#define EWMA_WHEEL_KEY_NONE INT64_MIN
+
+STATIC int64_t ewma_wheel_add_cells(int64_t key, unsigned int n_cells,
+                                    uint64_t now_msec);
+STATIC int64_t ewma_wheel_rekey(int64_t key, double old_lambda,
+                                double new_lambda, uint64_t now_msec);
+#ifdef TOR_UNIT_TESTS
+STATIC int64_t ewma_wheel_get_key(circuitmux_policy_circ_data_t *pol_data);
+#endif
+#endif /* defined(CIRCUITMUX_EWMA_WHEEL_PRIVATE) */
+
+#endif /* !defined(TOR_CIRCUITMUX_EWMA_WHEEL_H) */
@@ -95,6 +95,14 @@ struct connection_t {
                          * connection. */
   size_t outbuf_flushlen; /**< How much data should we try to flush from the
                            * outbuf? */
+  /** If nonzero, once we've flushed the outbuf, we send this many more bytes
+   * straight from <b>sendfile_fd</b> to the socket, without copying them
+   * through the outbuf.  See connection_set_sendfile_source(). */
+  size_t sendfile_remaining;
+  /** The file to send from, if sendfile_remaining is nonzero.  We own it. */
+  int sendfile_fd;
+  /** Where in <b>sendfile_fd</b> the next byte to send is. */
+  off_t sendfile_offset;
   time_t timestamp_last_read_allowed; /**< When was the last time libevent said
                                        * we could read? */
   time_t timestamp_last_write_allowed; /**< When was the last time libevent
@@ -18,8 +18,9 @@
 #include "feature/nodelist/networkstatus.h"
 #include "feature/nodelist/nodelist.h"
 #include "feature/relay/routermode.h"
-#include "feature/stats/geoip_stats.h"
 #include "lib/crypt_ops/crypto_rand.h"
+#include "lib/process/process.h"
+#include "siphash.h"
 
 #include "core/or/dos.h"
 
@@ -71,6 +72,76 @@ static uint64_t conn_num_addr_rejected;
 /* Keep stats for the heartbeat. */
 static uint64_t num_single_hop_client_refused;
 
+/*
+ * Early rejection of marked client addresses.
+ *
+ * Namespace used for this is "dos_reject_". When it is enabled, we refuse
+ * new connections from addresses that the circuit creation mitigation has
+ * marked, right after accept(), and we can tell a helper program about each
+ * one so that it can block them before they even reach us.
+ */
+
+/* Do we refuse new connections from marked addresses? */
+static unsigned int dos_reject_marked = 0;
+
+/* Keep some stats for the heartbeat so we can report out. */
+static uint64_t reject_num_conns_refused;
+
+/* The running rejection helper, or NULL if there is none. */
+static process_t *reject_helper = NULL;
+/* When did we last launch the rejection helper? */
+static time_t reject_helper_last_launch = 0;
+/* If the rejection helper exits, we wait at least this long after its
+ * previous launch before relaunching it (seconds). */
+#define DOS_REJECT_HELPER_RELAUNCH_INTERVAL 60
+
+/*
+ * Per-address client statistics.
+ *
+ * Every client address that has a connection open to us, or whose
+ * statistics still tell us something, has an entry in this table.  It is an
+ * open-addressing hash table with linear probing and fixed-size entries, so
+ * that finding an address touches one or two cache lines and adding one
+ * doesn't allocate, even when a flood of connections comes from millions of
+ * addresses.  Entries are removed with backward shifting, so there are no
+ * tombstones to clean up.
+ *
+ * IPv6 addresses share one entry per /64, since a client can usually use
+ * any address in its /64.
+ */
+
+/* Kinds of key in the client table. A slot whose kind is
+ * DOS_CLIENT_KEY_NONE is empty. */
+#define DOS_CLIENT_KEY_NONE 0
+#define DOS_CLIENT_KEY_IPV4 1
+#define DOS_CLIENT_KEY_IPV6 2
+
+/* An entry in the client table. */
+typedef struct dos_client_entry_t {
+  /* The IPv4 address in host order, or the first 64 bits of the IPv6
+   * address. */
+  uint64_t key;
+  /* Hash of the key, so that we don't recompute it when we move entries. */
+  uint32_t hash;
+  /* One of the DOS_CLIENT_KEY_* values. */
+  uint8_t kind;
+  /* The statistics themselves. */
+  dos_client_stats_t stats;
+} dos_client_entry_t;
+
+/* The table itself, and how many slots it has (always a power of two). */
+static dos_client_entry_t *client_table = NULL;
+static uint32_t client_table_n_slots = 0;
+/* How many slots in the table are in use? */
+static uint32_t client_table_n_entries = 0;
+/* The table never shrinks below this many slots. */
+#define DOS_CLIENT_TABLE_MIN_SLOTS 1024
+/* The table never grows beyond this many slots. */
+STATIC uint32_t dos_client_table_max_slots = DOS_CLIENT_TABLE_MAX_SLOTS;
+/* When did we last look for entries to evict from the full table without
+ * getting it down to its low-water mark? */
+static time_t client_table_last_short_sweep = 0;
+
 /* Return true iff the circuit creation mitigation is enabled. We look at the
  * consensus for this else a default value is returned. */
 MOCK_IMPL(STATIC unsigned int,
@@ -175,6 +246,18 @@ get_param_conn_max_concurrent_count(const networkstatus_t *ns)
                                  1, INT32_MAX);
 }
 
+/* Return true iff we should refuse new connections from marked addresses.
+ * We look at the consensus for this else a default value is returned. */
+MOCK_IMPL(STATIC unsigned int,
+get_param_reject_marked, (const networkstatus_t *ns))
+{
+  if (get_options()->DoSRejectMarkedAddresses != -1) {
+    return get_options()->DoSRejectMarkedAddresses;
+  }
+  return !!networkstatus_get_param(ns, "DoSRejectMarkedAddresses",
+                                   DOS_REJECT_MARKED_DEFAULT, 0, 1);
+}
+
 /* Return the consensus parameter of the connection defense type. */
 static uint32_t
 get_param_conn_defense_type(const networkstatus_t *ns)
@@ -187,6 +270,8 @@ get_param_conn_defense_type(const networkstatus_t *ns)
                                  DOS_CONN_DEFENSE_NONE, DOS_CONN_DEFENSE_MAX);
 }
 
+static void reject_helper_configure(void);
+
 /* Set circuit creation parameters located in the consensus or their default
  * if none are present. Called at initialization or when the consensus
  * changes. */
@@ -205,6 +290,10 @@ set_dos_parameters(const networkstatus_t *ns)
   dos_conn_enabled = get_param_conn_enabled(ns);
   dos_conn_max_concurrent_count = get_param_conn_max_concurrent_count(ns);
   dos_conn_defense_type = get_param_conn_defense_type(ns);
+
+  /* Early rejection. */
+  dos_reject_marked = get_param_reject_marked(ns);
+  reject_helper_configure();
 }
 
 /* Free everything for the circuit creation DoS mitigation subsystem. */
@@ -362,6 +451,456 @@ cc_mark_client(cc_client_stats_t *stats)
     crypto_rand_int_range(1, dos_cc_defense_time_period / 2);
 }
 
+/* Set *<b>key_out</b> and *<b>kind_out</b> to the client table key for
+ * <b>addr</b>. Return 0 on success, or -1 if we can't track addresses of
+ * this kind. */
+static int
+client_key_from_addr(const tor_addr_t *addr, uint64_t *key_out,
+                     uint8_t *kind_out)
+{
+  switch (tor_addr_family(addr)) {
+    case AF_INET:
+      *key_out = tor_addr_to_ipv4h(addr);
+      *kind_out = DOS_CLIENT_KEY_IPV4;
+      return 0;
+    case AF_INET6:
+      *key_out = get_uint64(tor_addr_to_in6_addr8(addr));
+      *kind_out = DOS_CLIENT_KEY_IPV6;
+      return 0;
+    default:
+      return -1;
+  }
+}
+
+/* Return the hash of the client table key <b>key</b> of kind <b>kind</b>.
+ * This is keyed, so that nobody can pick addresses that collide. */
+static uint32_t
+client_key_hash(uint64_t key, uint8_t kind)
+{
+  uint64_t buf[2] = { key, kind };
+  uint64_t hash = siphash24g(buf, sizeof(buf));
+  return (uint32_t) hash;
+}
+
+/* Return the index of the slot that holds the given key, or of the empty
+ * slot where it would go. */
+static uint32_t
+client_table_find(uint64_t key, uint8_t kind, uint32_t hash)
+{
+  const uint32_t mask = client_table_n_slots - 1;
+  uint32_t i = hash & mask;
+
+  while (client_table[i].kind != DOS_CLIENT_KEY_NONE &&
+         (client_table[i].key != key || client_table[i].kind != kind)) {
+    i = (i + 1) & mask;
+  }
+  return i;
+}
+
+/* Move every entry of the client table into a new table of <b>n_slots</b>
+ * slots. */
+static void
+client_table_resize(uint32_t n_slots)
+{
+  dos_client_entry_t *old_table = client_table;
+  const uint32_t old_n_slots = client_table_n_slots;
+  uint32_t i;
+
+  tor_assert(n_slots >= DOS_CLIENT_TABLE_MIN_SLOTS);
+  tor_assert((n_slots & (n_slots - 1)) == 0);
+  tor_assert(n_slots > client_table_n_entries);
+
+  client_table = tor_calloc(n_slots, sizeof(dos_client_entry_t));
+  client_table_n_slots = n_slots;
+  for (i = 0; i < old_n_slots; ++i) {
+    const dos_client_entry_t *ent = &old_table[i];
+    if (ent->kind == DOS_CLIENT_KEY_NONE)
+      continue;
+    memcpy(&client_table[client_table_find(ent->key, ent->kind, ent->hash)],
+           ent, sizeof(*ent));
+  }
+  tor_free(old_table);
+}
+
+/* Return how many entries the client table may hold before it has to grow,
+ * or, once it is as big as it gets, before we have to evict entries. */
+static uint32_t
+client_table_max_entries(void)
+{
+  if (client_table_n_slots >= dos_client_table_max_slots)
+    return client_table_n_slots / 4 * 3;
+  return client_table_n_slots / 2;
+}
+
+/* Remove the entry in slot <b>i</b> of the client table, shifting later
+ * entries back so that every entry stays reachable from its home slot. */
+static void
+client_table_remove_slot(uint32_t i)
+{
+  const uint32_t mask = client_table_n_slots - 1;
+  uint32_t j = i, home;
+
+  for (;;) {
+    j = (j + 1) & mask;
+    if (client_table[j].kind == DOS_CLIENT_KEY_NONE)
+      break;
+    home = client_table[j].hash & mask;
+    /* The entry in slot j can move back to slot i unless its home slot is
+     * cyclically in (i, j]. */
+    if (i <= j ? (home <= i || home > j) : (home <= i && home > j)) {
+      memcpy(&client_table[i], &client_table[j], sizeof(client_table[i]));
+      i = j;
+    }
+  }
+  memset(&client_table[i], 0, sizeof(client_table[i]));
+  --client_table_n_entries;
+}
+
+/* Remove entries from the client table whose statistics make
+ * <b>should_remove</b> return true at time <b>now</b>, until no more than
+ * <b>target</b> entries are left. Return how many we removed. */
+static uint32_t
+client_table_remove_if(int (*should_remove)(const dos_client_stats_t *,
+                                            time_t),
+                       time_t now, uint32_t target)
+{
+  uint32_t i = 0, n_removed = 0;
+
+  while (i < client_table_n_slots && client_table_n_entries > target) {
+    if (client_table[i].kind != DOS_CLIENT_KEY_NONE &&
+        should_remove(&client_table[i].stats, now)) {
+      /* Removing shifts a later entry into this slot, so look again. */
+      client_table_remove_slot(i);
+      ++n_removed;
+      continue;
+    }
+    ++i;
+  }
+  return n_removed;
+}
+
+/* Return true iff <b>stats</b> tells us nothing that a new entry for the
+ * same address wouldn't: there are no connections, the address isn't
+ * marked, and its circuit bucket would have refilled by <b>now</b>. */
+static int
+client_stats_is_idle(const dos_client_stats_t *stats, time_t now)
+{
+  const cc_client_stats_t *cc_stats = &stats->cc_stats;
+  uint64_t elapsed;
+
+  if (stats->concurrent_count > 0 || cc_stats->marked_until_ts >= now)
+    return 0;
+  /* A bucket that was never filled, or that we'd fill up because the clock
+   * jumped backward, is just like a new one. */
+  if (cc_stats->last_circ_bucket_refill_ts == 0 ||
+      cc_stats->last_circ_bucket_refill_ts > now)
+    return 1;
+  elapsed = (uint64_t) (now - cc_stats->last_circ_bucket_refill_ts);
+  return elapsed > UINT32_MAX ||
+    cc_stats->circuit_bucket + elapsed * dos_cc_circuit_rate >=
+    dos_cc_circuit_burst;
+}
+
+/* Return true iff we can evict <b>stats</b> when the client table is full:
+ * it has no connections for us to keep count of, and isn't marked. */
+static int
+client_stats_is_evictable(const dos_client_stats_t *stats, time_t now)
+{
+  return stats->concurrent_count == 0 &&
+    stats->cc_stats.marked_until_ts < now;
+}
+
+/* Make room for a new entry in the client table, which is as big as it
+ * gets, and return 0; or return -1 if there is no room. We evict in bulk,
+ * down to half the table, so that we don't have to look again until many
+ * more addresses have arrived. If we can't get that far, we don't look again
+ * for the rest of the second, so that a table full of addresses that we must
+ * keep doesn't cost us a scan of the whole table for every new address. */
+static int
+client_table_make_room(time_t now)
+{
+  const uint32_t low_water = client_table_n_slots / 2;
+
+  if (client_table_last_short_sweep != now) {
+    client_table_remove_if(client_stats_is_idle, now, 0);
+    client_table_remove_if(client_stats_is_evictable, now, low_water);
+    if (client_table_n_entries > low_water)
+      client_table_last_short_sweep = now;
+  }
+  return client_table_n_entries < client_table_max_entries() ? 0 : -1;
+}
+
+/* Return the statistics for the client address <b>addr</b>, or NULL if we
+ * have none. The pointer is only good until the next entry is added. */
+STATIC dos_client_stats_t *
+dos_client_lookup(const tor_addr_t *addr)
+{
+  dos_client_entry_t *ent;
+  uint64_t key;
+  uint8_t kind;
+
+  if (!client_table || client_key_from_addr(addr, &key, &kind) < 0)
+    return NULL;
+
+  ent = &client_table[client_table_find(key, kind,
+                                        client_key_hash(key, kind))];
+  return ent->kind == DOS_CLIENT_KEY_NONE ? NULL : &ent->stats;
+}
+
+/* Return the statistics for the client address <b>addr</b>, adding an
+ * entry for it if it has none. Return NULL if the address can't be
+ * tracked, or if the table is full of entries that we must keep. The
+ * pointer is only good until the next entry is added. */
+STATIC dos_client_stats_t *
+dos_client_lookup_or_add(const tor_addr_t *addr, time_t now)
+{
+  dos_client_entry_t *ent;
+  uint64_t key;
+  uint32_t hash;
+  uint8_t kind;
+
+  if (client_key_from_addr(addr, &key, &kind) < 0)
+    return NULL;
+  if (!client_table)
+    client_table_resize(DOS_CLIENT_TABLE_MIN_SLOTS);
+
+  hash = client_key_hash(key, kind);
+  ent = &client_table[client_table_find(key, kind, hash)];
+  if (ent->kind != DOS_CLIENT_KEY_NONE)
+    return &ent->stats;
+
+  if (client_table_n_entries + 1 > client_table_max_entries()) {
+    if (client_table_n_slots < dos_client_table_max_slots) {
+      client_table_resize(client_table_n_slots * 2);
+    } else if (client_table_make_room(now) < 0) {
+      static ratelim_t full_warning = RATELIM_INIT(3600);
+      log_fn_ratelim(&full_warning, LOG_NOTICE, LD_DOS,
+                     "DoS client address table is full of addresses with "
+                     "open connections. New addresses won't be tracked.");
+      return NULL;
+    }
+    ent = &client_table[client_table_find(key, kind, hash)];
+  }
+
+  memset(ent, 0, sizeof(*ent));
+  ent->key = key;
+  ent->hash = hash;
+  ent->kind = kind;
+  ++client_table_n_entries;
+  return &ent->stats;
+}
+
+#ifdef TOR_UNIT_TESTS
+/* Return how many addresses are in the client table. */
+STATIC uint32_t
+dos_client_table_n_entries(void)
+{
+  return client_table_n_entries;
+}
+#endif /* defined(TOR_UNIT_TESTS) */
+
+/* Return the number of bytes allocated for the client table. */
+size_t
+dos_client_table_total_allocation(void)
+{
+  return (size_t) client_table_n_slots * sizeof(dos_client_entry_t);
+}
+
+/* Free the client table and everything in it. */
+static void
+client_table_free_all(void)
+{
+  tor_free(client_table);
+  client_table_n_slots = client_table_n_entries = 0;
+  client_table_last_short_sweep = 0;
+}
+
+/* Set *<b>prefix_out</b> to the first address covered by the client table
+ * key <b>key</b> of kind <b>kind</b>, and return the prefix length. */
+static int
+client_key_to_prefix(uint64_t key, uint8_t kind, tor_addr_t *prefix_out)
+{
+  uint8_t bytes[16];
+
+  if (kind == DOS_CLIENT_KEY_IPV4) {
+    tor_addr_from_ipv4h(prefix_out, (uint32_t) key);
+    return 32;
+  }
+  tor_assert(kind == DOS_CLIENT_KEY_IPV6);
+  memset(bytes, 0, sizeof(bytes));
+  set_uint64(bytes, key);
+  tor_addr_from_ipv6_bytes(prefix_out, (const char *) bytes);
+  return 64;
+}
+
+/* Return a newly allocated line telling the rejection helper to block the
+ * client address <b>addr</b> for <b>seconds</b> seconds, or NULL if we
+ * can't track addresses like it. */
+STATIC char *
+dos_reject_line_new(const tor_addr_t *addr, time_t seconds)
+{
+  tor_addr_t prefix;
+  uint64_t key;
+  uint8_t kind;
+  int prefix_len;
+  char *line = NULL;
+
+  if (client_key_from_addr(addr, &key, &kind) < 0)
+    return NULL;
+  prefix_len = client_key_to_prefix(key, kind, &prefix);
+  tor_asprintf(&line, "reject %s/%d %"PRId64"\n", fmt_addr(&prefix),
+               prefix_len, (int64_t) MAX(seconds, 1));
+  return line;
+}
+
+/* Called when the rejection helper writes a line to its stdout or
+ * stderr. */
+static void
+reject_helper_output_cb(process_t *process, const char *line, size_t size)
+{
+  (void) process;
+  (void) size;
+  log_info(LD_DOS, "DoS rejection helper says: %s", escaped(line));
+}
+
+/* Called when the rejection helper exits. Returns true so that the process
+ * subsystem frees the handle. */
+static bool
+reject_helper_exit_cb(process_t *process, process_exit_code_t exit_code)
+{
+  /* If we didn't stop it ourselves, we'll launch it again the next time we
+   * have something to tell it. */
+  if (process == reject_helper) {
+    log_warn(LD_DOS, "DoS rejection helper exited with status code %"
+             PRIu64 ".", exit_code);
+    reject_helper = NULL;
+  }
+  return true;
+}
+
+/* Tell the rejection helper about every address that is marked right
+ * now. */
+static void
+reject_helper_send_all_marked(void)
+{
+  const time_t now = approx_time();
+  tor_addr_t prefix;
+  uint32_t i;
+  char *line;
+
+  for (i = 0; i < client_table_n_slots; ++i) {
+    const dos_client_entry_t *ent = &client_table[i];
+    if (ent->kind == DOS_CLIENT_KEY_NONE ||
+        ent->stats.cc_stats.marked_until_ts < now)
+      continue;
+    client_key_to_prefix(ent->key, ent->kind, &prefix);
+    line = dos_reject_line_new(&prefix,
+                               ent->stats.cc_stats.marked_until_ts - now);
+    process_write(reject_helper, (const uint8_t *) line, strlen(line));
+    tor_free(line);
+  }
+}
+
+/* Launch the rejection helper that DoSRejectHelper names, and tell it about
+ * every address that is marked right now. */
+static void
+reject_helper_launch(void)
+{
+  const or_options_t *options = get_options();
+  process_t *process;
+
+  tor_assert(!reject_helper);
+  tor_assert(options->DoSRejectHelper);
+
+  if (options->NoExec || options->Sandbox) {
+    static ratelim_t noexec_warning = RATELIM_INIT(3600);
+    log_fn_ratelim(&noexec_warning, LOG_WARN, LD_DOS,
+                   "DoSRejectHelper is not compatible with NoExec or "
+                   "Sandbox; not launching it.");
+    return;
+  }
+
+  reject_helper_last_launch = approx_time();
+  process = process_new(options->DoSRejectHelper);
+  process_set_stdout_read_callback(process, reject_helper_output_cb);
+  process_set_stderr_read_callback(process, reject_helper_output_cb);
+  process_set_exit_callback(process, reject_helper_exit_cb);
+  process_set_protocol(process, PROCESS_PROTOCOL_LINE);
+  if (process_exec(process) != PROCESS_STATUS_RUNNING) {
+    log_warn(LD_DOS, "Couldn't launch DoS rejection helper %s.",
+             escaped(options->DoSRejectHelper));
+    process_free(process);
+    return;
+  }
+
+  log_notice(LD_DOS, "Launched DoS rejection helper %s with PID %" PRIu64 ".",
+             escaped(options->DoSRejectHelper), process_get_pid(process));
+  reject_helper = process;
+  reject_helper_send_all_marked();
+}
+
+/* Stop the rejection helper, if it is running. */
+static void
+reject_helper_terminate(void)
+{
+  process_t *process = reject_helper;
+
+  if (!process)
+    return;
+  /* The exit callback frees the handle. */
+  reject_helper = NULL;
+  process_terminate(process);
+}
+
+/* Launch, relaunch or stop the rejection helper as our options and the
+ * consensus say. */
+static void
+reject_helper_configure(void)
+{
+  const char *path = NULL;
+
+  if (dos_cc_enabled && dos_reject_marked)
+    path = get_options()->DoSRejectHelper;
+
+  if (reject_helper &&
+      (!path || strcmp(path, process_get_command(reject_helper)))) {
+    reject_helper_terminate();
+  }
+  if (path && !reject_helper)
+    reject_helper_launch();
+}
+
+/* Send <b>line</b> to the rejection helper, relaunching it if it exited a
+ * while ago. */
+MOCK_IMPL(STATIC void,
+dos_reject_helper_send, (const char *line))
+{
+  if (!reject_helper) {
+    /* A fresh helper hears about every marked address, this one included. */
+    if (reject_helper_last_launch + DOS_REJECT_HELPER_RELAUNCH_INTERVAL <=
+        approx_time())
+      reject_helper_launch();
+    return;
+  }
+  process_write(reject_helper, (const uint8_t *) line, strlen(line));
+}
+
+/* Note that the client address <b>addr</b> has just been marked until
+ * <b>marked_until</b>, and tell the rejection helper if we have one. */
+static void
+reject_note_marked(const tor_addr_t *addr, time_t marked_until)
+{
+  char *line;
+
+  if (!dos_reject_marked || !get_options()->DoSRejectHelper)
+    return;
+
+  line = dos_reject_line_new(addr, marked_until - approx_time());
+  if (line)
+    dos_reject_helper_send(line);
+  tor_free(line);
+}
+
 /* Return true iff the given channel address is marked as malicious. This is
  * called a lot and part of the fast path of handling cells. It has to remain
  * as fast as we can. */
@@ -370,8 +909,7 @@ cc_channel_addr_is_marked(channel_t *chan)
 {
   time_t now;
   tor_addr_t addr;
-  clientmap_entry_t *entry;
-  cc_client_stats_t *stats = NULL;
+  dos_client_stats_t *stats = NULL;
 
   if (chan == NULL) {
     goto end;
@@ -385,19 +923,17 @@ cc_channel_addr_is_marked(channel_t *chan)
     goto end;
   }
 
-  /* We are only interested in client connection from the geoip cache. */
-  entry = geoip_lookup_client(&addr, NULL, GEOIP_CLIENT_CONNECT);
-  if (entry == NULL) {
-    /* We can have a connection creating circuits but not tracked by the geoip
-     * cache. Once this DoS subsystem is enabled, we can end up here with no
-     * entry for the channel. */
+  /* We are only interested in client addresses that we track. */
+  stats = dos_client_lookup(&addr);
+  if (stats == NULL) {
+    /* We can have a connection creating circuits but not tracked by this
+     * subsystem, if it was opened before the subsystem was enabled. */
     goto end;
   }
   now = approx_time();
-  stats = &entry->dos_stats.cc_stats;
 
  end:
-  return stats && stats->marked_until_ts >= now;
+  return stats && stats->cc_stats.marked_until_ts >= now;
 }
 
 /* Concurrent connection private API. */
@@ -438,7 +974,7 @@ void
 dos_cc_new_create_cell(channel_t *chan)
 {
   tor_addr_t addr;
-  clientmap_entry_t *entry;
+  dos_client_stats_t *stats;
 
   tor_assert(chan);
 
@@ -456,12 +992,11 @@ dos_cc_new_create_cell(channel_t *chan)
     goto end;
   }
 
-  /* We are only interested in client connection from the geoip cache. */
-  entry = geoip_lookup_client(&addr, NULL, GEOIP_CLIENT_CONNECT);
-  if (entry == NULL) {
-    /* We can have a connection creating circuits but not tracked by the geoip
-     * cache. Once this DoS subsystem is enabled, we can end up here with no
-     * entry for the channel. */
+  /* We are only interested in client addresses that we track. */
+  stats = dos_client_lookup(&addr);
+  if (stats == NULL) {
+    /* We can have a connection creating circuits but not tracked by this
+     * subsystem, if it was opened before the subsystem was enabled. */
     goto end;
   }
 
@@ -472,26 +1007,30 @@ dos_cc_new_create_cell(channel_t *chan)
 
   /* First of all, we'll try to refill the circuit bucket opportunistically
    * before we assess. */
-  cc_stats_refill_bucket(&entry->dos_stats.cc_stats, &addr);
+  cc_stats_refill_bucket(&stats->cc_stats, &addr);
 
   /* Take a token out of the circuit bucket if we are above 0 so we don't
    * underflow the bucket. */
-  if (entry->dos_stats.cc_stats.circuit_bucket > 0) {
-    entry->dos_stats.cc_stats.circuit_bucket--;
+  if (stats->cc_stats.circuit_bucket > 0) {
+    stats->cc_stats.circuit_bucket--;
   }
 
   /* This is the detection. Assess at every CREATE cell if the client should
    * get marked as malicious. This should be kept as fast as possible. */
-  if (cc_has_exhausted_circuits(&entry->dos_stats)) {
+  if (cc_has_exhausted_circuits(stats)) {
     /* If this is the first time we mark this entry, log it a info level.
      * Under heavy DDoS, logging each time we mark would results in lots and
      * lots of logs. */
-    if (entry->dos_stats.cc_stats.marked_until_ts == 0) {
+    const int was_marked = stats->cc_stats.marked_until_ts >= approx_time();
+    if (stats->cc_stats.marked_until_ts == 0) {
       log_debug(LD_DOS, "Detected circuit creation DoS by address: %s",
                 fmt_addr(&addr));
       cc_num_marked_addrs++;
     }
-    cc_mark_client(&entry->dos_stats.cc_stats);
+    cc_mark_client(&stats->cc_stats);
+    if (!was_marked) {
+      reject_note_marked(&addr, stats->cc_stats.marked_until_ts);
+    }
   }
 
  end:
@@ -531,24 +1070,33 @@ dos_cc_get_defense_type(channel_t *chan)
 dos_conn_defense_type_t
 dos_conn_addr_get_defense_type(const tor_addr_t *addr)
 {
-  clientmap_entry_t *entry;
+  dos_client_stats_t *stats;
 
   tor_assert(addr);
 
   /* Skip everything if not enabled. */
-  if (!dos_conn_enabled) {
+  if (!dos_conn_enabled && !(dos_cc_enabled && dos_reject_marked)) {
     goto end;
   }
 
-  /* We are only interested in client connection from the geoip cache. */
-  entry = geoip_lookup_client(addr, NULL, GEOIP_CLIENT_CONNECT);
-  if (entry == NULL) {
+  /* We are only interested in client addresses that we track. */
+  stats = dos_client_lookup(addr);
+  if (stats == NULL) {
     goto end;
   }
 
+  /* Refuse marked addresses right away, if we've been asked to, so that we
+   * don't spend a TLS handshake on them. */
+  if (dos_cc_enabled && dos_reject_marked &&
+      stats->cc_stats.marked_until_ts >= approx_time()) {
+    reject_num_conns_refused++;
+    return DOS_CONN_DEFENSE_CLOSE;
+  }
+
   /* Need to be above the maximum concurrent connection count to trigger a
    * defense. */
-  if (entry->dos_stats.concurrent_count > dos_conn_max_concurrent_count) {
+  if (dos_conn_enabled &&
+      stats->concurrent_count > dos_conn_max_concurrent_count) {
     conn_num_addr_rejected++;
     return dos_conn_defense_type;
   }
@@ -559,39 +1107,26 @@ dos_conn_addr_get_defense_type(const tor_addr_t *addr)
 
 /* General API */
 
-/* Take any appropriate actions for the given geoip entry that is about to get
- * freed. This is called for every entry that is being freed.
- *
- * This function will clear out the connection tracked flag if the concurrent
- * count of the entry is above 0 so if those connections end up being seen by
- * this subsystem, we won't try to decrement the counter for a new geoip entry
- * that might have been added after this call for the same address. */
+/* Remove the statistics for client addresses that no longer tell us
+ * anything, and give back memory if the table has become mostly empty.
+ * Called every so often. */
 void
-dos_geoip_entry_about_to_free(const clientmap_entry_t *geoip_ent)
+dos_clean_clients(time_t now)
 {
-  tor_assert(geoip_ent);
+  uint32_t n_slots;
 
-  /* The count is down to 0 meaning no connections right now, we can safely
-   * clear the geoip entry from the cache. */
-  if (geoip_ent->dos_stats.concurrent_count == 0) {
-    goto end;
-  }
+  if (!client_table)
+    return;
 
-  /* For each connection matching the geoip entry address, we'll clear the
-   * tracked flag because the entry is about to get removed from the geoip
-   * cache. We do not try to decrement if the flag is not set. */
-  SMARTLIST_FOREACH_BEGIN(get_connection_array(), connection_t *, conn) {
-    if (conn->type == CONN_TYPE_OR) {
-      or_connection_t *or_conn = TO_OR_CONN(conn);
-      if (!tor_addr_compare(&geoip_ent->addr, &or_conn->real_addr,
-                            CMP_EXACT)) {
-        or_conn->tracked_for_dos_mitigation = 0;
-      }
-    }
-  } SMARTLIST_FOREACH_END(conn);
+  client_table_remove_if(client_stats_is_idle, now, 0);
 
- end:
-  return;
+  n_slots = client_table_n_slots;
+  while (n_slots > DOS_CLIENT_TABLE_MIN_SLOTS &&
+         client_table_n_entries < n_slots / 8) {
+    n_slots /= 2;
+  }
+  if (n_slots != client_table_n_slots)
+    client_table_resize(n_slots);
 }
 
 /* Note down that we've just refused a single hop client. This increments a
@@ -629,13 +1164,21 @@ dos_log_heartbeat(void)
   char *cc_msg = NULL;
   char *single_hop_client_msg = NULL;
   char *circ_stats_msg = NULL;
+  char *client_table_msg = NULL;
 
   /* Stats number coming from relay.c append_cell_to_circuit_queue(). */
   tor_asprintf(&circ_stats_msg,
                " %" PRIu64 " circuits killed with too many cells.",
                stats_n_circ_max_cell_reached);
 
-  if (dos_cc_enabled) {
+  if (dos_cc_enabled && dos_reject_marked) {
+    tor_asprintf(&cc_msg,
+                 " %" PRIu64 " circuits rejected,"
+                 " %" PRIu32 " marked addresses,"
+                 " %" PRIu64 " connections from them refused.",
+                 cc_num_rejected_cells, cc_num_marked_addrs,
+                 reject_num_conns_refused);
+  } else if (dos_cc_enabled) {
     tor_asprintf(&cc_msg,
                  " %" PRIu64 " circuits rejected,"
                  " %" PRIu32 " marked addresses.",
@@ -654,17 +1197,25 @@ dos_log_heartbeat(void)
                  num_single_hop_client_refused);
   }
 
+  tor_asprintf(&client_table_msg,
+               " %" PRIu32 " client addresses tracked in %" TOR_PRIuSZ
+               " kB.",
+               client_table_n_entries,
+               dos_client_table_total_allocation() / 1024);
+
   log_notice(LD_HEARTBEAT,
-             "DoS mitigation since startup:%s%s%s%s",
+             "DoS mitigation since startup:%s%s%s%s%s",
              circ_stats_msg,
              (cc_msg != NULL) ? cc_msg : " [cc not enabled]",
              (conn_msg != NULL) ? conn_msg : " [conn not enabled]",
-             (single_hop_client_msg != NULL) ? single_hop_client_msg : "");
+             (single_hop_client_msg != NULL) ? single_hop_client_msg : "",
+             client_table_msg);
 
   tor_free(conn_msg);
   tor_free(cc_msg);
   tor_free(single_hop_client_msg);
   tor_free(circ_stats_msg);
+  tor_free(client_table_msg);
   return;
 }
 
@@ -673,7 +1224,7 @@ dos_log_heartbeat(void)
 void
 dos_new_client_conn(or_connection_t *or_conn)
 {
-  clientmap_entry_t *entry;
+  dos_client_stats_t *stats;
 
   tor_assert(or_conn);
 
@@ -691,20 +1242,16 @@ dos_new_client_conn(or_connection_t *or_conn)
     goto end;
   }
 
-  /* We are only interested in client connection from the geoip cache. */
-  entry = geoip_lookup_client(&or_conn->real_addr, NULL,
-                              GEOIP_CLIENT_CONNECT);
-  if (BUG(entry == NULL)) {
-    /* Should never happen because we note down the address in the geoip
-     * cache before this is called. */
+  stats = dos_client_lookup_or_add(&or_conn->real_addr, approx_time());
+  if (stats == NULL) {
     goto end;
   }
 
-  entry->dos_stats.concurrent_count++;
+  stats->concurrent_count++;
   or_conn->tracked_for_dos_mitigation = 1;
   log_debug(LD_DOS, "Client address %s has now %u concurrent connections.",
             fmt_addr(&or_conn->real_addr),
-            entry->dos_stats.concurrent_count);
+            stats->concurrent_count);
 
  end:
   return;
@@ -714,7 +1261,7 @@ dos_new_client_conn(or_connection_t *or_conn)
 void
 dos_close_client_conn(const or_connection_t *or_conn)
 {
-  clientmap_entry_t *entry;
+  dos_client_stats_t *stats;
 
   tor_assert(or_conn);
 
@@ -725,27 +1272,25 @@ dos_close_client_conn(const or_connection_t *or_conn)
     goto end;
   }
 
-  /* We are only interested in client connection from the geoip cache. */
-  entry = geoip_lookup_client(&or_conn->real_addr, NULL,
-                              GEOIP_CLIENT_CONNECT);
-  if (entry == NULL) {
-    /* This can happen because we can close a connection before the channel
-     * got to be noted down in the geoip cache. */
+  /* We never remove an address that has connections, so this can only
+   * happen if the table was freed. */
+  stats = dos_client_lookup(&or_conn->real_addr);
+  if (stats == NULL) {
     goto end;
   }
 
   /* Extra super duper safety. Going below 0 means an underflow which could
    * lead to most likely a false positive. In theory, this should never happen
    * but lets be extra safe. */
-  if (BUG(entry->dos_stats.concurrent_count == 0)) {
+  if (BUG(stats->concurrent_count == 0)) {
     goto end;
   }
 
-  entry->dos_stats.concurrent_count--;
+  stats->concurrent_count--;
   log_debug(LD_DOS, "Client address %s has lost a connection. Concurrent "
                     "connections are now at %u",
             fmt_addr(&or_conn->real_addr),
-            entry->dos_stats.concurrent_count);
+            stats->concurrent_count);
 
  end:
   return;
@@ -790,6 +1335,13 @@ dos_free_all(void)
   /* Free the connection mitigation subsystem. It is safe to do this even if
    * it wasn't initialized. */
   conn_free_all();
+
+  /* Forget every client address. */
+  client_table_free_all();
+
+  /* Stop telling anybody about them. */
+  dos_reject_marked = 0;
+  reject_helper_terminate();
 }
 
 /* Initialize the Denial of Service subsystem. */
@@ -29,8 +29,8 @@ typedef struct cc_client_stats_t {
 } cc_client_stats_t;
 
 /* This object is a top level object that contains everything related to the
- * per-IP client DoS mitigation. Because it is per-IP, it is used in the geoip
- * clientmap_entry_t object. */
+ * per-IP client DoS mitigation. We keep one for each client address (or
+ * IPv6 /64) in the client table in dos.c. */
 typedef struct dos_client_stats_t {
   /* Concurrent connection count from the specific address. 2^32 is most
    * likely way too big for the amount of allowed file descriptors. */
@@ -43,15 +43,13 @@ typedef struct dos_client_stats_t {
 
 /* General API. */
 
-/* Stub. */
-struct clientmap_entry_t;
-
 void dos_init(void);
 void dos_free_all(void);
 void dos_consensus_has_changed(const networkstatus_t *ns);
 int dos_enabled(void);
 void dos_log_heartbeat(void);
-void dos_geoip_entry_about_to_free(const struct clientmap_entry_t *geoip_ent);
+void dos_clean_clients(time_t now);
+size_t dos_client_table_total_allocation(void);
 
 void dos_new_client_conn(or_connection_t *or_conn);
 void dos_close_client_conn(const or_connection_t *or_conn);
@@ -117,8 +115,30 @@ typedef enum dos_conn_defense_type_t {
 
 dos_conn_defense_type_t dos_conn_addr_get_defense_type(const tor_addr_t *addr);
 
+/*
+ * Early rejection of marked client addresses.
+ */
+
+/* DoSRejectMarkedAddresses default. Disabled by default. */
+#define DOS_REJECT_MARKED_DEFAULT 0
+
 #ifdef DOS_PRIVATE
 
+/* Largest number of slots in the client table. Each slot takes 48 bytes, and
+ * the table holds up to 3/4 as many addresses once it is this big. */
+#define DOS_CLIENT_TABLE_MAX_SLOTS (1 << 20)
+EXTERN(uint32_t, dos_client_table_max_slots)
+
+STATIC dos_client_stats_t *dos_client_lookup(const tor_addr_t *addr);
+STATIC dos_client_stats_t *dos_client_lookup_or_add(const tor_addr_t *addr,
+                                                    time_t now);
+#ifdef TOR_UNIT_TESTS
+STATIC uint32_t dos_client_table_n_entries(void);
+#endif
+
+STATIC char *dos_reject_line_new(const tor_addr_t *addr, time_t seconds);
+MOCK_DECL(STATIC void, dos_reject_helper_send, (const char *line));
+
 STATIC uint32_t get_param_conn_max_concurrent_count(
                                               const networkstatus_t *ns);
 STATIC uint32_t get_param_cc_circuit_burst(const networkstatus_t *ns);
@@ -133,6 +153,8 @@ MOCK_DECL(STATIC unsigned int, get_param_cc_enabled,
           (const networkstatus_t *ns));
 MOCK_DECL(STATIC unsigned int, get_param_conn_enabled,
           (const networkstatus_t *ns));
+MOCK_DECL(STATIC unsigned int, get_param_reject_marked,
+          (const networkstatus_t *ns));
 
 #endif /* TOR_DOS_PRIVATE */
 
@@ -13,6 +13,7 @@
 #include "core/or/crypt_path_st.h"
 
 struct onion_queue_t;
+struct relay_offload_t;
 
 /** An or_circuit_t holds information needed to implement a circuit at an
  * OR. */
@@ -33,6 +34,8 @@ struct or_circuit_t {
   cell_queue_t p_chan_cells;
   /** The channel that is previous in this circuit. */
   channel_t *p_chan;
+  /** Entry in the p_circuits list of p_chan. */
+  TOR_LIST_ENTRY(or_circuit_t) p_chan_circuits;
   /**
    * Circuit mux associated with p_chan to which this circuit is attached;
    * NULL if we have no p_chan.
@@ -47,6 +50,12 @@ struct or_circuit_t {
   /** Cryptographic state used for encrypting and authenticating relay
    * cells to and from this hop. */
   relay_crypto_t crypto;
+  /** If a cpuworker does the relay crypto for this circuit, the state we
+   * use to keep its cells in order.  Used only in relay_offload.c. */
+  struct relay_offload_t *crypto_offload;
+  /** How many relay cells have we received on this circuit?  Stops counting
+   * once it is large enough to make us offload the circuit's crypto. */
+  uint32_t n_relay_cells_received;
 
   /** Points to spliced circuit if purpose is REND_ESTABLISHED, and circuit
    * is not marked for close. */
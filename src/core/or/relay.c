@@ -61,6 +61,7 @@
 #include "core/mainloop/connection.h"
 #include "core/or/connection_edge.h"
 #include "core/or/connection_or.h"
+#include "core/or/dos.h"
 #include "feature/control/control.h"
 #include "lib/crypt_ops/crypto_rand.h"
 #include "lib/crypt_ops/crypto_util.h"
@@ -75,12 +76,14 @@
 #include "core/or/policies.h"
 #include "core/or/reasons.h"
 #include "core/or/relay.h"
+#include "core/or/relay_offload.h"
 #include "core/crypto/relay_crypto.h"
 #include "feature/rend/rendcache.h"
 #include "feature/rend/rendcommon.h"
 #include "feature/nodelist/describe.h"
 #include "feature/nodelist/routerlist.h"
 #include "core/or/scheduler.h"
+#include "core/or/scheduler_stats.h"
 
 #include "core/or/cell_st.h"
 #include "core/or/cell_queue_st.h"
@@ -115,13 +118,6 @@ static void adjust_exit_policy_from_exitpolicy_failure(origin_circuit_t *circ,
                                                   node_t *node,
                                                   const tor_addr_t *addr);
 
-/** Stop reading on edge connections when we have this many cells
- * waiting on the appropriate queue. */
-#define CELL_QUEUE_HIGHWATER_SIZE 256
-/** Start reading from edge connections again when we get down to this many
- * cells. */
-#define CELL_QUEUE_LOWWATER_SIZE 64
-
 /** Stats: how many relay cells have originated at this hop, or have
  * been relayed onward (not recognized at this hop)?
  */
@@ -229,10 +225,8 @@ int
 circuit_receive_relay_cell(cell_t *cell, circuit_t *circ,
                            cell_direction_t cell_direction)
 {
-  channel_t *chan = NULL;
   crypt_path_t *layer_hint=NULL;
   char recognized=0;
-  int reason;
 
   tor_assert(cell);
   tor_assert(circ);
@@ -241,6 +235,13 @@ circuit_receive_relay_cell(cell_t *cell, circuit_t *circ,
   if (circ->marked_for_close)
     return 0;
 
+  if (! CIRCUIT_IS_ORIGIN(circ) &&
+      relay_offload_receive_cell(TO_OR_CIRCUIT(circ), cell, cell_direction)) {
+    /* A cpuworker will do the crypto; we'll see the cell again once it's
+     * done. */
+    return 0;
+  }
+
   if (relay_decrypt_cell(circ, cell, cell_direction, &layer_hint, &recognized)
       < 0) {
     log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
@@ -248,6 +249,26 @@ circuit_receive_relay_cell(cell_t *cell, circuit_t *circ,
     return -END_CIRC_REASON_INTERNAL;
   }
 
+  return circuit_receive_crypted_relay_cell(cell, circ, cell_direction,
+                                            layer_hint, recognized);
+}
+
+/** Finish receiving the relay cell <b>cell</b> on <b>circ</b>, after its
+ * layer of crypto has been done: <b>recognized</b> is true iff it is
+ * addressed to us (at the hop <b>layer_hint</b>, if we're the origin).
+ * Deliver it to the right edge if it is for us, or else pass it on.
+ *
+ * Return -<b>reason</b> on failure.
+ */
+int
+circuit_receive_crypted_relay_cell(cell_t *cell, circuit_t *circ,
+                                   cell_direction_t cell_direction,
+                                   crypt_path_t *layer_hint,
+                                   char recognized)
+{
+  channel_t *chan = NULL;
+  int reason;
+
   circuit_update_channel_usage(circ, cell);
 
   if (recognized) {
@@ -407,6 +428,10 @@ circuit_package_relay_cell, (cell_t *cell, circuit_t *circ,
       return 0; /* just drop it */
     }
     or_circuit_t *or_circ = TO_OR_CIRCUIT(circ);
+    if (relay_offload_package_cell(or_circ, cell, on_stream)) {
+      /* A cpuworker will encrypt it, and queue it when it's done. */
+      return 0;
+    }
     relay_encrypt_cell_inbound(cell, or_circ);
     chan = or_circ->p_chan;
   }
@@ -2217,7 +2242,8 @@ circuit_resume_edge_reading_helper(edge_connection_t *first_conn,
     cells_on_queue = circ->n_chan_cells.n;
   } else {
     or_circuit_t *or_circ = TO_OR_CIRCUIT(circ);
-    cells_on_queue = or_circ->p_chan_cells.n;
+    cells_on_queue = or_circ->p_chan_cells.n +
+      relay_offload_n_pending(or_circ);
   }
   if (CELL_QUEUE_HIGHWATER_SIZE - cells_on_queue < max_to_package)
     max_to_package = CELL_QUEUE_HIGHWATER_SIZE - cells_on_queue;
@@ -2409,20 +2435,148 @@ circuit_consider_sending_sendme(circuit_t *circ, crypt_path_t *layer_hint)
 /** The total number of cells we have allocated. */
 static size_t total_cells_allocated = 0;
 
+/** We lay out packed cells at multiples of this many bytes. */
+#define PACKED_CELL_ALIGN 64
+/** How many bytes apart are adjacent cells in a slab? */
+#define PACKED_CELL_STRIDE \
+  ((sizeof(packed_cell_t) + PACKED_CELL_ALIGN - 1) & ~(PACKED_CELL_ALIGN - 1))
+/** How many packed cells does each slab hold? */
+#define PACKED_CELLS_PER_SLAB 64
+/** How many completely unused slabs do we keep around for reuse? */
+#define MAX_EMPTY_PACKED_CELL_SLABS 4
+
+/** A contiguous block of memory from which we allocate packed cells.
+ *
+ * Every slab with some, but not all, of its cells in use lives on
+ * avail_slabs.  Slabs with all their cells in use are not on any list; slabs
+ * with none of them in use are on empty_slabs, or freed. */
+typedef struct packed_cell_slab_t {
+  /** Links for avail_slabs or empty_slabs. */
+  TOR_LIST_ENTRY(packed_cell_slab_t) node;
+  /** Cells in this slab that are not in use. */
+  TOR_SIMPLEQ_HEAD(packed_cell_freeq, packed_cell_t) free_cells;
+  /** How many entries are there in free_cells? */
+  int n_free;
+  /** The unaligned memory that holds this slab's cells. */
+  char mem[FLEXIBLE_ARRAY_MEMBER];
+} packed_cell_slab_t;
+
+/** Number of bytes that we allocate for each slab. */
+#define PACKED_CELL_SLAB_ALLOC \
+  (offsetof(packed_cell_slab_t, mem) + PACKED_CELL_ALIGN - 1 + \
+   PACKED_CELLS_PER_SLAB * PACKED_CELL_STRIDE)
+
+/** Slabs with at least one cell in use and at least one cell free. */
+static TOR_LIST_HEAD(packed_cell_slab_list, packed_cell_slab_t)
+  avail_slabs = TOR_LIST_HEAD_INITIALIZER(avail_slabs);
+/** Slabs with no cells in use, kept around for reuse. */
+static struct packed_cell_slab_list
+  empty_slabs = TOR_LIST_HEAD_INITIALIZER(empty_slabs);
+/** How many slabs are on empty_slabs? */
+static int n_empty_slabs = 0;
+/** How many slabs have we allocated, in total? */
+static int n_slabs_allocated = 0;
+/** How many slabs have we ever allocated or freed? */
+static uint64_t n_slab_allocs = 0, n_slab_frees = 0;
+
+/** Allocate and return a new slab, with all of its cells free. */
+static packed_cell_slab_t *
+packed_cell_slab_new(void)
+{
+  packed_cell_slab_t *slab = tor_malloc(PACKED_CELL_SLAB_ALLOC);
+  uintptr_t p = (uintptr_t) slab->mem;
+  char *cp;
+  int i;
+
+  p = (p + PACKED_CELL_ALIGN - 1) & ~(uintptr_t)(PACKED_CELL_ALIGN - 1);
+  cp = (char *) p;
+
+  TOR_SIMPLEQ_INIT(&slab->free_cells);
+  for (i = 0; i < PACKED_CELLS_PER_SLAB; ++i) {
+    packed_cell_t *cell = (packed_cell_t *) (cp + i * PACKED_CELL_STRIDE);
+    cell->slab = slab;
+    TOR_SIMPLEQ_INSERT_TAIL(&slab->free_cells, cell, next);
+  }
+  slab->n_free = PACKED_CELLS_PER_SLAB;
+  ++n_slabs_allocated;
+  ++n_slab_allocs;
+  return slab;
+}
+
+/** Release the storage held by <b>slab</b>, which must have no cells in
+ * use, and must not be on any list. */
+static void
+packed_cell_slab_free(packed_cell_slab_t *slab)
+{
+  tor_assert(slab->n_free == PACKED_CELLS_PER_SLAB);
+  --n_slabs_allocated;
+  ++n_slab_frees;
+  tor_free(slab);
+}
+
+/** Take a free cell out of our slabs and return it, uninitialized. */
+static inline packed_cell_t *
+packed_cell_pool_get(void)
+{
+  packed_cell_slab_t *slab = TOR_LIST_FIRST(&avail_slabs);
+  packed_cell_t *cell;
+
+  if (PREDICT_UNLIKELY(!slab)) {
+    if ((slab = TOR_LIST_FIRST(&empty_slabs))) {
+      TOR_LIST_REMOVE(slab, node);
+      --n_empty_slabs;
+    } else {
+      slab = packed_cell_slab_new();
+    }
+    TOR_LIST_INSERT_HEAD(&avail_slabs, slab, node);
+  }
+
+  cell = TOR_SIMPLEQ_FIRST(&slab->free_cells);
+  TOR_SIMPLEQ_REMOVE_HEAD(&slab->free_cells, next);
+  if (--slab->n_free == 0) {
+    TOR_LIST_REMOVE(slab, node);
+  }
+  ++total_cells_allocated;
+  return cell;
+}
+
+/** Give <b>cell</b> back to the slab it came from. */
+static inline void
+packed_cell_pool_put(packed_cell_t *cell)
+{
+  packed_cell_slab_t *slab = cell->slab;
+
+  --total_cells_allocated;
+  TOR_SIMPLEQ_INSERT_HEAD(&slab->free_cells, cell, next);
+  if (++slab->n_free == 1) {
+    TOR_LIST_INSERT_HEAD(&avail_slabs, slab, node);
+  } else if (slab->n_free == PACKED_CELLS_PER_SLAB) {
+    TOR_LIST_REMOVE(slab, node);
+    if (n_empty_slabs < MAX_EMPTY_PACKED_CELL_SLABS) {
+      TOR_LIST_INSERT_HEAD(&empty_slabs, slab, node);
+      ++n_empty_slabs;
+    } else {
+      packed_cell_slab_free(slab);
+    }
+  }
+}
+
 /** Release storage held by <b>cell</b>. */
 static inline void
 packed_cell_free_unchecked(packed_cell_t *cell)
 {
-  --total_cells_allocated;
-  tor_free(cell);
+  packed_cell_pool_put(cell);
 }
 
 /** Allocate and return a new packed_cell_t. */
 STATIC packed_cell_t *
 packed_cell_new(void)
 {
-  ++total_cells_allocated;
-  return tor_malloc_zero(sizeof(packed_cell_t));
+  packed_cell_t *cell = packed_cell_pool_get();
+  packed_cell_slab_t *slab = cell->slab;
+  memset(cell, 0, sizeof(packed_cell_t));
+  cell->slab = slab;
+  return cell;
 }
 
 /** Return a packed cell used outside by channel_t lower layer */
@@ -2434,6 +2588,36 @@ packed_cell_free_(packed_cell_t *cell)
   packed_cell_free_unchecked(cell);
 }
 
+/** Free the packed cell slabs that have no cells in use.  Return the number
+ * of bytes released. */
+size_t
+packed_cell_pool_shrink(void)
+{
+  packed_cell_slab_t *slab;
+  size_t freed = 0;
+  while ((slab = TOR_LIST_FIRST(&empty_slabs))) {
+    TOR_LIST_REMOVE(slab, node);
+    --n_empty_slabs;
+    packed_cell_slab_free(slab);
+    freed += PACKED_CELL_SLAB_ALLOC;
+  }
+  return freed;
+}
+
+/** Return the number of bytes held in packed cell slabs that have no cells
+ * in use.
+ *
+ * We don't count the free cells in partly used slabs here: the OOM handler
+ * can't give that memory back, since packed_cell_pool_shrink() only
+ * releases empty slabs.  Counting it would make the cells freed by killing a
+ * circuit reappear in the total, so the handler would keep killing
+ * circuits while the slabs stayed fragmented. */
+size_t
+packed_cell_pool_get_idle_allocation(void)
+{
+  return n_empty_slabs * PACKED_CELL_SLAB_ALLOC;
+}
+
 /** Log current statistics for cell pool allocation at log level
  * <b>severity</b>. */
 void
@@ -2451,6 +2635,26 @@ dump_cell_pool_usage(int severity)
   tor_log(severity, LD_MM,
           "%d cells allocated on %d circuits. %d cells leaked.",
           n_cells, n_circs, (int)total_cells_allocated - n_cells);
+  tor_log(severity, LD_MM,
+          "%d packed cell slabs of %d cells (%d empty), using %"TOR_PRIuSZ
+          " bytes. %"PRIu64" slabs allocated and %"PRIu64" freed since "
+          "startup.",
+          n_slabs_allocated, PACKED_CELLS_PER_SLAB, n_empty_slabs,
+          n_slabs_allocated * PACKED_CELL_SLAB_ALLOC,
+          n_slab_allocs, n_slab_frees);
+}
+
+/** Log a heartbeat message describing the packed cell pool. */
+void
+packed_cell_pool_log_heartbeat(void)
+{
+  log_notice(LD_HEARTBEAT,
+             "Cell pool: %"TOR_PRIuSZ" cells in use, in %d slabs "
+             "(%"TOR_PRIuSZ" bytes, %d slabs empty). %"PRIu64" slabs "
+             "allocated and %"PRIu64" freed since startup.",
+             total_cells_allocated, n_slabs_allocated,
+             n_slabs_allocated * PACKED_CELL_SLAB_ALLOC, n_empty_slabs,
+             n_slab_allocs, n_slab_frees);
 }
 
 /** Allocate a new copy of packed <b>cell</b>. */
@@ -2497,6 +2701,18 @@ cell_queue_init(cell_queue_t *queue)
   TOR_SIMPLEQ_INIT(&queue->head);
 }
 
+/** Append <b>n</b> newly allocated, zeroed cells to the end of <b>queue</b>.
+ * Use this when you know in advance how many cells you are about to fill. */
+void
+cell_queue_alloc_batch(cell_queue_t *queue, int n)
+{
+  int i;
+  tor_assert(n >= 0);
+  for (i = 0; i < n; ++i) {
+    cell_queue_append(queue, packed_cell_new());
+  }
+}
+
 /** Remove and free every cell in <b>queue</b>. */
 void
 cell_queue_clear(cell_queue_t *queue)
@@ -2594,14 +2810,15 @@ destroy_cell_to_packed_cell(destroy_cell_t *inp, int wide_circ_ids)
 size_t
 packed_cell_mem_cost(void)
 {
-  return sizeof(packed_cell_t);
+  return PACKED_CELL_STRIDE;
 }
 
 /* DOCDOC */
 size_t
 cell_queues_get_total_allocation(void)
 {
-  return total_cells_allocated * packed_cell_mem_cost();
+  return total_cells_allocated * packed_cell_mem_cost() +
+    relay_offload_get_total_allocation();
 }
 
 /** How long after we've been low on memory should we try to conserve it? */
@@ -2619,6 +2836,8 @@ cell_queues_check_size(void)
   size_t alloc = cell_queues_get_total_allocation();
   alloc += half_streams_get_total_allocation();
   alloc += buf_get_total_allocation();
+  alloc += buf_get_freelist_allocation();
+  alloc += packed_cell_pool_get_idle_allocation();
   alloc += tor_compress_get_total_allocation();
   const size_t rend_cache_total = rend_cache_get_total_allocation();
   alloc += rend_cache_total;
@@ -2627,9 +2846,16 @@ cell_queues_check_size(void)
   alloc += geoip_client_cache_total;
   const size_t dns_cache_total = dns_cache_total_allocation();
   alloc += dns_cache_total;
+  alloc += dos_client_table_total_allocation();
   if (alloc >= get_options()->MaxMemInQueues_low_threshold) {
     last_time_under_memory_pressure = approx_time();
     if (alloc >= get_options()->MaxMemInQueues) {
+      /* Idle buffer chunks and cell slabs are the cheapest thing we can
+       * give back: do that before anything else. */
+      alloc -= buf_shrink_freelists(1);
+      alloc -= packed_cell_pool_shrink();
+      if (alloc < get_options()->MaxMemInQueues)
+        return 0;
       /* If we're spending over 20% of the memory limit on hidden service
        * descriptors, free them until we're down to 10%. Do the same for geoip
        * client cache. */
@@ -2853,6 +3079,7 @@ channel_flush_from_first_active_circuit, (channel_t *chan, int max))
     if (!circ) break;
 
     if (circ->n_chan == chan) {
+      or_circ = NULL;
       queue = &circ->n_chan_cells;
       streams_blocked = circ->streams_blocked_on_n_chan;
     } else {
@@ -2883,12 +3110,16 @@ channel_flush_from_first_active_circuit, (channel_t *chan, int max))
 
     /* Calculate the exact time that this cell has spent in the queue. */
     if (get_options()->CellStatistics ||
-        get_options()->TestingEnableCellStatsEvent) {
+        get_options()->TestingEnableCellStatsEvent ||
+        get_options()->SchedulerStats) {
       uint32_t timestamp_now = monotime_coarse_get_stamp();
       uint32_t msec_waiting =
         (uint32_t) monotime_coarse_stamp_units_to_approx_msec(
                          timestamp_now - cell->inserted_timestamp);
 
+      if (get_options()->SchedulerStats)
+        scheduler_stats_note_cell_delay(cmux, msec_waiting);
+
       if (get_options()->CellStatistics && !CIRCUIT_IS_ORIGIN(circ)) {
         or_circ = TO_OR_CIRCUIT(circ);
         or_circ->total_cell_waiting_time += msec_waiting;
@@ -2947,7 +3178,9 @@ channel_flush_from_first_active_circuit, (channel_t *chan, int max))
 
     /* Is the cell queue low enough to unblock all the streams that are waiting
      * to write to this circuit? */
-    if (streams_blocked && queue->n <= CELL_QUEUE_LOWWATER_SIZE)
+    if (streams_blocked &&
+        queue->n + (or_circ ? relay_offload_n_pending(or_circ) : 0) <=
+        CELL_QUEUE_LOWWATER_SIZE)
       set_streams_blocked_on_circ(circ, chan, 0, 0); /* unblock streams */
 
     /* If n_flushed < max still, loop around and pick another circuit */
@@ -2957,6 +3190,32 @@ channel_flush_from_first_active_circuit, (channel_t *chan, int max))
   return n_flushed;
 }
 
+/** Block or unblock the edge streams that write to the OR circuit
+ * <b>circ</b> towards the client, counting both the cells on its p_chan
+ * queue and the ones still waiting for their relay crypto on a cpuworker.
+ * If the streams are blocked and <b>fromstream</b> is nonzero, make sure
+ * that stream is blocked too. */
+void
+or_circuit_update_streams_blocked(or_circuit_t *circ, streamid_t fromstream)
+{
+  circuit_t *circ_ = TO_CIRCUIT(circ);
+  int n_queued;
+
+  if (circ_->marked_for_close || !circ->p_chan)
+    return;
+
+  n_queued = circ->p_chan_cells.n + relay_offload_n_pending(circ);
+  if (!circ_->streams_blocked_on_p_chan &&
+      n_queued >= CELL_QUEUE_HIGHWATER_SIZE)
+    set_streams_blocked_on_circ(circ_, circ->p_chan, 1, 0);
+  else if (circ_->streams_blocked_on_p_chan &&
+           n_queued <= CELL_QUEUE_LOWWATER_SIZE)
+    set_streams_blocked_on_circ(circ_, circ->p_chan, 0, 0);
+
+  if (circ_->streams_blocked_on_p_chan && fromstream)
+    set_streams_blocked_on_circ(circ_, circ->p_chan, 1, fromstream);
+}
+
 /* Minimum value is the maximum circuit window size.
  *
  * SENDME cells makes it that we can control how many cells can be inflight on
@@ -2995,6 +3254,14 @@ channel_flush_from_first_active_circuit, (channel_t *chan, int max))
 static int32_t max_circuit_cell_queue_size =
   RELAY_CIRC_CELL_QUEUE_SIZE_DEFAULT;
 
+/** Return the maximum number of cells that a circuit may have waiting in
+ * any one of its queues. */
+int32_t
+relay_get_max_circuit_cell_queue_size(void)
+{
+  return max_circuit_cell_queue_size;
+}
+
 /* Called when the consensus has changed. At this stage, the global consensus
  * object has NOT been updated. It is called from
  * notify_before_networkstatus_changes(). */
@@ -3064,8 +3331,11 @@ append_cell_to_circuit_queue(circuit_t *circ, channel_t *chan,
   }
 
   /* If we have too many cells on the circuit, we should stop reading from
-   * the edge streams for a while. */
-  if (!streams_blocked && queue->n >= CELL_QUEUE_HIGHWATER_SIZE)
+   * the edge streams for a while.  Towards the client, count the cells that
+   * are still waiting for their relay crypto on a cpuworker. */
+  if (!streams_blocked &&
+      queue->n + (orcirc ? relay_offload_n_pending(orcirc) : 0) >=
+      CELL_QUEUE_HIGHWATER_SIZE)
     set_streams_blocked_on_circ(circ, chan, 1, 0); /* block streams */
 
   if (streams_blocked && fromstream) {
@@ -17,8 +17,13 @@ extern uint64_t stats_n_relay_cells_delivered;
 extern uint64_t stats_n_circ_max_cell_reached;
 
 void relay_consensus_has_changed(const networkstatus_t *ns);
+int32_t relay_get_max_circuit_cell_queue_size(void);
 int circuit_receive_relay_cell(cell_t *cell, circuit_t *circ,
                                cell_direction_t cell_direction);
+int circuit_receive_crypted_relay_cell(cell_t *cell, circuit_t *circ,
+                                       cell_direction_t cell_direction,
+                                       crypt_path_t *layer_hint,
+                                       char recognized);
 size_t cell_queues_get_total_allocation(void);
 
 void relay_header_pack(uint8_t *dest, const relay_header_t *src);
@@ -49,6 +54,9 @@ extern uint64_t stats_n_data_cells_received;
 extern uint64_t stats_n_data_bytes_received;
 
 void dump_cell_pool_usage(int severity);
+void packed_cell_pool_log_heartbeat(void);
+size_t packed_cell_pool_shrink(void);
+size_t packed_cell_pool_get_idle_allocation(void);
 size_t packed_cell_mem_cost(void);
 
 int have_been_under_memory_pressure(void);
@@ -60,6 +68,7 @@ void packed_cell_free_(packed_cell_t *cell);
 
 void cell_queue_init(cell_queue_t *queue);
 void cell_queue_clear(cell_queue_t *queue);
+void cell_queue_alloc_batch(cell_queue_t *queue, int n);
 void cell_queue_append(cell_queue_t *queue, packed_cell_t *cell);
 void cell_queue_append_packed_copy(circuit_t *circ, cell_queue_t *queue,
                                    int exitward, const cell_t *cell,
@@ -93,12 +102,21 @@ const uint8_t *decode_address_from_payload(tor_addr_t *addr_out,
                                         const uint8_t *payload,
                                         int payload_len);
 void circuit_clear_cell_queue(circuit_t *circ, channel_t *chan);
+void or_circuit_update_streams_blocked(or_circuit_t *circ,
+                                       streamid_t fromstream);
 
 void stream_choice_seed_weak_rng(void);
 
 circid_t packed_cell_get_circid(const packed_cell_t *cell, int wide_circ_ids);
 
 #ifdef RELAY_PRIVATE
+/** Stop reading on edge connections when we have this many cells
+ * waiting on the appropriate queue. */
+#define CELL_QUEUE_HIGHWATER_SIZE 256
+/** Start reading from edge connections again when we get down to this many
+ * cells. */
+#define CELL_QUEUE_LOWWATER_SIZE 64
+
 STATIC int connected_cell_parse(const relay_header_t *rh, const cell_t *cell,
                          tor_addr_t *addr_out, int *ttl_out);
 /** An address-and-ttl tuple as yielded by resolved_cell_parse */
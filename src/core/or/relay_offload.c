@@ -0,0 +1,442 @@
+/* Copyright (c) 2019, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file relay_offload.c
+ * \brief Do the relay crypto for busy circuits on the cpuworker threads.
+ *
+ * Ordinarily, every relay cell that we receive gets its layer of crypto in
+ * circuit_receive_relay_cell(), on the main thread, so a relay can forward
+ * no more cells than one core can encrypt -- no matter how many cores the
+ * cpuworkers are using for onionskins.
+ *
+ * When RelayCryptoOffload is set, once an OR circuit has received
+ * RELAY_OFFLOAD_MIN_CELLS relay cells, we hand all of its further relay
+ * crypto to the cpuworker threadpool instead.
+ *
+ * The cipher and digest state of a circuit must see its cells in exactly
+ * the order in which they are sent, so each circuit has at most one job
+ * with the cpuworkers at a time.  Cells that arrive (or that we originate
+ * towards the client) while a job is out wait on the circuit's pending
+ * queue, and go out with the next job.  Like the circuit's cell queues, the
+ * pending queue may hold no more than relay_get_max_circuit_cell_queue_size()
+ * cells, and counts towards cell_queues_get_total_allocation().  When a job
+ * comes back, we finish
+ * handling its cells on the main thread, in order, with
+ * circuit_receive_crypted_relay_cell() or append_cell_to_circuit_queue(),
+ * just as if we had done their crypto ourselves.
+ *
+ * While a job is out, the worker owns the circuit's relay_crypto_t: nothing
+ * else may use it.  If the circuit is freed in the meantime, the job takes
+ * the crypto state with it, and releases it when the reply arrives.
+ **/
+
+#define RELAY_OFFLOAD_PRIVATE
+#include "core/or/or.h"
+#include "app/config/config.h"
+#include "core/crypto/relay_crypto.h"
+#include "core/mainloop/cpuworker.h"
+#include "core/or/circuitlist.h"
+#include "core/or/relay.h"
+#include "core/or/relay_offload.h"
+#include "feature/relay/routermode.h"
+#include "lib/crypt_ops/crypto_util.h"
+#include "lib/evloop/workqueue.h"
+
+#include "core/or/cell_st.h"
+#include "core/or/or_circuit_st.h"
+
+/** A cell whose relay crypto we are doing on a cpuworker. */
+typedef struct offload_cell_t {
+  TOR_SIMPLEQ_ENTRY(offload_cell_t) next;
+  /** The cell itself. */
+  cell_t cell;
+  /** Which way is this cell heading? */
+  cell_direction_t direction;
+  /** If we originated this cell, the stream it came from, or 0. */
+  streamid_t on_stream;
+  /** True iff we originated this cell, and are sending it to the client. */
+  unsigned int originated : 1;
+  /** Set by the worker: true iff this cell is addressed to us. */
+  unsigned int recognized : 1;
+} offload_cell_t;
+
+TOR_SIMPLEQ_HEAD(offload_cell_queue_t, offload_cell_t);
+
+/** Magic number for relay_offload_job_t. */
+#define RELAY_OFFLOAD_JOB_MAGIC 0x0ff10adu
+
+/** A batch of cells that we have handed to a cpuworker. */
+typedef struct relay_offload_job_t {
+  /** Must be RELAY_OFFLOAD_JOB_MAGIC. */
+  uint32_t magic;
+  /** The circuit that these cells are for, or NULL if it has been freed.
+   * Only the main thread may look at this. */
+  or_circuit_t *circ;
+  /** A copy of the circuit's relay crypto state.  The ciphers and digests
+   * are shared with the circuit, but only the worker may use them until the
+   * job comes back. */
+  relay_crypto_t crypto;
+  /** The cells in this job, in the order in which they need their crypto. */
+  struct offload_cell_queue_t cells;
+} relay_offload_job_t;
+
+/** Per-circuit state for a circuit whose crypto we are offloading. */
+struct relay_offload_t {
+  /** Cells that are waiting for the next job. */
+  struct offload_cell_queue_t pending;
+  /** Number of cells in <b>pending</b>. */
+  int n_pending;
+  /** The job that a cpuworker has for this circuit, if any. */
+  relay_offload_job_t *job;
+  /** Number of cells in <b>job</b> that we have not yet finished handling. */
+  int n_in_job;
+  /** The workqueue entry for <b>job</b>, if any. */
+  workqueue_entry_t *workqueue_entry;
+};
+
+/** How many offload_cell_t are allocated, whether they are pending or out
+ * with a cpuworker? Only the main thread touches this. */
+static size_t total_offload_cells_allocated = 0;
+
+static void relay_offload_launch(or_circuit_t *circ);
+
+/** Release all storage held by <b>q</b>, wiping the cells as we go.
+ * Return the number of cells freed. */
+static int
+offload_cell_queue_clear(struct offload_cell_queue_t *q)
+{
+  offload_cell_t *oc;
+  int n = 0;
+  while ((oc = TOR_SIMPLEQ_FIRST(q))) {
+    TOR_SIMPLEQ_REMOVE_HEAD(q, next);
+    memwipe(oc, 0, sizeof(*oc));
+    tor_free(oc);
+    ++n;
+  }
+  tor_assert(total_offload_cells_allocated >= (size_t)n);
+  total_offload_cells_allocated -= n;
+  return n;
+}
+
+/** Release all storage held by <b>job</b>, but not its crypto state. */
+static void
+relay_offload_job_free(relay_offload_job_t *job)
+{
+  offload_cell_queue_clear(&job->cells);
+  memwipe(job, 0xe0, sizeof(*job));
+  tor_free(job);
+}
+
+/** Return true iff we should start offloading the relay crypto for
+ * <b>circ</b>. */
+static int
+relay_offload_should_start(const or_circuit_t *circ)
+{
+  const or_options_t *options = get_options();
+
+  if (!options->RelayCryptoOffload || !server_mode(options))
+    return 0;
+  if (circ->n_relay_cells_received < RELAY_OFFLOAD_MIN_CELLS)
+    return 0;
+  /* Don't bother with circuits that are going away, or that don't have
+   * their keys yet. */
+  if (circ->base_.marked_for_close || !circ->crypto.f_crypto)
+    return 0;
+  return 1;
+}
+
+/** Add a copy of <b>cell</b> to the end of the pending queue for <b>circ</b>,
+ * and hand it to a cpuworker if none is busy with this circuit.
+ *
+ * If the pending queue is already full, drop the cell and close the circuit,
+ * as append_cell_to_circuit_queue() would. */
+static void
+relay_offload_add_cell(or_circuit_t *circ, const cell_t *cell,
+                       cell_direction_t cell_direction, int originated,
+                       streamid_t on_stream)
+{
+  struct relay_offload_t *ro = circ->crypto_offload;
+  const int32_t max_queue_size = relay_get_max_circuit_cell_queue_size();
+  offload_cell_t *oc;
+
+  if (circ->base_.marked_for_close)
+    return;
+
+  if (PREDICT_UNLIKELY(ro->n_pending >= max_queue_size)) {
+    log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
+           "Circuit has %d cells waiting for their relay crypto, maximum "
+           "allowed is %d. Closing circuit for safety reasons.",
+           ro->n_pending, (int)max_queue_size);
+    circuit_mark_for_close(TO_CIRCUIT(circ), END_CIRC_REASON_RESOURCELIMIT);
+    stats_n_circ_max_cell_reached++;
+    return;
+  }
+
+  oc = tor_malloc_zero(sizeof(offload_cell_t));
+  ++total_offload_cells_allocated;
+  memcpy(&oc->cell, cell, sizeof(cell_t));
+  oc->direction = cell_direction;
+  oc->originated = originated ? 1 : 0;
+  oc->on_stream = on_stream;
+  TOR_SIMPLEQ_INSERT_TAIL(&ro->pending, oc, next);
+  ++ro->n_pending;
+
+  /* Cells waiting here count toward the circuit's queue, so that a growing
+   * backlog stops our edge streams from reading. */
+  or_circuit_update_streams_blocked(circ, on_stream);
+
+  relay_offload_launch(circ);
+}
+
+/** Called when we receive the relay cell <b>cell</b> on the OR circuit
+ * <b>circ</b>, before doing any crypto on it.  If a cpuworker should handle
+ * the cell's crypto, queue a copy of it and return 1: we'll finish handling
+ * it when the worker is done.  Otherwise return 0, and the caller should
+ * handle the cell itself. */
+int
+relay_offload_receive_cell(or_circuit_t *circ, const cell_t *cell,
+                           cell_direction_t cell_direction)
+{
+  if (!circ->crypto_offload) {
+    if (circ->n_relay_cells_received < RELAY_OFFLOAD_MIN_CELLS)
+      ++circ->n_relay_cells_received;
+    if (!relay_offload_should_start(circ))
+      return 0;
+    log_debug(LD_OR, "Offloading relay crypto for busy circuit %u.",
+              (unsigned)circ->p_circ_id);
+    circ->crypto_offload = tor_malloc_zero(sizeof(struct relay_offload_t));
+    TOR_SIMPLEQ_INIT(&circ->crypto_offload->pending);
+  }
+
+  relay_offload_add_cell(circ, cell, cell_direction, 0, 0);
+  return 1;
+}
+
+/** Called when we are about to encrypt the cell <b>cell</b> that we
+ * originated on <b>circ</b> from the stream <b>on_stream</b>, and send it
+ * towards the client.  If the crypto for this circuit is offloaded, queue a
+ * copy of the cell behind everything else on the circuit, and return 1.
+ * Otherwise return 0. */
+int
+relay_offload_package_cell(or_circuit_t *circ, const cell_t *cell,
+                           streamid_t on_stream)
+{
+  if (!circ->crypto_offload)
+    return 0;
+
+  relay_offload_add_cell(circ, cell, CELL_DIRECTION_IN, 1, on_stream);
+  return 1;
+}
+
+/** Return true iff a cpuworker does the relay crypto for <b>circ</b>, so
+ * that nothing else may touch <b>circ</b>'s relay_crypto_t. */
+int
+relay_offload_is_active(const or_circuit_t *circ)
+{
+  return circ->crypto_offload != NULL;
+}
+
+/** Return the number of cells on <b>circ</b> that are waiting for their
+ * relay crypto, whether or not a cpuworker has them yet. */
+int
+relay_offload_n_pending(const or_circuit_t *circ)
+{
+  const struct relay_offload_t *ro = circ->crypto_offload;
+
+  if (!ro)
+    return 0;
+  return ro->n_pending + ro->n_in_job;
+}
+
+/** Worker thread function: do the relay crypto for every cell in the
+ * relay_offload_job_t <b>work_</b>, in order. */
+static workqueue_reply_t
+relay_offload_threadfn(void *state_, void *work_)
+{
+  relay_offload_job_t *job = work_;
+  offload_cell_t *oc;
+  (void)state_;
+
+  TOR_SIMPLEQ_FOREACH(oc, &job->cells, next) {
+    if (oc->originated) {
+      relay_crypto_encrypt_cell_inbound(&job->crypto, &oc->cell);
+    } else {
+      char recognized = 0;
+      relay_crypto_decrypt_at_relay(&job->crypto, &oc->cell, oc->direction,
+                                    &recognized);
+      oc->recognized = recognized ? 1 : 0;
+    }
+  }
+
+  return WQ_RPL_REPLY;
+}
+
+/** Finish handling the cell <b>oc</b> on <b>circ</b>, now that its relay
+ * crypto is done. */
+static void
+relay_offload_finish_cell(or_circuit_t *circ, offload_cell_t *oc)
+{
+  circuit_t *circ_ = TO_CIRCUIT(circ);
+  int reason;
+
+  if (oc->originated) {
+    if (!circ->p_chan)
+      return;
+    ++stats_n_relay_cells_relayed;
+    append_cell_to_circuit_queue(circ_, circ->p_chan, &oc->cell,
+                                 CELL_DIRECTION_IN, oc->on_stream);
+    return;
+  }
+
+  reason = circuit_receive_crypted_relay_cell(&oc->cell, circ_,
+                                              oc->direction, NULL,
+                                              oc->recognized);
+  if (reason < 0) {
+    log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL, "circuit_receive_relay_cell "
+           "(%s) failed. Closing.",
+           oc->direction == CELL_DIRECTION_OUT ? "forward" : "backward");
+    circuit_mark_for_close(circ_, -reason);
+  }
+}
+
+/** Main thread reply function: a cpuworker has finished the relay crypto
+ * for the relay_offload_job_t <b>work_</b>.  Handle its cells in order, and
+ * start the next job for the circuit, if there is one. */
+static void
+relay_offload_replyfn(void *work_)
+{
+  relay_offload_job_t *job = work_;
+  or_circuit_t *circ = job->circ;
+  offload_cell_t *oc;
+
+  tor_assert(job->magic == RELAY_OFFLOAD_JOB_MAGIC);
+
+  if (!circ) {
+    /* The circuit went away while we were working: the crypto state is
+     * ours to release. */
+    relay_crypto_clear(&job->crypto);
+    relay_offload_job_free(job);
+    return;
+  }
+
+  tor_assert(circ->crypto_offload);
+  tor_assert(circ->crypto_offload->job == job);
+  circ->crypto_offload->workqueue_entry = NULL;
+
+  /* Any cells that we originate while handling these go on the pending
+   * queue, behind everything here: we don't clear the job until we're
+   * done. */
+  TOR_SIMPLEQ_FOREACH(oc, &job->cells, next) {
+    if (circ->base_.marked_for_close)
+      break;
+    --circ->crypto_offload->n_in_job;
+    relay_offload_finish_cell(circ, oc);
+  }
+  circ->crypto_offload->job = NULL;
+  circ->crypto_offload->n_in_job = 0;
+  relay_offload_job_free(job);
+
+  if (! circ->base_.marked_for_close) {
+    relay_offload_launch(circ);
+    /* The backlog that kept our edge streams blocked may be gone now. */
+    or_circuit_update_streams_blocked(circ, 0);
+  }
+}
+
+/** If no cpuworker is busy with <b>circ</b>, and it has cells waiting for
+ * their relay crypto, hand up to RELAY_OFFLOAD_MAX_BATCH of them to a
+ * cpuworker. */
+static void
+relay_offload_launch(or_circuit_t *circ)
+{
+  struct relay_offload_t *ro = circ->crypto_offload;
+  relay_offload_job_t *job;
+  workqueue_entry_t *entry;
+  int n_cells = 0;
+
+  if (ro->job || TOR_SIMPLEQ_EMPTY(&ro->pending))
+    return;
+
+  job = tor_malloc_zero(sizeof(relay_offload_job_t));
+  job->magic = RELAY_OFFLOAD_JOB_MAGIC;
+  job->circ = circ;
+  memcpy(&job->crypto, &circ->crypto, sizeof(relay_crypto_t));
+  TOR_SIMPLEQ_INIT(&job->cells);
+  while (n_cells < RELAY_OFFLOAD_MAX_BATCH && ro->n_pending) {
+    offload_cell_t *oc = TOR_SIMPLEQ_FIRST(&ro->pending);
+    TOR_SIMPLEQ_REMOVE_HEAD(&ro->pending, next);
+    TOR_SIMPLEQ_INSERT_TAIL(&job->cells, oc, next);
+    --ro->n_pending;
+    ++n_cells;
+  }
+  ro->job = job;
+  ro->n_in_job = n_cells;
+
+  entry = cpuworker_queue_work(WQ_PRI_MED,
+                               relay_offload_threadfn,
+                               relay_offload_replyfn,
+                               job);
+  if (!entry) {
+    /* We couldn't queue it; do the work here instead, so that the cells
+     * still go out in order. */
+    log_warn(LD_BUG, "Couldn't queue relay crypto on threadpool");
+    relay_offload_threadfn(NULL, job);
+    relay_offload_replyfn(job);
+    return;
+  }
+  ro->workqueue_entry = entry;
+}
+
+/** Free every cell on <b>circ</b> that is waiting for a cpuworker, and return
+ * the number of bytes freed.  Cells that a cpuworker already has are left
+ * alone.  Used by the OOM handler, on circuits that are marked for close. */
+size_t
+relay_offload_free_pending(or_circuit_t *circ)
+{
+  struct relay_offload_t *ro = circ->crypto_offload;
+  int n;
+
+  if (!ro)
+    return 0;
+  n = offload_cell_queue_clear(&ro->pending);
+  TOR_SIMPLEQ_INIT(&ro->pending);
+  ro->n_pending = 0;
+  return n * sizeof(offload_cell_t);
+}
+
+/** Return the number of bytes used by cells that are waiting for, or
+ * having, their relay crypto done on a cpuworker. */
+size_t
+relay_offload_get_total_allocation(void)
+{
+  return total_offload_cells_allocated * sizeof(offload_cell_t);
+}
+
+/** Release the offload state for <b>circ</b>, which is about to be freed.
+ * If a cpuworker is still busy with the circuit's crypto state, hand that
+ * state over to the job, and clear it on the circuit. */
+void
+relay_offload_circuit_free(or_circuit_t *circ)
+{
+  struct relay_offload_t *ro = circ->crypto_offload;
+
+  if (!ro)
+    return;
+
+  if (ro->job) {
+    relay_offload_job_t *job = workqueue_entry_cancel(ro->workqueue_entry);
+    if (job) {
+      /* It successfully cancelled: the crypto state is still ours. */
+      tor_assert(job == ro->job);
+      relay_offload_job_free(job);
+    } else {
+      /* A worker has it; relay_offload_replyfn() will clean up. */
+      ro->job->circ = NULL;
+      memset(&circ->crypto, 0, sizeof(circ->crypto));
+    }
+  }
+
+  offload_cell_queue_clear(&ro->pending);
+  tor_free(circ->crypto_offload);
+}
@@ -0,0 +1,29 @@
+/* Copyright (c) 2019, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file relay_offload.h
+ * \brief Header file for relay_offload.c.
+ **/
+
+#ifndef TOR_RELAY_OFFLOAD_H
+#define TOR_RELAY_OFFLOAD_H
+
+/** Once an OR circuit has received this many relay cells, and
+ * RelayCryptoOffload is set, we do all of its relay crypto on the
+ * cpuworkers. */
+#define RELAY_OFFLOAD_MIN_CELLS 256
+/** Largest number of cells that we hand to a cpuworker in a single job. */
+#define RELAY_OFFLOAD_MAX_BATCH 128
+
+int relay_offload_receive_cell(or_circuit_t *circ, const cell_t *cell,
+                               cell_direction_t cell_direction);
+int relay_offload_package_cell(or_circuit_t *circ, const cell_t *cell,
+                               streamid_t on_stream);
+int relay_offload_is_active(const or_circuit_t *circ);
+int relay_offload_n_pending(const or_circuit_t *circ);
+size_t relay_offload_free_pending(or_circuit_t *circ);
+void relay_offload_circuit_free(or_circuit_t *circ);
+size_t relay_offload_get_total_allocation(void);
+
+#endif /* !defined(TOR_RELAY_OFFLOAD_H) */
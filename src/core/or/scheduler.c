@@ -8,6 +8,7 @@
 #define SCHEDULER_PRIVATE_
 #define SCHEDULER_KIST_PRIVATE
 #include "core/or/scheduler.h"
+#include "core/or/scheduler_stats.h"
 #include "core/mainloop/mainloop.h"
 #include "lib/buf/buffers.h"
 #define TOR_CHANNEL_INTERNAL_
@@ -217,7 +218,16 @@ scheduler_evt_callback(mainloop_event_t *event, void *arg)
    * are getting scheduled. Things are very broken. scheduler_t says the run()
    * function is mandatory. */
   tor_assert(the_scheduler->run);
-  the_scheduler->run();
+  if (get_options()->SchedulerStats) {
+    monotime_t start, end;
+    scheduler_stats_note_run_start(the_scheduler->type);
+    monotime_get(&start);
+    the_scheduler->run();
+    monotime_get(&end);
+    scheduler_stats_note_run_end(monotime_diff_usec(&start, &end));
+  } else {
+    the_scheduler->run();
+  }
 
   /* Schedule itself back in if it has more work. */
 
@@ -107,6 +107,22 @@ typedef struct scheduler_s {
 #define KIST_SCHED_RUN_INTERVAL_MIN 0
 /* Maximum interval that KIST runs (in ms). */
 #define KIST_SCHED_RUN_INTERVAL_MAX 100
+/* Default number of cells that KIST flushes from a channel each time it picks
+ * that channel. */
+#define KIST_SCHED_QUANTUM_DEFAULT 8
+/* Minimum number of cells that KIST flushes from a channel at a time. */
+#define KIST_SCHED_QUANTUM_MIN 1
+/* Maximum number of cells that KIST flushes from a channel at a time. */
+#define KIST_SCHED_QUANTUM_MAX 64
+/* Default number of scheduler runs for which KIST may keep using a socket's
+ * write limit without asking the kernel again. Zero means it never does. */
+#define KIST_SOCK_INFO_MAX_AGE_DEFAULT 0
+/* Minimum number of runs that KIST may keep a socket's write limit. */
+#define KIST_SOCK_INFO_MAX_AGE_MIN 0
+/* Maximum number of runs that KIST may keep a socket's write limit. The
+ * kernel can shrink a socket's congestion window at any time, so we never
+ * trust an old limit for more than a few runs. */
+#define KIST_SOCK_INFO_MAX_AGE_MAX 4
 
 /*****************************************************************************
  * Globally visible scheduler functions
@@ -180,6 +196,9 @@ typedef struct socket_table_ent_s {
   uint64_t written;
   /* Amount that can be written this scheduling run */
   uint64_t limit;
+  /* The scheduling run in which we last asked the kernel about this socket,
+   * or 0 if we never have. */
+  uint64_t updated_run;
   /* TCP info from the kernel */
   uint32_t cwnd;
   uint32_t unacked;
@@ -199,9 +218,15 @@ void scheduler_kist_set_full_mode(void);
 void scheduler_kist_set_lite_mode(void);
 scheduler_t *get_kist_scheduler(void);
 int kist_scheduler_run_interval(void);
+int kist_scheduler_quantum(void);
+int kist_sock_info_max_age(void);
 
 #ifdef TOR_UNIT_TESTS
 extern int32_t sched_run_interval;
+extern int32_t sched_quantum;
+extern int32_t sched_sock_info_max_age;
+extern uint64_t sock_info_n_refreshed;
+extern uint64_t sock_info_n_reused;
 #endif /* TOR_UNIT_TESTS */
 
 #endif /* defined(SCHEDULER_KIST_PRIVATE) */
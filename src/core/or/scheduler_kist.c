@@ -95,6 +95,19 @@ static monotime_t scheduler_last_run;
 static double sock_buf_size_factor = 1.0;
 /* How often the scheduler runs. */
 STATIC int sched_run_interval = KIST_SCHED_RUN_INTERVAL_DEFAULT;
+/* How many cells the scheduler flushes from a channel each time it picks
+ * it. */
+STATIC int sched_quantum = KIST_SCHED_QUANTUM_DEFAULT;
+/* For how many scheduler runs we may keep using a socket's write limit
+ * without asking the kernel again, as long as it still has room for a
+ * quantum of cells. Zero means we ask every run. */
+STATIC int sched_sock_info_max_age = KIST_SOCK_INFO_MAX_AGE_DEFAULT;
+/* How many times the scheduler has run. */
+static uint64_t sched_n_runs = 0;
+/* How many times we have asked the kernel for a socket's state, and how many
+ * times we have reused a socket's write limit instead. */
+STATIC uint64_t sock_info_n_refreshed = 0;
+STATIC uint64_t sock_info_n_reused = 0;
 
 #ifdef HAVE_KIST_SUPPORT
 /* Indicate if KIST lite mode is on or off. We can disable it at runtime.
@@ -320,7 +333,9 @@ update_socket_info_impl, (socket_table_ent_t *ent))
 
 /* Given a socket that isn't in the table, add it.
  * Given a socket that is in the table, re-init values that need init-ing
- * every scheduling run
+ * every scheduling run. What we didn't write of the socket's limit last run
+ * becomes its limit for this run, unless update_socket_info() asks the
+ * kernel for a new one.
  */
 static void
 init_socket_info(socket_table_t *table, const channel_t *chan)
@@ -334,6 +349,7 @@ init_socket_info(socket_table_t *table, const channel_t *chan)
     ent->chan = chan;
     HT_INSERT(socket_table_s, table, ent);
   }
+  ent->limit = (ent->limit > ent->written) ? ent->limit - ent->written : 0;
   ent->written = 0;
 }
 
@@ -379,27 +395,82 @@ set_scheduler_run_interval(void)
   }
 }
 
-/* Return true iff the channel hasn't hit its kist-imposed write limit yet */
-static int
-socket_can_write(socket_table_t *table, const channel_t *chan)
+/* Set the number of cells we flush from a channel each time we pick it. */
+static void
+set_scheduler_quantum(void)
+{
+  int old_sched_quantum = sched_quantum;
+  sched_quantum = kist_scheduler_quantum();
+  if (old_sched_quantum != sched_quantum) {
+    log_info(LD_SCHED, "Scheduler KIST changing its quantum "
+                       "from %d to %d cells",
+             old_sched_quantum, sched_quantum);
+  }
+}
+
+/* Set for how many runs we may reuse a socket's write limit. */
+static void
+set_sock_info_max_age(void)
+{
+  int old_max_age = sched_sock_info_max_age;
+  sched_sock_info_max_age = kist_sock_info_max_age();
+  if (old_max_age != sched_sock_info_max_age) {
+    log_info(LD_SCHED, "Scheduler KIST changing its socket info max age "
+                       "from %d to %d runs",
+             old_max_age, sched_sock_info_max_age);
+  }
+}
+
+/* Return the number of cells that the channel can write before it hits its
+ * kist-imposed write limit. */
+static int64_t
+socket_write_space(socket_table_t *table, const channel_t *chan)
 {
   socket_table_ent_t *ent = NULL;
   ent = socket_table_search(table, chan);
   if (SCHED_BUG(!ent, chan)) {
-    return 1; // Just return true, saying that kist wouldn't limit the socket
+    return INT64_MAX; // Just say that kist wouldn't limit the socket
   }
 
   /* We previously calculated a write limit for this socket. In the below
    * calculation, first determine how much room is left in bytes. Then divide
-   * that by the amount of space a cell takes. If there's room for at least 1
-   * cell, then KIST will allow the socket to write. */
-  int64_t kist_limit_space =
-    (int64_t) (ent->limit - ent->written) /
+   * that by the amount of space a cell takes. */
+  return (int64_t) (ent->limit - ent->written) /
     (CELL_MAX_NETWORK_SIZE + TLS_PER_CELL_OVERHEAD);
-  return kist_limit_space > 0;
 }
 
-/* Update the channel's socket kernel information. */
+/* Return true iff the channel hasn't hit its kist-imposed write limit yet */
+static int
+socket_can_write(socket_table_t *table, const channel_t *chan)
+{
+  /* If there's room for at least 1 cell, then KIST will allow the socket to
+   * write. */
+  return socket_write_space(table, chan) > 0;
+}
+
+/* Return true iff the write limit that we computed for the socket in
+ * <b>ent</b> during an earlier run is still good enough to use in this one.
+ *
+ * This is only an estimate: the kernel may have drained the socket since
+ * then, but it may also have shrunk the congestion window after a loss, in
+ * which case the old limit lets us write more than KIST would now allow.
+ * That's why we only keep using it for a few runs, and only while it still
+ * has room for a quantum of cells. */
+static int
+socket_info_is_fresh(const socket_table_ent_t *ent)
+{
+  if (sched_sock_info_max_age <= 0 || kist_lite_mode || !ent->updated_run) {
+    return 0;
+  }
+  if (sched_n_runs - ent->updated_run > (uint64_t) sched_sock_info_max_age) {
+    return 0;
+  }
+  return ent->limit >= (uint64_t) sched_quantum *
+                       (CELL_MAX_NETWORK_SIZE + TLS_PER_CELL_OVERHEAD);
+}
+
+/* Update the channel's socket kernel information, unless what we have is
+ * fresh enough. */
 static void
 update_socket_info(socket_table_t *table, const channel_t *chan)
 {
@@ -408,7 +479,15 @@ update_socket_info(socket_table_t *table, const channel_t *chan)
   if (SCHED_BUG(!ent, chan)) {
     return; // Whelp. Entry didn't exist for some reason so nothing to do.
   }
+  if (socket_info_is_fresh(ent)) {
+    ++sock_info_n_reused;
+    log_debug(LD_SCHED, "chan=%" PRIu64 " reusing socket info, limit: %"
+              PRIu64, ent->chan->global_identifier, ent->limit);
+    return;
+  }
   update_socket_info_impl(ent);
+  ent->updated_run = sched_n_runs;
+  ++sock_info_n_refreshed;
   log_debug(LD_SCHED, "chan=%" PRIu64 " updated socket info, limit: %" PRIu64
                       ", cwnd: %" PRIu32 ", unacked: %" PRIu32
                       ", notsent: %" PRIu32 ", mss: %" PRIu32,
@@ -491,6 +570,8 @@ static void
 kist_scheduler_on_new_consensus(void)
 {
   set_scheduler_run_interval();
+  set_scheduler_quantum();
+  set_sock_info_max_age();
 }
 
 /* Function of the scheduler interface: on_new_options() */
@@ -501,6 +582,8 @@ kist_scheduler_on_new_options(void)
 
   /* Calls kist_scheduler_run_interval which calls get_options(). */
   set_scheduler_run_interval();
+  set_scheduler_quantum();
+  set_sock_info_max_age();
 }
 
 /* Function of the scheduler interface: init() */
@@ -573,20 +656,26 @@ kist_scheduler_run(void)
   /* The last distinct chan served in a sched loop. */
   channel_t *prev_chan = NULL;
   int flush_result; // temporarily store results from flush calls
+  int64_t write_space; // how many cells kist lets us write on the channel
+  int can_write; // can we still write on the channel after flushing?
   /* Channels to be re-adding to pending at the end */
   smartlist_t *to_readd = NULL;
   smartlist_t *cp = get_channels_pending();
 
   outbuf_table_t outbuf_table = HT_INITIALIZER();
+  uint64_t n_refreshed = sock_info_n_refreshed;
 
-  /* For each pending channel, collect new kernel information */
+  /* For each pending channel, collect new kernel information, in one pass
+   * before we start scheduling. */
+  ++sched_n_runs;
   SMARTLIST_FOREACH_BEGIN(cp, const channel_t *, pchan) {
       init_socket_info(&socket_table, pchan);
       update_socket_info(&socket_table, pchan);
   } SMARTLIST_FOREACH_END(pchan);
 
-  log_debug(LD_SCHED, "Running the scheduler. %d channels pending",
-            smartlist_len(cp));
+  log_debug(LD_SCHED, "Running the scheduler. %d channels pending, "
+            "%" PRIu64 " socket info refreshed from the kernel",
+            smartlist_len(cp), sock_info_n_refreshed - n_refreshed);
 
   /* The main scheduling loop. Loop until there are no more pending channels */
   while (smartlist_len(cp) > 0) {
@@ -615,9 +704,14 @@ kist_scheduler_run(void)
     }
 
     /* Only flush and write if the per-socket limit hasn't been hit */
-    if (socket_can_write(&socket_table, chan)) {
-      /* flush to channel queue/outbuf */
-      flush_result = (int)channel_flush_some_cells(chan, 1); // 1 for num cells
+    write_space = socket_write_space(&socket_table, chan);
+    if (write_space > 0) {
+      /* Flush to channel queue/outbuf. We take up to a quantum of cells at a
+       * time rather than just one, so that we don't have to go through the
+       * pending heap for every cell. The circuitmux still picks the circuits
+       * they come from, in priority order. */
+      flush_result = (int)channel_flush_some_cells(chan,
+                                            MIN(write_space, sched_quantum));
       /* XXX: While flushing cells, it is possible that the connection write
        * fails leading to the channel to be closed which triggers a release
        * and free its entry in the socket table. And because of a engineering
@@ -655,8 +749,8 @@ kist_scheduler_run(void)
 
     /* Decide what to do with the channel now */
 
-    if (!channel_more_to_flush(chan) &&
-        !socket_can_write(&socket_table, chan)) {
+    can_write = socket_can_write(&socket_table, chan);
+    if (!channel_more_to_flush(chan) && !can_write) {
 
       /* Case 1: no more cells to send, and cannot write */
 
@@ -681,7 +775,7 @@ kist_scheduler_run(void)
       /* Case 2: no more cells to send, but still open for writes */
 
       scheduler_set_channel_state(chan, SCHED_CHAN_WAITING_FOR_CELLS);
-    } else if (!socket_can_write(&socket_table, chan)) {
+    } else if (!can_write) {
 
       /* Case 3: cells to send, but cannot write */
 
@@ -793,6 +887,51 @@ kist_scheduler_run_interval(void)
                                  KIST_SCHED_RUN_INTERVAL_MAX);
 }
 
+/* Return the number of cells that the KIST scheduler should flush from a
+ * channel each time it picks that channel.
+ *
+ * First check the configuration:
+ *   - If > 0, then return that value.
+ * Otherwise, return the consensus value, or KIST_SCHED_QUANTUM_DEFAULT if the
+ * consensus doesn't say anything.
+ */
+int
+kist_scheduler_quantum(void)
+{
+  int quantum = get_options()->KISTSchedQuantum;
+
+  if (quantum > 0) {
+    log_debug(LD_SCHED, "Found KISTSchedQuantum=%d in torrc. Using that.",
+              quantum);
+    return quantum;
+  }
+
+  return networkstatus_get_param(NULL, "KISTSchedQuantum",
+                                 KIST_SCHED_QUANTUM_DEFAULT,
+                                 KIST_SCHED_QUANTUM_MIN,
+                                 KIST_SCHED_QUANTUM_MAX);
+}
+
+/* Return for how many scheduler runs KIST may keep using a socket's write
+ * limit without asking the kernel again. Use the torrc value if it is set,
+ * else the consensus value. */
+int
+kist_sock_info_max_age(void)
+{
+  int max_age = get_options()->KISTSockInfoMaxAge;
+
+  if (max_age >= 0) {
+    log_debug(LD_SCHED, "Found KISTSockInfoMaxAge=%d in torrc. Using that.",
+              max_age);
+    return max_age;
+  }
+
+  return networkstatus_get_param(NULL, "KISTSockInfoMaxAge",
+                                 KIST_SOCK_INFO_MAX_AGE_DEFAULT,
+                                 KIST_SOCK_INFO_MAX_AGE_MIN,
+                                 KIST_SOCK_INFO_MAX_AGE_MAX);
+}
+
 /* Set KISTLite mode that is KIST without kernel support. */
 void
 scheduler_kist_set_lite_mode(void)
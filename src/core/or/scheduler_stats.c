@@ -0,0 +1,272 @@
+/* Copyright (c) 2019, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file scheduler_stats.c
+ * \brief Histograms of how long cells wait to be sent, and of how long the
+ * cell scheduler takes.
+ *
+ * When SchedulerStats is set, we note how long each cell waited between
+ * being queued on its circuit and being written to its channel, keyed by
+ * the circuitmux policy that picked it and by the scheduler that was
+ * running.  We also note how long each scheduler run took, and how many
+ * cells it sent.  All of these go into histograms whose buckets get wider as
+ * their values grow, so that they record everything from a millisecond to
+ * an hour to within 25%, in a fixed amount of memory.
+ *
+ * The histograms are available through GETINFO sched-stats/..., and a
+ * summary of them goes in the heartbeat.
+ **/
+
+#include "core/or/or.h"
+#include "core/or/circuitmux.h"
+#include "core/or/circuitmux_ewma.h"
+#include "core/or/circuitmux_ewma_wheel.h"
+#include "core/or/scheduler.h"
+#include "core/or/scheduler_stats.h"
+#include "lib/math/histogram.h"
+
+/** Indices for the circuitmux policies we keep histograms for. */
+typedef enum {
+  SCHED_STATS_POLICY_EWMA = 0,
+  SCHED_STATS_POLICY_EWMA_WHEEL,
+  SCHED_STATS_POLICY_OTHER,
+  SCHED_STATS_N_POLICIES
+} sched_stats_policy_t;
+
+/** Names for each sched_stats_policy_t, as we report them. */
+static const char *policy_names[SCHED_STATS_N_POLICIES] = {
+  "EWMA", "EWMAWheel", "Other",
+};
+
+/** Indices for the schedulers we keep histograms for. */
+typedef enum {
+  SCHED_STATS_SCHED_VANILLA = 0,
+  SCHED_STATS_SCHED_KIST,
+  SCHED_STATS_SCHED_KIST_LITE,
+  SCHED_STATS_N_SCHEDULERS
+} sched_stats_sched_t;
+
+/** Names for each sched_stats_sched_t, as we report them. */
+static const char *sched_names[SCHED_STATS_N_SCHEDULERS] = {
+  "Vanilla", "KIST", "KISTLite",
+};
+
+/** How long cells waited in their circuit queues (in msec), by the
+ * circuitmux policy that picked them. */
+static log_histogram_t cell_delay_by_policy[SCHED_STATS_N_POLICIES];
+/** How long cells waited in their circuit queues (in msec), by the
+ * scheduler that was in use. */
+static log_histogram_t cell_delay_by_sched[SCHED_STATS_N_SCHEDULERS];
+/** How long each scheduler run took (in usec). */
+static log_histogram_t run_usec_by_sched[SCHED_STATS_N_SCHEDULERS];
+/** How many cells each scheduler run sent. */
+static log_histogram_t run_cells_by_sched[SCHED_STATS_N_SCHEDULERS];
+
+/** The scheduler that ran most recently, or -1 if none has. */
+static int cur_sched = -1;
+/** How many cells we have sent since the current scheduler run began. */
+static uint32_t n_cells_this_run = 0;
+
+/*** Formatting ***/
+
+/** Add a line describing <b>hist</b> to <b>out</b>, starting with
+ * <b>label</b>.  If <b>with_buckets</b> is true, list the upper bound and
+ * count of every nonempty bucket, too. */
+static void
+format_histogram_line(smartlist_t *out, const char *label,
+                      const log_histogram_t *hist, int with_buckets)
+{
+  char *buckets = NULL;
+
+  if (with_buckets) {
+    smartlist_t *elts = smartlist_new();
+    for (int i = 0; i < LOG_HISTOGRAM_N_BUCKETS; ++i) {
+      if (hist->counts[i])
+        smartlist_add_asprintf(elts, "%"PRIu32":%"PRIu64,
+                               log_histogram_bucket_max(i), hist->counts[i]);
+    }
+    buckets = smartlist_join_strings(elts, ",", 0, NULL);
+    SMARTLIST_FOREACH(elts, char *, cp, tor_free(cp));
+    smartlist_free(elts);
+  }
+
+  smartlist_add_asprintf(out, "%s count=%"PRIu64" mean=%"PRIu64
+                         " p50=%"PRIu32" p90=%"PRIu32" p99=%"PRIu32
+                         " max=%"PRIu32"%s%s",
+                         label, hist->n, log_histogram_mean(hist),
+                         log_histogram_percentile(hist, 50),
+                         log_histogram_percentile(hist, 90),
+                         log_histogram_percentile(hist, 99),
+                         hist->max,
+                         buckets ? " buckets=" : "",
+                         buckets ? buckets : "");
+  tor_free(buckets);
+}
+
+/*** Recording ***/
+
+/** Return the index of the histograms for <b>cmux</b>'s policy. */
+static sched_stats_policy_t
+policy_index(circuitmux_t *cmux)
+{
+  const circuitmux_policy_t *policy = circuitmux_get_policy(cmux);
+
+  if (policy == &ewma_policy)
+    return SCHED_STATS_POLICY_EWMA;
+  if (policy == &ewma_wheel_policy)
+    return SCHED_STATS_POLICY_EWMA_WHEEL;
+  return SCHED_STATS_POLICY_OTHER;
+}
+
+/** Note that a cell picked by <b>cmux</b> waited <b>msec_waiting</b> msec
+ * between being queued and being written to its channel. */
+void
+scheduler_stats_note_cell_delay(circuitmux_t *cmux,
+                                uint32_t msec_waiting)
+{
+  tor_assert(cmux);
+
+  log_histogram_add(&cell_delay_by_policy[policy_index(cmux)],
+                      msec_waiting);
+  /* Cells can also get sent between runs, when a channel flushes on its
+   * own. We count them against whichever scheduler ran last. */
+  if (cur_sched >= 0)
+    log_histogram_add(&cell_delay_by_sched[cur_sched], msec_waiting);
+  ++n_cells_this_run;
+}
+
+/** Note that a run of the scheduler of type <b>type</b> is starting. */
+void
+scheduler_stats_note_run_start(scheduler_types_t type)
+{
+  switch (type) {
+    case SCHEDULER_VANILLA:
+      cur_sched = SCHED_STATS_SCHED_VANILLA;
+      break;
+    case SCHEDULER_KIST:
+      cur_sched = SCHED_STATS_SCHED_KIST;
+      break;
+    case SCHEDULER_KIST_LITE:
+      cur_sched = SCHED_STATS_SCHED_KIST_LITE;
+      break;
+    case SCHEDULER_NONE:
+      /* fallthrough */
+    default:
+      cur_sched = -1;
+      break;
+  }
+  n_cells_this_run = 0;
+}
+
+/** Note that the current scheduler run just finished, after <b>usec</b>
+ * microseconds. */
+void
+scheduler_stats_note_run_end(uint64_t usec)
+{
+  if (cur_sched < 0)
+    return;
+
+  log_histogram_add(&run_usec_by_sched[cur_sched],
+                      (uint32_t) MIN(usec, UINT32_MAX));
+  log_histogram_add(&run_cells_by_sched[cur_sched], n_cells_this_run);
+  n_cells_this_run = 0;
+}
+
+/** Forget everything we have recorded. */
+void
+scheduler_stats_reset(void)
+{
+  memset(cell_delay_by_policy, 0, sizeof(cell_delay_by_policy));
+  memset(cell_delay_by_sched, 0, sizeof(cell_delay_by_sched));
+  memset(run_usec_by_sched, 0, sizeof(run_usec_by_sched));
+  memset(run_cells_by_sched, 0, sizeof(run_cells_by_sched));
+  cur_sched = -1;
+  n_cells_this_run = 0;
+}
+
+/*** Reporting ***/
+
+/** Log a summary of every histogram that has anything in it, as part of the
+ * heartbeat. */
+void
+scheduler_stats_log_heartbeat(void)
+{
+  int i;
+
+  for (i = 0; i < SCHED_STATS_N_POLICIES; ++i) {
+    const log_histogram_t *h = &cell_delay_by_policy[i];
+    if (!h->n)
+      continue;
+    log_notice(LD_HEARTBEAT, "Cell queue delay with the %s circuitmux "
+               "policy: %"PRIu64" cells, median %"PRIu32" msec, "
+               "99th percentile %"PRIu32" msec, max %"PRIu32" msec.",
+               policy_names[i], h->n, log_histogram_percentile(h, 50),
+               log_histogram_percentile(h, 99), h->max);
+  }
+  for (i = 0; i < SCHED_STATS_N_SCHEDULERS; ++i) {
+    const log_histogram_t *d = &cell_delay_by_sched[i];
+    const log_histogram_t *u = &run_usec_by_sched[i];
+    const log_histogram_t *c = &run_cells_by_sched[i];
+    if (!d->n && !u->n)
+      continue;
+    log_notice(LD_HEARTBEAT, "%s scheduler: %"PRIu64" runs, median %"PRIu32
+               " usec and %"PRIu32" cells, 99th percentile %"PRIu32
+               " usec and %"PRIu32" cells. Cell queue delay: median %"PRIu32
+               " msec, 99th percentile %"PRIu32" msec.",
+               sched_names[i], u->n,
+               log_histogram_percentile(u, 50),
+               log_histogram_percentile(c, 50),
+               log_histogram_percentile(u, 99),
+               log_histogram_percentile(c, 99),
+               log_histogram_percentile(d, 50),
+               log_histogram_percentile(d, 99));
+  }
+}
+
+/** Implementation helper for GETINFO: knows the answers to questions about
+ * the scheduler statistics. */
+int
+getinfo_helper_sched_stats(control_connection_t *conn,
+                           const char *question, char **answer,
+                           const char **errmsg)
+{
+  smartlist_t *lines;
+  char *label = NULL;
+  int i;
+
+  (void) conn;
+  (void) errmsg;
+
+  lines = smartlist_new();
+  if (!strcmp(question, "sched-stats/cell-delay")) {
+    for (i = 0; i < SCHED_STATS_N_POLICIES; ++i) {
+      tor_asprintf(&label, "policy=%s", policy_names[i]);
+      format_histogram_line(lines, label, &cell_delay_by_policy[i], 1);
+      tor_free(label);
+    }
+    for (i = 0; i < SCHED_STATS_N_SCHEDULERS; ++i) {
+      tor_asprintf(&label, "scheduler=%s", sched_names[i]);
+      format_histogram_line(lines, label, &cell_delay_by_sched[i], 1);
+      tor_free(label);
+    }
+  } else if (!strcmp(question, "sched-stats/run-usec")) {
+    for (i = 0; i < SCHED_STATS_N_SCHEDULERS; ++i) {
+      tor_asprintf(&label, "scheduler=%s", sched_names[i]);
+      format_histogram_line(lines, label, &run_usec_by_sched[i], 1);
+      tor_free(label);
+    }
+  } else if (!strcmp(question, "sched-stats/run-cells")) {
+    for (i = 0; i < SCHED_STATS_N_SCHEDULERS; ++i) {
+      tor_asprintf(&label, "scheduler=%s", sched_names[i]);
+      format_histogram_line(lines, label, &run_cells_by_sched[i], 1);
+      tor_free(label);
+    }
+  }
+
+  if (smartlist_len(lines))
+    *answer = smartlist_join_strings(lines, "\n", 0, NULL);
+  SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+  smartlist_free(lines);
+  return 0;
+}
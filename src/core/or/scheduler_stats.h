@@ -0,0 +1,24 @@
+/* Copyright (c) 2019, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file scheduler_stats.h
+ * \brief Header file for scheduler_stats.c
+ **/
+
+#ifndef TOR_SCHEDULER_STATS_H
+#define TOR_SCHEDULER_STATS_H
+
+#include "core/or/scheduler.h"
+
+void scheduler_stats_note_cell_delay(circuitmux_t *cmux,
+                                     uint32_t msec_waiting);
+void scheduler_stats_note_run_start(scheduler_types_t type);
+void scheduler_stats_note_run_end(uint64_t usec);
+void scheduler_stats_log_heartbeat(void);
+void scheduler_stats_reset(void);
+int getinfo_helper_sched_stats(control_connection_t *conn,
+                               const char *question, char **answer,
+                               const char **errmsg);
+
+#endif /* !defined(TOR_SCHEDULER_STATS_H) */
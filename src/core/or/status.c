@@ -30,6 +30,8 @@
 #include "feature/hs/hs_stats.h"
 #include "feature/hs/hs_service.h"
 #include "core/or/dos.h"
+#include "feature/relay/onion_queue.h"
+#include "core/or/scheduler_stats.h"
 #include "feature/stats/geoip_stats.h"
 
 #include "app/config/or_state_st.h"
@@ -171,8 +173,10 @@ log_heartbeat(time_t now)
 
   if (public_server_mode(options)) {
     rep_hist_log_circuit_handshake_stats(now);
+    onion_queue_log_heartbeat();
     rep_hist_log_link_protocol_counts();
     dos_log_heartbeat();
+    packed_cell_pool_log_heartbeat();
   }
 
   circuit_log_ancient_one_hop_circuits(1800);
@@ -199,6 +203,9 @@ log_heartbeat(time_t now)
          (main_loop_idle_count));
   }
 
+  if (options->SchedulerStats)
+    scheduler_stats_log_heartbeat();
+
   /** Now, if we are an HS service, log some stats about our usage */
   log_onion_service_stats();
 
@@ -41,6 +41,7 @@
 #include "app/config/confparse.h"
 #include "app/main/main.h"
 #include "core/mainloop/connection.h"
+#include "core/mainloop/cpuworker.h"
 #include "core/mainloop/mainloop.h"
 #include "core/or/channel.h"
 #include "core/or/channeltls.h"
@@ -54,6 +55,7 @@
 #include "core/or/ocirc_event.h"
 #include "core/or/policies.h"
 #include "core/or/reasons.h"
+#include "core/or/scheduler_stats.h"
 #include "core/or/versions.h"
 #include "core/proto/proto_control0.h"
 #include "core/proto/proto_http.h"
@@ -3367,6 +3369,20 @@ static const getinfo_item_t getinfo_items[] = {
   DOC("address-mappings/config",
       "Current address mappings from configuration."),
   DOC("address-mappings/control", "Current address mappings from controller."),
+  PREFIX("onionskin-cost/", onionskin_cost, NULL),
+  DOC("onionskin-cost/tap",
+      "How long TAP onionskins take the cpuworkers, and how long a new one "
+      "would wait."),
+  DOC("onionskin-cost/ntor",
+      "How long ntor onionskins take the cpuworkers, and how long a new one "
+      "would wait."),
+  PREFIX("sched-stats/", sched_stats, NULL),
+  DOC("sched-stats/cell-delay",
+      "Histograms of how long cells waited in their circuit queues, in msec."),
+  DOC("sched-stats/run-usec",
+      "Histograms of how long each scheduler run took, in usec."),
+  DOC("sched-stats/run-cells",
+      "Histograms of how many cells each scheduler run sent."),
   PREFIX("status/", events, NULL),
   DOC("status/circuit-established",
       "Whether we think client functionality is working."),
@@ -437,6 +437,39 @@ consensus_cache_entry_get_body(const consensus_cache_entry_t *ent,
   return 0;
 }
 
+/**
+ * Open the file that holds <b>ent</b> for reading, so that we can send its
+ * body without copying it through our own memory.  On success, set
+ * *<b>offset_out</b> to where the body starts in the file (just past the
+ * labels), *<b>sz_out</b> to its size, and return the file descriptor,
+ * which the caller must close.  On failure return -1.
+ *
+ * The file keeps the body that <b>ent</b> had when we opened it, even if
+ * <b>ent</b> is removed from the cache afterwards.
+ */
+int
+consensus_cache_entry_open_body(const consensus_cache_entry_t *ent,
+                                off_t *offset_out,
+                                size_t *sz_out)
+{
+  const uint8_t *body;
+  size_t bodylen;
+
+  /* We need the file mapped to know where the labels end. */
+  if (consensus_cache_entry_get_body(ent, &body, &bodylen) < 0)
+    return -1;
+  if (BUG(!ent->in_cache))
+    return -1; // LCOV_EXCL_LINE
+
+  int fd = storage_dir_open(ent->in_cache->dir, ent->fname);
+  if (fd < 0)
+    return -1;
+
+  *offset_out = (off_t)(body - (const uint8_t *)ent->map->data);
+  *sz_out = bodylen;
+  return fd;
+}
+
 /**
  * Unmap every mmap'd element of <b>cache</b> that has been unused
  * since <b>cutoff</b>.
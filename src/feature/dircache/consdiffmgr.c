@@ -25,6 +25,7 @@
 #include "lib/evloop/workqueue.h"
 #include "lib/compress/compress.h"
 #include "lib/encoding/confline.h"
+#include "lib/lock/compat_mutex.h"
 
 #include "feature/nodelist/networkstatus_st.h"
 #include "feature/nodelist/networkstatus_voter_info_st.h"
@@ -191,8 +192,13 @@ static int consdiffmgr_ensure_space_for_files(int n);
 static int consensus_queue_compression_work(const char *consensus,
                                             size_t consensus_len,
                                             const networkstatus_t *as_parsed);
+struct consensus_diff_batch_t;
+static struct consensus_diff_batch_t *consensus_diff_batch_new(
+                                          consensus_cache_entry_t *diff_to,
+                                          const char *flavname);
+static void consensus_diff_batch_decref(struct consensus_diff_batch_t *batch);
 static int consensus_diff_queue_diff_work(consensus_cache_entry_t *diff_from,
-                                          consensus_cache_entry_t *diff_to);
+                                      struct consensus_diff_batch_t *batch);
 static void consdiffmgr_set_cache_flags(void);
 
 /* =====
@@ -913,6 +919,7 @@ consdiffmgr_rescan_flavor_(consensus_flavor_t flavor)
   smartlist_t *diffs = NULL;
   smartlist_t *compute_diffs_from = NULL;
   strmap_t *have_diff_from = NULL;
+  struct consensus_diff_batch_t *batch = NULL;
 
   // look for the most recent consensus, and for all previous in-range
   // consensuses.  Do they all have diffs to it?
@@ -993,7 +1000,10 @@ consdiffmgr_rescan_flavor_(consensus_flavor_t flavor)
   //    target consensuses.
   cdm_diff_ht_purge(flavor, most_recent_sha3);
 
-  // 5. Actually launch the requests.
+  // 5. Actually launch the requests.  They all share one batch, so that
+  //    we only get the most recent consensus ready to diff against once.
+  if (smartlist_len(compute_diffs_from))
+    batch = consensus_diff_batch_new(most_recent, flavname);
   SMARTLIST_FOREACH_BEGIN(compute_diffs_from, consensus_cache_entry_t *, c) {
     if (BUG(c == most_recent))
       continue; // LCOV_EXCL_LINE
@@ -1010,10 +1020,11 @@ consdiffmgr_rescan_flavor_(consensus_flavor_t flavor)
       // This is already pending, or we encountered an error.
       continue;
     }
-    consensus_diff_queue_diff_work(c, most_recent);
+    consensus_diff_queue_diff_work(c, batch);
   } SMARTLIST_FOREACH_END(c);
 
  done:
+  consensus_diff_batch_decref(batch);
   smartlist_free(matches);
   smartlist_free(diffs);
   smartlist_free(compute_diffs_from);
@@ -1383,6 +1394,134 @@ store_multiple(consensus_cache_entry_handle_t **handles_out,
   return status;
 }
 
+/**
+ * State shared by all the jobs that compute diffs to the same consensus in
+ * one rescan.
+ *
+ * Rather than have every job uncompress the newest consensus and split it
+ * into lines for itself, the first job to run does it once, under
+ * <b>lock</b>, and the others use the result read-only.  Only the main
+ * thread touches the reference count and the progress counters.
+ */
+typedef struct consensus_diff_batch_t {
+  /** How many jobs (and callers) hold a pointer to this batch. */
+  int refcnt;
+  /** The consensus to compute diffs to.  Holds a reference to the cache
+   * entry, whose body is mapped into memory in the main thread. */
+  consensus_cache_entry_t *diff_to;
+  /** The flavor of <b>diff_to</b>, for logging. */
+  const char *flavname;
+
+  /** Protects the fields below until <b>prepared</b> is set; after that,
+   * they never change. */
+  tor_mutex_t lock;
+  /** True iff some job has tried to build <b>target</b>. */
+  int prepared;
+  /** If <b>diff_to</b> was stored compressed, its uncompressed body. */
+  char *owned_body;
+  /** <b>diff_to</b>, ready to compute diffs to, or NULL if we couldn't
+   * build it. */
+  consensus_diff_target_t *target;
+
+  /** How many jobs we queued. */
+  int n_jobs;
+  /** How many of those jobs have come back, and how many of those failed. */
+  int n_done;
+  int n_failed;
+  /** When we started queueing jobs. */
+  monotime_coarse_t started;
+} consensus_diff_batch_t;
+
+/**
+ * Return a new batch for computing diffs to <b>diff_to</b>, with a single
+ * reference held by the caller.
+ */
+static consensus_diff_batch_t *
+consensus_diff_batch_new(consensus_cache_entry_t *diff_to,
+                         const char *flavname)
+{
+  tor_assert(in_main_thread());
+
+  consensus_diff_batch_t *batch = tor_malloc_zero(sizeof(*batch));
+  batch->refcnt = 1;
+  batch->diff_to = diff_to;
+  batch->flavname = flavname;
+  consensus_cache_entry_incref(diff_to);
+  tor_mutex_init_nonrecursive(&batch->lock);
+  monotime_coarse_get(&batch->started);
+  return batch;
+}
+
+/**
+ * Drop a reference to <b>batch</b>, and free it if that was the last one.
+ */
+static void
+consensus_diff_batch_decref(consensus_diff_batch_t *batch)
+{
+  tor_assert(in_main_thread());
+
+  if (!batch)
+    return;
+  if (--batch->refcnt > 0)
+    return;
+
+  consensus_diff_target_free(batch->target);
+  tor_free(batch->owned_body);
+  tor_mutex_uninit(&batch->lock);
+  consensus_cache_entry_decref(batch->diff_to);
+  tor_free(batch);
+}
+
+/**
+ * Worker function: return the consensus of <b>batch</b>, ready to compute
+ * diffs to, or NULL if we can't.  The first caller builds it; the others
+ * wait for it.
+ */
+static const consensus_diff_target_t *
+consensus_diff_batch_get_target(consensus_diff_batch_t *batch)
+{
+  const consensus_diff_target_t *target;
+
+  tor_mutex_acquire(&batch->lock);
+  if (!batch->prepared) {
+    const char *body = NULL;
+    size_t bodylen = 0;
+    if (uncompress_or_set_ptr(&body, &bodylen, &batch->owned_body,
+                              batch->diff_to) == 0) {
+      batch->target = consensus_diff_target_new(body, bodylen);
+    }
+    batch->prepared = 1;
+  }
+  target = batch->target;
+  tor_mutex_release(&batch->lock);
+
+  return target;
+}
+
+/**
+ * Note that one of the jobs in <b>batch</b> has come back, successfully iff
+ * <b>ok</b> is true.  Once they all have, say how it went.
+ */
+static void
+consensus_diff_batch_note_done(consensus_diff_batch_t *batch, int ok)
+{
+  tor_assert(in_main_thread());
+
+  ++batch->n_done;
+  if (!ok)
+    ++batch->n_failed;
+  if (batch->n_done < batch->n_jobs)
+    return;
+
+  monotime_coarse_t now;
+  monotime_coarse_get(&now);
+  log_info(LD_DIRSERV, "Finished generating %d diff%s to the most recent "
+           "%s consensus in %"PRId64" msec; %d failed.",
+           batch->n_jobs, batch->n_jobs == 1 ? "" : "s", batch->flavname,
+           monotime_coarse_diff_msec(&batch->started, &now),
+           batch->n_failed);
+}
+
 /**
  * An object passed to a worker thread that will try to produce a consensus
  * diff.
@@ -1400,6 +1539,11 @@ typedef struct consensus_diff_worker_job_t {
    * the main thread. The body must be mapped into memory in the main thread.
    */
   consensus_cache_entry_t *diff_to;
+  /**
+   * Input: The batch that this job belongs to, which holds <b>diff_to</b>
+   * ready to compute diffs to.  Holds a reference to the batch.
+   */
+  consensus_diff_batch_t *batch;
 
   /** Output: labels and bodies */
   compressed_result_t out[ARRAY_LENGTH(compress_diffs_with)];
@@ -1508,31 +1652,27 @@ consensus_diff_worker_threadfn(void *state_, void *work_)
 
   char *consensus_diff;
   {
-    const char *diff_from_nt = NULL, *diff_to_nt = NULL;
-    char *owned1 = NULL, *owned2 = NULL;
-    size_t diff_from_nt_len, diff_to_nt_len;
+    const consensus_diff_target_t *target;
+    const char *diff_from_nt = NULL;
+    char *owned1 = NULL;
+    size_t diff_from_nt_len;
 
+    target = consensus_diff_batch_get_target(job->batch);
+    if (!target)
+      return WQ_RPL_REPLY;
     if (uncompress_or_set_ptr(&diff_from_nt, &diff_from_nt_len, &owned1,
                               job->diff_from) < 0) {
       return WQ_RPL_REPLY;
     }
-    if (uncompress_or_set_ptr(&diff_to_nt, &diff_to_nt_len, &owned2,
-                              job->diff_to) < 0) {
-      tor_free(owned1);
-      return WQ_RPL_REPLY;
-    }
     tor_assert(diff_from_nt);
-    tor_assert(diff_to_nt);
-
-    // XXXX ugh; this is going to calculate the SHA3 of both its
-    // XXXX inputs again, even though we already have that. Maybe it's time
-    // XXXX to change the API here?
-    consensus_diff = consensus_diff_generate(diff_from_nt,
-                                             diff_from_nt_len,
-                                             diff_to_nt,
-                                             diff_to_nt_len);
+
+    // XXXX ugh; this is going to calculate the SHA3 of its input again,
+    // XXXX even though we already have that. Maybe it's time to change
+    // XXXX the API here?
+    consensus_diff = consensus_diff_generate_to_target(diff_from_nt,
+                                                       diff_from_nt_len,
+                                                       target);
     tor_free(owned1);
-    tor_free(owned2);
   }
   if (!consensus_diff) {
     /* Couldn't generate consensus; we'll leave the reply blank. */
@@ -1602,6 +1742,7 @@ consensus_diff_worker_job_free_(consensus_diff_worker_job_t *job)
   }
   consensus_cache_entry_decref(job->diff_from);
   consensus_cache_entry_decref(job->diff_to);
+  consensus_diff_batch_decref(job->batch);
   tor_free(job);
 }
 
@@ -1669,6 +1810,7 @@ consensus_diff_worker_replyfn(void *work_)
     /* Cache this error so we don't try to compute this one again. */
     status = CDM_DIFF_ERROR;
   }
+  consensus_diff_batch_note_done(job->batch, status == CDM_DIFF_PRESENT);
 
   unsigned u;
   for (u = 0; u < ARRAY_LENGTH(handles); ++u) {
@@ -1690,21 +1832,24 @@ consensus_diff_worker_replyfn(void *work_)
 }
 
 /**
- * Queue the job of computing the diff from <b>diff_from</b> to <b>diff_to</b>
- * in a worker thread.
+ * Queue the job of computing the diff from <b>diff_from</b> to the consensus
+ * of <b>batch</b> in a worker thread.
  */
 static int
 consensus_diff_queue_diff_work(consensus_cache_entry_t *diff_from,
-                               consensus_cache_entry_t *diff_to)
+                               consensus_diff_batch_t *batch)
 {
   tor_assert(in_main_thread());
 
+  consensus_cache_entry_t *diff_to = batch->diff_to;
   consensus_cache_entry_incref(diff_from);
   consensus_cache_entry_incref(diff_to);
+  ++batch->refcnt;
 
   consensus_diff_worker_job_t *job = tor_malloc_zero(sizeof(*job));
   job->diff_from = diff_from;
   job->diff_to = diff_to;
+  job->batch = batch;
 
   /* Make sure body is mapped. */
   const uint8_t *body;
@@ -1722,6 +1867,7 @@ consensus_diff_queue_diff_work(consensus_cache_entry_t *diff_from,
   if (!work)
     goto err;
 
+  ++batch->n_jobs;
   return 0;
  err:
   consensus_diff_worker_job_free(job); // includes decrefs.
@@ -607,6 +607,26 @@ spooled_resource_flush_some(spooled_resource_t *spooled,
     if (BUG(!cached && !cce))
       return SRFS_DONE;
 
+    if (spooled->cce_sent_from_file) {
+      /* The connection is sending the body from the file by itself; we're
+       * done once it has. */
+      return conn->base_.sendfile_remaining ? SRFS_MORE : SRFS_DONE;
+    }
+    if (cce && spooled->cached_dir_offset == 0 && !conn->compress_state &&
+        connection_can_sendfile(TO_CONN(conn))) {
+      /* We're sending the stored body unchanged over a plain socket, so let
+       * the kernel send it from the file without copying it through our
+       * buffers. If we can't open the file, spool it as usual. */
+      off_t offset;
+      size_t len;
+      int fd = consensus_cache_entry_open_body(cce, &offset, &len);
+      if (fd >= 0) {
+        connection_set_sendfile_source(TO_CONN(conn), fd, offset, len);
+        spooled->cce_sent_from_file = 1;
+        return len ? SRFS_MORE : SRFS_DONE;
+      }
+    }
+
     int64_t total_len;
     const char *ptr;
     if (cached) {
@@ -69,6 +69,11 @@ typedef struct spooled_resource_t {
    * The current offset into cached_dir or cce_body. Only used when
    * spool_eagerly is false */
   off_t cached_dir_offset;
+  /**
+   * True iff we've handed the connection the file holding
+   * consensus_cache_entry, to send with sendfile() instead of spooling
+   * it. */
+  unsigned cce_sent_from_file : 1;
 } spooled_resource_t;
 
 int connection_dirserv_flushed_some(dir_connection_t *conn);
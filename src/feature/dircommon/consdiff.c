@@ -15,11 +15,14 @@
  * it, relying on gen_ed_diff to generate the ed diff and some digest helper
  * functions to generate the digest hashes.
  *
- * gen_ed_diff is the tricky bit. In it simplest form, it will take quadratic
- * time and linear space to generate an ed diff given two smartlists. As shown
- * in its comment section, calling calc_changes on the entire two consensuses
- * will calculate what is to be added and what is to be deleted in the diff.
- * Its comment section briefly explains how it works.
+ * gen_ed_diff is the tricky bit. In it simplest form, it will take O((N+M)D)
+ * time and linear space to generate an ed diff given two smartlists, where D
+ * is the number of lines that changed. As shown in its comment section,
+ * calling calc_changes on the entire two consensuses will calculate what is
+ * to be added and what is to be deleted in the diff.  calc_changes works on
+ * integer line IDs from consensus_intern_lines rather than on the lines
+ * themselves, so comparing two lines is cheap.  Its comment section briefly
+ * explains how it works.
  *
  * In our case specific to consensuses, we take advantage of the fact that
  * consensuses list routers sorted by their identities. We use that
@@ -42,6 +45,7 @@
 #include "feature/dircommon/consdiff.h"
 #include "lib/memarea/memarea.h"
 #include "feature/dirparse/ns_parse.h"
+#include "siphash.h"
 
 static const char* ns_diff_version = "network-status-diff-version 1";
 static const char* hash_token = "hash";
@@ -131,233 +135,243 @@ consensus_digest_eq,(const uint8_t *d1,
   return fast_memeq(d1, d2, DIGEST256_LEN);
 }
 
-/** Create (allocate) a new slice from a smartlist. Assumes that the start
- * and the end indexes are within the bounds of the initial smartlist. The end
- * element is not part of the resulting slice. If end is -1, the slice is to
- * reach the end of the smartlist.
- */
-STATIC smartlist_slice_t *
-smartlist_slice(const smartlist_t *list, int start, int end)
-{
-  int list_len = smartlist_len(list);
-  tor_assert(start >= 0);
-  tor_assert(start <= list_len);
-  if (end == -1) {
-    end = list_len;
-  }
-  tor_assert(start <= end);
-
-  smartlist_slice_t *slice = tor_malloc(sizeof(smartlist_slice_t));
-  slice->list = list;
-  slice->offset = start;
-  slice->len = end - start;
-  return slice;
-}
-
-/** Helper: Compute the longest common subsequence lengths for the two slices.
- * Used as part of the diff generation to find the column at which to split
- * slice2 while still having the optimal solution.
- * If direction is -1, the navigation is reversed. Otherwise it must be 1.
- * The length of the resulting integer array is that of the second slice plus
- * one.
+/** An entry in the table that consensus_intern_lines() uses to give equal
+ * lines equal IDs. */
+typedef struct intern_entry_t {
+  /** The line, or NULL if this slot is empty. */
+  const cdline_t *line;
+  /** A hash of the line's contents. */
+  uint64_t hash;
+  /** The ID of the line. */
+  uint32_t id;
+} intern_entry_t;
+
+/** Give each of lines <b>start1</b> through <b>end1</b>-1 of <b>cons1</b>
+ * and lines <b>start2</b> through <b>end2</b>-1 of <b>cons2</b> an ID, such
+ * that two lines get the same ID iff they have the same contents.  Store the
+ * IDs at the same indices in <b>ids1</b> and <b>ids2</b>, and return the
+ * number of distinct lines.
+ *
+ * Comparing these IDs is much cheaper than comparing the lines, which is
+ * what the diff algorithm spends most of its time doing.
  */
-STATIC int *
-lcs_lengths(const smartlist_slice_t *slice1, const smartlist_slice_t *slice2,
-            int direction)
+STATIC uint32_t
+consensus_intern_lines(const smartlist_t *cons1, int start1, int end1,
+                       const smartlist_t *cons2, int start2, int end2,
+                       uint32_t *ids1, uint32_t *ids2)
 {
-  size_t a_size = sizeof(int) * (slice2->len+1);
-
-  /* Resulting lcs lengths. */
-  int *result = tor_malloc_zero(a_size);
-  /* Copy of the lcs lengths from the last iteration. */
-  int *prev = tor_malloc(a_size);
-
-  tor_assert(direction == 1 || direction == -1);
-
-  int si = slice1->offset;
-  if (direction == -1) {
-    si += (slice1->len-1);
-  }
-
-  for (int i = 0; i < slice1->len; ++i, si+=direction) {
-
-    const cdline_t *line1 = smartlist_get(slice1->list, si);
-    /* Store the last results. */
-    memcpy(prev, result, a_size);
-
-    int sj = slice2->offset;
-    if (direction == -1) {
-      sj += (slice2->len-1);
-    }
-
-    for (int j = 0; j < slice2->len; ++j, sj+=direction) {
-
-      const cdline_t *line2 = smartlist_get(slice2->list, sj);
-      if (lines_eq(line1, line2)) {
-        /* If the lines are equal, the lcs is one line longer. */
-        result[j + 1] = prev[j] + 1;
-      } else {
-        /* If not, see what lcs parent path is longer. */
-        result[j + 1] = MAX(result[j], prev[j + 1]);
+  const smartlist_t *conses[2] = { cons1, cons2 };
+  const int starts[2] = { start1, start2 };
+  const int ends[2] = { end1, end2 };
+  uint32_t *ids[2] = { ids1, ids2 };
+  intern_entry_t *table;
+  size_t n_slots = 16, mask;
+  uint32_t n_ids = 0;
+  int c, i;
+
+  /* Keep the table at most half full. */
+  while (n_slots < 2 * (size_t)((end1 - start1) + (end2 - start2)))
+    n_slots *= 2;
+  mask = n_slots - 1;
+  table = tor_calloc(n_slots, sizeof(intern_entry_t));
+
+  for (c = 0; c < 2; ++c) {
+    for (i = starts[c]; i < ends[c]; ++i) {
+      const cdline_t *line = smartlist_get(conses[c], i);
+      const uint64_t hash = siphash24g(line->s, line->len);
+      size_t idx = (size_t) hash & mask;
+      while (table[idx].line &&
+             (table[idx].hash != hash || !lines_eq(table[idx].line, line))) {
+        idx = (idx + 1) & mask;
       }
+      if (!table[idx].line) {
+        table[idx].line = line;
+        table[idx].hash = hash;
+        table[idx].id = n_ids++;
+      }
+      ids[c][i] = table[idx].id;
     }
   }
-  tor_free(prev);
-  return result;
-}
-
-/** Helper: Trim any number of lines that are equally at the start or the end
- * of both slices.
- */
-STATIC void
-trim_slices(smartlist_slice_t *slice1, smartlist_slice_t *slice2)
-{
-  while (slice1->len>0 && slice2->len>0) {
-    const cdline_t *line1 = smartlist_get(slice1->list, slice1->offset);
-    const cdline_t *line2 = smartlist_get(slice2->list, slice2->offset);
-    if (!lines_eq(line1, line2)) {
-      break;
-    }
-    slice1->offset++; slice1->len--;
-    slice2->offset++; slice2->len--;
-  }
-
-  int i1 = (slice1->offset+slice1->len)-1;
-  int i2 = (slice2->offset+slice2->len)-1;
 
-  while (slice1->len>0 && slice2->len>0) {
-    const cdline_t *line1 = smartlist_get(slice1->list, i1);
-    const cdline_t *line2 = smartlist_get(slice2->list, i2);
-    if (!lines_eq(line1, line2)) {
-      break;
-    }
-    i1--;
-    slice1->len--;
-    i2--;
-    slice2->len--;
-  }
+  tor_free(table);
+  return n_ids;
 }
 
-/** Like smartlist_string_pos, but uses a cdline_t, and is restricted to the
- * bounds of the slice.
- */
-STATIC int
-smartlist_slice_string_pos(const smartlist_slice_t *slice,
-                           const cdline_t *string)
+/** Helper: Mark lines <b>start</b> through <b>end</b>-1 as changed in
+ * <b>changed</b>. */
+static void
+set_changed_range(bitarray_t *changed, int start, int end)
 {
-  int end = slice->offset + slice->len;
-  for (int i = slice->offset; i < end; ++i) {
-    const cdline_t *el = smartlist_get(slice->list, i);
-    if (lines_eq(el, string)) {
-      return i;
-    }
+  for (int i = start; i < end; ++i) {
+    bitarray_set(changed, i);
   }
-  return -1;
 }
 
-/** Helper: Set all the appropriate changed booleans to true. The first slice
- * must be of length 0 or 1. All the lines of slice1 and slice2 which are not
- * present in the other slice will be set to changed in their bool array.
- * The two changed bool arrays are passed in the same order as the slices.
+/**
+ * Helper: Find the "middle snake" of the shortest edit script that turns
+ * lines <b>start1</b> through <b>end1</b>-1 of <b>ids1</b> into lines
+ * <b>start2</b> through <b>end2</b>-1 of <b>ids2</b>, as described in
+ * Myers, "An O(ND) Difference Algorithm and Its Variations" (1986).
+ *
+ * We walk the edit graph forward from the start and backward from the end at
+ * the same time, one edit at a time, until the two walks meet.  The place
+ * where they meet is on some shortest edit script, so we can split both
+ * ranges there and diff the two halves separately.  This takes O((N+M)D)
+ * time and O(N+M) space, where D is the number of lines that changed.
+ *
+ * Neither range may be empty, and they must not start or end with the same
+ * line.  On success, set *<b>split1_out</b> and *<b>split2_out</b> to the
+ * indices at which to split the ranges, and return 0.
+ *
+ * We give up and return -1 if the walks haven't met after (N+M+1)/2 edits
+ * each.  That happens exactly when the ranges have no line in common: then
+ * the shortest edit script deletes every line of one range and inserts every
+ * line of the other, and it takes N+M edits, so the walks would only meet on
+ * the very last step.  The caller doesn't need a split point in that case.
  */
-STATIC void
-set_changed(bitarray_t *changed1, bitarray_t *changed2,
-            const smartlist_slice_t *slice1, const smartlist_slice_t *slice2)
+static int
+find_middle_snake(const uint32_t *ids1, int start1, int end1,
+                  const uint32_t *ids2, int start2, int end2,
+                  int *split1_out, int *split2_out)
 {
-  int toskip = -1;
-  tor_assert(slice1->len == 0 || slice1->len == 1);
-
-  if (slice1->len == 1) {
-    const cdline_t *line_common = smartlist_get(slice1->list, slice1->offset);
-    toskip = smartlist_slice_string_pos(slice2, line_common);
-    if (toskip == -1) {
-      bitarray_set(changed1, slice1->offset);
-    }
-  }
-  int end = slice2->offset + slice2->len;
-  for (int i = slice2->offset; i < end; ++i) {
-    if (i != toskip) {
-      bitarray_set(changed2, i);
+  const uint32_t *a = ids1 + start1, *b = ids2 + start2;
+  const int n = end1 - start1, m = end2 - start2;
+  const int delta = n - m;
+  /* If delta is odd, the walks meet while we're extending the forward one;
+   * otherwise, while we're extending the backward one. */
+  const int front = (delta & 1);
+  const int max_d = (n + m + 1) / 2;
+  const int v_offset = max_d;
+  const int v_len = 2 * max_d + 2;
+  /* For each diagonal k (along which x - y = k), the furthest x reached so
+   * far, going forward from (0,0) in v1 and backward from (n,m) in v2.  We
+   * measure x in v2 from the end, so that both walks look the same. */
+  int *v1 = tor_malloc(sizeof(int) * v_len);
+  int *v2 = tor_malloc(sizeof(int) * v_len);
+  /* How far to skip at each end of the range of diagonals, once a walk has
+   * run off the edge of the graph there. */
+  int k1start = 0, k1end = 0, k2start = 0, k2end = 0;
+  int d, k1, k2, x1, x2, y1, y2, result = -1;
+
+  for (int i = 0; i < v_len; ++i)
+    v1[i] = v2[i] = -1;
+  v1[v_offset + 1] = 0;
+  v2[v_offset + 1] = 0;
+
+  for (d = 0; d < max_d; ++d) {
+    /* Extend the forward walk by one edit. */
+    for (k1 = -d + k1start; k1 <= d - k1end; k1 += 2) {
+      const int k1_offset = v_offset + k1;
+      if (k1 == -d || (k1 != d && v1[k1_offset - 1] < v1[k1_offset + 1]))
+        x1 = v1[k1_offset + 1];
+      else
+        x1 = v1[k1_offset - 1] + 1;
+      y1 = x1 - k1;
+      while (x1 < n && y1 < m && a[x1] == b[y1]) {
+        ++x1;
+        ++y1;
+      }
+      v1[k1_offset] = x1;
+      if (x1 > n) {
+        k1end += 2;
+      } else if (y1 > m) {
+        k1start += 2;
+      } else if (front) {
+        const int k2_offset = v_offset + delta - k1;
+        if (k2_offset >= 0 && k2_offset < v_len && v2[k2_offset] != -1) {
+          if (x1 >= n - v2[k2_offset]) {
+            *split1_out = start1 + x1;
+            *split2_out = start2 + y1;
+            result = 0;
+            goto done;
+          }
+        }
+      }
     }
-  }
-}
 
-/*
- * Helper: Given that slice1 has been split by half into top and bot, we want
- * to fetch the column at which to split slice2 so that we are still on track
- * to the optimal diff solution, i.e. the shortest one. We use lcs_lengths
- * since the shortest diff is just another way to say the longest common
- * subsequence.
- */
-static int
-optimal_column_to_split(const smartlist_slice_t *top,
-                        const smartlist_slice_t *bot,
-                        const smartlist_slice_t *slice2)
-{
-  int *lens_top = lcs_lengths(top, slice2, 1);
-  int *lens_bot = lcs_lengths(bot, slice2, -1);
-  int column=0, max_sum=-1;
-
-  for (int i = 0; i < slice2->len+1; ++i) {
-    int sum = lens_top[i] + lens_bot[slice2->len-i];
-    if (sum > max_sum) {
-      column = i;
-      max_sum = sum;
+    /* Extend the backward walk by one edit. */
+    for (k2 = -d + k2start; k2 <= d - k2end; k2 += 2) {
+      const int k2_offset = v_offset + k2;
+      if (k2 == -d || (k2 != d && v2[k2_offset - 1] < v2[k2_offset + 1]))
+        x2 = v2[k2_offset + 1];
+      else
+        x2 = v2[k2_offset - 1] + 1;
+      y2 = x2 - k2;
+      while (x2 < n && y2 < m && a[n - x2 - 1] == b[m - y2 - 1]) {
+        ++x2;
+        ++y2;
+      }
+      v2[k2_offset] = x2;
+      if (x2 > n) {
+        k2end += 2;
+      } else if (y2 > m) {
+        k2start += 2;
+      } else if (!front) {
+        const int k1_offset = v_offset + delta - k2;
+        if (k1_offset >= 0 && k1_offset < v_len && v1[k1_offset] != -1) {
+          x1 = v1[k1_offset];
+          y1 = v_offset + x1 - k1_offset;
+          if (x1 >= n - x2) {
+            *split1_out = start1 + x1;
+            *split2_out = start2 + y1;
+            result = 0;
+            goto done;
+          }
+        }
+      }
     }
   }
-  tor_free(lens_top);
-  tor_free(lens_bot);
 
-  return column;
+ done:
+  tor_free(v1);
+  tor_free(v2);
+  return result;
 }
 
 /**
- * Helper: Figure out what elements are new or gone on the second smartlist
- * relative to the first smartlist, and store the booleans in the bitarrays.
- * True on the first bitarray means the element is gone, true on the second
- * bitarray means it's new.
+ * Helper: Figure out which of lines <b>start1</b> through <b>end1</b>-1 of
+ * the first consensus are gone, and which of lines <b>start2</b> through
+ * <b>end2</b>-1 of the second consensus are new, given the IDs of the lines
+ * in <b>ids1</b> and <b>ids2</b>.  Set the bits for those lines in
+ * <b>changed1</b> and <b>changed2</b> respectively, and leave the others
+ * alone.  The changes we find are as few as possible.
  *
- * In its base case, either of the smartlists is of length <= 1 and we can
- * quickly see what elements are new or are gone. In the other case, we will
- * split one smartlist by half and we'll use optimal_column_to_split to find
- * the optimal column at which to split the second smartlist so that we are
- * finding the smallest diff possible.
+ * We first skip the lines that are the same at the start and end of both
+ * ranges.  If either range is then empty, every line left in the other one
+ * has changed.  Otherwise, we split both ranges at a point on a shortest
+ * edit script with find_middle_snake(), and recurse on each half.
  */
 STATIC void
-calc_changes(smartlist_slice_t *slice1,
-             smartlist_slice_t *slice2,
+calc_changes(const uint32_t *ids1, int start1, int end1,
+             const uint32_t *ids2, int start2, int end2,
              bitarray_t *changed1, bitarray_t *changed2)
 {
-  trim_slices(slice1, slice2);
-
-  if (slice1->len <= 1) {
-    set_changed(changed1, changed2, slice1, slice2);
+  int split1, split2;
 
-  } else if (slice2->len <= 1) {
-    set_changed(changed2, changed1, slice2, slice1);
+  while (start1 < end1 && start2 < end2 && ids1[start1] == ids2[start2]) {
+    ++start1;
+    ++start2;
+  }
+  while (start1 < end1 && start2 < end2 &&
+         ids1[end1 - 1] == ids2[end2 - 1]) {
+    --end1;
+    --end2;
+  }
 
-  /* Keep on splitting the slices in two. */
+  if (start1 == end1) {
+    set_changed_range(changed2, start2, end2);
+  } else if (start2 == end2) {
+    set_changed_range(changed1, start1, end1);
+  } else if (find_middle_snake(ids1, start1, end1, ids2, start2, end2,
+                               &split1, &split2) < 0) {
+    /* The ranges have no line in common, so every line changed. */
+    set_changed_range(changed1, start1, end1);
+    set_changed_range(changed2, start2, end2);
   } else {
-    smartlist_slice_t *top, *bot, *left, *right;
-
-    /* Split the first slice in half. */
-    int mid = slice1->len/2;
-    top = smartlist_slice(slice1->list, slice1->offset, slice1->offset+mid);
-    bot = smartlist_slice(slice1->list, slice1->offset+mid,
-        slice1->offset+slice1->len);
-
-    /* Split the second slice by the optimal column. */
-    int mid2 = optimal_column_to_split(top, bot, slice2);
-    left = smartlist_slice(slice2->list, slice2->offset, slice2->offset+mid2);
-    right = smartlist_slice(slice2->list, slice2->offset+mid2,
-        slice2->offset+slice2->len);
-
-    calc_changes(top, left, changed1, changed2);
-    calc_changes(bot, right, changed1, changed2);
-    tor_free(top);
-    tor_free(bot);
-    tor_free(left);
-    tor_free(right);
+    calc_changes(ids1, start1, split1, ids2, start2, split2,
+                 changed1, changed2);
+    calc_changes(ids1, split1, end1, ids2, split2, end2,
+                 changed1, changed2);
   }
 }
 
@@ -608,16 +622,17 @@ preprocess_consensus(memarea_t *area,
  * in one of the inputs, or are newly allocated lines in the provided memarea.
  *
  * This implementation is consensus-specific. To generate an ed diff for any
- * given input in quadratic time, you can replace all the code until the
- * navigation in reverse order with the following:
+ * given input, you can replace all the code until the navigation in reverse
+ * order with the following:
  *
  *   int len1 = smartlist_len(cons1);
  *   int len2 = smartlist_len(cons2);
  *   bitarray_t *changed1 = bitarray_init_zero(len1);
  *   bitarray_t *changed2 = bitarray_init_zero(len2);
- *   cons1_sl = smartlist_slice(cons1, 0, -1);
- *   cons2_sl = smartlist_slice(cons2, 0, -1);
- *   calc_changes(cons1_sl, cons2_sl, changed1, changed2);
+ *   uint32_t *ids1 = tor_calloc(len1 + 1, sizeof(uint32_t));
+ *   uint32_t *ids2 = tor_calloc(len2 + 1, sizeof(uint32_t));
+ *   consensus_intern_lines(cons1, 0, len1, cons2, 0, len2, ids1, ids2);
+ *   calc_changes(ids1, 0, len1, ids2, 0, len2, changed1, changed2);
  */
 STATIC smartlist_t *
 gen_ed_diff(const smartlist_t *cons1_orig, const smartlist_t *cons2,
@@ -641,6 +656,7 @@ gen_ed_diff(const smartlist_t *cons1_orig, const smartlist_t *cons2,
    */
   bitarray_t *changed1 = bitarray_init_zero(len1);
   bitarray_t *changed2 = bitarray_init_zero(len2);
+  uint32_t *ids1 = NULL, *ids2 = NULL;
   int i1=-1, i2=-1;
   int start1=0, start2=0;
 
@@ -648,6 +664,9 @@ gen_ed_diff(const smartlist_t *cons1_orig, const smartlist_t *cons2,
   router_id_iterator_t iter1 = ROUTER_ID_ITERATOR_INIT;
   router_id_iterator_t iter2 = ROUTER_ID_ITERATOR_INIT;
 
+  ids1 = tor_calloc(len1 + 1, sizeof(uint32_t));
+  ids2 = tor_calloc(len2 + 1, sizeof(uint32_t));
+
   /* i1 and i2 are initialized at the first line of each consensus. They never
    * reach past len1 and len2 respectively, since next_router doesn't let that
    * happen. i1 and i2 are advanced by at least one line at each iteration as
@@ -720,11 +739,11 @@ gen_ed_diff(const smartlist_t *cons1_orig, const smartlist_t *cons2,
       }
     }
 
-    /* Make slices out of these chunks (up to the common router entry) and
-     * calculate the changes for them.
-     * Error if any of the two slices are longer than 10K lines. That should
+    /* Calculate the changes for these chunks (up to the common router
+     * entry).
+     * Error if any of the two chunks are longer than 10K lines. That should
      * never happen with any pair of real consensuses. Feeding more than 10K
-     * lines to calc_changes would be very slow anyway.
+     * very different lines to calc_changes would be slow anyway.
      */
 #define MAX_LINE_COUNT (10000)
     if (i1-start1 > MAX_LINE_COUNT || i2-start2 > MAX_LINE_COUNT) {
@@ -733,11 +752,22 @@ gen_ed_diff(const smartlist_t *cons1_orig, const smartlist_t *cons2,
       goto error_cleanup;
     }
 
-    smartlist_slice_t *cons1_sl = smartlist_slice(cons1, start1, i1);
-    smartlist_slice_t *cons2_sl = smartlist_slice(cons2, start2, i2);
-    calc_changes(cons1_sl, cons2_sl, changed1, changed2);
-    tor_free(cons1_sl);
-    tor_free(cons2_sl);
+    /* Most lines don't change, so skip the common lines at each end before
+     * we bother hashing anything. */
+    int end1 = i1, end2 = i2;
+    while (start1 < end1 && start2 < end2 &&
+           lines_eq(smartlist_get(cons1, start1),
+                    smartlist_get(cons2, start2))) {
+      ++start1, ++start2;
+    }
+    while (start1 < end1 && start2 < end2 &&
+           lines_eq(smartlist_get(cons1, end1 - 1),
+                    smartlist_get(cons2, end2 - 1))) {
+      --end1, --end2;
+    }
+    consensus_intern_lines(cons1, start1, end1, cons2, start2, end2,
+                           ids1, ids2);
+    calc_changes(ids1, start1, end1, ids2, start2, end2, changed1, changed2);
     start1 = i1, start2 = i2;
   }
 
@@ -812,6 +842,8 @@ gen_ed_diff(const smartlist_t *cons1_orig, const smartlist_t *cons2,
   smartlist_free(cons1);
   bitarray_free(changed1);
   bitarray_free(changed2);
+  tor_free(ids1);
+  tor_free(ids2);
 
   return result;
 
@@ -820,6 +852,8 @@ gen_ed_diff(const smartlist_t *cons1_orig, const smartlist_t *cons2,
   smartlist_free(cons1);
   bitarray_free(changed1);
   bitarray_free(changed2);
+  tor_free(ids1);
+  tor_free(ids2);
 
   smartlist_free(result);
 
@@ -1332,32 +1366,79 @@ consensus_join_lines(const smartlist_t *inp)
   return result;
 }
 
-/** Given two consensus documents, try to compute a diff between them.  On
- * success, retun a newly allocated string containing that diff.  On failure,
- * return NULL. */
+/** A consensus that we're going to compute diffs to, split into lines and
+ * digested ahead of time.  We make one of these for the newest consensus,
+ * and use it for the diffs from every older one.  It's never modified after
+ * it's built, so any number of threads can use it at once. */
+struct consensus_diff_target_t {
+  /** Holds the cdline_t objects in <b>lines</b>. */
+  memarea_t *area;
+  /** The lines of the consensus.  They point into the string that the
+   * target was made from. */
+  smartlist_t *lines;
+  /** The digest of the consensus. */
+  consensus_digest_t digests;
+};
+
+/** Split the consensus document <b>cons</b>, of length <b>cons_len</b>, into
+ * lines and digest it, so that we can compute diffs to it.  Return a newly
+ * allocated consensus_diff_target_t on success, or NULL on failure.  The
+ * caller must keep <b>cons</b> unchanged until the target is freed. */
+consensus_diff_target_t *
+consensus_diff_target_new(const char *cons, size_t cons_len)
+{
+  consensus_diff_target_t *target = tor_malloc_zero(sizeof(*target));
+
+  if (BUG(consensus_compute_digest(cons, cons_len, &target->digests) < 0))
+    goto err; // LCOV_EXCL_LINE
+
+  target->area = memarea_new();
+  target->lines = smartlist_new();
+  if (consensus_split_lines(target->lines, cons, cons_len, target->area) < 0)
+    goto err;
+
+  return target;
+ err:
+  consensus_diff_target_free(target);
+  return NULL;
+}
+
+/** Release all storage held in <b>target</b>. */
+void
+consensus_diff_target_free_(consensus_diff_target_t *target)
+{
+  if (!target)
+    return;
+  smartlist_free(target->lines);
+  if (target->area)
+    memarea_drop_all(target->area);
+  tor_free(target);
+}
+
+/** Given a consensus document <b>cons1</b> and a consensus in <b>target</b>,
+ * try to compute a diff between them.  On success, return a newly allocated
+ * string containing that diff.  On failure, return NULL.  <b>target</b> is
+ * not modified. */
 char *
-consensus_diff_generate(const char *cons1, size_t cons1len,
-                        const char *cons2, size_t cons2len)
+consensus_diff_generate_to_target(const char *cons1, size_t cons1len,
+                                  const consensus_diff_target_t *target)
 {
-  consensus_digest_t d1, d2;
-  smartlist_t *lines1 = NULL, *lines2 = NULL, *result_lines = NULL;
-  int r1, r2;
+  consensus_digest_t d1;
+  smartlist_t *lines1 = NULL, *result_lines = NULL;
   char *result = NULL;
 
-  r1 = consensus_compute_digest_as_signed(cons1, cons1len, &d1);
-  r2 = consensus_compute_digest(cons2, cons2len, &d2);
-  if (BUG(r1 < 0 || r2 < 0))
+  tor_assert(target);
+
+  if (BUG(consensus_compute_digest_as_signed(cons1, cons1len, &d1) < 0))
     return NULL; // LCOV_EXCL_LINE
 
   memarea_t *area = memarea_new();
   lines1 = smartlist_new();
-  lines2 = smartlist_new();
   if (consensus_split_lines(lines1, cons1, cons1len, area) < 0)
     goto done;
-  if (consensus_split_lines(lines2, cons2, cons2len, area) < 0)
-    goto done;
 
-  result_lines = consdiff_gen_diff(lines1, lines2, &d1, &d2, area);
+  result_lines = consdiff_gen_diff(lines1, target->lines,
+                                   &d1, &target->digests, area);
 
  done:
   if (result_lines) {
@@ -1367,7 +1448,24 @@ consensus_diff_generate(const char *cons1, size_t cons1len,
 
   memarea_drop_all(area);
   smartlist_free(lines1);
-  smartlist_free(lines2);
+
+  return result;
+}
+
+/** Given two consensus documents, try to compute a diff between them.  On
+ * success, retun a newly allocated string containing that diff.  On failure,
+ * return NULL. */
+char *
+consensus_diff_generate(const char *cons1, size_t cons1len,
+                        const char *cons2, size_t cons2len)
+{
+  consensus_diff_target_t *target;
+  char *result = NULL;
+
+  target = consensus_diff_target_new(cons2, cons2len);
+  if (target)
+    result = consensus_diff_generate_to_target(cons1, cons1len, target);
+  consensus_diff_target_free(target);
 
   return result;
 }
@@ -7,8 +7,17 @@
 
 #include "core/or/or.h"
 
+typedef struct consensus_diff_target_t consensus_diff_target_t;
+
 char *consensus_diff_generate(const char *cons1, size_t cons1len,
                               const char *cons2, size_t cons2len);
+consensus_diff_target_t *consensus_diff_target_new(const char *cons,
+                                                   size_t cons_len);
+void consensus_diff_target_free_(consensus_diff_target_t *target);
+#define consensus_diff_target_free(target) \
+  FREE_AND_NULL(consensus_diff_target_t, consensus_diff_target_free_, (target))
+char *consensus_diff_generate_to_target(const char *cons1, size_t cons1len,
+                                  const consensus_diff_target_t *target);
 char *consensus_diff_apply(const char *consensus, size_t consensus_len,
                            const char *diff, size_t diff_len);
 
@@ -43,41 +52,24 @@ STATIC int consdiff_get_digests(const smartlist_t *diff,
                                 char *digest1_out,
                                 char *digest2_out);
 
-/** Data structure to define a slice of a smarltist. */
-typedef struct smartlist_slice_t {
-  /**
-   * Smartlist that this slice is made from.
-   * References the whole original smartlist that the slice was made out of.
-   * */
-  const smartlist_t *list;
-  /** Starting position of the slice in the smartlist. */
-  int offset;
-  /** Length of the slice, i.e. the number of elements it holds. */
-  int len;
-} smartlist_slice_t;
 STATIC smartlist_t *gen_ed_diff(const smartlist_t *cons1,
                                 const smartlist_t *cons2,
                                 struct memarea_t *area);
 STATIC smartlist_t *apply_ed_diff(const smartlist_t *cons1,
                                   const smartlist_t *diff,
                                   int start_line);
-STATIC void calc_changes(smartlist_slice_t *slice1, smartlist_slice_t *slice2,
+STATIC uint32_t consensus_intern_lines(const smartlist_t *cons1,
+                                       int start1, int end1,
+                                       const smartlist_t *cons2,
+                                       int start2, int end2,
+                                       uint32_t *ids1, uint32_t *ids2);
+STATIC void calc_changes(const uint32_t *ids1, int start1, int end1,
+                         const uint32_t *ids2, int start2, int end2,
                          bitarray_t *changed1, bitarray_t *changed2);
-STATIC smartlist_slice_t *smartlist_slice(const smartlist_t *list,
-                                          int start, int end);
 STATIC int next_router(const smartlist_t *cons, int cur);
-STATIC int *lcs_lengths(const smartlist_slice_t *slice1,
-                        const smartlist_slice_t *slice2,
-                        int direction);
-STATIC void trim_slices(smartlist_slice_t *slice1, smartlist_slice_t *slice2);
 STATIC int base64cmp(const cdline_t *hash1, const cdline_t *hash2);
 STATIC int get_id_hash(const cdline_t *line, cdline_t *hash_out);
 STATIC int is_valid_router_entry(const cdline_t *line);
-STATIC int smartlist_slice_string_pos(const smartlist_slice_t *slice,
-                                      const cdline_t *string);
-STATIC void set_changed(bitarray_t *changed1, bitarray_t *changed2,
-                        const smartlist_slice_t *slice1,
-                        const smartlist_slice_t *slice2);
 STATIC int consensus_split_lines(smartlist_t *out,
                                  const char *s, size_t len,
                                  struct memarea_t *area);
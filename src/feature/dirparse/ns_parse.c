@@ -1054,54 +1054,22 @@ extract_shared_random_srvs(networkstatus_t *ns, smartlist_t *tokens)
   }
 }
 
-/** Parse a v3 networkstatus vote, opinion, or consensus (depending on
- * ns_type), from <b>s</b>, and return the result.  Return NULL on failure. */
-networkstatus_t *
-networkstatus_parse_vote_from_string(const char *s,
-                                     size_t s_len,
-                                     const char **eos_out,
-                                     networkstatus_type_t ns_type)
+/** Helper: fill in the fields of <b>ns</b> from <b>tokens</b>, the
+ * tokenized header of a networkstatus document of type <b>ns_type</b>,
+ * which runs from <b>s</b> to <b>end_of_header</b>.  For votes, the
+ * digests in <b>ns</b> must already be set.  Return 0 on success, -1 on
+ * failure. */
+static int
+networkstatus_parse_header(networkstatus_t *ns, smartlist_t *tokens,
+                           networkstatus_type_t ns_type,
+                           const char *s, const char *end_of_header)
 {
-  smartlist_t *tokens = smartlist_new();
-  smartlist_t *rs_tokens = NULL, *footer_tokens = NULL;
   networkstatus_voter_info_t *voter = NULL;
-  networkstatus_t *ns = NULL;
-  common_digests_t ns_digests;
-  uint8_t sha3_as_signed[DIGEST256_LEN];
-  const char *cert, *end_of_header, *end_of_footer, *s_dup = s;
   directory_token_t *tok;
+  const char *cert;
   struct in_addr in;
-  int i, inorder, n_signatures = 0;
-  memarea_t *area = NULL, *rs_area = NULL;
-  consensus_flavor_t flav = FLAV_NS;
-  char *last_kwd=NULL;
-  const char *eos = s + s_len;
-
-  tor_assert(s);
-
-  if (eos_out)
-    *eos_out = NULL;
-
-  if (router_get_networkstatus_v3_hashes(s, s_len, &ns_digests) ||
-      router_get_networkstatus_v3_sha3_as_signed(sha3_as_signed,
-                                                 s, s_len)<0) {
-    log_warn(LD_DIR, "Unable to compute digest of network-status");
-    goto err;
-  }
-
-  area = memarea_new();
-  end_of_header = find_start_of_next_routerstatus(s, eos);
-  if (tokenize_string(area, s, end_of_header, tokens,
-                      (ns_type == NS_TYPE_CONSENSUS) ?
-                      networkstatus_consensus_token_table :
-                      networkstatus_token_table, 0)) {
-    log_warn(LD_DIR, "Error tokenizing network-status header");
-    goto err;
-  }
-
-  ns = tor_malloc_zero(sizeof(networkstatus_t));
-  memcpy(&ns->digests, &ns_digests, sizeof(ns_digests));
-  memcpy(&ns->digest_sha3_as_signed, sha3_as_signed, sizeof(sha3_as_signed));
+  int i, inorder, r = -1;
+  char *last_kwd = NULL;
 
   tok = find_by_keyword(tokens, K_NETWORK_STATUS_VERSION);
   tor_assert(tok);
@@ -1112,9 +1080,9 @@ networkstatus_parse_vote_from_string(const char *s,
                escaped(tok->args[1]));
       goto err;
     }
-    ns->flavor = flav = flavor;
+    ns->flavor = flavor;
   }
-  if (flav != FLAV_NS && ns_type != NS_TYPE_CONSENSUS) {
+  if (ns->flavor != FLAV_NS && ns_type != NS_TYPE_CONSENSUS) {
     log_warn(LD_DIR, "Flavor found on non-consensus networkstatus.");
     goto err;
   }
@@ -1327,7 +1295,8 @@ networkstatus_parse_vote_from_string(const char *s,
       voter = tor_malloc_zero(sizeof(networkstatus_voter_info_t));
       voter->sigs = smartlist_new();
       if (ns->type != NS_TYPE_CONSENSUS)
-        memcpy(voter->vote_digest, ns_digests.d[DIGEST_SHA1], DIGEST_LEN);
+        memcpy(voter->vote_digest, ns->digests.d[DIGEST_SHA1],
+               DIGEST_LEN);
 
       voter->nickname = tor_strdup(tok->args[0]);
       if (strlen(tok->args[1]) != HEX_DIGEST_LEN ||
@@ -1430,68 +1399,39 @@ networkstatus_parse_vote_from_string(const char *s,
     extract_shared_random_srvs(ns, tokens);
   }
 
-  /* Parse routerstatus lines. */
-  rs_tokens = smartlist_new();
-  rs_area = memarea_new();
-  s = end_of_header;
-  ns->routerstatus_list = smartlist_new();
-
-  while (eos - s >= 2 && fast_memeq(s, "r ", 2)) {
-    if (ns->type != NS_TYPE_CONSENSUS) {
-      vote_routerstatus_t *rs = tor_malloc_zero(sizeof(vote_routerstatus_t));
-      if (routerstatus_parse_entry_from_string(rs_area, &s, eos, rs_tokens, ns,
-                                               rs, 0, 0)) {
-        smartlist_add(ns->routerstatus_list, rs);
-      } else {
-        vote_routerstatus_free(rs);
-      }
-    } else {
-      routerstatus_t *rs;
-      if ((rs = routerstatus_parse_entry_from_string(rs_area, &s, eos,
-                                                     rs_tokens,
-                                                     NULL, NULL,
-                                                     ns->consensus_method,
-                                                     flav))) {
-        /* Use exponential-backoff scheduling when downloading microdescs */
-        smartlist_add(ns->routerstatus_list, rs);
-      }
-    }
-  }
-  for (i = 1; i < smartlist_len(ns->routerstatus_list); ++i) {
-    routerstatus_t *rs1, *rs2;
-    if (ns->type != NS_TYPE_CONSENSUS) {
-      vote_routerstatus_t *a = smartlist_get(ns->routerstatus_list, i-1);
-      vote_routerstatus_t *b = smartlist_get(ns->routerstatus_list, i);
-      rs1 = &a->status; rs2 = &b->status;
-    } else {
-      rs1 = smartlist_get(ns->routerstatus_list, i-1);
-      rs2 = smartlist_get(ns->routerstatus_list, i);
-    }
-    if (fast_memcmp(rs1->identity_digest, rs2->identity_digest, DIGEST_LEN)
-        >= 0) {
-      log_warn(LD_DIR, "Networkstatus entries not sorted by identity digest");
-      goto err;
+  r = 0;
+ err:
+  if (voter) {
+    if (voter->sigs) {
+      SMARTLIST_FOREACH(voter->sigs, document_signature_t *, sig,
+                        document_signature_free(sig));
+      smartlist_free(voter->sigs);
     }
+    tor_free(voter->nickname);
+    tor_free(voter->address);
+    tor_free(voter->contact);
+    tor_free(voter);
   }
-  if (ns_type != NS_TYPE_CONSENSUS) {
-    digest256map_t *ed_id_map = digest256map_new();
-    SMARTLIST_FOREACH_BEGIN(ns->routerstatus_list, vote_routerstatus_t *,
-                            vrs) {
-      if (! vrs->has_ed25519_listing ||
-          tor_mem_is_zero((const char *)vrs->ed25519_id, DIGEST256_LEN))
-        continue;
-      if (digest256map_get(ed_id_map, vrs->ed25519_id) != NULL) {
-        log_warn(LD_DIR, "Vote networkstatus ed25519 identities were not "
-                 "unique");
-        digest256map_free(ed_id_map, NULL);
-        goto err;
-      }
-      digest256map_set(ed_id_map, vrs->ed25519_id, (void*)1);
-    } SMARTLIST_FOREACH_END(vrs);
-    digest256map_free(ed_id_map, NULL);
-  }
+  tor_free(last_kwd);
+  return r;
+}
+
+/** Helper: parse the footer of the networkstatus document <b>ns</b>, which
+ * starts at <b>s</b>, and which ends at the start of the next document or at
+ * <b>eos</b>.  Allocate its memory from <b>area</b>.  Record its weights and
+ * signatures in <b>ns</b>, checking the signature if it is a vote, and set
+ * *<b>end_of_footer_out</b> to the end of the footer.  Return 0 on success,
+ * -1 on failure. */
+static int
+networkstatus_parse_footer(networkstatus_t *ns, memarea_t *area,
+                           const char *s, const char *eos,
+                           const char **end_of_footer_out)
+{
+  smartlist_t *footer_tokens = NULL;
+  directory_token_t *tok;
+  const char *end_of_footer;
+  int i, n_signatures = 0, r = -1;
 
-  /* Parse footer; check signature. */
   footer_tokens = smartlist_new();
   if ((end_of_footer = tor_memstr(s, eos-s, "\nnetwork-status-version ")))
     ++end_of_footer;
@@ -1625,7 +1565,7 @@ networkstatus_parse_vote_from_string(const char *s,
     }
 
     if (ns->type != NS_TYPE_CONSENSUS) {
-      if (check_signature_token(ns_digests.d[DIGEST_SHA1], DIGEST_LEN,
+      if (check_signature_token(ns->digests.d[DIGEST_SHA1], DIGEST_LEN,
                                 tok, ns->cert->signing_key, 0,
                                 "network-status document")) {
         tor_free(sig);
@@ -1654,6 +1594,130 @@ networkstatus_parse_vote_from_string(const char *s,
     goto err;
   }
 
+  *end_of_footer_out = end_of_footer;
+  r = 0;
+ err:
+  if (footer_tokens) {
+    SMARTLIST_FOREACH(footer_tokens, directory_token_t *, t, token_clear(t));
+    smartlist_free(footer_tokens);
+  }
+  return r;
+}
+
+/** Parse a v3 networkstatus vote, opinion, or consensus (depending on
+ * ns_type), from <b>s</b>, and return the result.  Return NULL on failure. */
+networkstatus_t *
+networkstatus_parse_vote_from_string(const char *s,
+                                     size_t s_len,
+                                     const char **eos_out,
+                                     networkstatus_type_t ns_type)
+{
+  smartlist_t *tokens = smartlist_new();
+  smartlist_t *rs_tokens = NULL;
+  networkstatus_t *ns = NULL;
+  common_digests_t ns_digests;
+  uint8_t sha3_as_signed[DIGEST256_LEN];
+  const char *end_of_header, *end_of_footer, *s_dup = s;
+  int i;
+  memarea_t *area = NULL, *rs_area = NULL;
+  consensus_flavor_t flav = FLAV_NS;
+  const char *eos = s + s_len;
+
+  tor_assert(s);
+
+  if (eos_out)
+    *eos_out = NULL;
+
+  if (router_get_networkstatus_v3_hashes(s, s_len, &ns_digests) ||
+      router_get_networkstatus_v3_sha3_as_signed(sha3_as_signed,
+                                                 s, s_len)<0) {
+    log_warn(LD_DIR, "Unable to compute digest of network-status");
+    goto err;
+  }
+
+  area = memarea_new();
+  end_of_header = find_start_of_next_routerstatus(s, eos);
+  if (tokenize_string(area, s, end_of_header, tokens,
+                      (ns_type == NS_TYPE_CONSENSUS) ?
+                      networkstatus_consensus_token_table :
+                      networkstatus_token_table, 0)) {
+    log_warn(LD_DIR, "Error tokenizing network-status header");
+    goto err;
+  }
+
+  ns = tor_malloc_zero(sizeof(networkstatus_t));
+  memcpy(&ns->digests, &ns_digests, sizeof(ns_digests));
+  memcpy(&ns->digest_sha3_as_signed, sha3_as_signed, sizeof(sha3_as_signed));
+
+  if (networkstatus_parse_header(ns, tokens, ns_type,
+                                 s, end_of_header) < 0)
+    goto err;
+  flav = ns->flavor;
+
+  /* Parse routerstatus lines. */
+  rs_tokens = smartlist_new();
+  rs_area = memarea_new();
+  s = end_of_header;
+  ns->routerstatus_list = smartlist_new();
+
+  while (eos - s >= 2 && fast_memeq(s, "r ", 2)) {
+    if (ns->type != NS_TYPE_CONSENSUS) {
+      vote_routerstatus_t *rs = tor_malloc_zero(sizeof(vote_routerstatus_t));
+      if (routerstatus_parse_entry_from_string(rs_area, &s, eos, rs_tokens, ns,
+                                               rs, 0, 0)) {
+        smartlist_add(ns->routerstatus_list, rs);
+      } else {
+        vote_routerstatus_free(rs);
+      }
+    } else {
+      routerstatus_t *rs;
+      if ((rs = routerstatus_parse_entry_from_string(rs_area, &s, eos,
+                                                     rs_tokens,
+                                                     NULL, NULL,
+                                                     ns->consensus_method,
+                                                     flav))) {
+        /* Use exponential-backoff scheduling when downloading microdescs */
+        smartlist_add(ns->routerstatus_list, rs);
+      }
+    }
+  }
+  for (i = 1; i < smartlist_len(ns->routerstatus_list); ++i) {
+    routerstatus_t *rs1, *rs2;
+    if (ns->type != NS_TYPE_CONSENSUS) {
+      vote_routerstatus_t *a = smartlist_get(ns->routerstatus_list, i-1);
+      vote_routerstatus_t *b = smartlist_get(ns->routerstatus_list, i);
+      rs1 = &a->status; rs2 = &b->status;
+    } else {
+      rs1 = smartlist_get(ns->routerstatus_list, i-1);
+      rs2 = smartlist_get(ns->routerstatus_list, i);
+    }
+    if (fast_memcmp(rs1->identity_digest, rs2->identity_digest, DIGEST_LEN)
+        >= 0) {
+      log_warn(LD_DIR, "Networkstatus entries not sorted by identity digest");
+      goto err;
+    }
+  }
+  if (ns_type != NS_TYPE_CONSENSUS) {
+    digest256map_t *ed_id_map = digest256map_new();
+    SMARTLIST_FOREACH_BEGIN(ns->routerstatus_list, vote_routerstatus_t *,
+                            vrs) {
+      if (! vrs->has_ed25519_listing ||
+          tor_mem_is_zero((const char *)vrs->ed25519_id, DIGEST256_LEN))
+        continue;
+      if (digest256map_get(ed_id_map, vrs->ed25519_id) != NULL) {
+        log_warn(LD_DIR, "Vote networkstatus ed25519 identities were not "
+                 "unique");
+        digest256map_free(ed_id_map, NULL);
+        goto err;
+      }
+      digest256map_set(ed_id_map, vrs->ed25519_id, (void*)1);
+    } SMARTLIST_FOREACH_END(vrs);
+    digest256map_free(ed_id_map, NULL);
+  }
+
+  if (networkstatus_parse_footer(ns, area, s, eos, &end_of_footer) < 0)
+    goto err;
+
   if (eos_out)
     *eos_out = end_of_footer;
 
@@ -1667,32 +1731,347 @@ networkstatus_parse_vote_from_string(const char *s,
     SMARTLIST_FOREACH(tokens, directory_token_t *, t, token_clear(t));
     smartlist_free(tokens);
   }
-  if (voter) {
-    if (voter->sigs) {
-      SMARTLIST_FOREACH(voter->sigs, document_signature_t *, sig,
-                        document_signature_free(sig));
-      smartlist_free(voter->sigs);
-    }
-    tor_free(voter->nickname);
-    tor_free(voter->address);
-    tor_free(voter->contact);
-    tor_free(voter);
-  }
   if (rs_tokens) {
     SMARTLIST_FOREACH(rs_tokens, directory_token_t *, t, token_clear(t));
     smartlist_free(rs_tokens);
   }
-  if (footer_tokens) {
-    SMARTLIST_FOREACH(footer_tokens, directory_token_t *, t, token_clear(t));
-    smartlist_free(footer_tokens);
-  }
   if (area) {
     DUMP_AREA(area, "v3 networkstatus");
     memarea_drop_all(area);
   }
   if (rs_area)
     memarea_drop_all(rs_area);
-  tor_free(last_kwd);
 
   return ns;
 }
+
+/** How much input do we take into a stream's buffer at a time? */
+#define NS_PARSE_STREAM_WINDOW 16384
+/** What's the most input that we'll buffer while waiting for the end of a
+ * header, a routerstatus entry, or a footer? Real ones are far smaller. */
+#define NS_PARSE_STREAM_MAX_PENDING (1<<18)
+
+/** Possible states for an ns_parse_stream_t. */
+typedef enum {
+  /** Waiting for the end of the header. */
+  NS_PARSE_STREAM_HEADER,
+  /** Parsing routerstatus entries, or waiting for the end of the footer. */
+  NS_PARSE_STREAM_ENTRIES,
+  /** We hit an error; nothing more to do. */
+  NS_PARSE_STREAM_FAILED,
+} ns_parse_stream_state_t;
+
+/** State for parsing a consensus incrementally, as its bytes arrive.
+ *
+ * Unlike networkstatus_parse_vote_from_string(), we never need to hold the
+ * whole document: we keep only the part of the input that we haven't
+ * parsed yet, which is at most one header, routerstatus entry, or footer,
+ * plus one window of new input.  We compute the digests of the signed part
+ * of the document as we go. */
+struct ns_parse_stream_t {
+  /** Bytes that we've been given but haven't parsed yet. */
+  char *buf;
+  /** Number of bytes used in <b>buf</b>. */
+  size_t buf_len;
+  /** Number of bytes allocated for <b>buf</b>. */
+  size_t buf_alloc;
+  /** Largest value that <b>buf_len</b> has had. */
+  size_t max_buf_len;
+  /** What are we waiting for? */
+  ns_parse_stream_state_t state;
+  /** The consensus we're building; NULL until we've parsed its header. */
+  networkstatus_t *ns;
+  /** Running digests of the signed part of the document. */
+  crypto_digest_t *digest_sha1;
+  crypto_digest_t *digest_sha256;
+  crypto_digest_t *digest_sha3;
+  /** Memory area and token list for whatever we're parsing right now. */
+  memarea_t *area;
+  smartlist_t *tokens;
+  /** Number of routerstatus entries that we've parsed so far. */
+  int n_entries;
+  /** Identity digest of the last routerstatus entry that we parsed. */
+  char last_identity[DIGEST_LEN];
+  /** Function to call with each routerstatus, or NULL to keep them all in
+   * ns-\>routerstatus_list. */
+  ns_parse_stream_cb_t cb;
+  /** Argument to pass to <b>cb</b>. */
+  void *cb_arg;
+};
+
+/** Return a new ns_parse_stream_t to parse a consensus of any flavor.
+ *
+ * If <b>cb</b> is set, then we call it with each routerstatus entry as soon
+ * as we parse it, along with the (partly parsed) consensus and
+ * <b>cb_arg</b>.  The callback takes ownership of the routerstatus, and
+ * returns 0 on success or -1 to stop parsing.  In that case, the
+ * routerstatus_list of the consensus that we return will be empty.  If
+ * <b>cb</b> is NULL, we keep the entries in routerstatus_list as usual. */
+ns_parse_stream_t *
+ns_parse_stream_new(ns_parse_stream_cb_t cb, void *cb_arg)
+{
+  ns_parse_stream_t *st = tor_malloc_zero(sizeof(ns_parse_stream_t));
+  st->state = NS_PARSE_STREAM_HEADER;
+  st->digest_sha1 = crypto_digest_new();
+  st->digest_sha256 = crypto_digest256_new(DIGEST_SHA256);
+  st->digest_sha3 = crypto_digest256_new(DIGEST_SHA3_256);
+  st->area = memarea_new();
+  st->tokens = smartlist_new();
+  st->cb = cb;
+  st->cb_arg = cb_arg;
+  return st;
+}
+
+/** Release all storage held by <b>st</b>. */
+void
+ns_parse_stream_free_(ns_parse_stream_t *st)
+{
+  if (!st)
+    return;
+  tor_free(st->buf);
+  networkstatus_vote_free(st->ns);
+  crypto_digest_free(st->digest_sha1);
+  crypto_digest_free(st->digest_sha256);
+  crypto_digest_free(st->digest_sha3);
+  SMARTLIST_FOREACH(st->tokens, directory_token_t *, t, token_clear(t));
+  smartlist_free(st->tokens);
+  memarea_drop_all(st->area);
+  tor_free(st);
+}
+
+/** Add the <b>len</b> bytes at <b>data</b> to the signed-part digests of
+ * <b>st</b>. */
+static void
+ns_parse_stream_digest(ns_parse_stream_t *st, const char *data, size_t len)
+{
+  crypto_digest_add_bytes(st->digest_sha1, data, len);
+  crypto_digest_add_bytes(st->digest_sha256, data, len);
+  crypto_digest_add_bytes(st->digest_sha3, data, len);
+}
+
+/** Remove the first <b>n</b> bytes from the buffer of <b>st</b>. */
+static void
+ns_parse_stream_consume(ns_parse_stream_t *st, size_t n)
+{
+  tor_assert(n <= st->buf_len);
+  memmove(st->buf, st->buf + n, st->buf_len - n);
+  st->buf_len -= n;
+}
+
+/** Helper: release the tokens and memory that <b>st</b> used for the item
+ * it just parsed. */
+static void
+ns_parse_stream_clear_tokens(ns_parse_stream_t *st)
+{
+  SMARTLIST_FOREACH(st->tokens, directory_token_t *, t, token_clear(t));
+  smartlist_clear(st->tokens);
+  memarea_clear(st->area);
+}
+
+/** Helper: if the buffer of <b>st</b> holds a complete header, parse it.
+ * If <b>finishing</b> is true, there's no more input coming.  Return 0 if
+ * we parsed the header or need more input, and -1 on error. */
+static int
+ns_parse_stream_process_header(ns_parse_stream_t *st, int finishing)
+{
+  const char *eob = st->buf + st->buf_len;
+  const char *end_of_header, *start;
+  const char start_str[] = "network-status-version";
+
+  end_of_header = find_start_of_next_routerstatus(st->buf, eob);
+  if (end_of_header == eob) {
+    if (!finishing)
+      return 0;
+    log_warn(LD_DIR, "Network-status ended inside its header.");
+    return -1;
+  }
+
+  /* The signed part of the document starts here; see
+   * router_get_networkstatus_v3_signed_boundaries(). */
+  start = tor_memstr(st->buf, end_of_header - st->buf, start_str);
+  if (!start || (start != st->buf && start[-1] != '\n')) {
+    log_warn(LD_DIR, "Couldn't find the start of the network-status.");
+    return -1;
+  }
+
+  if (tokenize_string(st->area, st->buf, end_of_header, st->tokens,
+                      networkstatus_consensus_token_table, 0)) {
+    log_warn(LD_DIR, "Error tokenizing network-status header");
+    return -1;
+  }
+  st->ns = tor_malloc_zero(sizeof(networkstatus_t));
+  st->ns->routerstatus_list = smartlist_new();
+  if (networkstatus_parse_header(st->ns, st->tokens, NS_TYPE_CONSENSUS,
+                                 st->buf, end_of_header) < 0)
+    return -1;
+  ns_parse_stream_clear_tokens(st);
+
+  ns_parse_stream_digest(st, start, end_of_header - start);
+  ns_parse_stream_consume(st, end_of_header - st->buf);
+  st->state = NS_PARSE_STREAM_ENTRIES;
+  return 0;
+}
+
+/** Helper: parse every complete routerstatus entry at the start of the
+ * buffer of <b>st</b>.  If <b>finishing</b> is true, there's no more input
+ * coming.  Return 0 on success and -1 on error. */
+static int
+ns_parse_stream_process_entries(ns_parse_stream_t *st, int finishing)
+{
+  networkstatus_t *ns = st->ns;
+
+  while (st->buf_len >= 2 && fast_memeq(st->buf, "r ", 2)) {
+    const char *eob = st->buf + st->buf_len;
+    const char *end = find_start_of_next_routerstatus(st->buf, eob);
+    const char *s = st->buf;
+    routerstatus_t *rs;
+
+    if (end == eob && !finishing)
+      break;
+
+    rs = routerstatus_parse_entry_from_string(st->area, &s, end, st->tokens,
+                                              NULL, NULL,
+                                              ns->consensus_method,
+                                              ns->flavor);
+    ns_parse_stream_digest(st, st->buf, end - st->buf);
+    ns_parse_stream_consume(st, end - st->buf);
+    if (!rs)
+      continue;
+
+    if (st->n_entries &&
+        fast_memcmp(st->last_identity, rs->identity_digest, DIGEST_LEN)
+        >= 0) {
+      log_warn(LD_DIR, "Networkstatus entries not sorted by identity digest");
+      routerstatus_free(rs);
+      return -1;
+    }
+    memcpy(st->last_identity, rs->identity_digest, DIGEST_LEN);
+    ++st->n_entries;
+
+    if (st->cb) {
+      if (st->cb(ns, rs, st->cb_arg) < 0)
+        return -1;
+    } else {
+      smartlist_add(ns->routerstatus_list, rs);
+    }
+  }
+  return 0;
+}
+
+/** Helper: parse whatever we can from the buffer of <b>st</b>.  Return 0
+ * on success and -1 on error. */
+static int
+ns_parse_stream_process(ns_parse_stream_t *st, int finishing)
+{
+  if (st->state == NS_PARSE_STREAM_HEADER &&
+      ns_parse_stream_process_header(st, finishing) < 0)
+    goto err;
+  if (st->state == NS_PARSE_STREAM_ENTRIES &&
+      ns_parse_stream_process_entries(st, finishing) < 0)
+    goto err;
+  if (st->buf_len > NS_PARSE_STREAM_MAX_PENDING) {
+    log_warn(LD_DIR, "Network-status has an item over %d bytes long.",
+             NS_PARSE_STREAM_MAX_PENDING);
+    goto err;
+  }
+  return 0;
+ err:
+  st->state = NS_PARSE_STREAM_FAILED;
+  return -1;
+}
+
+/** Give the next <b>len</b> bytes of the consensus at <b>data</b> to
+ * <b>st</b>, and parse as much of it as we can.  Return 0 on success, and -1
+ * if the consensus is invalid (or the callback asked us to stop). */
+int
+ns_parse_stream_add(ns_parse_stream_t *st, const char *data, size_t len)
+{
+  tor_assert(st);
+  tor_assert(data || !len);
+
+  while (len) {
+    size_t n = MIN(len, NS_PARSE_STREAM_WINDOW);
+    if (st->state == NS_PARSE_STREAM_FAILED)
+      return -1;
+    if (st->buf_len + n > st->buf_alloc) {
+      st->buf_alloc = st->buf_len + NS_PARSE_STREAM_WINDOW;
+      st->buf = tor_realloc(st->buf, st->buf_alloc);
+    }
+    memcpy(st->buf + st->buf_len, data, n);
+    st->buf_len += n;
+    st->max_buf_len = MAX(st->max_buf_len, st->buf_len);
+    data += n;
+    len -= n;
+
+    if (ns_parse_stream_process(st, 0) < 0)
+      return -1;
+  }
+  return st->state == NS_PARSE_STREAM_FAILED ? -1 : 0;
+}
+
+/** Tell <b>st</b> that there is no more input, and parse the rest of the
+ * consensus.  On success, return the consensus, with its digests set so
+ * that networkstatus_check_consensus_signature() can check it.  Return
+ * NULL on failure.  Either way, the caller must still free <b>st</b>. */
+networkstatus_t *
+ns_parse_stream_finish(ns_parse_stream_t *st)
+{
+  const char sig_str[] = "directory-signature";
+  const char *eob, *end_of_signed, *end_of_footer;
+  networkstatus_t *ns;
+
+  tor_assert(st);
+  if (st->state == NS_PARSE_STREAM_FAILED ||
+      ns_parse_stream_process(st, 1) < 0)
+    return NULL;
+
+  /* All that's left is the footer. The signed part of the document goes
+   * through the first space after the first "directory-signature". The
+   * newline before it may already be digested, if it ended the last item. */
+  eob = st->buf + st->buf_len;
+  if (st->buf_len >= strlen(sig_str) &&
+      fast_memeq(st->buf, sig_str, strlen(sig_str))) {
+    end_of_signed = st->buf;
+  } else {
+    end_of_signed = tor_memstr(st->buf, st->buf_len, "\ndirectory-signature");
+    if (end_of_signed)
+      ++end_of_signed;
+  }
+  if (end_of_signed) {
+    end_of_signed += strlen(sig_str);
+    end_of_signed = memchr(end_of_signed, ' ', eob - end_of_signed);
+  }
+  if (!end_of_signed) {
+    log_warn(LD_DIR, "Unable to compute digest of network-status");
+    goto err;
+  }
+  ns_parse_stream_digest(st, st->buf, end_of_signed + 1 - st->buf);
+
+  ns = st->ns;
+  crypto_digest_get_digest(st->digest_sha1,
+                           (char *)ns->digests.d[DIGEST_SHA1], DIGEST_LEN);
+  crypto_digest_get_digest(st->digest_sha256,
+                           (char *)ns->digests.d[DIGEST_SHA256],
+                           DIGEST256_LEN);
+  crypto_digest_get_digest(st->digest_sha3,
+                           (char *)ns->digest_sha3_as_signed, DIGEST256_LEN);
+
+  if (networkstatus_parse_footer(ns, st->area, st->buf, eob,
+                                 &end_of_footer) < 0)
+    goto err;
+
+  st->ns = NULL;
+  return ns;
+ err:
+  st->state = NS_PARSE_STREAM_FAILED;
+  return NULL;
+}
+
+#ifdef TOR_UNIT_TESTS
+/** Return the most input that <b>st</b> has ever had to hold at once. */
+size_t
+ns_parse_stream_get_max_buffered(const ns_parse_stream_t *st)
+{
+  return st->max_buf_len;
+}
+#endif /* defined(TOR_UNIT_TESTS) */
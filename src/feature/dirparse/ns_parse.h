@@ -28,7 +28,25 @@ networkstatus_t *networkstatus_parse_vote_from_string(const char *s,
                                            const char **eos_out,
                                            enum networkstatus_type_t ns_type);
 
+/** State for parsing a consensus a piece at a time. */
+typedef struct ns_parse_stream_t ns_parse_stream_t;
+/** Callback type for ns_parse_stream_t: called with each routerstatus entry
+ * in a consensus. */
+typedef int (*ns_parse_stream_cb_t)(const networkstatus_t *ns,
+                                    routerstatus_t *rs, void *arg);
+ns_parse_stream_t *ns_parse_stream_new(ns_parse_stream_cb_t cb,
+                                       void *cb_arg);
+int ns_parse_stream_add(ns_parse_stream_t *st, const char *data,
+                        size_t len);
+networkstatus_t *ns_parse_stream_finish(ns_parse_stream_t *st);
+void ns_parse_stream_free_(ns_parse_stream_t *st);
+#define ns_parse_stream_free(st) \
+  FREE_AND_NULL(ns_parse_stream_t, ns_parse_stream_free_, (st))
+
 #ifdef NS_PARSE_PRIVATE
+#ifdef TOR_UNIT_TESTS
+size_t ns_parse_stream_get_max_buffered(const ns_parse_stream_t *st);
+#endif
 STATIC int routerstatus_parse_guardfraction(const char *guardfraction_str,
                                             networkstatus_t *vote,
                                             vote_routerstatus_t *vote_rs,
@@ -277,7 +277,7 @@ get_next_token(memarea_t *area,
 #define MAX_LINE_LENGTH (128*1024)
 
   const char *next, *eol;
-  size_t obname_len;
+  size_t obname_len, kwd_len;
   int i;
   directory_token_t *tok;
   obj_syntax o_syn = NO_OBJ;
@@ -309,9 +309,11 @@ get_next_token(memarea_t *area,
   }
 
   /* Search the table for the appropriate entry.  (I tried a binary search
-   * instead, but it wasn't any faster.) */
+   * instead, but it wasn't any faster.)  Comparing the lengths first rules
+   * out most entries without looking at their keywords. */
+  kwd_len = next - *s;
   for (i = 0; table[i].t ; ++i) {
-    if (mem_eq_token(*s, next-*s, table[i].t)) {
+    if (table[i].t_len == kwd_len && fast_memeq(*s, table[i].t, kwd_len)) {
       /* We've found the keyword. */
       kwd = table[i].t;
       tok->tp = table[i].v;
@@ -358,6 +360,8 @@ get_next_token(memarea_t *area,
   /* Check whether there's an object present */
   *s = eat_whitespace_eos(eol, eos);  /* Scan from end of first line */
   tor_assert(eos >= *s);
+  if (*s == eos || **s != '-') /* No object; don't bother finding the eol. */
+    goto check_object;
   eol = memchr(*s, '\n', eos-*s);
   if (!eol || eol-*s<11 || strcmpstart(*s, "-----BEGIN ")) /* No object. */
     goto check_object;
@@ -234,30 +234,30 @@ typedef enum {
 /**
  * @name macros for defining token rules
  *
- * Helper macros to define token tables.  's' is a string, 't' is a
+ * Helper macros to define token tables.  's' is a string literal, 't' is a
  * directory_keyword, 'a' is a trio of argument multiplicities, and 'o' is an
  * object syntax.
  */
 /**@{*/
 
 /** Appears to indicate the end of a table. */
-#define END_OF_TABLE { NULL, NIL_, 0,0,0, NO_OBJ, 0, INT_MAX, 0, 0 }
+#define END_OF_TABLE { NULL, NIL_, 0,0,0, NO_OBJ, 0, INT_MAX, 0, 0, 0 }
 /** An item with no restrictions: used for obsolete document types */
-#define T(s,t,a,o)    { s, t, a, o, 0, INT_MAX, 0, 0 }
+#define T(s,t,a,o)    { s, t, a, o, 0, INT_MAX, 0, 0, sizeof(s)-1 }
 /** An item with no restrictions on multiplicity or location. */
-#define T0N(s,t,a,o)  { s, t, a, o, 0, INT_MAX, 0, 0 }
+#define T0N(s,t,a,o)  { s, t, a, o, 0, INT_MAX, 0, 0, sizeof(s)-1 }
 /** An item that must appear exactly once */
-#define T1(s,t,a,o)   { s, t, a, o, 1, 1, 0, 0 }
+#define T1(s,t,a,o)   { s, t, a, o, 1, 1, 0, 0, sizeof(s)-1 }
 /** An item that must appear exactly once, at the start of the document */
-#define T1_START(s,t,a,o)   { s, t, a, o, 1, 1, AT_START, 0 }
+#define T1_START(s,t,a,o)   { s, t, a, o, 1, 1, AT_START, 0, sizeof(s)-1 }
 /** An item that must appear exactly once, at the end of the document */
-#define T1_END(s,t,a,o)   { s, t, a, o, 1, 1, AT_END, 0 }
+#define T1_END(s,t,a,o)   { s, t, a, o, 1, 1, AT_END, 0, sizeof(s)-1 }
 /** An item that must appear one or more times */
-#define T1N(s,t,a,o)  { s, t, a, o, 1, INT_MAX, 0, 0 }
+#define T1N(s,t,a,o)  { s, t, a, o, 1, INT_MAX, 0, 0, sizeof(s)-1 }
 /** An item that must appear no more than once */
-#define T01(s,t,a,o)  { s, t, a, o, 0, 1, 0, 0 }
+#define T01(s,t,a,o)  { s, t, a, o, 0, 1, 0, 0, sizeof(s)-1 }
 /** An annotation that must appear no more than once */
-#define A01(s,t,a,o)  { s, t, a, o, 0, 1, 0, 1 }
+#define A01(s,t,a,o)  { s, t, a, o, 0, 1, 0, 1, sizeof(s)-1 }
 
 /** Argument multiplicity: any number of arguments. */
 #define ARGS        0,INT_MAX,0
@@ -295,6 +295,9 @@ typedef struct token_rule_t {
   int pos;
   /** True iff this token is an annotation. */
   int is_annotation;
+  /** The length of <b>t</b>, so that we don't need to strlen() it each time
+   * we look up a keyword. */
+  size_t t_len;
 } token_rule_t;
 
 void token_clear(directory_token_t *tok);
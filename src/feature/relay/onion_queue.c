@@ -21,7 +21,19 @@
  *      them to worker threads.
  *   <li>Expiring onionskins on the relay side if they have waited for
  *     too long.
+ *   <li>Sharing the queue fairly between the channels that the onionskins
+ *     arrive on.
  * </ul>
+ *
+ * Every queued onionskin is on two lists.  The per-type ol_list[] holds
+ * them in the order they arrived, so that we can expire the oldest ones.
+ * Each source (the channel an onionskin came in on, and its handshake type)
+ * also has a list of its own, and onion_next_task() takes onionskins from
+ * the sources in turn.  When the queue is full, a new onionskin can push
+ * out the newest one from the source with the most queued, as long as that
+ * source has more than its own would.  That way, one channel sending a
+ * flood of CREATE cells delays and drops its own requests rather than
+ * everyone's.
  **/
 
 #include "core/or/or.h"
@@ -30,22 +42,108 @@
 
 #include "app/config/config.h"
 #include "core/mainloop/cpuworker.h"
+#include "core/or/channel.h"
 #include "core/or/circuitlist.h"
 #include "core/or/onion.h"
 #include "feature/nodelist/networkstatus.h"
+#include "lib/math/histogram.h"
 
 #include "core/or/or_circuit_st.h"
 
+#include "ht.h"
+
+struct onion_source_t;
+
 /** Type for a linked list of circuits that are waiting for a free CPU worker
  * to process a waiting onion handshake. */
 typedef struct onion_queue_t {
   TOR_TAILQ_ENTRY(onion_queue_t) next;
+  /** Links to the other onionskins from the same source. */
+  TOR_TAILQ_ENTRY(onion_queue_t) next_from_source;
+  /** The source this onionskin came from. */
+  struct onion_source_t *source;
   or_circuit_t *circ;
   uint16_t handshake_type;
   create_cell_t *onionskin;
   time_t when_added;
+  /** When we queued this onionskin, in msec on the coarse monotonic
+   * clock. */
+  uint64_t when_added_msec;
 } onion_queue_t;
 
+/** The kinds of channel that onionskins can come from, for our
+ * statistics. */
+typedef enum {
+  ONION_SOURCE_CLIENT = 0,
+  ONION_SOURCE_RELAY,
+  ONION_SOURCE_N_CLASSES
+} onion_source_class_t;
+
+/** Names for each onion_source_class_t, for the log. */
+static const char *onion_source_class_names[ONION_SOURCE_N_CLASSES] = {
+  "client", "relay",
+};
+
+/** All of the onionskins of one handshake type that are queued from one
+ * channel.  A source only exists while it has something queued. */
+typedef struct onion_source_t {
+  HT_ENTRY(onion_source_t) node;
+  /** The global identifier of the channel the onionskins came in on, or 0
+   * if they didn't come in on a channel. */
+  uint64_t chan_id;
+  /** The handshake type of the onionskins. */
+  uint16_t handshake_type;
+  /** What kind of channel the onionskins came in on. */
+  onion_source_class_t source_class;
+  /** How many onionskins are in <b>entries</b>. */
+  int n_entries;
+  /** The onionskins, oldest first. */
+  TOR_TAILQ_HEAD(onion_source_entries_t, onion_queue_t) entries;
+  /** Links to the other sources of the same handshake type, in the order
+   * we'll take from them. */
+  TOR_TAILQ_ENTRY(onion_source_t) next_source;
+} onion_source_t;
+
+/** Statistics about the onionskins from one class of source. */
+typedef struct onion_source_stats_t {
+  /** How long the onionskins that we handed to the cpuworkers waited in the
+   * queue, in msec. */
+  log_histogram_t queue_msec;
+  /** How many onionskins we queued. */
+  uint64_t n_queued;
+  /** How many onionskins we refused because the queue was full. */
+  uint64_t n_rejected;
+  /** How many queued onionskins we dropped to make room for onionskins from
+   * a source with fewer queued. */
+  uint64_t n_pushed_out;
+  /** How many queued onionskins we dropped because they waited too long. */
+  uint64_t n_expired;
+} onion_source_stats_t;
+
+/** Statistics for each onion_source_class_t. */
+static onion_source_stats_t onion_source_stats[ONION_SOURCE_N_CLASSES];
+
+static inline unsigned int
+onion_source_hash(const onion_source_t *src)
+{
+  return (unsigned int) (src->chan_id * (MAX_ONION_HANDSHAKE_TYPE + 1) +
+                         src->handshake_type);
+}
+
+static inline int
+onion_source_eq(const onion_source_t *a, const onion_source_t *b)
+{
+  return a->chan_id == b->chan_id && a->handshake_type == b->handshake_type;
+}
+
+/** Map from channel and handshake type to the onion_source_t for them. */
+static HT_HEAD(onion_source_map, onion_source_t) onion_source_map =
+  HT_INITIALIZER();
+HT_PROTOTYPE(onion_source_map, onion_source_t, node, onion_source_hash,
+             onion_source_eq)
+HT_GENERATE2(onion_source_map, onion_source_t, node, onion_source_hash,
+             onion_source_eq, 0.6, tor_reallocarray_, tor_free_)
+
 /** 5 seconds on the onion queue til we just send back a destroy */
 #define ONIONQUEUE_WAIT_CUTOFF 5
 
@@ -61,6 +159,15 @@ static TOR_TAILQ_HEAD(onion_queue_head_t, onion_queue_t)
 /** Number of entries of each type currently in each element of ol_list[]. */
 static int ol_entries[MAX_ONION_HANDSHAKE_TYPE+1];
 
+/** For each handshake type, the sources that have onionskins queued, in the
+ * order that we'll take from them. */
+static TOR_TAILQ_HEAD(onion_source_list_t, onion_source_t)
+              onion_sources[MAX_ONION_HANDSHAKE_TYPE+1] =
+{ TOR_TAILQ_HEAD_INITIALIZER(onion_sources[0]), /* tap */
+  TOR_TAILQ_HEAD_INITIALIZER(onion_sources[1]), /* fast */
+  TOR_TAILQ_HEAD_INITIALIZER(onion_sources[2]), /* ntor */
+};
+
 static int num_ntors_per_tap(void);
 static void onion_queue_entry_remove(onion_queue_t *victim);
 
@@ -71,65 +178,159 @@ static void onion_queue_entry_remove(onion_queue_t *victim);
  * MAX_ONIONSKIN_CHALLENGE/REPLY_LEN."  Also, make sure that we can pass
  * over-large values via EXTEND2/EXTENDED2, for future-compatibility.*/
 
+/** Return an estimate of how many microseconds an onionskin of type
+ * <b>type</b> would wait, if we queued it now, before a cpuworker had
+ * answered it.
+ *
+ * It has to wait for the cpuworkers to finish what they already have, then
+ * for the onionskins ahead of it in the queue, and then for its own turn.
+ * We charge its own turn at the slowest 1% of recent onionskins, so that we
+ * don't admit work that we'd usually, but not reliably, finish in time. */
+uint64_t
+onion_estimated_queue_delay_usec(uint16_t type)
+{
+  const int num_cpus = get_num_cpus(get_options());
+  uint64_t usec;
+
+  /* How long until the cpuworkers have answered what they already have? */
+  usec = cpuworker_estimated_usec_in_flight();
+
+  if (type == ONION_HANDSHAKE_TYPE_NTOR) {
+    /* How long would it take to process all the NTor cells in the queue? */
+    usec += estimated_usec_for_onionskins(
+                                    ol_entries[ONION_HANDSHAKE_TYPE_NTOR],
+                                    ONION_HANDSHAKE_TYPE_NTOR) / num_cpus;
+    /* How long would it take to process the tap cells that we expect to
+     * process while draining the ntor queue? */
+    usec += estimated_usec_for_onionskins(
+      MIN(ol_entries[ONION_HANDSHAKE_TYPE_TAP],
+          ol_entries[ONION_HANDSHAKE_TYPE_NTOR] / num_ntors_per_tap()),
+                                    ONION_HANDSHAKE_TYPE_TAP) / num_cpus;
+  } else if (type == ONION_HANDSHAKE_TYPE_TAP) {
+    /* How long would it take to process all the TAP cells in the queue? */
+    usec += estimated_usec_for_onionskins(
+                                    ol_entries[ONION_HANDSHAKE_TYPE_TAP],
+                                    ONION_HANDSHAKE_TYPE_TAP) / num_cpus;
+    /* How long would it take to process the ntor cells that we expect to
+     * process while draining the tap queue? */
+    usec += estimated_usec_for_onionskins(
+      MIN(ol_entries[ONION_HANDSHAKE_TYPE_NTOR],
+          ol_entries[ONION_HANDSHAKE_TYPE_TAP] * num_ntors_per_tap()),
+                                    ONION_HANDSHAKE_TYPE_NTOR) / num_cpus;
+  } else {
+    return usec;
+  }
+
+  return usec + estimated_p99_usec_for_onionskin(type);
+}
+
 /** Return true iff we have room to queue another onionskin of type
  * <b>type</b>. */
 static int
 have_room_for_onionskin(uint16_t type)
 {
   const or_options_t *options = get_options();
-  int num_cpus;
-  uint64_t tap_usec, ntor_usec;
-  uint64_t ntor_during_tap_usec, tap_during_ntor_usec;
+  uint64_t tap_usec;
 
   /* If we've got fewer than 50 entries, we always have room for one more. */
   if (ol_entries[type] < 50)
     return 1;
-  num_cpus = get_num_cpus(options);
-  /* Compute how many microseconds we'd expect to need to clear all
-   * onionskins in various combinations of the queues. */
 
-  /* How long would it take to process all the TAP cells in the queue? */
-  tap_usec  = estimated_usec_for_onionskins(
+  /* See whether the wait would exceed MaxOnionQueueDelay. If so, we can't
+   * queue this. */
+  if (onion_estimated_queue_delay_usec(type) / 1000 >
+      (uint64_t)options->MaxOnionQueueDelay)
+    return 0;
+
+  /* If we support the ntor handshake, then don't let TAP handshakes use
+   * more than 2/3 of the space on the queue. */
+  if (type == ONION_HANDSHAKE_TYPE_TAP) {
+    tap_usec = estimated_usec_for_onionskins(
                                     ol_entries[ONION_HANDSHAKE_TYPE_TAP],
-                                    ONION_HANDSHAKE_TYPE_TAP) / num_cpus;
+                                    ONION_HANDSHAKE_TYPE_TAP) /
+      get_num_cpus(options);
+    if (tap_usec / 1000 > (uint64_t)options->MaxOnionQueueDelay * 2 / 3)
+      return 0;
+  }
 
-  /* How long would it take to process all the NTor cells in the queue? */
-  ntor_usec = estimated_usec_for_onionskins(
-                                    ol_entries[ONION_HANDSHAKE_TYPE_NTOR],
-                                    ONION_HANDSHAKE_TYPE_NTOR) / num_cpus;
+  return 1;
+}
 
-  /* How long would it take to process the tap cells that we expect to
-   * process while draining the ntor queue? */
-  tap_during_ntor_usec  = estimated_usec_for_onionskins(
-    MIN(ol_entries[ONION_HANDSHAKE_TYPE_TAP],
-        ol_entries[ONION_HANDSHAKE_TYPE_NTOR] / num_ntors_per_tap()),
-                                    ONION_HANDSHAKE_TYPE_TAP) / num_cpus;
+/** Set the channel identifier and class in <b>src</b> to those of the
+ * channel that <b>circ</b> came in on. */
+static void
+onion_source_set_channel(onion_source_t *src, const or_circuit_t *circ)
+{
+  if (circ->p_chan) {
+    src->chan_id = circ->p_chan->global_identifier;
+    src->source_class = channel_is_client(circ->p_chan) ?
+      ONION_SOURCE_CLIENT : ONION_SOURCE_RELAY;
+  } else {
+    src->chan_id = 0;
+    src->source_class = ONION_SOURCE_CLIENT;
+  }
+}
 
-  /* How long would it take to process the ntor cells that we expect to
-   * process while draining the tap queue? */
-  ntor_during_tap_usec  = estimated_usec_for_onionskins(
-    MIN(ol_entries[ONION_HANDSHAKE_TYPE_NTOR],
-        ol_entries[ONION_HANDSHAKE_TYPE_TAP] * num_ntors_per_tap()),
-                                    ONION_HANDSHAKE_TYPE_NTOR) / num_cpus;
+/** Return the source for onionskins of type <b>type</b> that come in on
+ * the same channel as <b>circ</b>, or NULL if it has none queued. */
+static onion_source_t *
+onion_source_lookup(const or_circuit_t *circ, uint16_t type)
+{
+  onion_source_t search;
 
-  /* See whether that exceeds MaxOnionQueueDelay. If so, we can't queue
-   * this. */
-  if (type == ONION_HANDSHAKE_TYPE_NTOR &&
-      (ntor_usec + tap_during_ntor_usec) / 1000 >
-       (uint64_t)options->MaxOnionQueueDelay)
-    return 0;
+  onion_source_set_channel(&search, circ);
+  search.handshake_type = type;
+  return HT_FIND(onion_source_map, &onion_source_map, &search);
+}
 
-  if (type == ONION_HANDSHAKE_TYPE_TAP &&
-      (tap_usec + ntor_during_tap_usec) / 1000 >
-       (uint64_t)options->MaxOnionQueueDelay)
-    return 0;
+/** Return the source for onionskins of type <b>type</b> that come in on
+ * the same channel as <b>circ</b>, creating it if it doesn't exist. */
+static onion_source_t *
+onion_source_get(const or_circuit_t *circ, uint16_t type)
+{
+  onion_source_t *src = onion_source_lookup(circ, type);
+
+  if (!src) {
+    src = tor_malloc_zero(sizeof(onion_source_t));
+    onion_source_set_channel(src, circ);
+    src->handshake_type = type;
+    TOR_TAILQ_INIT(&src->entries);
+    HT_INSERT(onion_source_map, &onion_source_map, src);
+    TOR_TAILQ_INSERT_TAIL(&onion_sources[type], src, next_source);
+  }
+  return src;
+}
 
-  /* If we support the ntor handshake, then don't let TAP handshakes use
-   * more than 2/3 of the space on the queue. */
-  if (type == ONION_HANDSHAKE_TYPE_TAP &&
-      tap_usec / 1000 > (uint64_t)options->MaxOnionQueueDelay * 2 / 3)
+/** The queue for onionskins of type <b>type</b> is full.  If the source with
+ * the most of them queued has more than <b>circ</b>'s source would, once
+ * we add <b>circ</b>'s, drop the newest onionskin from that source to make
+ * room and return 1.  Otherwise return 0. */
+static int
+onion_pending_push_out(const or_circuit_t *circ, uint16_t type)
+{
+  onion_source_t *mine = onion_source_lookup(circ, type);
+  onion_source_t *src, *biggest = NULL;
+  onion_queue_t *victim;
+  or_circuit_t *victim_circ;
+
+  TOR_TAILQ_FOREACH(src, &onion_sources[type], next_source) {
+    if (!biggest || src->n_entries > biggest->n_entries)
+      biggest = src;
+  }
+  if (!biggest || biggest == mine ||
+      biggest->n_entries <= (mine ? mine->n_entries : 0) + 1)
     return 0;
 
+  victim = TOR_TAILQ_LAST(&biggest->entries, onion_source_entries_t);
+  victim_circ = victim->circ;
+  ++onion_source_stats[biggest->source_class].n_pushed_out;
+  onion_queue_entry_remove(victim);
+  log_info(LD_CIRC, "Circuit create request pushed out by a request from "
+           "a quieter channel; canceling.");
+  if (! TO_CIRCUIT(victim_circ)->marked_for_close) {
+    circuit_mark_for_close(TO_CIRCUIT(victim_circ),
+                           END_CIRC_REASON_RESOURCELIMIT);
+  }
   return 1;
 }
 
@@ -156,8 +357,13 @@ onion_pending_add(or_circuit_t *circ, create_cell_t *onionskin)
   tmp->handshake_type = onionskin->handshake_type;
   tmp->onionskin = onionskin;
   tmp->when_added = now;
+  tmp->when_added_msec = monotime_coarse_absolute_msec();
 
-  if (!have_room_for_onionskin(onionskin->handshake_type)) {
+  if (!have_room_for_onionskin(onionskin->handshake_type) &&
+      !onion_pending_push_out(circ, onionskin->handshake_type)) {
+    onion_source_t search;
+    onion_source_set_channel(&search, circ);
+    ++onion_source_stats[search.source_class].n_rejected;
 #define WARN_TOO_MANY_CIRC_CREATIONS_INTERVAL (60)
     static ratelim_t last_warned =
       RATELIM_INIT(WARN_TOO_MANY_CIRC_CREATIONS_INTERVAL);
@@ -183,6 +389,10 @@ onion_pending_add(or_circuit_t *circ, create_cell_t *onionskin)
 
   circ->onionqueue_entry = tmp;
   TOR_TAILQ_INSERT_TAIL(&ol_list[onionskin->handshake_type], tmp, next);
+  tmp->source = onion_source_get(circ, onionskin->handshake_type);
+  TOR_TAILQ_INSERT_TAIL(&tmp->source->entries, tmp, next_from_source);
+  ++tmp->source->n_entries;
+  ++onion_source_stats[tmp->source->source_class].n_queued;
 
   /* cull elderly requests. */
   while (1) {
@@ -192,6 +402,7 @@ onion_pending_add(or_circuit_t *circ, create_cell_t *onionskin)
 
     circ = head->circ;
     circ->onionqueue_entry = NULL;
+    ++onion_source_stats[head->source->source_class].n_expired;
     onion_queue_entry_remove(head);
     log_info(LD_CIRC,
              "Circuit create request is too old; canceling due to overload.");
@@ -259,18 +470,34 @@ decide_next_handshake_type(void)
 }
 
 /** Remove the highest priority item from ol_list[] and return it, or
- * return NULL if the lists are empty.
+ * return NULL if the lists are empty.  Within each handshake type, we take
+ * the oldest onionskin from each source in turn.
  */
 or_circuit_t *
 onion_next_task(create_cell_t **onionskin_out)
 {
   or_circuit_t *circ;
   uint16_t handshake_to_choose = decide_next_handshake_type();
-  onion_queue_t *head = TOR_TAILQ_FIRST(&ol_list[handshake_to_choose]);
+  onion_source_t *src = TOR_TAILQ_FIRST(&onion_sources[handshake_to_choose]);
+  onion_queue_t *head;
+  uint64_t now_msec;
 
-  if (!head)
+  if (!src)
     return NULL; /* no onions pending, we're done */
 
+  head = TOR_TAILQ_FIRST(&src->entries);
+  tor_assert(head);
+  /* Let every other source have a turn before this one goes again. */
+  if (src->n_entries > 1) {
+    TOR_TAILQ_REMOVE(&onion_sources[handshake_to_choose], src, next_source);
+    TOR_TAILQ_INSERT_TAIL(&onion_sources[handshake_to_choose], src,
+                          next_source);
+  }
+  now_msec = monotime_coarse_absolute_msec();
+  log_histogram_add(&onion_source_stats[src->source_class].queue_msec,
+                    (uint32_t) MIN(now_msec - head->when_added_msec,
+                                   UINT32_MAX));
+
   tor_assert(head->circ);
   tor_assert(head->handshake_type <= MAX_ONION_HANDSHAKE_TYPE);
 //  tor_assert(head->circ->p_chan); /* make sure it's still valid */
@@ -334,6 +561,17 @@ onion_queue_entry_remove(onion_queue_t *victim)
 
   TOR_TAILQ_REMOVE(&ol_list[victim->handshake_type], victim, next);
 
+  if (victim->source) {
+    onion_source_t *src = victim->source;
+    TOR_TAILQ_REMOVE(&src->entries, victim, next_from_source);
+    if (--src->n_entries == 0) {
+      TOR_TAILQ_REMOVE(&onion_sources[src->handshake_type], src,
+                       next_source);
+      HT_REMOVE(onion_source_map, &onion_source_map, src);
+      tor_free(src);
+    }
+  }
+
   if (victim->circ)
     victim->circ->onionqueue_entry = NULL;
 
@@ -344,7 +582,8 @@ onion_queue_entry_remove(onion_queue_t *victim)
   tor_free(victim);
 }
 
-/** Remove all circuits from the pending list.  Called from tor_free_all. */
+/** Remove all circuits from the pending list, and forget our statistics
+ * about them.  Called from tor_free_all. */
 void
 clear_pending_onions(void)
 {
@@ -356,6 +595,32 @@ clear_pending_onions(void)
       onion_queue_entry_remove(victim);
     }
     tor_assert(TOR_TAILQ_EMPTY(&ol_list[i]));
+    tor_assert(TOR_TAILQ_EMPTY(&onion_sources[i]));
   }
   memset(ol_entries, 0, sizeof(ol_entries));
+  HT_CLEAR(onion_source_map, &onion_source_map);
+  memset(onion_source_stats, 0, sizeof(onion_source_stats));
+}
+
+/** Log how long the onionskins from each class of channel have waited in
+ * the queue, and how many we have dropped, as part of the heartbeat. */
+void
+onion_queue_log_heartbeat(void)
+{
+  int i;
+
+  for (i = 0; i < ONION_SOURCE_N_CLASSES; ++i) {
+    const onion_source_stats_t *st = &onion_source_stats[i];
+    if (!st->n_queued && !st->n_rejected)
+      continue;
+    log_notice(LD_HEARTBEAT, "Circuit create requests from %s channels: "
+               "%"PRIu64" queued, with a median wait of %"PRIu32" msec and "
+               "a 99th percentile of %"PRIu32" msec. %"PRIu64" refused "
+               "because the queue was full, %"PRIu64" pushed out by "
+               "quieter channels, and %"PRIu64" expired.",
+               onion_source_class_names[i], st->n_queued,
+               log_histogram_percentile(&st->queue_msec, 50),
+               log_histogram_percentile(&st->queue_msec, 99),
+               st->n_rejected, st->n_pushed_out, st->n_expired);
+  }
 }
@@ -17,7 +17,9 @@ struct create_cell_t;
 int onion_pending_add(or_circuit_t *circ, struct create_cell_t *onionskin);
 or_circuit_t *onion_next_task(struct create_cell_t **onionskin_out);
 int onion_num_pending(uint16_t handshake_type);
+uint64_t onion_estimated_queue_delay_usec(uint16_t type);
 void onion_pending_remove(or_circuit_t *circ);
 void clear_pending_onions(void);
+void onion_queue_log_heartbeat(void);
 
 #endif
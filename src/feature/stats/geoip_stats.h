@@ -12,8 +12,6 @@
 #ifndef TOR_GEOIP_STATS_H
 #define TOR_GEOIP_STATS_H
 
-#include "core/or/dos.h"
-
 /** Indicates an action that we might be noting geoip statistics on.
  * Note that if we're noticing CONNECT, we're a bridge, and if we're noticing
  * the others, we're not.
@@ -74,7 +72,7 @@ typedef enum {
 
 /** Entry in a map from IP address to the last time we've seen an incoming
  * connection from that IP address. Used by bridges only to track which
- * countries have them blocked, or the DoS mitigation subsystem if enabled. */
+ * countries have them blocked. */
 typedef struct clientmap_entry_t {
   HT_ENTRY(clientmap_entry_t) node;
   tor_addr_t addr;
@@ -88,10 +86,6 @@ typedef struct clientmap_entry_t {
    * 4000 CE, please remember to add more bits to last_seen_in_minutes.) */
   unsigned int last_seen_in_minutes:30;
   unsigned int action:2;
-
-  /* This object is used to keep some statistics per client address for the
-   * DoS mitigation subsystem. */
-  dos_client_stats_t dos_stats;
 } clientmap_entry_t;
 
 int should_record_bridge_info(const or_options_t *options);
@@ -123,24 +123,111 @@ chunk_repack(chunk_t *chunk)
 
 /** Keep track of total size of allocated chunks for consistency asserts */
 static size_t total_bytes_allocated_in_chunks = 0;
-static void
+
+/** A freelist of chunks, all of the same allocation size. */
+typedef struct chunk_freelist_t {
+  size_t alloc_size; /**< What size chunks does this freelist hold? */
+  int max_length; /**< Never allow more than this number of chunks in the
+                   * freelist. */
+  int slack; /**< When trimming the freelist, leave this number of extra
+              * chunks beyond lowest_length.*/
+  int cur_length; /**< How many chunks on the freelist now? */
+  int lowest_length; /**< What's the smallest value of cur_length since the
+                      * last time we cleaned this freelist? */
+  uint64_t n_alloc; /**< How many chunks have we allocated for this size? */
+  uint64_t n_free; /**< How many of those have we freed? */
+  uint64_t n_hit; /**< How many allocations have we served from this
+                   * freelist? */
+  chunk_t *head; /**< First chunk on the freelist. */
+} chunk_freelist_t;
+
+/** Macro to help define freelists. */
+#define FL(a,m,s) { a, m, s, 0, 0, 0, 0, 0, NULL }
+
+/** Static array of freelists, sorted by alloc_len, terminated by an entry
+ * with alloc_size of 0. */
+static chunk_freelist_t freelists[] = {
+  FL(4096, 256, 8), FL(8192, 128, 4), FL(16384, 64, 4), FL(32768, 32, 2),
+  FL(65536, 16, 2),
+  FL(0, 0, 0)
+};
+#undef FL
+/** How many times have we looked for a chunk of a size that no freelist
+ * could help with? */
+static uint64_t n_freelist_miss = 0;
+/** How many bytes are held in chunks that are sitting on a freelist? */
+static size_t total_bytes_in_freelists = 0;
+
+/** Return the freelist to hold chunks of size <b>alloc</b>, or NULL if
+ * no freelist exists for that size. */
+static inline chunk_freelist_t *
+get_freelist(size_t alloc)
+{
+  int i;
+  for (i=0; (freelists[i].alloc_size <= alloc &&
+             freelists[i].alloc_size); ++i ) {
+    if (freelists[i].alloc_size == alloc) {
+      return &freelists[i];
+    }
+  }
+  return NULL;
+}
+
+/** Release storage held by <b>chunk</b>, which must not be on any buffer.
+ * If there is room on the freelist for chunks of its size, keep it there
+ * for later reuse instead. */
+void
 buf_chunk_free_unchecked(chunk_t *chunk)
 {
+  size_t alloc;
+  chunk_freelist_t *freelist;
   if (!chunk)
     return;
+  alloc = CHUNK_ALLOC_SIZE(chunk->memlen);
 #ifdef DEBUG_CHUNK_ALLOC
-  tor_assert(CHUNK_ALLOC_SIZE(chunk->memlen) == chunk->DBG_alloc);
+  tor_assert(alloc == chunk->DBG_alloc);
 #endif
-  tor_assert(total_bytes_allocated_in_chunks >=
-             CHUNK_ALLOC_SIZE(chunk->memlen));
-  total_bytes_allocated_in_chunks -= CHUNK_ALLOC_SIZE(chunk->memlen);
-  tor_free(chunk);
+  tor_assert(total_bytes_allocated_in_chunks >= alloc);
+  total_bytes_allocated_in_chunks -= alloc;
+
+  freelist = get_freelist(alloc);
+  if (freelist && freelist->cur_length < freelist->max_length) {
+    chunk->next = freelist->head;
+    freelist->head = chunk;
+    ++freelist->cur_length;
+    total_bytes_in_freelists += alloc;
+  } else {
+    if (freelist)
+      ++freelist->n_free;
+    tor_free(chunk);
+  }
 }
+
+/** Allocate a new chunk with a given allocation size, or get one from the
+ * freelist.  Note that a chunk with allocation size A can actually hold only
+ * CHUNK_SIZE_WITH_ALLOC(A) bytes in its mem field. */
 static inline chunk_t *
 chunk_new_with_alloc_size(size_t alloc)
 {
   chunk_t *ch;
-  ch = tor_malloc(alloc);
+  chunk_freelist_t *freelist;
+  tor_assert(alloc >= sizeof(chunk_t));
+  freelist = get_freelist(alloc);
+  if (freelist && freelist->head) {
+    ch = freelist->head;
+    freelist->head = ch->next;
+    if (--freelist->cur_length < freelist->lowest_length)
+      freelist->lowest_length = freelist->cur_length;
+    ++freelist->n_hit;
+    tor_assert(total_bytes_in_freelists >= alloc);
+    total_bytes_in_freelists -= alloc;
+  } else {
+    if (freelist)
+      ++freelist->n_alloc;
+    else
+      ++n_freelist_miss;
+    ch = tor_malloc(alloc);
+  }
   ch->next = NULL;
   ch->datalen = 0;
 #ifdef DEBUG_CHUNK_ALLOC
@@ -153,6 +240,74 @@ chunk_new_with_alloc_size(size_t alloc)
   return ch;
 }
 
+/** Remove from each freelist the chunks that have gone unused since the last
+ * time we called this function, keeping a few extras around as slack.  If
+ * <b>free_all</b> is true, empty every freelist completely.  Return the
+ * number of bytes released. */
+size_t
+buf_shrink_freelists(int free_all)
+{
+  int i;
+  size_t total_freed = 0;
+  for (i = 0; freelists[i].alloc_size; ++i) {
+    chunk_freelist_t *fl = &freelists[i];
+    int n_to_keep;
+    chunk_t **chp, *chunk;
+
+    if (free_all)
+      n_to_keep = 0;
+    else if (fl->lowest_length > fl->slack)
+      n_to_keep = fl->cur_length - (fl->lowest_length - fl->slack);
+    else
+      n_to_keep = fl->cur_length;
+
+    /* Skip over the chunks that we're keeping... */
+    chp = &fl->head;
+    for (int j = 0; j < n_to_keep; ++j) {
+      tor_assert(*chp);
+      chp = &(*chp)->next;
+    }
+    /* ... and free the rest. */
+    chunk = *chp;
+    *chp = NULL;
+    while (chunk) {
+      chunk_t *next = chunk->next;
+      tor_free(chunk);
+      chunk = next;
+      ++fl->n_free;
+      total_freed += fl->alloc_size;
+    }
+    fl->cur_length = n_to_keep;
+    fl->lowest_length = n_to_keep;
+  }
+  tor_assert(total_bytes_in_freelists >= total_freed);
+  total_bytes_in_freelists -= total_freed;
+  return total_freed;
+}
+
+/** Describe the current status of the buffer freelists at log level
+ * <b>severity</b>. */
+void
+buf_dump_freelist_sizes(int severity)
+{
+  int i;
+  tor_log(severity, LD_MM, "====== Buffer freelists:");
+  for (i = 0; freelists[i].alloc_size; ++i) {
+    uint64_t total = ((uint64_t)freelists[i].cur_length) *
+      freelists[i].alloc_size;
+    tor_log(severity, LD_MM,
+        "  %"PRIu64" bytes in %d %"TOR_PRIuSZ"-byte chunks "
+        "[%"PRIu64" misses; %"PRIu64" frees; %"PRIu64" hits]",
+        (total),
+        freelists[i].cur_length, freelists[i].alloc_size,
+        (freelists[i].n_alloc),
+        (freelists[i].n_free),
+        (freelists[i].n_hit));
+  }
+  tor_log(severity, LD_MM, "%"PRIu64" allocations in non-freelist sizes",
+      (n_freelist_miss));
+}
+
 /** Expand <b>chunk</b> until it can hold <b>sz</b> bytes, and return a
  * new pointer to <b>chunk</b>.  Old pointers are no longer valid. */
 static inline chunk_t *
@@ -510,12 +665,23 @@ buf_get_oldest_chunk_timestamp(const buf_t *buf, uint32_t now)
   }
 }
 
+/** Return the number of bytes allocated for chunks that are currently in
+ * use on some buffer.  This does not include chunks held on the freelists:
+ * see buf_get_freelist_allocation(). */
 size_t
 buf_get_total_allocation(void)
 {
   return total_bytes_allocated_in_chunks;
 }
 
+/** Return the number of bytes allocated for chunks that are sitting idle on
+ * the freelists, waiting to be reused. */
+size_t
+buf_get_freelist_allocation(void)
+{
+  return total_bytes_in_freelists;
+}
+
 /** Append <b>string_len</b> bytes from <b>string</b> to the end of
  * <b>buf</b>.
  *
@@ -13,9 +13,19 @@
  * is a workqueue_entry_t, containing data to process and a function to
  * process it with.
  *
- * The main thread informs the worker threads of pending work by using a
- * condition variable.  The workers inform the main process of completed work
+ * Each worker thread has its own queues of pending work, one per priority,
+ * with its own lock.  The main thread hands each new item to the workers in
+ * turn, and a worker that runs out of work of its own steals from the
+ * others, so that no single lock is shared by every worker and every caller.
+ * A worker only takes another thread's lock when that thread's count of
+ * pending work says there is something to steal.
+ *
+ * The main thread informs a worker of pending work by using its condition
+ * variable.  The workers inform the main process of completed work
  * by using an alert_sockets_t object, as implemented in net/alertsock.c.
+ * Where we have working C11 atomics, workers hand their answers to the main
+ * thread through a lock-free stack, and only write to the alert socket when
+ * that stack was empty: a burst of answers costs one wakeup.
  *
  * The main thread can also queue an "update" that will be handled by all the
  * workers.  This is useful for updating state that all the workers share.
@@ -23,6 +33,7 @@
  * In Tor today, there is currently only one thread pool, used in cpuworker.c.
  */
 
+#define WORKQUEUE_PRIVATE
 #include "orconfig.h"
 #include "lib/evloop/compat_libevent.h"
 #include "lib/evloop/workqueue.h"
@@ -49,22 +60,19 @@ typedef struct work_tailq_t work_tailq_t;
 
 struct threadpool_s {
   /** An array of pointers to workerthread_t: one for each running worker
-   * thread. */
+   * thread.  This doesn't change once the threads are running. */
   struct workerthread_s **threads;
 
-  /** Condition variable that we wait on when we have no work, and which
-   * gets signaled when our queue becomes nonempty. */
-  tor_cond_t condition;
-  /** Queues of pending work that we have to do. The queue with priority
-   * <b>p</b> is work[p]. */
-  work_tailq_t work[WORKQUEUE_N_PRIORITIES];
-
-  /** Weak RNG, used to decide when to ignore priority. */
-  tor_weak_rng_t weak_rng;
+  /** Index of the thread that should get the next item of work; used to
+   * spread work over the threads. */
+  atomic_counter_t next_thread;
+  /** Number of threads that are waiting, or about to wait, for work. */
+  atomic_counter_t n_waiting;
 
   /** The current 'update generation' of the threadpool.  Any thread that is
-   * at an earlier generation needs to run the update function. */
-  unsigned generation;
+   * at an earlier generation needs to run the update function.  Only
+   * changed with <b>lock</b> held. */
+  atomic_counter_t generation;
 
   /** Function that should be run for updates on each thread. */
   workqueue_reply_t (*update_fn)(void *, void *);
@@ -78,7 +86,7 @@ struct threadpool_s {
 
   /** Number of elements in threads. */
   int n_threads;
-  /** Mutex to protect all the above fields. */
+  /** Mutex to protect the update fields above. */
   tor_mutex_t lock;
 
   /** A reply queue to use when constructing new threads. */
@@ -103,6 +111,9 @@ struct workqueue_entry_s {
    * is set when the workqueue_entry_t is created, and won't be cleared until
    * after it's handled in the main thread. */
   struct threadpool_s *on_pool;
+  /** The worker thread on whose queue this entry was put.  (Another worker
+   * may steal it from there, but it is never moved to another queue.) */
+  struct workerthread_s *on_thread;
   /** True iff this entry is waiting for a worker to start processing it. */
   uint8_t pending;
   /** Priority of this entry. */
@@ -113,13 +124,30 @@ struct workqueue_entry_s {
   void (*reply_fn)(void *arg);
   /** Argument for the above functions. */
   void *arg;
+  /** The next (older) answer on the incoming stack of a reply queue. */
+  struct workqueue_entry_s *next_reply;
 };
 
 struct replyqueue_s {
-  /** Mutex to protect the answers field */
+#ifdef HAVE_WORKING_STDATOMIC
+  /** Stack of answers that worker threads have finished, most recent first.
+   * Workers push onto it without locking; the main thread takes the whole
+   * stack at once. */
+  _Atomic(workqueue_entry_t *) incoming;
+#else
+  /** Mutex to protect the incoming field */
   tor_mutex_t lock;
-  /** Doubly-linked list of answers that the reply queue needs to handle. */
+  /** Stack of answers that worker threads have finished, most recent
+   * first. */
+  workqueue_entry_t *incoming;
+#endif /* defined(HAVE_WORKING_STDATOMIC) */
+  /** Doubly-linked list of answers that the main thread has taken from
+   * <b>incoming</b>, but not yet handled, oldest first.  Only the main
+   * thread uses this. */
   TOR_TAILQ_HEAD(, workqueue_entry_s) answers;
+  /** If nonzero, replyqueue_process() handles no more than this many answers
+   * per call. */
+  unsigned max_per_process;
 
   /** Mechanism to wake up the main thread when it is receiving answers. */
   alert_sockets_t alert;
@@ -137,9 +165,31 @@ typedef struct workerthread_s {
   /** Reply queue to which we pass our results. */
   replyqueue_t *reply_queue;
   /** The current update generation of this thread */
-  unsigned generation;
+  size_t generation;
   /** One over the probability of taking work from a lower-priority queue. */
   int32_t lower_priority_chance;
+  /** Weak RNG, used to decide when to ignore priority. Only this thread
+   * uses it. */
+  tor_weak_rng_t weak_rng;
+
+  /** Mutex to protect this thread's queues, and the flags below. */
+  tor_mutex_t lock;
+  /** Condition variable that we wait on when we have no work, and which
+   * gets signaled when somebody has work for us. */
+  tor_cond_t condition;
+  /** Queues of pending work that have been given to this thread. The queue
+   * with priority <b>p</b> is work[p]. */
+  work_tailq_t work[WORKQUEUE_N_PRIORITIES];
+  /** How many entries are there on <b>work</b>, over all priorities?  Only
+   * changed with <b>lock</b> held, but other threads read it without the
+   * lock, to decide whether there's anything to steal here. */
+  atomic_counter_t n_pending;
+  /** True iff this thread has found no work, and is waiting (or about to
+   * wait) on its condition variable. */
+  unsigned waiting : 1;
+  /** True iff somebody has signaled this thread since it started
+   * waiting. */
+  unsigned woken : 1;
 } workerthread_t;
 
 static void queue_reply(replyqueue_t *queue, workqueue_entry_t *work);
@@ -195,14 +245,16 @@ workqueue_entry_cancel(workqueue_entry_t *ent)
 {
   int cancelled = 0;
   void *result = NULL;
-  tor_mutex_acquire(&ent->on_pool->lock);
+  workerthread_t *thread = ent->on_thread;
+  tor_mutex_acquire(&thread->lock);
   workqueue_priority_t prio = ent->priority;
   if (ent->pending) {
-    TOR_TAILQ_REMOVE(&ent->on_pool->work[prio], ent, next_work);
+    TOR_TAILQ_REMOVE(&thread->work[prio], ent, next_work);
+    atomic_counter_sub(&thread->n_pending, 1);
     cancelled = 1;
     result = ent->arg;
   }
-  tor_mutex_release(&ent->on_pool->lock);
+  tor_mutex_release(&thread->lock);
 
   if (cancelled) {
     workqueue_entry_free(ent);
@@ -210,35 +262,62 @@ workqueue_entry_cancel(workqueue_entry_t *ent)
   return result;
 }
 
-/**DOCDOC
+/**
+ * Return the argument that was passed to the work function and reply
+ * function of <b>ent</b>.  Call only from the main thread, and only before
+ * <b>ent</b>'s reply function has run.
+ */
+void *
+workqueue_entry_get_arg(workqueue_entry_t *ent)
+{
+  return ent->arg;
+}
 
-   must hold lock */
+/** Return true iff the pool has an update that <b>thread</b> hasn't run
+ * yet. */
+static inline int
+worker_thread_has_update(workerthread_t *thread)
+{
+  return atomic_counter_get(&thread->in_pool->generation) !=
+    thread->generation;
+}
+
+/** Return true iff any of <b>thread</b>'s own queues has work on it.
+ *
+ * Without thread's lock, the answer is only a hint. */
 static int
-worker_thread_has_work(workerthread_t *thread)
+worker_thread_has_own_work(workerthread_t *thread)
 {
-  unsigned i;
-  for (i = WORKQUEUE_PRIORITY_FIRST; i <= WORKQUEUE_PRIORITY_LAST; ++i) {
-    if (!TOR_TAILQ_EMPTY(&thread->in_pool->work[i]))
-        return 1;
-  }
-  return thread->generation != thread->in_pool->generation;
+  return atomic_counter_get(&thread->n_pending) != 0;
 }
 
-/** Extract the next workqueue_entry_t from the the thread's pool, removing
- * it from the relevant queues and marking it as non-pending.
+/** Remove the next workqueue_entry_t from the queues of <b>victim</b>, on
+ * behalf of <b>thread</b> (which may be the same thread), mark it as
+ * non-pending, and return it.  Return NULL if <b>victim</b> has no work, or
+ * if <b>thread</b> has an update to run first.
  *
- * The caller must hold the lock. */
+ * We usually take the oldest entry with the highest priority.  Like the old
+ * single-queue version, with probability 1/lower_priority_chance we pass
+ * over the work we found and keep looking for lower-priority work, so that
+ * low-priority queues don't starve. */
 static workqueue_entry_t *
-worker_thread_extract_next_work(workerthread_t *thread)
+worker_thread_take_work_from(workerthread_t *thread, workerthread_t *victim)
 {
-  threadpool_t *pool = thread->in_pool;
   work_tailq_t *queue = NULL, *this_queue;
+  workqueue_entry_t *work = NULL;
   unsigned i;
+
+  tor_mutex_acquire(&victim->lock);
+  /* Work queued after an update must not run before it: checking here,
+   * with the queue's lock held, makes sure of that. */
+  if (worker_thread_has_update(thread))
+    goto done;
+
   for (i = WORKQUEUE_PRIORITY_FIRST; i <= WORKQUEUE_PRIORITY_LAST; ++i) {
-    this_queue = &pool->work[i];
+    this_queue = &victim->work[i];
     if (!TOR_TAILQ_EMPTY(this_queue)) {
       queue = this_queue;
-      if (! tor_weak_random_one_in_n(&pool->weak_rng,
+      if (! tor_weak_random_one_in_n(&thread->weak_rng,
                                      thread->lower_priority_chance)) {
         /* Usually we'll just break now, so that we can get out of the loop
          * and use the queue where we found work. But with a small
@@ -249,15 +328,120 @@ worker_thread_extract_next_work(workerthread_t *thread)
     }
   }
 
-  if (queue == NULL)
-    return NULL;
-
-  workqueue_entry_t *work = TOR_TAILQ_FIRST(queue);
-  TOR_TAILQ_REMOVE(queue, work, next_work);
-  work->pending = 0;
+  if (queue) {
+    work = TOR_TAILQ_FIRST(queue);
+    TOR_TAILQ_REMOVE(queue, work, next_work);
+    atomic_counter_sub(&victim->n_pending, 1);
+    work->pending = 0;
+  }
+ done:
+  tor_mutex_release(&victim->lock);
   return work;
 }
 
+/** Extract the next workqueue_entry_t for <b>thread</b> to run, removing it
+ * from the relevant queue and marking it as non-pending.  Return NULL if
+ * there is no work anywhere, or if <b>thread</b> has an update to run
+ * first.
+ *
+ * We run our own work first, and only steal when we have none.  Then we
+ * start at a random other thread, and go round the pool once, skipping
+ * every thread whose pending count is zero without taking its lock.  So a
+ * busy pool costs each worker one lock per item of work, and an idle one
+ * costs it no locks besides its own. */
+static workqueue_entry_t *
+worker_thread_extract_next_work(workerthread_t *thread)
+{
+  threadpool_t *pool = thread->in_pool;
+  workqueue_entry_t *work;
+  int start, i;
+
+  if (worker_thread_has_own_work(thread)) {
+    work = worker_thread_take_work_from(thread, thread);
+    if (work)
+      return work;
+  }
+
+  start = tor_weak_random_range(&thread->weak_rng, pool->n_threads);
+  for (i = 0; i < pool->n_threads; ++i) {
+    workerthread_t *victim =
+      pool->threads[(start + i) % pool->n_threads];
+    if (victim == thread ||
+        atomic_counter_get(&victim->n_pending) == 0)
+      continue;
+    work = worker_thread_take_work_from(thread, victim);
+    if (work)
+      return work;
+  }
+  return NULL;
+}
+
+/** Mark <b>thread</b> as waiting for work (if <b>waiting</b> is true), or as
+ * no longer waiting. */
+static void
+worker_thread_set_waiting(workerthread_t *thread, int waiting)
+{
+  tor_mutex_acquire(&thread->lock);
+  if (waiting) {
+    thread->waiting = 1;
+    thread->woken = 0;
+    atomic_counter_add(&thread->in_pool->n_waiting, 1);
+  } else {
+    thread->waiting = 0;
+    atomic_counter_sub(&thread->in_pool->n_waiting, 1);
+  }
+  tor_mutex_release(&thread->lock);
+}
+
+/** Block <b>thread</b> until somebody gives it work or an update.  The
+ * thread must already be marked as waiting. */
+static void
+worker_thread_wait(workerthread_t *thread)
+{
+  tor_mutex_acquire(&thread->lock);
+  if (!thread->woken && !worker_thread_has_own_work(thread) &&
+      !worker_thread_has_update(thread)) {
+    if (tor_cond_wait(&thread->condition, &thread->lock, NULL) < 0) {
+      log_warn(LD_GENERAL, "Fail tor_cond_wait.");
+    }
+  }
+  tor_mutex_release(&thread->lock);
+}
+
+/** If <b>thread</b> is waiting for work and nobody has woken it yet, wake
+ * it up and return 1.  Otherwise return 0.
+ *
+ * The caller must hold thread's lock. */
+static int
+worker_thread_wake_if_waiting(workerthread_t *thread)
+{
+  if (thread->waiting && !thread->woken) {
+    thread->woken = 1;
+    tor_cond_signal_one(&thread->condition);
+    return 1;
+  }
+  return 0;
+}
+
+/** Run the pool's current update function on <b>thread</b>, and return its
+ * result. */
+static workqueue_reply_t
+worker_thread_run_update(workerthread_t *thread)
+{
+  threadpool_t *pool = thread->in_pool;
+  workqueue_reply_t (*update_fn)(void*,void*);
+  void *arg;
+
+  tor_mutex_acquire(&pool->lock);
+  arg = pool->update_args[thread->index];
+  pool->update_args[thread->index] = NULL;
+  update_fn = pool->update_fn;
+  thread->generation = atomic_counter_get(&pool->generation);
+  tor_mutex_release(&pool->lock);
+
+  return update_fn(thread->state, arg);
+}
+
 /**
  * Main function for the worker thread.
  */
@@ -265,58 +449,39 @@ static void
 worker_thread_main(void *thread_)
 {
   workerthread_t *thread = thread_;
-  threadpool_t *pool = thread->in_pool;
   workqueue_entry_t *work;
   workqueue_reply_t result;
 
-  tor_mutex_acquire(&pool->lock);
   while (1) {
-    /* lock must be held at this point. */
-    while (worker_thread_has_work(thread)) {
-      /* lock must be held at this point. */
-      if (thread->in_pool->generation != thread->generation) {
-        void *arg = thread->in_pool->update_args[thread->index];
-        thread->in_pool->update_args[thread->index] = NULL;
-        workqueue_reply_t (*update_fn)(void*,void*) =
-            thread->in_pool->update_fn;
-        thread->generation = thread->in_pool->generation;
-        tor_mutex_release(&pool->lock);
-
-        workqueue_reply_t r = update_fn(thread->state, arg);
-
-        if (r != WQ_RPL_REPLY) {
-          return;
-        }
-
-        tor_mutex_acquire(&pool->lock);
-        continue;
-      }
-      work = worker_thread_extract_next_work(thread);
-      if (BUG(work == NULL))
-        break;
-      tor_mutex_release(&pool->lock);
-
-      /* We run the work function without holding the thread lock. This
-       * is the main thread's first opportunity to give us more work. */
-      result = work->fn(thread->state, work->arg);
-
-      /* Queue the reply for the main thread. */
-      queue_reply(thread->reply_queue, work);
-
-      /* We may need to exit the thread. */
-      if (result != WQ_RPL_REPLY) {
+    if (worker_thread_has_update(thread)) {
+      if (worker_thread_run_update(thread) != WQ_RPL_REPLY) {
         return;
       }
-      tor_mutex_acquire(&pool->lock);
+      continue;
     }
-    /* At this point the lock is held, and there is no work in this thread's
-     * queue. */
 
-    /* TODO: support an idle-function */
+    work = worker_thread_extract_next_work(thread);
+    if (!work) {
+      /* Say that we're waiting before we look for the last time: anybody
+       * who queues work after that will wake us up. */
+      worker_thread_set_waiting(thread, 1);
+      work = worker_thread_extract_next_work(thread);
+      if (!work)
+        worker_thread_wait(thread);
+      worker_thread_set_waiting(thread, 0);
+      if (!work)
+        continue;
+    }
 
-    /* Okay. Now, wait till somebody has work for us. */
-    if (tor_cond_wait(&pool->condition, &pool->lock, NULL) < 0) {
-      log_warn(LD_GENERAL, "Fail tor_cond_wait.");
+    /* We run the work function without holding any lock. */
+    result = work->fn(thread->state, work->arg);
+
+    /* Queue the reply for the main thread. */
+    queue_reply(thread->reply_queue, work);
+
+    /* We may need to exit the thread. */
+    if (result != WQ_RPL_REPLY) {
+      return;
     }
   }
 }
@@ -326,39 +491,53 @@ worker_thread_main(void *thread_)
 static void
 queue_reply(replyqueue_t *queue, workqueue_entry_t *work)
 {
-  int was_empty;
+  workqueue_entry_t *head;
+#ifdef HAVE_WORKING_STDATOMIC
+  head = atomic_load_explicit(&queue->incoming, memory_order_relaxed);
+  do {
+    work->next_reply = head;
+  } while (!atomic_compare_exchange_weak_explicit(&queue->incoming,
+                                                  &head, work,
+                                                  memory_order_release,
+                                                  memory_order_relaxed));
+#else
   tor_mutex_acquire(&queue->lock);
-  was_empty = TOR_TAILQ_EMPTY(&queue->answers);
-  TOR_TAILQ_INSERT_TAIL(&queue->answers, work, next_work);
+  head = queue->incoming;
+  work->next_reply = head;
+  queue->incoming = work;
   tor_mutex_release(&queue->lock);
+#endif /* defined(HAVE_WORKING_STDATOMIC) */
 
-  if (was_empty) {
+  /* If the stack was nonempty, the main thread has a wakeup coming
+   * already, and will take this answer along with the others. */
+  if (head == NULL) {
     if (queue->alert.alert_fn(queue->alert.write_fd) < 0) {
       /* XXXX complain! */
     }
   }
 }
 
-/** Allocate and start a new worker thread to use state object <b>state</b>,
- * and send responses to <b>replyqueue</b>. */
+/** Allocate a new worker thread to use state object <b>state</b>, and send
+ * responses to <b>replyqueue</b>.  Don't start it yet. */
 static workerthread_t *
 workerthread_new(int32_t lower_priority_chance,
                  void *state, threadpool_t *pool, replyqueue_t *replyqueue)
 {
   workerthread_t *thr = tor_malloc_zero(sizeof(workerthread_t));
+  unsigned i, seed;
   thr->state = state;
   thr->reply_queue = replyqueue;
   thr->in_pool = pool;
   thr->lower_priority_chance = lower_priority_chance;
-
-  if (spawn_func(worker_thread_main, thr) < 0) {
-    //LCOV_EXCL_START
-    tor_assert_nonfatal_unreached();
-    log_err(LD_GENERAL, "Can't launch worker thread.");
-    tor_free(thr);
-    return NULL;
-    //LCOV_EXCL_STOP
+  thr->generation = atomic_counter_get(&pool->generation);
+  tor_mutex_init_for_cond(&thr->lock);
+  tor_cond_init(&thr->condition);
+  for (i = WORKQUEUE_PRIORITY_FIRST; i <= WORKQUEUE_PRIORITY_LAST; ++i) {
+    TOR_TAILQ_INIT(&thr->work[i]);
   }
+  atomic_counter_init(&thr->n_pending);
+  crypto_rand((void*)&seed, sizeof(seed));
+  tor_init_weak_random(&thr->weak_rng, seed);
 
   return thr;
 }
@@ -396,17 +575,38 @@ threadpool_queue_work_priority(threadpool_t *pool,
              ((int)prio) <= WORKQUEUE_PRIORITY_LAST);
 
   workqueue_entry_t *ent = workqueue_entry_new(fn, reply_fn, arg);
+  workerthread_t *thread;
+  int woke;
+  int i;
+
+  /* Take the threads in turn.  (If two callers race here, they may pick the
+   * same thread; that's harmless.) */
+  atomic_counter_add(&pool->next_thread, 1);
+  thread = pool->threads[atomic_counter_get(&pool->next_thread) %
+                         pool->n_threads];
+
   ent->on_pool = pool;
+  ent->on_thread = thread;
   ent->pending = 1;
   ent->priority = prio;
 
-  tor_mutex_acquire(&pool->lock);
-
-  TOR_TAILQ_INSERT_TAIL(&pool->work[prio], ent, next_work);
-
-  tor_cond_signal_one(&pool->condition);
-
-  tor_mutex_release(&pool->lock);
+  tor_mutex_acquire(&thread->lock);
+  TOR_TAILQ_INSERT_TAIL(&thread->work[prio], ent, next_work);
+  atomic_counter_add(&thread->n_pending, 1);
+  woke = worker_thread_wake_if_waiting(thread);
+  tor_mutex_release(&thread->lock);
+
+  /* If that thread is busy, but another one is idle, wake the idle one up
+   * so it can steal the work. */
+  for (i = 1; !woke && i < pool->n_threads; ++i) {
+    if (atomic_counter_get(&pool->n_waiting) == 0)
+      break;
+    workerthread_t *other =
+      pool->threads[(thread->index + i) % pool->n_threads];
+    tor_mutex_acquire(&other->lock);
+    woke = worker_thread_wake_if_waiting(other);
+    tor_mutex_release(&other->lock);
+  }
 
   return ent;
 }
@@ -464,12 +664,18 @@ threadpool_queue_update(threadpool_t *pool,
   pool->update_args = new_args;
   pool->free_update_arg_fn = free_fn;
   pool->update_fn = fn;
-  ++pool->generation;
-
-  tor_cond_signal_all(&pool->condition);
+  atomic_counter_add(&pool->generation, 1);
 
   tor_mutex_release(&pool->lock);
 
+  for (i = 0; i < n_threads; ++i) {
+    workerthread_t *thread = pool->threads[i];
+    tor_mutex_acquire(&thread->lock);
+    thread->woken = 1;
+    tor_cond_signal_one(&thread->condition);
+    tor_mutex_release(&thread->lock);
+  }
+
   if (old_args) {
     for (i = 0; i < n_threads; ++i) {
       if (old_args[i] && old_args_free_fn)
@@ -492,20 +698,25 @@ threadpool_queue_update(threadpool_t *pool,
 #define CHANCE_PERMISSIVE 37
 #define CHANCE_STRICT INT32_MAX
 
-/** Launch threads until we have <b>n</b>. */
+/** Create <b>n</b> threads for <b>pool</b>, and launch them. */
 static int
 threadpool_start_threads(threadpool_t *pool, int n)
 {
-  if (BUG(n < 0))
+  int i;
+  if (BUG(n < 1))
     return -1; // LCOV_EXCL_LINE
   if (n > MAX_THREADS)
     n = MAX_THREADS;
 
   tor_mutex_acquire(&pool->lock);
 
-  if (pool->n_threads < n)
-    pool->threads = tor_reallocarray(pool->threads,
-                                     sizeof(workerthread_t*), n);
+  /* Threads steal from one another through this array, so we can only set
+   * it up once, before any of them start. */
+  if (BUG(pool->n_threads)) {
+    tor_mutex_release(&pool->lock); // LCOV_EXCL_LINE
+    return -1; // LCOV_EXCL_LINE
+  }
+  pool->threads = tor_calloc(n, sizeof(workerthread_t*));
 
   while (pool->n_threads < n) {
     /* For half of our threads, we'll choose lower priorities permissively;
@@ -516,19 +727,20 @@ threadpool_start_threads(threadpool_t *pool, int n)
     void *state = pool->new_thread_state_fn(pool->new_thread_state_arg);
     workerthread_t *thr = workerthread_new(chance,
                                            state, pool, pool->reply_queue);
+    thr->index = pool->n_threads;
+    pool->threads[pool->n_threads++] = thr;
+  }
+  tor_mutex_release(&pool->lock);
 
-    if (!thr) {
+  for (i = 0; i < n; ++i) {
+    if (spawn_func(worker_thread_main, pool->threads[i]) < 0) {
       //LCOV_EXCL_START
       tor_assert_nonfatal_unreached();
-      pool->free_thread_state_fn(state);
-      tor_mutex_release(&pool->lock);
+      log_err(LD_GENERAL, "Can't launch worker thread.");
       return -1;
       //LCOV_EXCL_STOP
     }
-    thr->index = pool->n_threads;
-    pool->threads[pool->n_threads++] = thr;
   }
-  tor_mutex_release(&pool->lock);
 
   return 0;
 }
@@ -550,16 +762,9 @@ threadpool_new(int n_threads,
   threadpool_t *pool;
   pool = tor_malloc_zero(sizeof(threadpool_t));
   tor_mutex_init_nonrecursive(&pool->lock);
-  tor_cond_init(&pool->condition);
-  unsigned i;
-  for (i = WORKQUEUE_PRIORITY_FIRST; i <= WORKQUEUE_PRIORITY_LAST; ++i) {
-    TOR_TAILQ_INIT(&pool->work[i]);
-  }
-  {
-    unsigned seed;
-    crypto_rand((void*)&seed, sizeof(seed));
-    tor_init_weak_random(&pool->weak_rng, seed);
-  }
+  atomic_counter_init(&pool->next_thread);
+  atomic_counter_init(&pool->n_waiting);
+  atomic_counter_init(&pool->generation);
 
   pool->new_thread_state_fn = new_thread_state_fn;
   pool->new_thread_state_arg = arg;
@@ -569,7 +774,6 @@ threadpool_new(int n_threads,
   if (threadpool_start_threads(pool, n_threads) < 0) {
     //LCOV_EXCL_START
     tor_assert_nonfatal_unreached();
-    tor_cond_uninit(&pool->condition);
     tor_mutex_uninit(&pool->lock);
     tor_free(pool);
     return NULL;
@@ -603,7 +807,11 @@ replyqueue_new(uint32_t alertsocks_flags)
     //LCOV_EXCL_STOP
   }
 
+#ifdef HAVE_WORKING_STDATOMIC
+  atomic_init(&rq->incoming, NULL);
+#else
   tor_mutex_init(&rq->lock);
+#endif
   TOR_TAILQ_INIT(&rq->answers);
 
   return rq;
@@ -647,13 +855,60 @@ threadpool_register_reply_event(threadpool_t *tp,
 }
 
 /**
- * Process all pending replies on a reply queue. The main thread should call
+ * Make <b>queue</b> handle no more than <b>max</b> replies each time
+ * replyqueue_process() is called, so that a flood of replies can't keep the
+ * main thread from everything else.  If <b>max</b> is 0, there is no limit.
+ */
+void
+replyqueue_set_max_per_process(replyqueue_t *queue, unsigned max)
+{
+  queue->max_per_process = max;
+}
+
+/** Take every answer from the incoming stack of <b>queue</b>, and append
+ * them to its answers list in the order they were queued. */
+static void
+replyqueue_take_incoming(replyqueue_t *queue)
+{
+  workqueue_entry_t *stack, *reversed = NULL, *next;
+
+#ifdef HAVE_WORKING_STDATOMIC
+  stack = atomic_exchange_explicit(&queue->incoming, NULL,
+                                   memory_order_acquire);
+#else
+  tor_mutex_acquire(&queue->lock);
+  stack = queue->incoming;
+  queue->incoming = NULL;
+  tor_mutex_release(&queue->lock);
+#endif /* defined(HAVE_WORKING_STDATOMIC) */
+
+  /* The stack is newest-first; flip it. */
+  for (; stack; stack = next) {
+    next = stack->next_reply;
+    stack->next_reply = reversed;
+    reversed = stack;
+  }
+  for (; reversed; reversed = next) {
+    next = reversed->next_reply;
+    reversed->next_reply = NULL;
+    TOR_TAILQ_INSERT_TAIL(&queue->answers, reversed, next_work);
+  }
+}
+
+/**
+ * Process pending replies on a reply queue. The main thread should call
  * this function every time the socket returned by replyqueue_get_socket() is
  * readable.
+ *
+ * If the queue has a limit set with replyqueue_set_max_per_process(), and
+ * there are more replies than that, handle only that many, and make the
+ * socket readable again so that we come back for the rest.
  */
 void
 replyqueue_process(replyqueue_t *queue)
 {
+  workqueue_entry_t *work;
+  unsigned n_handled = 0;
   int r = queue->alert.drain_fn(queue->alert.read_fd);
   if (r < 0) {
     //LCOV_EXCL_START
@@ -664,19 +919,47 @@ replyqueue_process(replyqueue_t *queue)
     //LCOV_EXCL_STOP
   }
 
-  tor_mutex_acquire(&queue->lock);
-  while (!TOR_TAILQ_EMPTY(&queue->answers)) {
-    /* lock must be held at this point.*/
-    workqueue_entry_t *work = TOR_TAILQ_FIRST(&queue->answers);
+  replyqueue_take_incoming(queue);
+
+  while ((work = TOR_TAILQ_FIRST(&queue->answers))) {
+    if (queue->max_per_process && n_handled >= queue->max_per_process) {
+      /* Let the event loop do something else, then come back. */
+      if (queue->alert.alert_fn(queue->alert.write_fd) < 0) {
+        /* XXXX complain! */
+      }
+      break;
+    }
     TOR_TAILQ_REMOVE(&queue->answers, work, next_work);
-    tor_mutex_release(&queue->lock);
     work->on_pool = NULL;
 
     work->reply_fn(work->arg);
     workqueue_entry_free(work);
-
-    tor_mutex_acquire(&queue->lock);
+    ++n_handled;
   }
+}
 
-  tor_mutex_release(&queue->lock);
+#ifdef TOR_UNIT_TESTS
+/** Take the work that the thread with index <b>thread_idx</b> in <b>pool</b>
+ * would run next, without running it.  Free the workqueue entry, set
+ * *<b>prio_out</b> to its priority, and return its argument; or return NULL
+ * if there is no work.
+ *
+ * Tests use this while the pool's threads are all busy, so that which work
+ * gets taken doesn't depend on thread scheduling. */
+STATIC void *
+threadpool_take_next_work_for_thread(threadpool_t *pool, int thread_idx,
+                                     workqueue_priority_t *prio_out)
+{
+  workqueue_entry_t *work;
+  void *arg;
+
+  tor_assert(thread_idx >= 0 && thread_idx < pool->n_threads);
+  work = worker_thread_extract_next_work(pool->threads[thread_idx]);
+  if (!work)
+    return NULL;
+  *prio_out = work->priority;
+  arg = work->arg;
+  workqueue_entry_free(work);
+  return arg;
 }
+#endif /* defined(TOR_UNIT_TESTS) */
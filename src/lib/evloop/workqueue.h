@@ -10,6 +10,7 @@
 #define TOR_WORKQUEUE_H
 
 #include "lib/cc/torint.h"
+#include "lib/testsupport/testsupport.h"
 
 /** A replyqueue is used to tell the main thread about the outcome of
  * work that we queued for the workers. */
@@ -53,6 +54,7 @@ int threadpool_queue_update(threadpool_t *pool,
                             void (*free_fn)(void *),
                             void *arg);
 void *workqueue_entry_cancel(workqueue_entry_t *pending_work);
+void *workqueue_entry_get_arg(workqueue_entry_t *ent);
 threadpool_t *threadpool_new(int n_threads,
                              replyqueue_t *replyqueue,
                              void *(*new_thread_state_fn)(void*),
@@ -62,8 +64,17 @@ replyqueue_t *threadpool_get_replyqueue(threadpool_t *tp);
 
 replyqueue_t *replyqueue_new(uint32_t alertsocks_flags);
 void replyqueue_process(replyqueue_t *queue);
+void replyqueue_set_max_per_process(replyqueue_t *queue, unsigned max);
 
 int threadpool_register_reply_event(threadpool_t *tp,
                                     void (*cb)(threadpool_t *tp));
 
+#ifdef WORKQUEUE_PRIVATE
+#ifdef TOR_UNIT_TESTS
+STATIC void *threadpool_take_next_work_for_thread(
+                                            threadpool_t *pool, int thread_idx,
+                                            workqueue_priority_t *prio_out);
+#endif
+#endif /* defined(WORKQUEUE_PRIVATE) */
+
 #endif /* !defined(TOR_WORKQUEUE_H) */
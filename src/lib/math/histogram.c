@@ -0,0 +1,116 @@
+/* Copyright (c) 2019, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file histogram.c
+ *
+ * \brief Implements histograms with logarithmically-sized buckets, for
+ * recording latencies and other values that span several orders of
+ * magnitude.
+ *
+ * A value below 2^LOG_HISTOGRAM_SUB_BITS gets a bucket of its own.  Above
+ * that, each power of two is split into 2^LOG_HISTOGRAM_SUB_BITS buckets of
+ * equal width, so that the top LOG_HISTOGRAM_SUB_BITS+1 bits of a value
+ * pick its bucket.
+ **/
+
+#include "orconfig.h"
+#include "lib/math/histogram.h"
+#include "lib/intmath/bits.h"
+#include "lib/intmath/cmp.h"
+
+#include "lib/log/util_bug.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+/** Return the index of the bucket that holds <b>value</b>. */
+int
+log_histogram_bucket(uint32_t value)
+{
+  int log2;
+
+  if (value < (1u << LOG_HISTOGRAM_SUB_BITS))
+    return (int) value;
+
+  log2 = tor_log2(value);
+  return ((log2 - LOG_HISTOGRAM_SUB_BITS + 1) << LOG_HISTOGRAM_SUB_BITS) |
+    (int) ((value >> (log2 - LOG_HISTOGRAM_SUB_BITS)) &
+           ((1u << LOG_HISTOGRAM_SUB_BITS) - 1));
+}
+
+/** Return the largest value that falls in <b>bucket</b>. */
+uint32_t
+log_histogram_bucket_max(int bucket)
+{
+  int shift;
+  uint64_t lo;
+
+  tor_assert(bucket >= 0 && bucket < LOG_HISTOGRAM_N_BUCKETS);
+  if (bucket < (1 << LOG_HISTOGRAM_SUB_BITS))
+    return (uint32_t) bucket;
+
+  shift = (bucket >> LOG_HISTOGRAM_SUB_BITS) - 1;
+  lo = ((uint64_t) (bucket & ((1 << LOG_HISTOGRAM_SUB_BITS) - 1)) |
+        (UINT64_C(1) << LOG_HISTOGRAM_SUB_BITS)) << shift;
+  return (uint32_t) (lo + (UINT64_C(1) << shift) - 1);
+}
+
+/** Record <b>value</b> in <b>hist</b>. */
+void
+log_histogram_add(log_histogram_t *hist, uint32_t value)
+{
+  ++hist->counts[log_histogram_bucket(value)];
+  ++hist->n;
+  hist->sum += value;
+  hist->max = MAX(hist->max, value);
+}
+
+/** Return an upper bound for the value below which <b>pct</b> percent of the
+ * values in <b>hist</b> fall, or 0 if <b>hist</b> is empty. */
+uint32_t
+log_histogram_percentile(const log_histogram_t *hist, double pct)
+{
+  uint64_t rank, seen = 0;
+  double exact_rank;
+  int i;
+
+  if (!hist->n)
+    return 0;
+
+  exact_rank = ceil(hist->n * pct / 100.0);
+  rank = CLAMP(1, (uint64_t) exact_rank, hist->n);
+  for (i = 0; i < LOG_HISTOGRAM_N_BUCKETS; ++i) {
+    seen += hist->counts[i];
+    if (seen >= rank)
+      return MIN(log_histogram_bucket_max(i), hist->max);
+  }
+  return hist->max;
+}
+
+/** Return the mean of the values in <b>hist</b>, or 0 if it is empty. */
+uint64_t
+log_histogram_mean(const log_histogram_t *hist)
+{
+  return hist->n ? hist->sum / hist->n : 0;
+}
+
+/** Halve every count in <b>hist</b>, so that the values we record from now
+ * on weigh twice as much as the ones we have already recorded.  Calling this
+ * every so often keeps a histogram's percentiles close to recent values. */
+void
+log_histogram_halve(log_histogram_t *hist)
+{
+  uint64_t old_n = hist->n;
+  int i, top = -1;
+
+  hist->n = 0;
+  for (i = 0; i < LOG_HISTOGRAM_N_BUCKETS; ++i) {
+    hist->counts[i] /= 2;
+    hist->n += hist->counts[i];
+    if (hist->counts[i])
+      top = i;
+  }
+  hist->sum = old_n ? (uint64_t) ((double) hist->sum * hist->n / old_n) : 0;
+  hist->max = top < 0 ? 0 : MIN(hist->max, log_histogram_bucket_max(top));
+}
@@ -0,0 +1,44 @@
+/* Copyright (c) 2019, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file histogram.h
+ *
+ * \brief Header for histogram.c
+ **/
+
+#ifndef TOR_HISTOGRAM_H
+#define TOR_HISTOGRAM_H
+
+#include "lib/cc/compat_compiler.h"
+#include "lib/cc/torint.h"
+
+/** Each power of two in a log_histogram_t is split into this many buckets,
+ * as a power of two: with 2, every bucket is at most 25% wide. */
+#define LOG_HISTOGRAM_SUB_BITS 2
+/** How many buckets a log_histogram_t needs to cover every uint32_t. */
+#define LOG_HISTOGRAM_N_BUCKETS ((32 - LOG_HISTOGRAM_SUB_BITS + 1) << \
+                                 LOG_HISTOGRAM_SUB_BITS)
+
+/** A histogram of uint32_t values, with buckets whose width grows with their
+ * values, so that every value is recorded to within a fixed relative
+ * precision in a fixed amount of memory. */
+typedef struct log_histogram_t {
+  /** How many values have fallen in each bucket. */
+  uint64_t counts[LOG_HISTOGRAM_N_BUCKETS];
+  /** How many values we have recorded in all. */
+  uint64_t n;
+  /** The sum of every value we have recorded. */
+  uint64_t sum;
+  /** The largest value we have recorded. */
+  uint32_t max;
+} log_histogram_t;
+
+int log_histogram_bucket(uint32_t value);
+uint32_t log_histogram_bucket_max(int bucket);
+void log_histogram_add(log_histogram_t *hist, uint32_t value);
+uint32_t log_histogram_percentile(const log_histogram_t *hist, double pct);
+uint64_t log_histogram_mean(const log_histogram_t *hist);
+void log_histogram_halve(log_histogram_t *hist);
+
+#endif /* !defined(TOR_HISTOGRAM_H) */
@@ -273,10 +273,11 @@ char *
 memarea_strndup(memarea_t *area, const char *s, size_t n)
 {
   size_t ln = 0;
+  const char *nul;
   char *result;
   tor_assert(n < SIZE_T_CEILING);
-  for (ln = 0; ln < n && s[ln]; ++ln)
-    ;
+  nul = memchr(s, '\0', n);
+  ln = nul ? (size_t)(nul - s) : n;
   result = memarea_alloc(area, ln+1);
   memcpy(result, s, ln);
   result[ln]='\0';
@@ -20,11 +20,38 @@
 #include <winsock2.h>
 #endif
 
+#include <limits.h>
 #include <stdlib.h>
 
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
+
+#if defined(HAVE_SYS_UIO_H) && defined(HAVE_READV) && defined(HAVE_WRITEV) \
+  && !defined(_WIN32)
+/** Defined if we can move data between a buf_t and a file descriptor with a
+ * single readv()/writev() call spanning several chunks. */
+#define USE_BUF_IOVEC
+#endif
+
+#ifdef USE_BUF_IOVEC
+#ifndef IOV_MAX
+#define IOV_MAX 16
+#endif
+/** Size of the iovec arrays that we keep on the stack. */
+#define BUF_IOV_ARRAY_LEN 64
+/** Largest number of chunks that we'll hand to a single readv() or writev()
+ * call. */
+#define BUF_MAX_IOV \
+  (IOV_MAX < BUF_IOV_ARRAY_LEN ? IOV_MAX : BUF_IOV_ARRAY_LEN)
+/** Largest number of fresh chunks that we'll allocate for a single readv()
+ * call.  We don't know in advance how much data is waiting for us, so we
+ * don't want to allocate too much memory speculatively. */
+#define BUF_MAX_NEW_READ_CHUNKS 4
+#endif /* defined(USE_BUF_IOVEC) */
 
 #ifdef PARANOIA
 /** Helper: If PARANOIA is defined, assert that the buffer in local variable
@@ -81,6 +108,100 @@ read_to_chunk(buf_t *buf, chunk_t *chunk, tor_socket_t fd, size_t at_most,
   }
 }
 
+#ifdef USE_BUF_IOVEC
+/** Read up to <b>at_most</b> bytes from the file descriptor <b>fd</b> onto
+ * the end of <b>buf</b> with a single readv() call, filling whatever space
+ * is left in the tail chunk and then in up to BUF_MAX_NEW_READ_CHUNKS new
+ * chunks.  If we get an EOF, set *<b>reached_eof</b> to 1.  Set
+ * *<b>readlen_out</b> to the number of bytes we asked for.  Return -1 on
+ * error (and sets *<b>error</b> to errno), 0 on eof or blocking, and the
+ * number of bytes read otherwise.
+ */
+static int
+read_to_chunks(buf_t *buf, tor_socket_t fd, size_t at_most,
+               int *reached_eof, int *error, size_t *readlen_out)
+{
+  struct iovec iov[BUF_IOV_ARRAY_LEN];
+  chunk_t *chunks[BUF_IOV_ARRAY_LEN];
+  int n_iov = 0, n_new = 0, i;
+  size_t readlen = 0;
+  ssize_t read_result;
+  int e;
+
+  if (buf->tail && CHUNK_REMAINING_CAPACITY(buf->tail)) {
+    size_t cap = CHUNK_REMAINING_CAPACITY(buf->tail);
+    if (cap > at_most)
+      cap = at_most;
+    chunks[n_iov] = buf->tail;
+    iov[n_iov].iov_base = CHUNK_WRITE_PTR(buf->tail);
+    iov[n_iov].iov_len = cap;
+    readlen += cap;
+    ++n_iov;
+  }
+  while (readlen < at_most && n_iov < BUF_MAX_IOV &&
+         n_new < BUF_MAX_NEW_READ_CHUNKS) {
+    size_t cap = at_most - readlen;
+    chunk_t *chunk = buf_add_chunk_with_capacity(buf, cap, 1);
+    if (cap > chunk->memlen)
+      cap = chunk->memlen;
+    chunks[n_iov] = chunk;
+    iov[n_iov].iov_base = CHUNK_WRITE_PTR(chunk);
+    iov[n_iov].iov_len = cap;
+    readlen += cap;
+    ++n_iov;
+    ++n_new;
+  }
+  *readlen_out = readlen;
+
+  read_result = readv(fd, iov, n_iov);
+  e = errno;
+
+  /* Credit the bytes we got to the chunks that received them. */
+  i = 0;
+  if (read_result > 0) {
+    size_t left = (size_t) read_result;
+    for ( ; i < n_iov && left; ++i) {
+      size_t n = iov[i].iov_len < left ? iov[i].iov_len : left;
+      chunks[i]->datalen += n;
+      left -= n;
+    }
+    buf->datalen += read_result;
+  }
+
+  /* Chunks i and later got nothing.  Every chunk but the tail must hold
+   * data, so free the unused ones.  If nothing at all arrived, keep the
+   * first one as our (possibly empty) tail, as read_to_chunk() would. */
+  if (i < n_iov) {
+    int j;
+    if (i == 0)
+      ++i;
+    chunks[i-1]->next = NULL;
+    buf->tail = chunks[i-1];
+    for (j = i; j < n_iov; ++j) {
+      buf_chunk_free_unchecked(chunks[j]);
+    }
+  }
+
+  if (read_result < 0) {
+    if (!ERRNO_IS_EAGAIN(e)) { /* it's a real error */
+      if (error)
+        *error = e;
+      return -1;
+    }
+    return 0; /* would block. */
+  } else if (read_result == 0) {
+    log_debug(LD_NET,"Encountered eof on fd %d", (int)fd);
+    *reached_eof = 1;
+    return 0;
+  } else { /* actually got bytes. */
+    log_debug(LD_NET,"Read %ld bytes into %d chunks. %d on inbuf.",
+              (long)read_result, n_iov, (int)buf->datalen);
+    tor_assert(read_result < INT_MAX);
+    return (int)read_result;
+  }
+}
+#endif /* defined(USE_BUF_IOVEC) */
+
 /** Read from file descriptor <b>fd</b>, writing onto end of <b>buf</b>.  Read
  * at most <b>at_most</b> bytes, growing the buffer as necessary.  If recv()
  * returns 0 (because of EOF), set *<b>reached_eof</b> to 1 and return 0.
@@ -108,6 +229,22 @@ buf_read_from_fd(buf_t *buf, int fd, size_t at_most,
   if (BUG(buf->datalen >= INT_MAX - at_most))
     return -1;
 
+#ifdef USE_BUF_IOVEC
+  (void) is_socket;
+  while (at_most > total_read) {
+    size_t readlen = 0;
+    r = read_to_chunks(buf, fd, at_most - total_read,
+                       reached_eof, socket_error, &readlen);
+    check();
+    if (r < 0)
+      return r; /* Error */
+    tor_assert(total_read+r < INT_MAX);
+    total_read += r;
+    if ((size_t)r < readlen) { /* eof, block, or no more to read. */
+      break;
+    }
+  }
+#else /* !defined(USE_BUF_IOVEC) */
   while (at_most > total_read) {
     size_t readlen = at_most - total_read;
     chunk_t *chunk;
@@ -133,6 +270,7 @@ buf_read_from_fd(buf_t *buf, int fd, size_t at_most,
       break;
     }
   }
+#endif /* defined(USE_BUF_IOVEC) */
   return (int)total_read;
 }
 
@@ -175,6 +313,55 @@ flush_chunk(tor_socket_t fd, buf_t *buf, chunk_t *chunk, size_t sz,
   }
 }
 
+#ifdef USE_BUF_IOVEC
+/** Helper for buf_flush_to_socket(): try to write <b>sz</b> bytes from the
+ * front of <b>buf</b> onto file descriptor <b>fd</b> with a single writev()
+ * call that spans as many chunks as we need.  Set *<b>writelen_out</b> to
+ * the number of bytes we tried to write.  On success, deduct the bytes
+ * written from *<b>buf_flushlen</b>.  Return the number of bytes written on
+ * success, 0 on blocking, -1 on failure.
+ */
+static inline int
+flush_chunks(tor_socket_t fd, buf_t *buf, size_t sz,
+             size_t *buf_flushlen, size_t *writelen_out)
+{
+  struct iovec iov[BUF_IOV_ARRAY_LEN];
+  const chunk_t *chunk;
+  int n_iov = 0;
+  size_t writelen = 0;
+  ssize_t write_result;
+
+  for (chunk = buf->head; chunk && writelen < sz && n_iov < BUF_MAX_IOV;
+       chunk = chunk->next) {
+    size_t n = chunk->datalen;
+    if (n > sz - writelen)
+      n = sz - writelen;
+    iov[n_iov].iov_base = chunk->data;
+    iov[n_iov].iov_len = n;
+    writelen += n;
+    ++n_iov;
+  }
+  *writelen_out = writelen;
+
+  write_result = writev(fd, iov, n_iov);
+
+  if (write_result < 0) {
+    int e = errno;
+
+    if (!ERRNO_IS_EAGAIN(e)) { /* it's a real error */
+      return -1;
+    }
+    log_debug(LD_NET,"writev() would block, returning.");
+    return 0;
+  } else {
+    *buf_flushlen -= write_result;
+    buf_drain(buf, write_result);
+    tor_assert(write_result < INT_MAX);
+    return (int)write_result;
+  }
+}
+#endif /* defined(USE_BUF_IOVEC) */
+
 /** Write data from <b>buf</b> to the file descriptor <b>fd</b>.  Write at most
  * <b>sz</b> bytes, decrement *<b>buf_flushlen</b> by
  * the number of bytes actually written, and remove the written bytes
@@ -200,6 +387,21 @@ buf_flush_to_fd(buf_t *buf, int fd, size_t sz,
   }
 
   check();
+#ifdef USE_BUF_IOVEC
+  (void) is_socket;
+  while (sz) {
+    size_t flushlen0 = 0;
+    tor_assert(buf->head);
+    r = flush_chunks(fd, buf, sz, buf_flushlen, &flushlen0);
+    check();
+    if (r < 0)
+      return r;
+    flushed += r;
+    sz -= r;
+    if (r == 0 || (size_t)r < flushlen0) /* can't flush any more now. */
+      break;
+  }
+#else /* !defined(USE_BUF_IOVEC) */
   while (sz) {
     size_t flushlen0;
     tor_assert(buf->head);
@@ -217,6 +419,7 @@ buf_flush_to_fd(buf_t *buf, int fd, size_t sz,
     if (r == 0 || (size_t)r < flushlen0) /* can't flush any more now. */
       break;
   }
+#endif /* defined(USE_BUF_IOVEC) */
   tor_assert(flushed < INT_MAX);
   return (int)flushed;
 }
@@ -29,6 +29,9 @@
 #ifdef HAVE_FCNTL_H
 #include <fcntl.h>
 #endif
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
 #include <stddef.h>
 #include <string.h>
 #ifdef __FreeBSD__
@@ -554,6 +557,28 @@ tor_addr_from_getsockname(struct tor_addr_t *addr_out, tor_socket_t sock)
   return tor_addr_from_sockaddr(addr_out, (struct sockaddr *)&ss, NULL);
 }
 
+/** Send up to <b>len</b> bytes of the file <b>fd</b>, starting at
+ * *<b>offset</b>, to the socket <b>s</b>, without copying them through our
+ * own memory, and advance *<b>offset</b> past them.  Return the number of
+ * bytes sent, which is 0 only if the file ends at *<b>offset</b>.  On error,
+ * return -1 and set errno: as with send(), that includes the case where
+ * <b>s</b> would block.  If we can't do this on this platform, errno is
+ * ENOSYS. */
+ssize_t
+tor_sendfile(tor_socket_t s, int fd, off_t *offset, size_t len)
+{
+#ifdef TOR_HAVE_SENDFILE
+  return sendfile(s, fd, offset, len);
+#else
+  (void)s;
+  (void)fd;
+  (void)offset;
+  (void)len;
+  errno = ENOSYS;
+  return -1;
+#endif /* defined(TOR_HAVE_SENDFILE) */
+}
+
 /** Turn <b>socket</b> into a nonblocking socket. Return 0 on success, -1
  * on failure.
  */
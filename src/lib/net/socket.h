@@ -51,6 +51,13 @@ int tor_addr_from_getsockname(struct tor_addr_t *addr_out, tor_socket_t sock);
 #define tor_socket_send(s, buf, len, flags) send(s, buf, len, flags)
 #define tor_socket_recv(s, buf, len, flags) recv(s, buf, len, flags)
 
+#if defined(HAVE_SYS_SENDFILE_H) && defined(HAVE_SENDFILE) && !defined(_WIN32)
+/** Defined if tor_sendfile() can copy data from a file straight to a
+ * socket. */
+#define TOR_HAVE_SENDFILE
+#endif
+ssize_t tor_sendfile(tor_socket_t s, int fd, off_t *offset, size_t len);
+
 int set_socket_nonblocking(tor_socket_t socket);
 int tor_socketpair(int family, int type, int protocol, tor_socket_t fd[2]);
 int network_init(void);
@@ -215,6 +215,12 @@ static int filter_nopar_gen[] = {
     SCMP_SYS(sched_getaffinity),
 #ifdef __NR_sched_yield
     SCMP_SYS(sched_yield),
+#endif
+#ifdef __NR_sendfile
+    SCMP_SYS(sendfile),
+#endif
+#ifdef __NR_sendfile64
+    SCMP_SYS(sendfile64),
 #endif
     SCMP_SYS(sendmsg),
     SCMP_SYS(set_robust_list),
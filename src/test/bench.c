@@ -29,6 +29,7 @@
 #include "lib/crypt_ops/crypto_dh.h"
 #include "core/crypto/onion_ntor.h"
 #include "lib/crypt_ops/crypto_ed25519.h"
+#include "lib/crypt_ops/crypto_format.h"
 #include "lib/crypt_ops/crypto_rand.h"
 #include "feature/dircommon/consdiff.h"
 #include "lib/compress/compress.h"
@@ -38,9 +39,15 @@
 
 #include "lib/crypt_ops/digestset.h"
 #include "lib/crypt_ops/crypto_init.h"
+#include "lib/memarea/memarea.h"
 
 #include "feature/dirparse/microdesc_parse.h"
+#include "feature/dirparse/ns_parse.h"
+#include "feature/dirparse/parsecommon.h"
 #include "feature/nodelist/microdesc.h"
+#include "feature/nodelist/networkstatus.h"
+
+#include "feature/nodelist/networkstatus_st.h"
 
 #if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_PROCESS_CPUTIME_ID)
 static uint64_t nanostart;
@@ -677,6 +684,183 @@ bench_md_parse(void)
   printf("Microdesc parse: %f nsec\n", NANOCOUNT(start, end, N));
 }
 
+/** Helper: return a newly allocated string that looks enough like a
+ * microdesc consensus with <b>n_routers</b> routers to be diffed and
+ * parsed (but not to have its signature checked).  Each router with index
+ * i gets identity digest i; it's listed with probability <b>listed_pct</b>
+ * percent, and its bandwidth is <b>bw_base</b> + i, plus a random amount
+ * with probability <b>bw_change_pct</b> percent. */
+static char *
+bench_make_consensus(int n_routers, int listed_pct, int bw_change_pct,
+                     int bw_base)
+{
+  smartlist_t *lines = smartlist_new();
+  char digest[DIGEST256_LEN];
+  char id_b64[BASE64_DIGEST_LEN+1];
+  char md_b64[BASE64_DIGEST256_LEN+1];
+  char sig[256];
+  char sig_b64[512];
+  char *result;
+
+  smartlist_add_asprintf(lines, "network-status-version 3 microdesc\n"
+                         "vote-status consensus\n"
+                         "consensus-method 28\n"
+                         "valid-after 2019-01-01 00:00:00\n"
+                         "fresh-until 2019-01-01 01:00:00\n"
+                         "valid-until 2019-01-01 03:00:00\n"
+                         "voting-delay 300 300\n"
+                         "client-versions 0.4.0.1-alpha\n"
+                         "server-versions 0.4.0.1-alpha\n"
+                         "known-flags Fast Running Stable V2Dir Valid\n"
+                         "params circwindow=1000 refuseunknownexits=1\n"
+                         "dir-source bench %s 127.0.0.1 127.0.0.1 80 443\n"
+                         "contact bench@example.com\n"
+                         "vote-digest %s\n",
+                         "00000000000000000000000000000000000000AA",
+                         "00000000000000000000000000000000000000BB");
+  for (int i = 0; i < n_routers; ++i) {
+    int bw = bw_base + i;
+    if (crypto_rand_int(100) >= listed_pct)
+      continue;
+    if (crypto_rand_int(100) < bw_change_pct)
+      bw += crypto_rand_int(1000);
+    memset(digest, 0, sizeof(digest));
+    set_uint32(digest, htonl(i));
+    digest_to_base64(id_b64, digest);
+    digest256_to_base64(md_b64, digest);
+    smartlist_add_asprintf(lines,
+          "r router%d %s 2019-01-01 00:00:00 10.%d.%d.%d 9001 0\n"
+          "m %s\n"
+          "s Fast Running Stable V2Dir Valid\n"
+          "v Tor 0.4.1.5\n"
+          "pr Cons=1-2 Desc=1-2 DirCache=1-2 HSDir=1-2 Link=1-5\n"
+          "w Bandwidth=%d\n",
+          i, id_b64, (i >> 16) & 0xff, (i >> 8) & 0xff, i & 0xff,
+          md_b64, bw);
+  }
+  memset(sig, 0x5a, sizeof(sig));
+  base64_encode(sig_b64, sizeof(sig_b64), sig, sizeof(sig),
+                BASE64_ENCODE_MULTILINE);
+  smartlist_add_asprintf(lines, "directory-footer\n"
+                         "bandwidth-weights Wbd=0 Wbe=0 Wbg=4143\n"
+                         "directory-signature sha256 %s %s\n"
+                         "-----BEGIN SIGNATURE-----\n%s"
+                         "-----END SIGNATURE-----\n",
+                         "00000000000000000000000000000000000000AA",
+                         "00000000000000000000000000000000000000CC",
+                         sig_b64);
+  result = smartlist_join_strings(lines, "", 0, NULL);
+  SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+  smartlist_free(lines);
+  return result;
+}
+
+static void
+bench_ns_parse(void)
+{
+  const int N = 20;
+  const int n_routers = 7000;
+  uint64_t start, end;
+  char *cons = bench_make_consensus(n_routers, 100, 0, 1000);
+  size_t len = strlen(cons);
+  int n_rs = 0;
+
+  reset_perftime();
+  start = perftime();
+  for (int i = 0; i < N; ++i) {
+    networkstatus_t *ns = networkstatus_parse_vote_from_string(
+                                   cons, len, NULL, NS_TYPE_CONSENSUS);
+    tor_assert(ns);
+    n_rs = smartlist_len(ns->routerstatus_list);
+    networkstatus_vote_free(ns);
+  }
+  end = perftime();
+  printf("Consensus parse, %d routers: %.2f msec (%.1f nsec/byte)\n",
+         n_rs, NANOCOUNT(start, end, N) / 1e6,
+         NANOCOUNT(start, end, N) / len);
+  tor_free(cons);
+}
+
+/** Token table for bench_tokenize: the same as the one for routerstatus
+ * entries. */
+static token_rule_t bench_rs_token_table[] = {
+  T01("p",                   K_P,               CONCAT_ARGS, NO_OBJ ),
+  T1( "r",                   K_R,                   GE(7),   NO_OBJ ),
+  T0N("a",                   K_A,                   GE(1),   NO_OBJ ),
+  T1( "s",                   K_S,                   ARGS,    NO_OBJ ),
+  T01("v",                   K_V,               CONCAT_ARGS, NO_OBJ ),
+  T01("w",                   K_W,                   ARGS,    NO_OBJ ),
+  T0N("m",                   K_M,               CONCAT_ARGS, NO_OBJ ),
+  T0N("id",                  K_ID,                  GE(2),   NO_OBJ ),
+  T01("pr",                  K_PROTO,           CONCAT_ARGS, NO_OBJ ),
+  T0N("opt",                 K_OPT,             CONCAT_ARGS, OBJ_OK ),
+  END_OF_TABLE
+};
+
+static void
+bench_tokenize(void)
+{
+  const int N = 20;
+  uint64_t start, end;
+  char *cons = bench_make_consensus(7000, 100, 0, 1000);
+  const char *body = strstr(cons, "\nr ") + 1;
+  const char *body_end = strstr(body, "\ndirectory-footer") + 1;
+  smartlist_t *tokens = smartlist_new();
+  memarea_t *area = memarea_new();
+  int n_tokens = 0;
+
+  reset_perftime();
+  start = perftime();
+  for (int i = 0; i < N; ++i) {
+    int r = tokenize_string(area, body, body_end, tokens,
+                            bench_rs_token_table, TS_NOCHECK);
+    tor_assert(r == 0);
+    n_tokens = smartlist_len(tokens);
+    SMARTLIST_FOREACH(tokens, directory_token_t *, t, token_clear(t));
+    smartlist_clear(tokens);
+    memarea_clear(area);
+  }
+  end = perftime();
+  printf("Tokenize routerstatus entries: %.2f msec for %d tokens "
+         "(%.1f nsec/token)\n", NANOCOUNT(start, end, N) / 1e6, n_tokens,
+         NANOCOUNT(start, end, N) / n_tokens);
+
+  smartlist_free(tokens);
+  memarea_drop_all(area);
+  tor_free(cons);
+}
+
+static void
+bench_consdiff(void)
+{
+  const int N = 10;
+  const int n_routers = 7000;
+  const int bw_change_pcts[] = { 1, 10, 50 };
+  uint64_t start, end;
+  char *cons1 = bench_make_consensus(n_routers, 98, 0, 1000);
+
+  reset_perftime();
+  for (unsigned k = 0; k < ARRAY_LENGTH(bw_change_pcts); ++k) {
+    char *cons2 = bench_make_consensus(n_routers, 98, bw_change_pcts[k],
+                                       1000);
+    size_t difflen = 0;
+    start = perftime();
+    for (int i = 0; i < N; ++i) {
+      char *diff = consensus_diff_generate(cons1, strlen(cons1),
+                                           cons2, strlen(cons2));
+      tor_assert(diff);
+      difflen = strlen(diff);
+      tor_free(diff);
+    }
+    end = perftime();
+    printf("Consensus diff, %d routers, %d%% changed: %.2f msec "
+           "(%"TOR_PRIuSZ" bytes)\n", n_routers, bw_change_pcts[k],
+           NANOCOUNT(start, end, N) / 1e6, difflen);
+    tor_free(cons2);
+  }
+  tor_free(cons1);
+}
+
 typedef void (*bench_fn)(void);
 
 typedef struct benchmark_t {
@@ -706,6 +890,9 @@ static struct benchmark_t benchmarks[] = {
 #endif
 
   ENT(md_parse),
+  ENT(ns_parse),
+  ENT(tokenize),
+  ENT(consdiff),
   {NULL,NULL,0}
 };
 
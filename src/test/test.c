@@ -32,6 +32,7 @@
 #define ROUTER_PRIVATE
 #define CIRCUITSTATS_PRIVATE
 #define CIRCUITLIST_PRIVATE
+#define CPUWORKER_PRIVATE
 #define MAINLOOP_PRIVATE
 #define STATEFILE_PRIVATE
 
@@ -47,6 +48,7 @@
 #include "feature/rend/rendcache.h"
 #include "feature/rend/rendparse.h"
 #include "test/test.h"
+#include "core/mainloop/cpuworker.h"
 #include "core/mainloop/mainloop.h"
 #include "lib/memarea/memarea.h"
 #include "core/or/onion.h"
@@ -64,6 +66,7 @@
 #include "feature/rend/rend_intro_point_st.h"
 #include "feature/rend/rend_service_descriptor_st.h"
 #include "feature/relay/onion_queue.h"
+#include "test/fakechans.h"
 
 /** Run unit tests for the onion handshake code. */
 static void
@@ -354,6 +357,159 @@ test_onion_queues(void *arg)
   tor_free(onionskin);
 }
 
+#define N_FLOOD_CIRCS 150
+
+/** Run unit tests for sharing the onion queues between channels. */
+static void
+test_onion_queue_fairness(void *arg)
+{
+  uint8_t buf[NTOR_ONIONSKIN_LEN] = {0};
+  or_circuit_t *flood[N_FLOOD_CIRCS];
+  or_circuit_t *quiet = NULL, *circ;
+  channel_t *flood_chan = new_fake_channel();
+  channel_t *quiet_chan = new_fake_channel();
+  create_cell_t *create, *onionskin = NULL;
+  int i, n_queued = 0, n_refused = 0;
+  (void)arg;
+
+  /* Make the queue fill up after 100 msec worth of ntor handshakes. */
+  get_options_mutable()->MaxOnionQueueDelay = 100;
+  get_options_mutable()->NumCPUs = 1;
+
+  /* One channel floods us until the queue is full. */
+  for (i = 0; i < N_FLOOD_CIRCS; ++i) {
+    flood[i] = or_circuit_new(0, NULL);
+    TO_CIRCUIT(flood[i])->purpose = CIRCUIT_PURPOSE_OR;
+    flood[i]->p_chan = flood_chan;
+    create = tor_malloc_zero(sizeof(create_cell_t));
+    create_cell_init(create, CELL_CREATE2, ONION_HANDSHAKE_TYPE_NTOR,
+                     NTOR_ONIONSKIN_LEN, buf);
+    if (onion_pending_add(flood[i], create) == 0) {
+      ++n_queued;
+    } else {
+      ++n_refused;
+      tor_free(create);
+    }
+  }
+  tt_int_op(n_refused, OP_GT, 0);
+  tt_int_op(onion_num_pending(ONION_HANDSHAKE_TYPE_NTOR), OP_EQ, n_queued);
+
+  /* Another channel still gets in, pushing out the flood's newest. */
+  quiet = or_circuit_new(0, NULL);
+  TO_CIRCUIT(quiet)->purpose = CIRCUIT_PURPOSE_OR;
+  quiet->p_chan = quiet_chan;
+  create = tor_malloc_zero(sizeof(create_cell_t));
+  create_cell_init(create, CELL_CREATE2, ONION_HANDSHAKE_TYPE_NTOR,
+                   NTOR_ONIONSKIN_LEN, buf);
+  tt_int_op(onion_pending_add(quiet, create), OP_EQ, 0);
+  tt_int_op(onion_num_pending(ONION_HANDSHAKE_TYPE_NTOR), OP_EQ, n_queued);
+  tt_assert(TO_CIRCUIT(flood[n_queued - 1])->marked_for_close);
+  tt_ptr_op(flood[n_queued - 1]->onionqueue_entry, OP_EQ, NULL);
+
+  /* The flood can't push itself out. */
+  create = tor_malloc_zero(sizeof(create_cell_t));
+  create_cell_init(create, CELL_CREATE2, ONION_HANDSHAKE_TYPE_NTOR,
+                   NTOR_ONIONSKIN_LEN, buf);
+  tt_int_op(onion_pending_add(flood[N_FLOOD_CIRCS - 1], create), OP_EQ, -1);
+  tor_free(create);
+
+  /* The channels take turns, so the quiet one doesn't wait for the flood. */
+  circ = onion_next_task(&onionskin);
+  tt_ptr_op(circ, OP_EQ, flood[0]);
+  tor_free(onionskin);
+  circ = onion_next_task(&onionskin);
+  tt_ptr_op(circ, OP_EQ, quiet);
+  tor_free(onionskin);
+  circ = onion_next_task(&onionskin);
+  tt_ptr_op(circ, OP_EQ, flood[1]);
+  tor_free(onionskin);
+  tt_int_op(onion_num_pending(ONION_HANDSHAKE_TYPE_NTOR), OP_EQ,
+            n_queued - 3);
+
+  clear_pending_onions();
+  tt_int_op(0, OP_EQ, onion_num_pending(ONION_HANDSHAKE_TYPE_NTOR));
+
+ done:
+  clear_pending_onions();
+  for (i = 0; i < N_FLOOD_CIRCS; ++i) {
+    flood[i]->p_chan = NULL;
+    circuit_free_(TO_CIRCUIT(flood[i]));
+  }
+  if (quiet) {
+    quiet->p_chan = NULL;
+    circuit_free_(TO_CIRCUIT(quiet));
+  }
+  tor_free(onionskin);
+  free_fake_channel(flood_chan);
+  free_fake_channel(quiet_chan);
+}
+
+static void
+test_onion_cost_model(void *arg)
+{
+  uint8_t buf[NTOR_ONIONSKIN_LEN] = {0};
+  or_circuit_t *circs[10];
+  create_cell_t *create;
+  uint64_t p99;
+  int i;
+  (void)arg;
+
+  memset(circs, 0, sizeof(circs));
+  get_options_mutable()->NumCPUs = 1;
+  cpuworker_reset_onionskin_costs();
+
+  /* With no timings, we guess a millisecond. */
+  tt_u64_op(estimated_usec_for_onionskins(10, ONION_HANDSHAKE_TYPE_NTOR),
+            OP_EQ, 10000);
+  tt_u64_op(estimated_p99_usec_for_onionskin(ONION_HANDSHAKE_TYPE_NTOR),
+            OP_EQ, 1000);
+
+  for (i = 0; i < 200; ++i)
+    cpuworker_note_onionskin_usec(ONION_HANDSHAKE_TYPE_NTOR, 100);
+  tt_u64_op(estimated_usec_for_onionskins(10, ONION_HANDSHAKE_TYPE_NTOR),
+            OP_EQ, 1000);
+  tt_u64_op(estimated_p99_usec_for_onionskin(ONION_HANDSHAKE_TYPE_NTOR),
+            OP_EQ, 100);
+  /* TAP is still a guess. */
+  tt_u64_op(estimated_usec_for_onionskins(10, ONION_HANDSHAKE_TYPE_TAP),
+            OP_EQ, 10000);
+
+  /* When the handshakes get slower, the model catches up within a few
+   * dozen timings.  (A plain average would still say about 320 usec.) */
+  for (i = 0; i < 64; ++i)
+    cpuworker_note_onionskin_usec(ONION_HANDSHAKE_TYPE_NTOR, 1000);
+  tt_u64_op(estimated_usec_for_onionskins(1, ONION_HANDSHAKE_TYPE_NTOR),
+            OP_GT, 800);
+  p99 = estimated_p99_usec_for_onionskin(ONION_HANDSHAKE_TYPE_NTOR);
+  tt_u64_op(p99, OP_EQ, 1000);
+
+  /* With nothing queued and nothing at the cpuworkers, a new onionskin only
+   * waits for itself. */
+  tt_u64_op(cpuworker_estimated_usec_in_flight(), OP_EQ, 0);
+  tt_u64_op(onion_estimated_queue_delay_usec(ONION_HANDSHAKE_TYPE_NTOR),
+            OP_EQ, p99);
+
+  /* Otherwise, it waits for everything ahead of it in the queue, too. */
+  for (i = 0; i < 10; ++i) {
+    circs[i] = or_circuit_new(0, NULL);
+    TO_CIRCUIT(circs[i])->purpose = CIRCUIT_PURPOSE_OR;
+    create = tor_malloc_zero(sizeof(create_cell_t));
+    create_cell_init(create, CELL_CREATE2, ONION_HANDSHAKE_TYPE_NTOR,
+                     NTOR_ONIONSKIN_LEN, buf);
+    tt_int_op(onion_pending_add(circs[i], create), OP_EQ, 0);
+  }
+  tt_u64_op(onion_estimated_queue_delay_usec(ONION_HANDSHAKE_TYPE_NTOR),
+            OP_EQ,
+            estimated_usec_for_onionskins(10, ONION_HANDSHAKE_TYPE_NTOR) +
+            p99);
+
+ done:
+  clear_pending_onions();
+  for (i = 0; i < 10; ++i)
+    circuit_free_(TO_CIRCUIT(circs[i]));
+  cpuworker_reset_onionskin_costs();
+}
+
 static crypto_cipher_t *crypto_rand_aes_cipher = NULL;
 
 // Mock replacement for crypto_rand: Generates bytes from a provided AES_CTR
@@ -820,6 +976,8 @@ static struct testcase_t test_array[] = {
   ENT(onion_handshake),
   { "bad_onion_handshake", test_bad_onion_handshake, 0, NULL, NULL },
   ENT(onion_queues),
+  FORK(onion_queue_fairness),
+  FORK(onion_cost_model),
   { "ntor_handshake", test_ntor_handshake, 0, NULL, NULL },
   { "fast_handshake", test_fast_handshake, 0, NULL, NULL },
   FORK(circuit_timeout),
@@ -922,6 +1080,7 @@ struct testgroup_t testgroups[] = {
   { "socks/", socks_tests },
   { "status/" , status_tests },
   { "storagedir/", storagedir_tests },
+  { "threadpool/", threadpool_tests },
   { "tortls/", tortls_tests },
 #ifndef ENABLE_NSS
   { "tortls/openssl/", tortls_openssl_tests },
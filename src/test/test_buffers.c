@@ -7,6 +7,7 @@
 #define PROTO_HTTP_PRIVATE
 #include "core/or/or.h"
 #include "lib/buf/buffers.h"
+#include "lib/net/buffers_net.h"
 #include "lib/tls/buffers_tls.h"
 #include "lib/tls/tortls.h"
 #include "lib/compress/compress.h"
@@ -435,6 +436,60 @@ test_buffer_allocation_tracking(void *arg)
   tor_free(junk);
 }
 
+static void
+test_buffer_freelists(void *arg)
+{
+  char *junk = tor_malloc_zero(16384);
+  buf_t *buf1 = NULL, *buf2 = NULL;
+  int i;
+
+  (void)arg;
+
+  buf_shrink_freelists(1);
+  tt_int_op(buf_get_freelist_allocation(), OP_EQ, 0);
+
+  buf1 = buf_new();
+  for (i = 0; i < 4; ++i)
+    buf_add(buf1, junk, 4000);
+  tt_int_op(buf_allocation(buf1), OP_EQ, 16384);
+  tt_int_op(buf_get_total_allocation(), OP_EQ, 16384);
+
+  /* Draining a chunk puts it on the freelist instead of freeing it. */
+  buf_drain(buf1, 4096);
+  tt_int_op(buf_get_total_allocation(), OP_EQ, 12288);
+  tt_int_op(buf_get_freelist_allocation(), OP_EQ, 4096);
+
+  /* ... and the next allocation of that size takes it back. */
+  buf2 = buf_new();
+  buf_add(buf2, junk, 4000);
+  tt_int_op(buf_get_total_allocation(), OP_EQ, 16384);
+  tt_int_op(buf_get_freelist_allocation(), OP_EQ, 0);
+
+  /* Chunks of other sizes go to their own freelists. */
+  buf_add(buf2, junk, 16384);
+  tt_int_op(buf_allocation(buf2), OP_EQ, 4096 + 16384);
+  buf_free(buf2);
+  tt_int_op(buf_get_freelist_allocation(), OP_EQ, 4096 + 16384);
+  tt_int_op(buf_get_total_allocation(), OP_EQ, 12288);
+
+  /* Every chunk on the freelists was put there since the last shrink, so
+   * none of them has sat idle for a whole interval yet: a gentle shrink
+   * frees nothing.  Only a full shrink empties the freelists. */
+  tt_int_op(buf_shrink_freelists(0), OP_EQ, 0);
+  buf_free(buf1);
+  tt_int_op(buf_get_freelist_allocation(), OP_EQ, 4*4096 + 16384);
+  tt_int_op(buf_shrink_freelists(0), OP_EQ, 0);
+  tt_int_op(buf_shrink_freelists(1), OP_EQ, 4*4096 + 16384);
+  tt_int_op(buf_get_freelist_allocation(), OP_EQ, 0);
+  tt_int_op(buf_get_total_allocation(), OP_EQ, 0);
+
+ done:
+  buf_free(buf1);
+  buf_free(buf2);
+  buf_shrink_freelists(1);
+  tor_free(junk);
+}
+
 static void
 test_buffer_time_tracking(void *arg)
 {
@@ -705,6 +760,81 @@ test_buffers_tls_read_mocked(void *arg)
   buf_free(buf);
 }
 
+#ifndef _WIN32
+static void
+test_buffers_socket_multichunk(void *arg)
+{
+  (void)arg;
+  buf_t *buf = NULL, *buf2 = NULL;
+  tor_socket_t fds[2] = { TOR_INVALID_SOCKET, TOR_INVALID_SOCKET };
+  char *mem = tor_malloc(4000), *out = tor_malloc(4010);
+  size_t flushlen;
+  int reached_eof = 0, socket_error = 0;
+  int i;
+
+  for (i = 0; i < 4000; ++i)
+    mem[i] = (char)(i % 251);
+
+  tt_int_op(0, OP_EQ, tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  tt_int_op(0, OP_EQ, set_socket_nonblocking(fds[0]));
+  tt_int_op(0, OP_EQ, set_socket_nonblocking(fds[1]));
+
+  /* Small chunks, so that the data spans a lot of them. */
+  buf = buf_new_with_capacity(100);
+  for (i = 0; i < 4000; i += 500)
+    buf_add(buf, mem + i, 500);
+  tt_assert(buf->head->next->next);
+
+  /* Flush all but the last 100 bytes. */
+  flushlen = buf_datalen(buf);
+  tt_int_op(3900, OP_EQ, buf_flush_to_socket(buf, fds[0], 3900, &flushlen));
+  tt_int_op(100, OP_EQ, flushlen);
+  tt_int_op(100, OP_EQ, buf_datalen(buf));
+  buf_assert_ok(buf);
+  tt_int_op(100, OP_EQ, buf_flush_to_socket(buf, fds[0], 100, &flushlen));
+  tt_int_op(0, OP_EQ, flushlen);
+  tt_int_op(0, OP_EQ, buf_datalen(buf));
+  buf_assert_ok(buf);
+
+  /* Read it back onto a buffer whose tail chunk is partially full. */
+  buf2 = buf_new_with_capacity(100);
+  buf_add(buf2, "0123456789", 10);
+  tt_int_op(4000, OP_EQ, buf_read_from_socket(buf2, fds[1], 8000,
+                                              &reached_eof, &socket_error));
+  tt_int_op(0, OP_EQ, reached_eof);
+  tt_int_op(4010, OP_EQ, buf_datalen(buf2));
+  buf_assert_ok(buf2);
+  buf_get_bytes(buf2, out, 4010);
+  tt_mem_op(out, OP_EQ, "0123456789", 10);
+  tt_mem_op(out + 10, OP_EQ, mem, 4000);
+
+  /* Nothing is waiting: we should block without breaking the buffer. */
+  tt_int_op(0, OP_EQ, buf_read_from_socket(buf2, fds[1], 8000,
+                                           &reached_eof, &socket_error));
+  tt_int_op(0, OP_EQ, reached_eof);
+  tt_int_op(0, OP_EQ, buf_datalen(buf2));
+  buf_assert_ok(buf2);
+
+  /* Now we should see the EOF. */
+  tor_close_socket(fds[0]);
+  fds[0] = TOR_INVALID_SOCKET;
+  tt_int_op(0, OP_EQ, buf_read_from_socket(buf2, fds[1], 8000,
+                                           &reached_eof, &socket_error));
+  tt_int_op(1, OP_EQ, reached_eof);
+  buf_assert_ok(buf2);
+
+ done:
+  if (SOCKET_OK(fds[0]))
+    tor_close_socket(fds[0]);
+  if (SOCKET_OK(fds[1]))
+    tor_close_socket(fds[1]);
+  buf_free(buf);
+  buf_free(buf2);
+  tor_free(mem);
+  tor_free(out);
+}
+#endif /* !defined(_WIN32) */
+
 static void
 test_buffers_chunk_size(void *arg)
 {
@@ -802,9 +932,14 @@ struct testcase_t buffer_tests[] = {
   { "startswith", test_buffer_peek_startswith, 0, NULL, NULL },
   { "allocation_tracking", test_buffer_allocation_tracking, TT_FORK,
     NULL, NULL },
+  { "freelists", test_buffer_freelists, TT_FORK, NULL, NULL },
   { "time_tracking", test_buffer_time_tracking, TT_FORK, NULL, NULL },
   { "tls_read_mocked", test_buffers_tls_read_mocked, 0,
     NULL, NULL },
+#ifndef _WIN32
+  { "socket_multichunk", test_buffers_socket_multichunk, TT_FORK,
+    NULL, NULL },
+#endif
   { "chunk_size", test_buffers_chunk_size, 0, NULL, NULL },
   { "find_contentlen", test_buffers_find_contentlen, 0, NULL, NULL },
 
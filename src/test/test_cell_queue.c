@@ -139,8 +139,70 @@ test_circuit_n_cells(void *arg)
   circuit_free_(TO_CIRCUIT(origin_c));
 }
 
+static void
+test_cq_pool(void *arg)
+{
+  cell_queue_t cq;
+  packed_cell_t *pc = NULL;
+  size_t cost = packed_cell_mem_cost();
+  size_t idle;
+  int i;
+  (void)arg;
+
+  cell_queue_init(&cq);
+  tt_int_op(cell_queues_get_total_allocation(), OP_EQ, 0);
+
+  /* Fill a few slabs' worth of cells.  The unused part of the last slab
+   * can't be given back, so it doesn't count as idle. */
+  cell_queue_alloc_batch(&cq, 200);
+  tt_int_op(cq.n, OP_EQ, 200);
+  tt_int_op(cell_queues_get_total_allocation(), OP_EQ, 200 * cost);
+  tt_int_op(packed_cell_pool_get_idle_allocation(), OP_EQ, 0);
+
+  /* Freeing a few cells out of full slabs doesn't make them idle either. */
+  for (i = 0; i < 10; ++i) {
+    pc = cell_queue_pop(&cq);
+    packed_cell_free(pc);
+  }
+  tt_int_op(cell_queues_get_total_allocation(), OP_EQ, 190 * cost);
+  tt_int_op(packed_cell_pool_get_idle_allocation(), OP_EQ, 0);
+  tt_int_op(packed_cell_pool_shrink(), OP_EQ, 0);
+  cell_queue_alloc_batch(&cq, 10);
+
+  /* Cells come out zeroed, with cache-line aligned bodies. */
+  for (i = 0; i < 200; ++i) {
+    packed_cell_t *c = cell_queue_pop(&cq);
+    tt_assert(c);
+    tt_int_op(((uintptr_t)c->body) % 64, OP_EQ, 0);
+    tt_assert(tor_mem_is_zero(c->body, sizeof(c->body)));
+    tt_int_op(c->inserted_timestamp, OP_EQ, 0);
+    memset(c->body, 0xff, sizeof(c->body));
+    cell_queue_append(&cq, c);
+  }
+
+  /* Freeing everything leaves some completely empty slabs behind... */
+  cell_queue_clear(&cq);
+  tt_int_op(cell_queues_get_total_allocation(), OP_EQ, 0);
+  idle = packed_cell_pool_get_idle_allocation();
+  tt_int_op(idle, OP_GT, 0);
+
+  /* ... which we reuse, without leaking old contents. */
+  pc = packed_cell_new();
+  tt_assert(tor_mem_is_zero(pc->body, sizeof(pc->body)));
+  packed_cell_free(pc);
+
+  tt_int_op(packed_cell_pool_shrink(), OP_EQ, idle);
+  tt_int_op(packed_cell_pool_get_idle_allocation(), OP_EQ, 0);
+  tt_int_op(packed_cell_pool_shrink(), OP_EQ, 0);
+
+ done:
+  packed_cell_free(pc);
+  cell_queue_clear(&cq);
+}
+
 struct testcase_t cell_queue_tests[] = {
   { "basic", test_cq_manip, TT_FORK, NULL, NULL, },
+  { "pool", test_cq_pool, TT_FORK, NULL, NULL, },
   { "circ_n_cells", test_circuit_n_cells, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
@@ -182,6 +182,164 @@ test_clist_maps(void *arg)
   UNMOCK(circuitmux_detach_circuit);
 }
 
+/** Test that the map from channel and circuit ID keeps every entry
+ * findable as it grows and as entries come and go. */
+static void
+test_clist_chan_circid_map(void *arg)
+{
+  channel_t *ch1 = new_fake_channel();
+  channel_t *ch2 = new_fake_channel();
+  circid_t id;
+  int round;
+
+  (void) arg;
+
+  /* Enough entries that the map has to grow a few times. */
+  for (id = 1; id <= 3000; ++id) {
+    channel_mark_circid_unusable(ch1, id);
+    channel_mark_circid_unusable(ch2, id * 7);
+  }
+  tt_uint_op(chan_circid_map_n_entries(), OP_EQ, 6000);
+  /* Marking twice doesn't add anything. */
+  channel_mark_circid_unusable(ch1, 17);
+  tt_uint_op(chan_circid_map_n_entries(), OP_EQ, 6000);
+  for (id = 1; id <= 3000; ++id) {
+    tt_int_op(circuit_id_in_use_on_channel(id, ch1), OP_EQ, 2);
+    tt_int_op(circuit_id_in_use_on_channel(id * 7, ch2), OP_EQ, 2);
+  }
+  tt_int_op(circuit_id_in_use_on_channel(3001, ch1), OP_EQ, 0);
+  tt_int_op(circuit_id_in_use_on_channel(2, ch2), OP_EQ, 0);
+
+  /* Remove the odd IDs on ch1. */
+  for (id = 1; id <= 3000; id += 2)
+    channel_mark_circid_usable(ch1, id);
+  tt_uint_op(chan_circid_map_n_entries(), OP_EQ, 4500);
+  for (id = 1; id <= 3000; ++id) {
+    tt_int_op(circuit_id_in_use_on_channel(id, ch1), OP_EQ,
+              (id % 2) ? 0 : 2);
+    tt_int_op(circuit_id_in_use_on_channel(id * 7, ch2), OP_EQ, 2);
+  }
+
+  /* Lots of churn leaves lots of deleted slots behind, which we have to
+   * clean up without losing anything. */
+  for (round = 0; round < 20; ++round) {
+    for (id = 100000; id < 101000; ++id)
+      channel_mark_circid_unusable(ch1, id + round * 1000);
+    for (id = 100000; id < 101000; ++id)
+      channel_mark_circid_usable(ch1, id + round * 1000);
+  }
+  tt_uint_op(chan_circid_map_n_entries(), OP_EQ, 4500);
+  for (id = 1; id <= 3000; ++id) {
+    tt_int_op(circuit_id_in_use_on_channel(id, ch1), OP_EQ,
+              (id % 2) ? 0 : 2);
+    tt_int_op(circuit_id_in_use_on_channel(id * 7, ch2), OP_EQ, 2);
+  }
+
+  for (id = 1; id <= 3000; ++id) {
+    channel_mark_circid_usable(ch1, id);
+    channel_mark_circid_usable(ch2, id * 7);
+  }
+  tt_uint_op(chan_circid_map_n_entries(), OP_EQ, 0);
+
+ done:
+  tor_free(ch1);
+  tor_free(ch2);
+}
+
+/** Return the number of circuits on the lists of <b>chan</b>: the ones that
+ * use it as n_chan if <b>n</b> is true, else the ones that use it as
+ * p_chan. */
+static int
+count_chan_circuits(channel_t *chan, int n)
+{
+  circuit_t *circ;
+  or_circuit_t *or_circ;
+  int count = 0;
+
+  if (n) {
+    TOR_LIST_FOREACH(circ, &chan->n_circuits, n_chan_circuits)
+      ++count;
+  } else {
+    TOR_LIST_FOREACH(or_circ, &chan->p_circuits, p_chan_circuits)
+      ++count;
+  }
+  return count;
+}
+
+/** Test that each channel knows its circuits, and that unlinking a channel
+ * detaches and marks exactly those. */
+static void
+test_clist_chan_circuit_lists(void *arg)
+{
+  channel_t *ch1 = new_fake_channel();
+  channel_t *ch2 = new_fake_channel();
+  or_circuit_t *c1, *c2, *c3, *c4;
+
+  (void) arg;
+
+  setup_full_capture_of_logs(LOG_WARN);
+  ch1->cmux = circuitmux_alloc();
+  ch2->cmux = circuitmux_alloc();
+  circuitmux_set_policy(ch1->cmux, &ewma_policy);
+  circuitmux_set_policy(ch2->cmux, &ewma_policy);
+
+  c1 = or_circuit_new(10, ch1);
+  c2 = or_circuit_new(11, ch1);
+  c3 = or_circuit_new(12, ch2);
+  TO_CIRCUIT(c1)->purpose = CIRCUIT_PURPOSE_OR;
+  TO_CIRCUIT(c2)->purpose = CIRCUIT_PURPOSE_OR;
+  TO_CIRCUIT(c3)->purpose = CIRCUIT_PURPOSE_OR;
+  circuit_set_n_circid_chan(TO_CIRCUIT(c1), 20, ch2);
+  circuit_set_n_circid_chan(TO_CIRCUIT(c3), 21, ch1);
+  /* This one goes back out the channel it came from. */
+  c4 = or_circuit_new(13, ch1);
+  TO_CIRCUIT(c4)->purpose = CIRCUIT_PURPOSE_OR;
+  circuit_set_n_circid_chan(TO_CIRCUIT(c4), 22, ch1);
+  tt_int_op(count_chan_circuits(ch1, 0), OP_EQ, 3);
+  tt_int_op(count_chan_circuits(ch1, 1), OP_EQ, 2);
+  tt_int_op(count_chan_circuits(ch2, 0), OP_EQ, 1);
+  tt_int_op(count_chan_circuits(ch2, 1), OP_EQ, 1);
+  tt_uint_op(circuitmux_num_circuits(ch1->cmux), OP_EQ, 5);
+  tt_uint_op(circuitmux_num_circuits(ch2->cmux), OP_EQ, 2);
+
+  /* Moving a circuit moves it between lists. */
+  circuit_set_p_circid_chan(c2, 30, ch2);
+  tt_int_op(count_chan_circuits(ch1, 0), OP_EQ, 2);
+  tt_int_op(count_chan_circuits(ch2, 0), OP_EQ, 2);
+  tt_uint_op(circuitmux_num_circuits(ch1->cmux), OP_EQ, 4);
+  tt_uint_op(circuitmux_num_circuits(ch2->cmux), OP_EQ, 3);
+
+  /* Unlinking ch1 detaches and marks the circuits that used it, and only
+   * those, without falling back to searching the circuitmux. */
+  circuit_unlink_all_from_channel(ch1, END_CIRC_REASON_CHANNEL_CLOSED);
+  expect_no_log_entry();
+  tt_uint_op(circuitmux_num_circuits(ch1->cmux), OP_EQ, 0);
+  tt_uint_op(circuitmux_num_circuits(ch2->cmux), OP_EQ, 3);
+  tt_int_op(count_chan_circuits(ch1, 0), OP_EQ, 0);
+  tt_int_op(count_chan_circuits(ch1, 1), OP_EQ, 0);
+  tt_int_op(count_chan_circuits(ch2, 0), OP_EQ, 2);
+  tt_int_op(count_chan_circuits(ch2, 1), OP_EQ, 1);
+  tt_uint_op(ch1->num_n_circuits, OP_EQ, 0);
+  tt_uint_op(ch1->num_p_circuits, OP_EQ, 0);
+  tt_ptr_op(c1->p_chan, OP_EQ, NULL);
+  tt_ptr_op(TO_CIRCUIT(c3)->n_chan, OP_EQ, NULL);
+  tt_ptr_op(c4->p_chan, OP_EQ, NULL);
+  tt_ptr_op(TO_CIRCUIT(c4)->n_chan, OP_EQ, NULL);
+  tt_assert(TO_CIRCUIT(c1)->marked_for_close);
+  tt_assert(TO_CIRCUIT(c3)->marked_for_close);
+  tt_assert(TO_CIRCUIT(c4)->marked_for_close);
+  tt_assert(! TO_CIRCUIT(c2)->marked_for_close);
+  tt_ptr_op(c2->p_chan, OP_EQ, ch2);
+
+ done:
+  teardown_capture_of_logs();
+  circuit_free_all();
+  circuitmux_free(ch1->cmux);
+  circuitmux_free(ch2->cmux);
+  tor_free(ch1);
+  tor_free(ch2);
+}
+
 static void
 test_rend_token_maps(void *arg)
 {
@@ -312,6 +470,9 @@ test_pick_circid(void *arg)
 
   chan1 = tor_malloc_zero(sizeof(channel_t));
   chan2 = tor_malloc_zero(sizeof(channel_t));
+  /* The circuit ID map tells channels apart by their identifiers. */
+  chan1->global_identifier = 1;
+  chan2->global_identifier = 2;
   chan2->wide_circ_ids = 1;
 
   chan1->cmux = circuitmux_alloc();
@@ -466,6 +627,9 @@ test_hs_circuitmap_isolation(void *arg)
 
 struct testcase_t circuitlist_tests[] = {
   { "maps", test_clist_maps, TT_FORK, NULL, NULL },
+  { "chan_circid_map", test_clist_chan_circid_map, TT_FORK, NULL, NULL },
+  { "chan_circuit_lists", test_clist_chan_circuit_lists, TT_FORK,
+    NULL, NULL },
   { "rend_token_maps", test_rend_token_maps, TT_FORK, NULL, NULL },
   { "pick_circid", test_pick_circid, TT_FORK, NULL, NULL },
   { "hs_circuitmap_isolation", test_hs_circuitmap_isolation,
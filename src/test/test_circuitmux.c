@@ -4,16 +4,20 @@
 #define TOR_CHANNEL_INTERNAL_
 #define CIRCUITMUX_PRIVATE
 #define CIRCUITMUX_EWMA_PRIVATE
+#define CIRCUITMUX_EWMA_WHEEL_PRIVATE
 #define RELAY_PRIVATE
 #include "core/or/or.h"
 #include "core/or/channel.h"
 #include "core/or/circuitmux.h"
 #include "core/or/circuitmux_ewma.h"
+#include "core/or/circuitmux_ewma_wheel.h"
 #include "core/or/relay.h"
 #include "core/or/scheduler.h"
 #include "test/test.h"
 
+#include "core/or/circuit_st.h"
 #include "core/or/destroy_cell_queue_st.h"
+#include "lib/crypt_ops/crypto_rand.h"
 
 #include <math.h>
 
@@ -125,9 +129,211 @@ test_cmux_compute_ticks(void *arg)
   ;
 }
 
+static void
+test_cmux_ewma_wheel_keys(void *arg)
+{
+  const uint64_t halflife_msec = 30000;
+  int64_t k1, k2, k3;
+  (void)arg;
+
+  cmux_ewma_wheel_set_halflife(halflife_msec / 1000.0);
+
+  /* The first cells set the key. */
+  k1 = ewma_wheel_add_cells(EWMA_WHEEL_KEY_NONE, 1, 0);
+  tt_i64_op(k1, OP_EQ, 0);
+  k2 = ewma_wheel_add_cells(EWMA_WHEEL_KEY_NONE, 2, 0);
+  tt_i64_op(llabs(k2 - (int64_t)(log(2.0) * EWMA_WHEEL_KEY_SCALE)),
+            OP_LE, 1);
+
+  /* Cells sent at the same time add up. */
+  k3 = ewma_wheel_add_cells(k1, 1, 0);
+  tt_i64_op(llabs(k3 - k2), OP_LE, 1);
+
+  /* A cell sent one halflife later counts twice as much. */
+  k3 = ewma_wheel_add_cells(EWMA_WHEEL_KEY_NONE, 1, halflife_msec);
+  tt_i64_op(llabs(k3 - k2), OP_LE, 1);
+
+  /* 100 cells sent ten halflives ago count for less than one sent now. */
+  k1 = ewma_wheel_add_cells(EWMA_WHEEL_KEY_NONE, 100, 0);
+  k2 = ewma_wheel_add_cells(EWMA_WHEEL_KEY_NONE, 1, 10 * halflife_msec);
+  tt_i64_op(k1, OP_LT, k2);
+
+  /* Nothing overflows after a very long time. */
+  k1 = ewma_wheel_add_cells(EWMA_WHEEL_KEY_NONE, 1000,
+                            UINT64_C(10) * 365 * 86400 * 1000);
+  k2 = ewma_wheel_add_cells(k1, 1, UINT64_C(10) * 365 * 86400 * 1000);
+  tt_i64_op(k1, OP_GT, 0);
+  tt_i64_op(k2, OP_GT, k1);
+
+ done:
+  ;
+}
+
+static void
+test_cmux_ewma_wheel_halflife(void *arg)
+{
+  const circuitmux_policy_t *pol = &ewma_wheel_policy;
+  const uint64_t now_msec = 1000 * 1000;
+  circuitmux_t *cmux = NULL;
+  circuitmux_policy_data_t *pol_data = NULL;
+  circuitmux_policy_circ_data_t *cdata[2] = { NULL, NULL };
+  circuit_t circs[2];
+  int64_t k1, k2;
+  int i;
+  (void)arg;
+
+  monotime_enable_test_mocking();
+  monotime_coarse_set_mock_time_nsec(now_msec * 1000 * 1000);
+  memset(circs, 0, sizeof(circs));
+
+  /* Converting a key keeps its weighted count at that time. */
+  cmux_ewma_wheel_set_halflife(30.0);
+  k1 = ewma_wheel_add_cells(EWMA_WHEEL_KEY_NONE, 10, now_msec);
+  cmux_ewma_wheel_set_halflife(3.0);
+  k2 = ewma_wheel_add_cells(EWMA_WHEEL_KEY_NONE, 10, now_msec);
+  k1 = ewma_wheel_rekey(k1, log(2.0) / 30000.0, log(2.0) / 3000.0,
+                        now_msec);
+  tt_i64_op(llabs(k1 - k2), OP_LE, 2);
+  tt_i64_op(ewma_wheel_rekey(EWMA_WHEEL_KEY_NONE, log(2.0) / 30000.0,
+                             log(2.0) / 3000.0, now_msec),
+            OP_EQ, EWMA_WHEEL_KEY_NONE);
+
+  /* Circuit 0 has sent 100 cells and circuit 1 has sent 10. */
+  cmux_ewma_wheel_set_halflife(30.0);
+  cmux = circuitmux_alloc();
+  pol_data = pol->alloc_cmux_data(cmux);
+  for (i = 0; i < 2; ++i) {
+    cdata[i] = pol->alloc_circ_data(cmux, pol_data, &circs[i],
+                                    CELL_DIRECTION_OUT, 0);
+    pol->notify_circ_active(cmux, pol_data, &circs[i], cdata[i]);
+  }
+  pol->notify_xmit_cells(cmux, pol_data, &circs[0], cdata[0], 100);
+  pol->notify_xmit_cells(cmux, pol_data, &circs[1], cdata[1], 10);
+  tt_ptr_op(pol->pick_active_circuit(cmux, pol_data), OP_EQ, &circs[1]);
+
+  /* After the halflife changes, one more cell on circuit 1 still leaves it
+   * well below circuit 0, even though its new cell is keyed with the new
+   * halflife and circuit 0's cells were keyed with the old one. */
+  cmux_ewma_wheel_set_halflife(3.0);
+  pol->notify_xmit_cells(cmux, pol_data, &circs[1], cdata[1], 1);
+  tt_ptr_op(pol->pick_active_circuit(cmux, pol_data), OP_EQ, &circs[1]);
+  tt_i64_op(ewma_wheel_get_key(cdata[0]), OP_GT,
+            ewma_wheel_get_key(cdata[1]));
+
+  /* An inactive circuit gets converted when it comes back. */
+  pol->notify_circ_inactive(cmux, pol_data, &circs[1], cdata[1]);
+  cmux_ewma_wheel_set_halflife(30.0);
+  tt_ptr_op(pol->pick_active_circuit(cmux, pol_data), OP_EQ, &circs[0]);
+  pol->notify_circ_active(cmux, pol_data, &circs[1], cdata[1]);
+  tt_ptr_op(pol->pick_active_circuit(cmux, pol_data), OP_EQ, &circs[1]);
+
+ done:
+  for (i = 0; i < 2; ++i) {
+    if (cdata[i])
+      pol->free_circ_data(cmux, pol_data, &circs[i], cdata[i]);
+  }
+  if (pol_data)
+    pol->free_cmux_data(cmux, pol_data);
+  circuitmux_free(cmux);
+  monotime_disable_test_mocking();
+}
+
+#define N_WHEEL_CIRCS 200
+
+static void
+test_cmux_ewma_wheel_pick(void *arg)
+{
+  const circuitmux_policy_t *pol = &ewma_wheel_policy;
+  circuitmux_t *cmux = NULL;
+  circuitmux_policy_data_t *pol_data = NULL;
+  circuitmux_policy_circ_data_t *cdata[N_WHEEL_CIRCS];
+  circuit_t *circs = NULL;
+  int active[N_WHEEL_CIRCS];
+  int i, j, n_active;
+  (void)arg;
+
+  memset(cdata, 0, sizeof(cdata));
+  cmux_ewma_wheel_set_halflife(30.0);
+  cmux = circuitmux_alloc();
+  circs = tor_calloc(N_WHEEL_CIRCS, sizeof(circuit_t));
+  pol_data = pol->alloc_cmux_data(cmux);
+  for (i = 0; i < N_WHEEL_CIRCS; ++i) {
+    cdata[i] = pol->alloc_circ_data(cmux, pol_data, &circs[i],
+                                    CELL_DIRECTION_OUT, 0);
+  }
+
+  tt_ptr_op(pol->pick_active_circuit(cmux, pol_data), OP_EQ, NULL);
+
+  /* Circuits that haven't sent anything take turns. */
+  for (i = 0; i < 3; ++i)
+    pol->notify_circ_active(cmux, pol_data, &circs[i], cdata[i]);
+  tt_ptr_op(pol->pick_active_circuit(cmux, pol_data), OP_EQ, &circs[0]);
+  pol->notify_xmit_cells(cmux, pol_data, &circs[0], cdata[0], 10);
+  tt_ptr_op(pol->pick_active_circuit(cmux, pol_data), OP_EQ, &circs[1]);
+  pol->notify_xmit_cells(cmux, pol_data, &circs[1], cdata[1], 1);
+  tt_ptr_op(pol->pick_active_circuit(cmux, pol_data), OP_EQ, &circs[2]);
+  pol->notify_xmit_cells(cmux, pol_data, &circs[2], cdata[2], 3);
+
+  /* Then the quietest circuit goes first. */
+  tt_ptr_op(pol->pick_active_circuit(cmux, pol_data), OP_EQ, &circs[1]);
+  pol->notify_xmit_cells(cmux, pol_data, &circs[1], cdata[1], 1);
+  tt_ptr_op(pol->pick_active_circuit(cmux, pol_data), OP_EQ, &circs[1]);
+  pol->notify_xmit_cells(cmux, pol_data, &circs[1], cdata[1], 5);
+  tt_ptr_op(pol->pick_active_circuit(cmux, pol_data), OP_EQ, &circs[2]);
+
+  /* Even if one of them is far beyond the others. */
+  pol->notify_xmit_cells(cmux, pol_data, &circs[2], cdata[2], 1000000);
+  pol->notify_circ_inactive(cmux, pol_data, &circs[1], cdata[1]);
+  tt_ptr_op(pol->pick_active_circuit(cmux, pol_data), OP_EQ, &circs[0]);
+  pol->notify_circ_inactive(cmux, pol_data, &circs[0], cdata[0]);
+  tt_ptr_op(pol->pick_active_circuit(cmux, pol_data), OP_EQ, &circs[2]);
+  pol->notify_circ_inactive(cmux, pol_data, &circs[2], cdata[2]);
+  tt_ptr_op(pol->pick_active_circuit(cmux, pol_data), OP_EQ, NULL);
+
+  /* Now give lots of circuits very different counts, and make sure that we
+   * always pick one from the best slot. */
+  for (i = 0; i < N_WHEEL_CIRCS; ++i) {
+    pol->notify_circ_active(cmux, pol_data, &circs[i], cdata[i]);
+    pol->notify_xmit_cells(cmux, pol_data, &circs[i], cdata[i],
+                           1 + crypto_rand_int(1 << (i % 24)));
+    active[i] = 1;
+  }
+  for (n_active = N_WHEEL_CIRCS; n_active > 0; --n_active) {
+    int64_t best = INT64_MAX, picked_key;
+    circuit_t *picked = pol->pick_active_circuit(cmux, pol_data);
+    tt_assert(picked);
+    j = (int)(picked - circs);
+    tt_assert(active[j]);
+    for (i = 0; i < N_WHEEL_CIRCS; ++i) {
+      if (active[i])
+        best = MIN(best, ewma_wheel_get_key(cdata[i]));
+    }
+    picked_key = ewma_wheel_get_key(cdata[j]);
+    tt_i64_op(picked_key >> EWMA_WHEEL_SLOT_BITS, OP_EQ,
+              best >> EWMA_WHEEL_SLOT_BITS);
+    pol->notify_circ_inactive(cmux, pol_data, picked, cdata[j]);
+    active[j] = 0;
+  }
+  tt_ptr_op(pol->pick_active_circuit(cmux, pol_data), OP_EQ, NULL);
+
+ done:
+  for (i = 0; i < N_WHEEL_CIRCS; ++i) {
+    if (cdata[i])
+      pol->free_circ_data(cmux, pol_data, &circs[i], cdata[i]);
+  }
+  if (pol_data)
+    pol->free_cmux_data(cmux, pol_data);
+  tor_free(circs);
+  circuitmux_free(cmux);
+}
+
 struct testcase_t circuitmux_tests[] = {
   { "destroy_cell_queue", test_cmux_destroy_cell_queue, TT_FORK, NULL, NULL },
   { "compute_ticks", test_cmux_compute_ticks, TT_FORK, NULL, NULL },
+  { "ewma_wheel_keys", test_cmux_ewma_wheel_keys, 0, NULL, NULL },
+  { "ewma_wheel_pick", test_cmux_ewma_wheel_pick, TT_FORK, NULL, NULL },
+  { "ewma_wheel_halflife", test_cmux_ewma_wheel_halflife, TT_FORK,
+    NULL, NULL },
   END_OF_TESTCASES
 };
 
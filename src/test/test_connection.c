@@ -32,6 +32,10 @@
 #include "feature/nodelist/routerinfo_st.h"
 #include "core/or/socks_request_st.h"
 
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+
 static void * test_conn_get_basic_setup(const struct testcase_t *tc);
 static int test_conn_get_basic_teardown(const struct testcase_t *tc,
                                         void *arg);
@@ -881,6 +885,197 @@ test_failed_orconn_tracker(void *arg)
   ;
 }
 
+#ifdef TOR_HAVE_SENDFILE
+static void
+mock_connection_startstop_writing(connection_t *conn)
+{
+  (void)conn;
+}
+
+/* Test that a connection sends its outbuf and then part of a file. */
+static void
+test_conn_sendfile(void *arg)
+{
+  (void)arg;
+  tor_socket_t pair[2] = { TOR_INVALID_SOCKET, TOR_INVALID_SOCKET };
+  connection_t *conn = NULL;
+  char *fname = NULL, *contents = NULL;
+  char received[4096];
+  int fd = -1;
+  ssize_t n;
+  int i;
+
+  MOCK(connection_start_writing, mock_connection_startstop_writing);
+  MOCK(connection_stop_writing, mock_connection_startstop_writing);
+  connection_bucket_init();
+
+  /* 16 bytes of header we skip, then 3000 bytes we send, then more. */
+  contents = tor_malloc(4096);
+  for (i = 0; i < 4096; ++i)
+    contents[i] = (char)(i * 7);
+  fname = tor_strdup(get_fname("sendfile_src"));
+  tt_int_op(0, OP_EQ, write_bytes_to_file(fname, contents, 4096, 1));
+  fd = tor_open_cloexec(fname, O_RDONLY, 0);
+  tt_int_op(fd, OP_GE, 0);
+
+  tt_int_op(0, OP_EQ, tor_socketpair(AF_UNIX, SOCK_STREAM, 0, pair));
+  conn = TO_CONN(dir_connection_new(AF_UNIX));
+  conn->s = pair[0];
+  pair[0] = TOR_INVALID_SOCKET;
+  conn->state = DIR_CONN_STATE_CLIENT_SENDING;
+  conn->purpose = DIR_PURPOSE_FETCH_CONSENSUS;
+  tt_assert(connection_can_sendfile(conn));
+
+  connection_buf_add("HTTP/1.0 200 OK\r\n\r\n", 19, conn);
+  connection_set_sendfile_source(conn, fd, 16, 3000);
+  fd = -1;
+  tt_assert(connection_wants_to_flush(conn));
+
+  tt_int_op(0, OP_EQ, connection_handle_write(conn, 0));
+  tt_assert(! connection_wants_to_flush(conn));
+  tt_int_op(conn->sendfile_fd, OP_EQ, -1);
+  /* We finished flushing, so the state moved on. */
+  tt_int_op(conn->state, OP_EQ, DIR_CONN_STATE_CLIENT_READING);
+
+  n = read(pair[1], received, sizeof(received));
+  tt_int_op(n, OP_EQ, 19 + 3000);
+  tt_mem_op(received, OP_EQ, "HTTP/1.0 200 OK\r\n\r\n", 19);
+  tt_mem_op(received + 19, OP_EQ, contents + 16, 3000);
+
+ done:
+  UNMOCK(connection_start_writing);
+  UNMOCK(connection_stop_writing);
+  if (conn)
+    connection_free_minimal(conn);
+  if (fd >= 0)
+    close(fd);
+  tor_close_socket(pair[0]);
+  tor_close_socket(pair[1]);
+  tor_free(fname);
+  tor_free(contents);
+}
+
+/* Test that a connection that we close once it has flushed sends the rest
+ * of its file before we close it. */
+static void
+test_conn_sendfile_hold_open(void *arg)
+{
+  (void)arg;
+  tor_socket_t pair[2] = { TOR_INVALID_SOCKET, TOR_INVALID_SOCKET };
+  connection_t *conn = NULL;
+  char *fname = NULL, *contents = NULL;
+  char received[4096];
+  int fd = -1;
+  ssize_t n;
+  int i;
+
+  MOCK(connection_start_writing, mock_connection_startstop_writing);
+  MOCK(connection_stop_writing, mock_connection_startstop_writing);
+  connection_bucket_init();
+  tor_init_connection_lists();
+
+  contents = tor_malloc(1000);
+  for (i = 0; i < 1000; ++i)
+    contents[i] = (char)(i * 7);
+  fname = tor_strdup(get_fname("sendfile_src"));
+  tt_int_op(0, OP_EQ, write_bytes_to_file(fname, contents, 1000, 1));
+  fd = tor_open_cloexec(fname, O_RDONLY, 0);
+  tt_int_op(fd, OP_GE, 0);
+
+  tt_int_op(0, OP_EQ, tor_socketpair(AF_UNIX, SOCK_STREAM, 0, pair));
+  conn = TO_CONN(dir_connection_new(AF_UNIX));
+  conn->s = pair[0];
+  pair[0] = TOR_INVALID_SOCKET;
+  conn->state = DIR_CONN_STATE_SERVER_WRITING;
+  conn->purpose = DIR_PURPOSE_SERVER;
+  tt_int_op(0, OP_EQ, connection_add(conn));
+
+  connection_set_sendfile_source(conn, fd, 100, 500);
+  fd = -1;
+  connection_mark_and_flush(conn);
+  tt_assert(connection_wants_to_flush(conn));
+  tt_int_op(conn->sendfile_remaining, OP_EQ, 500);
+
+  /* This sends the rest of the file, then closes and frees conn. */
+  close_closeable_connections();
+  conn = NULL;
+  n = read(pair[1], received, sizeof(received));
+  tt_int_op(n, OP_EQ, 500);
+  tt_mem_op(received, OP_EQ, contents + 100, 500);
+  n = read(pair[1], received, sizeof(received));
+  tt_int_op(n, OP_EQ, 0);
+
+ done:
+  UNMOCK(connection_start_writing);
+  UNMOCK(connection_stop_writing);
+  if (conn)
+    connection_free_minimal(conn);
+  if (fd >= 0)
+    close(fd);
+  tor_close_socket(pair[0]);
+  tor_close_socket(pair[1]);
+  tor_free(fname);
+  tor_free(contents);
+}
+
+/* Test that a connection whose file is shorter than we expected gets
+ * closed, rather than waiting forever for the rest. */
+static void
+test_conn_sendfile_truncated(void *arg)
+{
+  (void)arg;
+  tor_socket_t pair[2] = { TOR_INVALID_SOCKET, TOR_INVALID_SOCKET };
+  connection_t *conn = NULL;
+  char *fname = NULL, *contents = NULL;
+  char received[4096];
+  int fd = -1;
+  ssize_t n;
+
+  MOCK(connection_start_writing, mock_connection_startstop_writing);
+  MOCK(connection_stop_writing, mock_connection_startstop_writing);
+  connection_bucket_init();
+  tor_init_connection_lists();
+
+  contents = tor_malloc_zero(1000);
+  fname = tor_strdup(get_fname("sendfile_short"));
+  tt_int_op(0, OP_EQ, write_bytes_to_file(fname, contents, 1000, 1));
+  fd = tor_open_cloexec(fname, O_RDONLY, 0);
+  tt_int_op(fd, OP_GE, 0);
+
+  tt_int_op(0, OP_EQ, tor_socketpair(AF_UNIX, SOCK_STREAM, 0, pair));
+  conn = TO_CONN(dir_connection_new(AF_UNIX));
+  conn->s = pair[0];
+  pair[0] = TOR_INVALID_SOCKET;
+  conn->state = DIR_CONN_STATE_CLIENT_SENDING;
+  conn->purpose = DIR_PURPOSE_FETCH_CONSENSUS;
+
+  /* We were told there are 2000 bytes, but the file only has 1000. */
+  connection_set_sendfile_source(conn, fd, 0, 2000);
+  fd = -1;
+  tt_int_op(0, OP_EQ, connection_handle_write(conn, 0));
+  tt_int_op(conn->sendfile_remaining, OP_EQ, 1000);
+  n = read(pair[1], received, sizeof(received));
+  tt_int_op(n, OP_EQ, 1000);
+
+  tt_int_op(-1, OP_EQ, connection_handle_write(conn, 0));
+  tt_assert(conn->marked_for_close);
+  tt_assert(! connection_wants_to_flush(conn));
+  tt_int_op(conn->sendfile_fd, OP_EQ, -1);
+
+ done:
+  UNMOCK(connection_start_writing);
+  UNMOCK(connection_stop_writing);
+  if (conn)
+    connection_free_minimal(conn);
+  if (fd >= 0)
+    close(fd);
+  tor_close_socket(pair[0]);
+  tor_close_socket(pair[1]);
+  tor_free(fname);
+  tor_free(contents);
+}
+#endif /* defined(TOR_HAVE_SENDFILE) */
+
 #define CONNECTION_TESTCASE(name, fork, setup)                           \
   { #name, test_conn_##name, fork, &setup, NULL }
 
@@ -898,5 +1093,10 @@ struct testcase_t connection_tests[] = {
                           test_conn_download_status_st, FLAV_NS),
 //CONNECTION_TESTCASE(func_suffix, TT_FORK, setup_func_pair),
   { "failed_orconn_tracker", test_failed_orconn_tracker, TT_FORK, NULL, NULL },
+#ifdef TOR_HAVE_SENDFILE
+  { "sendfile", test_conn_sendfile, TT_FORK, NULL, NULL },
+  { "sendfile_hold_open", test_conn_sendfile_hold_open, TT_FORK, NULL, NULL },
+  { "sendfile_truncated", test_conn_sendfile_truncated, TT_FORK, NULL, NULL },
+#endif
   END_OF_TESTCASES
 };
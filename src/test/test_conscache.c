@@ -84,6 +84,19 @@ test_conscache_simple_usage(void *arg)
   tt_mem_op(bp, OP_EQ, "A\0B\0C", 5);
   tt_assert(consensus_cache_entry_is_mapped(ent));
 
+  /* Check open_body: the file should hold the body at the offset. */
+  {
+    off_t off = 0;
+    char buf[5];
+    int fd = consensus_cache_entry_open_body(ent, &off, &sz);
+    tt_int_op(fd, OP_GE, 0);
+    tt_u64_op(sz, OP_EQ, 5);
+    tt_i64_op(lseek(fd, off, SEEK_SET), OP_EQ, off);
+    tt_int_op(read(fd, buf, sizeof(buf)), OP_EQ, 5);
+    close(fd);
+    tt_mem_op(buf, OP_EQ, "A\0B\0C", 5);
+  }
+
   /* Free and re-create the cache, to rescan the directory. */
   consensus_cache_free(cache);
   consensus_cache_entry_decref(ent);
@@ -8,6 +8,7 @@
 #include "test/test.h"
 
 #include "feature/dircommon/consdiff.h"
+#include "lib/crypt_ops/crypto_rand.h"
 #include "lib/memarea/memarea.h"
 #include "test/log_test_helpers.h"
 
@@ -47,238 +48,143 @@ consensus_compute_digest_as_signed_(const char *cons,
   return r;
 }
 
+/** Helper: split <b>s1</b> and <b>s2</b> into lines, and run calc_changes
+ * on all of them, setting the bits for the lines that changed in
+ * <b>changed1</b> and <b>changed2</b>. */
 static void
-test_consdiff_smartlist_slice(void *arg)
-{
-  smartlist_t *sl = smartlist_new();
-  smartlist_slice_t *sls;
-  int items[6] = {0,0,0,0,0,0};
-
-  /* Create a regular smartlist. */
-  (void)arg;
-  smartlist_add(sl, &items[1]);
-  smartlist_add(sl, &items[2]);
-  smartlist_add(sl, &items[3]);
-  smartlist_add(sl, &items[4]);
-  smartlist_add(sl, &items[5]);
-
-  /* See if the slice was done correctly. */
-  sls = smartlist_slice(sl, 2, 5);
-  tt_ptr_op(sl, OP_EQ, sls->list);
-  tt_ptr_op(&items[3], OP_EQ, smartlist_get(sls->list, sls->offset));
-  tt_ptr_op(&items[5], OP_EQ,
-      smartlist_get(sls->list, sls->offset + (sls->len-1)));
-  tor_free(sls);
-
-  /* See that using -1 as the end does get to the last element. */
-  sls = smartlist_slice(sl, 2, -1);
-  tt_ptr_op(sl, OP_EQ, sls->list);
-  tt_ptr_op(&items[3], OP_EQ, smartlist_get(sls->list, sls->offset));
-  tt_ptr_op(&items[5], OP_EQ,
-      smartlist_get(sls->list, sls->offset + (sls->len-1)));
-
- done:
-  tor_free(sls);
-  smartlist_free(sl);
-}
-
-static void
-test_consdiff_smartlist_slice_string_pos(void *arg)
-{
-  smartlist_t *sl = smartlist_new();
-  smartlist_slice_t *sls;
-  memarea_t *area = memarea_new();
-
-  /* Create a regular smartlist. */
-  (void)arg;
-  consensus_split_lines_(sl, "a\nd\nc\na\nb\n", area);
-
-  /* See that smartlist_slice_string_pos respects the bounds of the slice. */
-  sls = smartlist_slice(sl, 2, 5);
-  cdline_t a_line = { "a", 1 };
-  tt_int_op(3, OP_EQ, smartlist_slice_string_pos(sls, &a_line));
-  cdline_t d_line = { "d", 1 };
-  tt_int_op(-1, OP_EQ, smartlist_slice_string_pos(sls, &d_line));
-
- done:
-  tor_free(sls);
-  smartlist_free(sl);
-  memarea_drop_all(area);
-}
-
-static void
-test_consdiff_lcs_lengths(void *arg)
+calc_changes_on_strings(const char *s1, const char *s2,
+                        bitarray_t *changed1, bitarray_t *changed2)
 {
   smartlist_t *sl1 = smartlist_new();
   smartlist_t *sl2 = smartlist_new();
-  smartlist_slice_t *sls1, *sls2;
-  int *lengths1, *lengths2;
   memarea_t *area = memarea_new();
-
-  /* Expected lcs lengths in regular and reverse order. */
-  int e_lengths1[] = { 0, 1, 2, 3, 3, 4 };
-  int e_lengths2[] = { 0, 1, 1, 2, 3, 4 };
-
-  (void)arg;
-  consensus_split_lines_(sl1, "a\nb\nc\nd\ne\n", area);
-  consensus_split_lines_(sl2, "a\nc\nd\ni\ne\n", area);
-
-  sls1 = smartlist_slice(sl1, 0, -1);
-  sls2 = smartlist_slice(sl2, 0, -1);
-
-  lengths1 = lcs_lengths(sls1, sls2, 1);
-  lengths2 = lcs_lengths(sls1, sls2, -1);
-  tt_mem_op(e_lengths1, OP_EQ, lengths1, sizeof(int) * 6);
-  tt_mem_op(e_lengths2, OP_EQ, lengths2, sizeof(int) * 6);
-
- done:
-  tor_free(lengths1);
-  tor_free(lengths2);
-  tor_free(sls1);
-  tor_free(sls2);
+  uint32_t *ids1 = NULL, *ids2 = NULL;
+
+  consensus_split_lines_(sl1, s1, area);
+  consensus_split_lines_(sl2, s2, area);
+  ids1 = tor_calloc(smartlist_len(sl1) + 1, sizeof(uint32_t));
+  ids2 = tor_calloc(smartlist_len(sl2) + 1, sizeof(uint32_t));
+  consensus_intern_lines(sl1, 0, smartlist_len(sl1),
+                         sl2, 0, smartlist_len(sl2), ids1, ids2);
+  calc_changes(ids1, 0, smartlist_len(sl1), ids2, 0, smartlist_len(sl2),
+               changed1, changed2);
+
+  tor_free(ids1);
+  tor_free(ids2);
   smartlist_free(sl1);
   smartlist_free(sl2);
   memarea_drop_all(area);
 }
 
 static void
-test_consdiff_trim_slices(void *arg)
+test_consdiff_intern_lines(void *arg)
 {
   smartlist_t *sl1 = smartlist_new();
   smartlist_t *sl2 = smartlist_new();
-  smartlist_t *sl3 = smartlist_new();
-  smartlist_t *sl4 = smartlist_new();
-  smartlist_slice_t *sls1, *sls2, *sls3, *sls4;
   memarea_t *area = memarea_new();
+  uint32_t *ids1 = NULL, *ids2 = NULL;
+  uint32_t n;
 
   (void)arg;
-  consensus_split_lines_(sl1, "a\nb\nb\nb\nd\n", area);
-  consensus_split_lines_(sl2, "a\nc\nc\nc\nd\n", area);
-  consensus_split_lines_(sl3, "a\nb\nb\nb\na\n", area);
-  consensus_split_lines_(sl4, "c\nb\nb\nb\nc\n", area);
-  sls1 = smartlist_slice(sl1, 0, -1);
-  sls2 = smartlist_slice(sl2, 0, -1);
-  sls3 = smartlist_slice(sl3, 0, -1);
-  sls4 = smartlist_slice(sl4, 0, -1);
-
-  /* They should be trimmed by one line at each end. */
-  tt_int_op(5, OP_EQ, sls1->len);
-  tt_int_op(5, OP_EQ, sls2->len);
-  trim_slices(sls1, sls2);
-  tt_int_op(3, OP_EQ, sls1->len);
-  tt_int_op(3, OP_EQ, sls2->len);
-
-  /* They should not be trimmed at all. */
-  tt_int_op(5, OP_EQ, sls3->len);
-  tt_int_op(5, OP_EQ, sls4->len);
-  trim_slices(sls3, sls4);
-  tt_int_op(5, OP_EQ, sls3->len);
-  tt_int_op(5, OP_EQ, sls4->len);
+  consensus_split_lines_(sl1, "a\nb\na\nab\n", area);
+  consensus_split_lines_(sl2, "b\nc\nab\n\na\n", area);
+
+  ids1 = tor_calloc(smartlist_len(sl1), sizeof(uint32_t));
+  ids2 = tor_calloc(smartlist_len(sl2), sizeof(uint32_t));
+  n = consensus_intern_lines(sl1, 0, 4, sl2, 0, 5, ids1, ids2);
+  /* "a", "b", "ab", "c" and "". */
+  tt_uint_op(n, OP_EQ, 5);
+
+  /* Equal lines get equal IDs, in either consensus. */
+  tt_uint_op(ids1[0], OP_EQ, ids1[2]);
+  tt_uint_op(ids1[0], OP_EQ, ids2[4]);
+  tt_uint_op(ids1[1], OP_EQ, ids2[0]);
+  tt_uint_op(ids1[3], OP_EQ, ids2[2]);
+
+  /* Different lines get different IDs, even when one is a prefix of the
+   * other. */
+  tt_uint_op(ids1[0], OP_NE, ids1[1]);
+  tt_uint_op(ids1[0], OP_NE, ids1[3]);
+  tt_uint_op(ids1[1], OP_NE, ids1[3]);
+  tt_uint_op(ids2[1], OP_NE, ids1[0]);
+  tt_uint_op(ids2[1], OP_NE, ids1[1]);
+  tt_uint_op(ids2[1], OP_NE, ids1[3]);
+  tt_uint_op(ids2[3], OP_NE, ids1[0]);
+  tt_uint_op(ids2[3], OP_NE, ids2[1]);
+  tt_uint_op(ids2[3], OP_NE, ids1[3]);
+
+  /* Every ID is below the count. */
+  tt_uint_op(ids1[3], OP_LT, n);
+  tt_uint_op(ids2[1], OP_LT, n);
+  tt_uint_op(ids2[3], OP_LT, n);
+
+  /* Only the lines in the given ranges get IDs. */
+  memset(ids1, 0xff, sizeof(uint32_t) * 4);
+  memset(ids2, 0xff, sizeof(uint32_t) * 5);
+  n = consensus_intern_lines(sl1, 1, 3, sl2, 4, 5, ids1, ids2);
+  /* "b" and "a". */
+  tt_uint_op(n, OP_EQ, 2);
+  tt_uint_op(ids1[0], OP_EQ, UINT32_MAX);
+  tt_uint_op(ids1[3], OP_EQ, UINT32_MAX);
+  tt_uint_op(ids2[0], OP_EQ, UINT32_MAX);
+  tt_uint_op(ids1[2], OP_EQ, ids2[4]);
+  tt_uint_op(ids1[1], OP_NE, ids1[2]);
 
  done:
-  tor_free(sls1);
-  tor_free(sls2);
-  tor_free(sls3);
-  tor_free(sls4);
+  tor_free(ids1);
+  tor_free(ids2);
   smartlist_free(sl1);
   smartlist_free(sl2);
-  smartlist_free(sl3);
-  smartlist_free(sl4);
   memarea_drop_all(area);
 }
 
 static void
-test_consdiff_set_changed(void *arg)
+test_consdiff_calc_changes_trim(void *arg)
 {
-  smartlist_t *sl1 = smartlist_new();
-  smartlist_t *sl2 = smartlist_new();
-  bitarray_t *changed1 = bitarray_init_zero(4);
-  bitarray_t *changed2 = bitarray_init_zero(4);
-  smartlist_slice_t *sls1, *sls2;
-  memarea_t *area = memarea_new();
+  bitarray_t *changed1 = bitarray_init_zero(5);
+  bitarray_t *changed2 = bitarray_init_zero(5);
+  int i;
 
   (void)arg;
-  consensus_split_lines_(sl1, "a\nb\na\na\n", area);
-  consensus_split_lines_(sl2, "a\na\na\na\n", area);
-
-  /* Length of sls1 is 0. */
-  sls1 = smartlist_slice(sl1, 0, 0);
-  sls2 = smartlist_slice(sl2, 1, 3);
-  set_changed(changed1, changed2, sls1, sls2);
-
-  /* The former is not changed, the latter changes all of its elements. */
-  tt_assert(!bitarray_is_set(changed1, 0));
-  tt_assert(!bitarray_is_set(changed1, 1));
-  tt_assert(!bitarray_is_set(changed1, 2));
-  tt_assert(!bitarray_is_set(changed1, 3));
-
-  tt_assert(!bitarray_is_set(changed2, 0));
-  tt_assert(bitarray_is_set(changed2, 1));
-  tt_assert(bitarray_is_set(changed2, 2));
-  tt_assert(!bitarray_is_set(changed2, 3));
-  bitarray_clear(changed2, 1);
-  bitarray_clear(changed2, 2);
-
-  /* Length of sls1 is 1 and its element is in sls2. */
-  tor_free(sls1);
-  sls1 = smartlist_slice(sl1, 0, 1);
-  set_changed(changed1, changed2, sls1, sls2);
-
-  /* The latter changes all elements but the (first) common one. */
+  /* Only the middle lines change; the common ends are left alone. */
+  calc_changes_on_strings("a\nb\nb\nb\nd\n", "a\nc\nc\nc\nd\n",
+                          changed1, changed2);
   tt_assert(!bitarray_is_set(changed1, 0));
-  tt_assert(!bitarray_is_set(changed1, 1));
-  tt_assert(!bitarray_is_set(changed1, 2));
-  tt_assert(!bitarray_is_set(changed1, 3));
-
   tt_assert(!bitarray_is_set(changed2, 0));
-  tt_assert(!bitarray_is_set(changed2, 1));
-  tt_assert(bitarray_is_set(changed2, 2));
-  tt_assert(!bitarray_is_set(changed2, 3));
-  bitarray_clear(changed2, 2);
-
-  /* Length of sls1 is 1 and its element is not in sls2. */
-  tor_free(sls1);
-  sls1 = smartlist_slice(sl1, 1, 2);
-  set_changed(changed1, changed2, sls1, sls2);
-
-  /* The former changes its element, the latter changes all elements. */
-  tt_assert(!bitarray_is_set(changed1, 0));
-  tt_assert(bitarray_is_set(changed1, 1));
-  tt_assert(!bitarray_is_set(changed1, 2));
-  tt_assert(!bitarray_is_set(changed1, 3));
-
-  tt_assert(!bitarray_is_set(changed2, 0));
-  tt_assert(bitarray_is_set(changed2, 1));
-  tt_assert(bitarray_is_set(changed2, 2));
-  tt_assert(!bitarray_is_set(changed2, 3));
+  for (i = 1; i < 4; ++i) {
+    tt_assert(bitarray_is_set(changed1, i));
+    tt_assert(bitarray_is_set(changed2, i));
+    bitarray_clear(changed1, i);
+    bitarray_clear(changed2, i);
+  }
+  tt_assert(!bitarray_is_set(changed1, 4));
+  tt_assert(!bitarray_is_set(changed2, 4));
+
+  /* Nothing to trim at the ends, but the middle lines are common. */
+  calc_changes_on_strings("a\nb\nb\nb\na\n", "c\nb\nb\nb\nc\n",
+                          changed1, changed2);
+  tt_assert(bitarray_is_set(changed1, 0));
+  tt_assert(bitarray_is_set(changed2, 0));
+  for (i = 1; i < 4; ++i) {
+    tt_assert(!bitarray_is_set(changed1, i));
+    tt_assert(!bitarray_is_set(changed2, i));
+  }
+  tt_assert(bitarray_is_set(changed1, 4));
+  tt_assert(bitarray_is_set(changed2, 4));
 
  done:
   bitarray_free(changed1);
   bitarray_free(changed2);
-  smartlist_free(sl1);
-  smartlist_free(sl2);
-  tor_free(sls1);
-  tor_free(sls2);
-  memarea_drop_all(area);
 }
 
 static void
 test_consdiff_calc_changes(void *arg)
 {
-  smartlist_t *sl1 = smartlist_new();
-  smartlist_t *sl2 = smartlist_new();
-  smartlist_slice_t *sls1, *sls2;
   bitarray_t *changed1 = bitarray_init_zero(4);
   bitarray_t *changed2 = bitarray_init_zero(4);
-  memarea_t *area = memarea_new();
 
   (void)arg;
-  consensus_split_lines_(sl1, "a\na\na\na\n", area);
-  consensus_split_lines_(sl2, "a\na\na\na\n", area);
-
-  sls1 = smartlist_slice(sl1, 0, -1);
-  sls2 = smartlist_slice(sl2, 0, -1);
-  calc_changes(sls1, sls2, changed1, changed2);
+  calc_changes_on_strings("a\na\na\na\n", "a\na\na\na\n", changed1, changed2);
 
   /* Nothing should be set to changed. */
   tt_assert(!bitarray_is_set(changed1, 0));
@@ -291,13 +197,7 @@ test_consdiff_calc_changes(void *arg)
   tt_assert(!bitarray_is_set(changed2, 2));
   tt_assert(!bitarray_is_set(changed2, 3));
 
-  smartlist_clear(sl2);
-  consensus_split_lines_(sl2, "a\nb\na\nb\n", area);
-  tor_free(sls1);
-  tor_free(sls2);
-  sls1 = smartlist_slice(sl1, 0, -1);
-  sls2 = smartlist_slice(sl2, 0, -1);
-  calc_changes(sls1, sls2, changed1, changed2);
+  calc_changes_on_strings("a\na\na\na\n", "a\nb\na\nb\n", changed1, changed2);
 
   /* Two elements are changed. */
   tt_assert(!bitarray_is_set(changed1, 0));
@@ -311,16 +211,10 @@ test_consdiff_calc_changes(void *arg)
   tt_assert(bitarray_is_set(changed2, 1));
   tt_assert(!bitarray_is_set(changed2, 2));
   tt_assert(bitarray_is_set(changed2, 3));
-  bitarray_clear(changed1, 1);
-  bitarray_clear(changed1, 3);
+  bitarray_clear(changed2, 1);
+  bitarray_clear(changed2, 3);
 
-  smartlist_clear(sl2);
-  consensus_split_lines_(sl2, "b\nb\nb\nb\n", area);
-  tor_free(sls1);
-  tor_free(sls2);
-  sls1 = smartlist_slice(sl1, 0, -1);
-  sls2 = smartlist_slice(sl2, 0, -1);
-  calc_changes(sls1, sls2, changed1, changed2);
+  calc_changes_on_strings("a\na\na\na\n", "b\nb\nb\nb\n", changed1, changed2);
 
   /* All elements are changed. */
   tt_assert(bitarray_is_set(changed1, 0));
@@ -336,11 +230,125 @@ test_consdiff_calc_changes(void *arg)
  done:
   bitarray_free(changed1);
   bitarray_free(changed2);
-  smartlist_free(sl1);
-  smartlist_free(sl2);
-  tor_free(sls1);
-  tor_free(sls2);
-  memarea_drop_all(area);
+}
+
+static void
+test_consdiff_calc_changes_disjoint(void *arg)
+{
+  bitarray_t *changed1 = bitarray_init_zero(4);
+  bitarray_t *changed2 = bitarray_init_zero(4);
+
+  (void)arg;
+
+  /* One line, replaced by a different one. */
+  calc_changes_on_strings("a\n", "b\n", changed1, changed2);
+  tt_assert(bitarray_is_set(changed1, 0));
+  tt_assert(bitarray_is_set(changed2, 0));
+  bitarray_clear(changed1, 0);
+  bitarray_clear(changed2, 0);
+
+  /* Ranges of different lengths with nothing in common, once the lines that
+   * match at the start and end are skipped. */
+  calc_changes_on_strings("x\na\ny\n", "x\nb\nc\ny\n", changed1, changed2);
+  tt_assert(!bitarray_is_set(changed1, 0));
+  tt_assert(bitarray_is_set(changed1, 1));
+  tt_assert(!bitarray_is_set(changed1, 2));
+  tt_assert(!bitarray_is_set(changed2, 0));
+  tt_assert(bitarray_is_set(changed2, 1));
+  tt_assert(bitarray_is_set(changed2, 2));
+  tt_assert(!bitarray_is_set(changed2, 3));
+
+ done:
+  bitarray_free(changed1);
+  bitarray_free(changed2);
+}
+
+/** Helper: return the length of the longest common subsequence of the
+ * <b>n1</b> IDs in <b>ids1</b> and the <b>n2</b> IDs in <b>ids2</b>, the
+ * slow and obvious way. */
+static int
+slow_lcs_length(const uint32_t *ids1, int n1, const uint32_t *ids2, int n2)
+{
+  int *prev = tor_calloc(n2 + 1, sizeof(int));
+  int *cur = tor_calloc(n2 + 1, sizeof(int));
+  int *tmp, result;
+
+  for (int i = 1; i <= n1; ++i) {
+    for (int j = 1; j <= n2; ++j) {
+      if (ids1[i-1] == ids2[j-1])
+        cur[j] = prev[j-1] + 1;
+      else
+        cur[j] = MAX(prev[j], cur[j-1]);
+    }
+    tmp = prev;
+    prev = cur;
+    cur = tmp;
+  }
+  result = prev[n2];
+  tor_free(prev);
+  tor_free(cur);
+  return result;
+}
+
+static void
+test_consdiff_calc_changes_minimal(void *arg)
+{
+  enum { MAX_LEN = 60 };
+  uint32_t ids1[MAX_LEN], ids2[MAX_LEN];
+  bitarray_t *changed1 = NULL, *changed2 = NULL;
+
+  (void)arg;
+  for (int iter = 0; iter < 500; ++iter) {
+    const int n1 = crypto_rand_int(MAX_LEN + 1);
+    const int n2 = crypto_rand_int(MAX_LEN + 1);
+    /* Use few distinct lines, so that there's plenty in common. */
+    const unsigned alphabet = 2 + crypto_rand_int(6);
+    int i, j, n_changed1 = 0, n_changed2 = 0, lcs;
+
+    for (i = 0; i < n1; ++i)
+      ids1[i] = crypto_rand_int(alphabet);
+    for (i = 0; i < n2; ++i)
+      ids2[i] = crypto_rand_int(alphabet);
+    /* Sometimes make the second list an edit of the first. */
+    if (iter & 1) {
+      for (i = 0; i < MIN(n1, n2); ++i) {
+        if (crypto_rand_int(4))
+          ids2[i] = ids1[i];
+      }
+    }
+    bitarray_free(changed1);
+    bitarray_free(changed2);
+    changed1 = bitarray_init_zero(MAX_LEN);
+    changed2 = bitarray_init_zero(MAX_LEN);
+
+    calc_changes(ids1, 0, n1, ids2, 0, n2, changed1, changed2);
+
+    /* The lines that didn't change must match up, in order. */
+    for (i = 0, j = 0; ; ++i, ++j) {
+      while (i < n1 && bitarray_is_set(changed1, i)) {
+        ++i;
+        ++n_changed1;
+      }
+      while (j < n2 && bitarray_is_set(changed2, j)) {
+        ++j;
+        ++n_changed2;
+      }
+      if (i >= n1 || j >= n2)
+        break;
+      tt_uint_op(ids1[i], OP_EQ, ids2[j]);
+    }
+    tt_int_op(i, OP_EQ, n1);
+    tt_int_op(j, OP_EQ, n2);
+
+    /* And there must be as many of them as possible. */
+    lcs = slow_lcs_length(ids1, n1, ids2, n2);
+    tt_int_op(n1 - n_changed1, OP_EQ, lcs);
+    tt_int_op(n2 - n_changed2, OP_EQ, lcs);
+  }
+
+ done:
+  bitarray_free(changed1);
+  bitarray_free(changed2);
 }
 
 static void
@@ -1195,16 +1203,67 @@ test_consdiff_apply_diff(void *arg)
   memarea_drop_all(area);
 }
 
+static void
+test_consdiff_gen_diff_to_target(void *arg)
+{
+  const char *cons1a =
+    "network-status-version foo\n"
+    "r name bbbbbbbbbbbbbbbbb etc\nfoo\n"
+    "r name ccccccccccccccccc etc\nbar\n"
+    "directory-signature foo bar\nbar\n";
+  const char *cons1b =
+    "network-status-version foo\n"
+    "r name aaaaaaaaaaaaaaaaa etc\nbaz\n"
+    "r name ccccccccccccccccc etc\nbar\n"
+    "directory-signature foo bar\nbaz\n";
+  const char *cons2 =
+    "network-status-version foo\n"
+    "r name aaaaaaaaaaaaaaaaa etc\nfoo\n"
+    "r name ccccccccccccccccc etc\nbar\n"
+    "directory-signature foo bar\nbar\n";
+  consensus_diff_target_t *target = NULL;
+  char *diff_a = NULL, *diff_b = NULL, *diff_a2 = NULL;
+  char *applied_a = NULL, *applied_b = NULL;
+
+  (void)arg;
+  target = consensus_diff_target_new(cons2, strlen(cons2));
+  tt_assert(target);
+
+  /* The same target works for diffs from more than one consensus, and
+   * gives the same answers as computing each diff from scratch. */
+  diff_a = consensus_diff_generate_to_target(cons1a, strlen(cons1a), target);
+  diff_b = consensus_diff_generate_to_target(cons1b, strlen(cons1b), target);
+  tt_assert(diff_a);
+  tt_assert(diff_b);
+  diff_a2 = consensus_diff_generate(cons1a, strlen(cons1a),
+                                    cons2, strlen(cons2));
+  tt_str_op(diff_a, OP_EQ, diff_a2);
+
+  applied_a = consensus_diff_apply(cons1a, strlen(cons1a),
+                                   diff_a, strlen(diff_a));
+  applied_b = consensus_diff_apply(cons1b, strlen(cons1b),
+                                   diff_b, strlen(diff_b));
+  tt_str_op(applied_a, OP_EQ, cons2);
+  tt_str_op(applied_b, OP_EQ, cons2);
+
+ done:
+  consensus_diff_target_free(target);
+  tor_free(diff_a);
+  tor_free(diff_b);
+  tor_free(diff_a2);
+  tor_free(applied_a);
+  tor_free(applied_b);
+}
+
 #define CONSDIFF_LEGACY(name)                                          \
   { #name, test_consdiff_ ## name , 0, NULL, NULL }
 
 struct testcase_t consdiff_tests[] = {
-  CONSDIFF_LEGACY(smartlist_slice),
-  CONSDIFF_LEGACY(smartlist_slice_string_pos),
-  CONSDIFF_LEGACY(lcs_lengths),
-  CONSDIFF_LEGACY(trim_slices),
-  CONSDIFF_LEGACY(set_changed),
+  CONSDIFF_LEGACY(intern_lines),
+  CONSDIFF_LEGACY(calc_changes_trim),
   CONSDIFF_LEGACY(calc_changes),
+  CONSDIFF_LEGACY(calc_changes_disjoint),
+  CONSDIFF_LEGACY(calc_changes_minimal),
   CONSDIFF_LEGACY(get_id_hash),
   CONSDIFF_LEGACY(is_valid_router_entry),
   CONSDIFF_LEGACY(next_router),
@@ -1212,6 +1271,7 @@ struct testcase_t consdiff_tests[] = {
   CONSDIFF_LEGACY(gen_ed_diff),
   CONSDIFF_LEGACY(apply_ed_diff),
   CONSDIFF_LEGACY(gen_diff),
+  CONSDIFF_LEGACY(gen_diff_to_target),
   CONSDIFF_LEGACY(apply_diff),
   END_OF_TESTCASES
 };
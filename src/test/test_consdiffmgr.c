@@ -481,7 +481,13 @@ test_consdiffmgr_diff_rules(void *arg)
   tt_ptr_op(NULL, OP_NE, fake_cpuworker_queue);
   tt_int_op(3, OP_EQ, smartlist_len(fake_cpuworker_queue));
   tt_int_op(0, OP_EQ, mock_cpuworker_run_work());
+  setup_capture_of_logs(LOG_INFO);
   mock_cpuworker_handle_replies();
+  /* All three jobs were in one batch, and we hear about it once they're
+   * all done. */
+  expect_log_msg_containing("Finished generating 3 diffs to the most "
+                            "recent microdesc consensus");
+  teardown_capture_of_logs();
   tt_ptr_op(NULL, OP_EQ, fake_cpuworker_queue);
 
   /* For the NS consensuses: add 3, generate, and add one older one and
@@ -558,6 +564,7 @@ test_consdiffmgr_diff_rules(void *arg)
     networkstatus_vote_free(md_ns[i]);
     networkstatus_vote_free(ns_ns[i]);
   }
+  teardown_capture_of_logs();
   UNMOCK(cpuworker_queue_work);
 #undef N
 }
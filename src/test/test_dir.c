@@ -2777,6 +2777,80 @@ get_my_v3_authority_cert_m(void)
   return mock_cert;
 }
 
+/** ns_parse_stream_t callback: count and free each routerstatus. */
+static int
+count_streamed_routerstatus(const networkstatus_t *ns, routerstatus_t *rs,
+                            void *arg)
+{
+  int *n = arg;
+  tt_assert(ns);
+  ++*n;
+ done:
+  routerstatus_free(rs);
+  return 0;
+}
+
+/** Parse <b>text</b> with an ns_parse_stream_t, giving it <b>window</b>
+ * bytes at a time, and make sure that we get the same answer as
+ * <b>con</b>, which we parsed all at once. */
+static void
+test_streamed_consensus(const char *text, const networkstatus_t *con,
+                        size_t window, int use_cb)
+{
+  ns_parse_stream_t *st = NULL;
+  networkstatus_t *ns = NULL;
+  size_t len = strlen(text), off;
+  int n_cb = 0, i;
+
+  st = ns_parse_stream_new(use_cb ? count_streamed_routerstatus : NULL,
+                           &n_cb);
+  for (off = 0; off < len; off += window) {
+    tt_int_op(0, OP_EQ, ns_parse_stream_add(st, text + off,
+                                            MIN(window, len - off)));
+  }
+  ns = ns_parse_stream_finish(st);
+  tt_assert(ns);
+
+  /* We only held on to part of the document at once. */
+  if (window < len / 2)
+    tt_u64_op(ns_parse_stream_get_max_buffered(st), OP_LT, len);
+
+  tt_mem_op(&ns->digests, OP_EQ, &con->digests, sizeof(con->digests));
+  tt_mem_op(ns->digest_sha3_as_signed, OP_EQ, con->digest_sha3_as_signed,
+            DIGEST256_LEN);
+  tt_int_op(ns->flavor, OP_EQ, con->flavor);
+  tt_int_op(ns->valid_after, OP_EQ, con->valid_after);
+  tt_int_op(ns->consensus_method, OP_EQ, con->consensus_method);
+  tt_int_op(smartlist_len(ns->voters), OP_EQ, smartlist_len(con->voters));
+  tt_int_op(smartlist_len(ns->weight_params), OP_EQ,
+            smartlist_len(con->weight_params));
+  if (use_cb) {
+    tt_int_op(smartlist_len(ns->routerstatus_list), OP_EQ, 0);
+    tt_int_op(n_cb, OP_EQ, smartlist_len(con->routerstatus_list));
+  } else {
+    tt_int_op(smartlist_len(ns->routerstatus_list), OP_EQ,
+              smartlist_len(con->routerstatus_list));
+    for (i = 0; i < smartlist_len(ns->routerstatus_list); ++i) {
+      const routerstatus_t *rs1 = smartlist_get(ns->routerstatus_list, i);
+      const routerstatus_t *rs2 = smartlist_get(con->routerstatus_list, i);
+      tt_mem_op(rs1->identity_digest, OP_EQ, rs2->identity_digest,
+                DIGEST_LEN);
+      tt_str_op(rs1->nickname, OP_EQ, rs2->nickname);
+    }
+  }
+  networkstatus_vote_free(ns);
+  ns_parse_stream_free(st);
+
+  /* A truncated consensus doesn't parse. */
+  st = ns_parse_stream_new(NULL, NULL);
+  tt_int_op(0, OP_EQ, ns_parse_stream_add(st, text, len - 40));
+  tt_ptr_op(NULL, OP_EQ, ns_parse_stream_finish(st));
+
+ done:
+  networkstatus_vote_free(ns);
+  ns_parse_stream_free(st);
+}
+
 /** Run a unit tests for generating and parsing networkstatuses, with
  * the supply test fns. */
 static void
@@ -2952,6 +3026,12 @@ test_a_networkstatus(
   tt_assert(con_md);
   tt_int_op(con_md->flavor,OP_EQ, FLAV_MICRODESC);
 
+  /* Check that we get the same answers when we parse them piecemeal. */
+  test_streamed_consensus(consensus_text, con, 1, 0);
+  test_streamed_consensus(consensus_text, con, 97, 1);
+  test_streamed_consensus(consensus_text_md, con_md, 512, 0);
+  test_streamed_consensus(consensus_text_md, con_md, 1024*1024, 1);
+
   /* Check consensus contents. */
   tt_assert(con->type == NS_TYPE_CONSENSUS);
   tt_int_op(con->published,OP_EQ, 0); /* this field only appears in votes. */
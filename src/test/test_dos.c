@@ -6,6 +6,7 @@
 #define CIRCUITLIST_PRIVATE
 
 #include "core/or/or.h"
+#include "app/config/config.h"
 #include "core/or/dos.h"
 #include "core/or/circuitlist.h"
 #include "lib/crypt_ops/crypto_rand.h"
@@ -219,11 +220,9 @@ test_dos_bucket_refill(void *arg)
   geoip_note_client_seen(GEOIP_CLIENT_CONNECT, addr, NULL, now);
   dos_new_client_conn(&or_conn);
 
-  /* Fetch this client from the geoip cache and get its DoS structs */
-  clientmap_entry_t *entry = geoip_lookup_client(addr, NULL,
-                                                 GEOIP_CLIENT_CONNECT);
-  tt_assert(entry);
-  dos_client_stats_t* dos_stats = &entry->dos_stats;
+  /* Fetch this client's DoS structs */
+  dos_client_stats_t* dos_stats = dos_client_lookup(addr);
+  tt_assert(dos_stats);
   /* Check that the circuit bucket is still uninitialized */
   tt_uint_op(dos_stats->cc_stats.circuit_bucket, OP_EQ, 0);
 
@@ -422,7 +421,7 @@ test_dos_bucket_refill(void *arg)
 static void
 test_known_relay(void *arg)
 {
-  clientmap_entry_t *entry = NULL;
+  dos_client_stats_t *stats = NULL;
   routerstatus_t *rs = NULL; microdesc_t *md = NULL; routerinfo_t *ri = NULL;
 
   (void) arg;
@@ -465,10 +464,8 @@ test_known_relay(void *arg)
   dos_new_client_conn(&or_conn);
   dos_new_client_conn(&or_conn);
   dos_new_client_conn(&or_conn);
-  entry = geoip_lookup_client(&or_conn.real_addr, NULL, GEOIP_CLIENT_CONNECT);
-  tt_assert(entry);
-  /* We should have a count of 0. */
-  tt_uint_op(entry->dos_stats.concurrent_count, OP_EQ, 0);
+  /* We shouldn't be tracking it at all. */
+  tt_ptr_op(dos_client_lookup(&or_conn.real_addr), OP_EQ, NULL);
 
   /* To make sure that his is working properly, make a unknown client
    * connection and see if we do get it. */
@@ -476,10 +473,10 @@ test_known_relay(void *arg)
   geoip_note_client_seen(GEOIP_CLIENT_CONNECT, &or_conn.real_addr, NULL, 0);
   dos_new_client_conn(&or_conn);
   dos_new_client_conn(&or_conn);
-  entry = geoip_lookup_client(&or_conn.real_addr, NULL, GEOIP_CLIENT_CONNECT);
-  tt_assert(entry);
+  stats = dos_client_lookup(&or_conn.real_addr);
+  tt_assert(stats);
   /* We should have a count of 2. */
-  tt_uint_op(entry->dos_stats.concurrent_count, OP_EQ, 2);
+  tt_uint_op(stats->concurrent_count, OP_EQ, 2);
 
  done:
   routerstatus_free(rs); routerinfo_free(ri); microdesc_free(md);
@@ -492,11 +489,222 @@ test_known_relay(void *arg)
   UNMOCK(get_param_cc_enabled);
 }
 
+/* Test the table of client addresses. */
+static void
+test_dos_client_table(void *arg)
+{
+  tor_addr_t addr;
+  dos_client_stats_t *stats;
+  const time_t now = 1281533250; /* 2010-08-11 13:27:30 UTC */
+  size_t alloc;
+  int i;
+
+  (void) arg;
+
+  MOCK(get_param_cc_enabled, mock_enable_dos_protection);
+  MOCK(get_param_conn_enabled, mock_enable_dos_protection);
+  dos_init();
+
+  /* IPv6 addresses in the same /64 share an entry. */
+  tor_addr_parse(&addr, "[2001:db8:1:2::1]");
+  stats = dos_client_lookup_or_add(&addr, now);
+  tt_assert(stats);
+  stats->concurrent_count = 1;
+  tor_addr_parse(&addr, "[2001:db8:1:2:ffff::7]");
+  tt_ptr_op(dos_client_lookup(&addr), OP_EQ, stats);
+  tor_addr_parse(&addr, "[2001:db8:1:3::1]");
+  tt_ptr_op(dos_client_lookup(&addr), OP_EQ, NULL);
+  /* IPv4 addresses don't collide with IPv6 prefixes. */
+  tor_addr_parse(&addr, "0.0.0.0");
+  tt_ptr_op(dos_client_lookup(&addr), OP_EQ, NULL);
+  tt_uint_op(dos_client_table_n_entries(), OP_EQ, 1);
+
+  /* The table grows, and every address stays findable. */
+  for (i = 0; i < 5000; ++i) {
+    tor_addr_from_ipv4h(&addr, 0x0a000000 + i);
+    stats = dos_client_lookup_or_add(&addr, now);
+    tt_assert(stats);
+    stats->concurrent_count = i + 1;
+  }
+  tt_uint_op(dos_client_table_n_entries(), OP_EQ, 5001);
+  for (i = 0; i < 5000; ++i) {
+    tor_addr_from_ipv4h(&addr, 0x0a000000 + i);
+    stats = dos_client_lookup(&addr);
+    tt_assert(stats);
+    tt_uint_op(stats->concurrent_count, OP_EQ, i + 1);
+  }
+
+  /* Addresses with no connections and nothing else to remember go away,
+   * and the rest stay findable. */
+  for (i = 0; i < 5000; i += 2) {
+    tor_addr_from_ipv4h(&addr, 0x0a000000 + i);
+    dos_client_lookup(&addr)->concurrent_count = 0;
+  }
+  dos_clean_clients(now);
+  tt_uint_op(dos_client_table_n_entries(), OP_EQ, 2501);
+  for (i = 0; i < 5000; ++i) {
+    tor_addr_from_ipv4h(&addr, 0x0a000000 + i);
+    stats = dos_client_lookup(&addr);
+    if (i % 2 == 0) {
+      tt_ptr_op(stats, OP_EQ, NULL);
+    } else {
+      tt_assert(stats);
+      tt_uint_op(stats->concurrent_count, OP_EQ, i + 1);
+    }
+  }
+
+  /* A drained circuit bucket keeps an address around until it would have
+   * refilled. */
+  tor_addr_parse(&addr, "18.0.0.1");
+  stats = dos_client_lookup_or_add(&addr, now);
+  stats->cc_stats.circuit_bucket = 0;
+  stats->cc_stats.last_circ_bucket_refill_ts = now;
+  dos_clean_clients(now + 1);
+  tt_assert(dos_client_lookup(&addr));
+  dos_clean_clients(now + 3600);
+  tt_ptr_op(dos_client_lookup(&addr), OP_EQ, NULL);
+
+  /* Once the table is as big as it gets, we evict addresses without
+   * connections down to half the table. */
+  dos_free_all();
+  dos_client_table_max_slots = 1024;
+  for (i = 0; i < 768; ++i) {
+    tor_addr_from_ipv4h(&addr, 0x0b000000 + i);
+    stats = dos_client_lookup_or_add(&addr, now);
+    tt_assert(stats);
+    stats->cc_stats.last_circ_bucket_refill_ts = now;
+  }
+  alloc = dos_client_table_total_allocation();
+  tt_uint_op(alloc, OP_GE, 1024 * sizeof(dos_client_stats_t));
+  tor_addr_from_ipv4h(&addr, 0x0c000000);
+  tt_assert(dos_client_lookup_or_add(&addr, now));
+  tt_uint_op(dos_client_table_n_entries(), OP_EQ, 513);
+  tt_uint_op(dos_client_table_total_allocation(), OP_EQ, alloc);
+
+  /* If there are none, we refuse new addresses, and don't look again for
+   * the rest of the second. */
+  dos_free_all();
+  for (i = 0; i < 768; ++i) {
+    tor_addr_from_ipv4h(&addr, 0x0b000000 + i);
+    stats = dos_client_lookup_or_add(&addr, now);
+    tt_assert(stats);
+    stats->concurrent_count = 1;
+  }
+  tor_addr_from_ipv4h(&addr, 0x0c000000);
+  tt_ptr_op(dos_client_lookup_or_add(&addr, now), OP_EQ, NULL);
+  tor_addr_from_ipv4h(&addr, 0x0b000000 + 17);
+  dos_client_lookup(&addr)->concurrent_count = 0;
+  dos_client_lookup(&addr)->cc_stats.last_circ_bucket_refill_ts = now;
+  tor_addr_from_ipv4h(&addr, 0x0c000000);
+  tt_ptr_op(dos_client_lookup_or_add(&addr, now), OP_EQ, NULL);
+  tt_assert(dos_client_lookup_or_add(&addr, now + 1));
+  tor_addr_from_ipv4h(&addr, 0x0b000000 + 17);
+  tt_ptr_op(dos_client_lookup(&addr), OP_EQ, NULL);
+  tt_uint_op(dos_client_table_n_entries(), OP_EQ, 768);
+  for (i = 0; i < 768; ++i) {
+    if (i == 17)
+      continue;
+    tor_addr_from_ipv4h(&addr, 0x0b000000 + i);
+    tt_assert(dos_client_lookup(&addr));
+  }
+
+ done:
+  dos_client_table_max_slots = DOS_CLIENT_TABLE_MAX_SLOTS;
+  dos_free_all();
+  UNMOCK(get_param_cc_enabled);
+  UNMOCK(get_param_conn_enabled);
+}
+
+static smartlist_t *reject_helper_lines = NULL;
+static void
+mock_dos_reject_helper_send(const char *line)
+{
+  smartlist_add_strdup(reject_helper_lines, line);
+}
+
+/** Test that we refuse connections from marked addresses when asked to, and
+ *  tell the rejection helper about each address once. */
+static void
+test_dos_reject_marked(void *arg)
+{
+  tor_addr_t addr;
+  or_connection_t or_conn;
+  char *line = NULL;
+  unsigned int i;
+  channel_t *chan = NULL;
+
+  (void) arg;
+
+  MOCK(get_param_cc_enabled, mock_enable_dos_protection);
+  MOCK(get_param_reject_marked, mock_enable_dos_protection);
+  MOCK(channel_get_addr_if_possible, mock_channel_get_addr_if_possible);
+  MOCK(dos_reject_helper_send, mock_dos_reject_helper_send);
+  reject_helper_lines = smartlist_new();
+
+  update_approx_time(1281533250); /* 2010-08-11 13:27:30 UTC */
+  dos_init();
+  /* Set this after dos_init() so that we don't launch anything. */
+  get_options_mutable()->DoSRejectHelper = tor_strdup("/bin/true");
+
+  /* The lines we send. */
+  tor_addr_parse(&addr, "[2001:db8:1:2:ffff::7]");
+  line = dos_reject_line_new(&addr, 3600);
+  tt_str_op(line, OP_EQ, "reject 2001:db8:1:2::/64 3600\n");
+  tor_free(line);
+  tor_addr_parse(&addr, "18.0.0.1");
+  line = dos_reject_line_new(&addr, 0);
+  tt_str_op(line, OP_EQ, "reject 18.0.0.1/32 1\n");
+  tor_free(line);
+
+  chan = tor_malloc_zero(sizeof(channel_t));
+  channel_init(chan);
+  chan->is_client = 1;
+  memset(&or_conn, 0, sizeof(or_conn));
+  tor_addr_copy(&or_conn.real_addr, &addr);
+  for (i = 0; i < get_param_cc_min_concurrent_connection(NULL); i++) {
+    dos_new_client_conn(&or_conn);
+  }
+  tt_int_op(dos_conn_addr_get_defense_type(&addr), OP_EQ,
+            DOS_CONN_DEFENSE_NONE);
+
+  /* Use up the circuit bucket: the address gets marked, and we refuse its
+   * connections from now on. */
+  for (i = 0; i < get_param_cc_circuit_burst(NULL) + 5; i++) {
+    dos_cc_new_create_cell(chan);
+  }
+  tt_int_op(dos_cc_get_defense_type(chan), OP_EQ, DOS_CC_DEFENSE_REFUSE_CELL);
+  tt_int_op(dos_conn_addr_get_defense_type(&addr), OP_EQ,
+            DOS_CONN_DEFENSE_CLOSE);
+  /* The helper heard about it once, even though we kept marking it. */
+  tt_int_op(smartlist_len(reject_helper_lines), OP_EQ, 1);
+  tt_assert(!strcmpstart(smartlist_get(reject_helper_lines, 0),
+                         "reject 18.0.0.1/32 "));
+
+  /* Without the option, marked addresses can still connect. */
+  UNMOCK(get_param_reject_marked);
+  dos_init();
+  tt_int_op(dos_conn_addr_get_defense_type(&addr), OP_EQ,
+            DOS_CONN_DEFENSE_NONE);
+
+ done:
+  tor_free(line);
+  tor_free(chan);
+  dos_free_all();
+  SMARTLIST_FOREACH(reject_helper_lines, char *, cp, tor_free(cp));
+  smartlist_free(reject_helper_lines);
+  UNMOCK(get_param_cc_enabled);
+  UNMOCK(get_param_reject_marked);
+  UNMOCK(channel_get_addr_if_possible);
+  UNMOCK(dos_reject_helper_send);
+}
+
 struct testcase_t dos_tests[] = {
   { "conn_creation", test_dos_conn_creation, TT_FORK, NULL, NULL },
   { "circuit_creation", test_dos_circuit_creation, TT_FORK, NULL, NULL },
   { "bucket_refill", test_dos_bucket_refill, TT_FORK, NULL, NULL },
   { "known_relay" , test_known_relay, TT_FORK,
     NULL, NULL },
+  { "client_table", test_dos_client_table, TT_FORK, NULL, NULL },
+  { "reject_marked", test_dos_reject_marked, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
@@ -143,8 +143,9 @@ test_oom_circbuf(void *arg)
   monotime_coarse_set_mock_time_nsec(now_ns);
   c2 = dummy_or_circuit_new(20, 20);
 
-  tt_int_op(packed_cell_mem_cost(), OP_EQ,
+  tt_int_op(packed_cell_mem_cost(), OP_GE,
             sizeof(packed_cell_t));
+  tt_int_op(packed_cell_mem_cost() % 64, OP_EQ, 0);
   tt_int_op(cell_queues_get_total_allocation(), OP_EQ,
             packed_cell_mem_cost() * 70);
   tt_int_op(cell_queues_check_size(), OP_EQ, 0); /* We are still not OOM */
@@ -227,6 +227,65 @@ test_parsecommon_tokenize_string_no_annotations(void *arg)
   return;
 }
 
+static void
+test_parsecommon_tokenize_string_keywords(void *arg)
+{
+  memarea_t *area = memarea_new();
+  smartlist_t *tokens = smartlist_new();
+  /* Keywords that share prefixes and lengths with each other. */
+  token_rule_t table[] = {
+    T0N("p",      K_P,      CONCAT_ARGS, NO_OBJ),
+    T0N("pr",     K_PROTO,  CONCAT_ARGS, NO_OBJ),
+    T0N("r",      K_R,      GE(1),       NO_OBJ),
+    T0N("router", K_ROUTER, GE(1),       NO_OBJ),
+    END_OF_TABLE
+  };
+  const char *str =
+    "pr Link=1-5\n"
+    "p accept 80\n"
+    "router a b\n"
+    "r x\n"
+    "prx y\n"
+    "-notanobject\n"
+    "opt router c\n";
+  directory_token_t *tok;
+  (void)arg;
+
+  tt_int_op(0, OP_EQ, tokenize_string(area, str, NULL, tokens, table,
+                                      TS_NOCHECK));
+  tt_int_op(smartlist_len(tokens), OP_EQ, 7);
+
+  tok = smartlist_get(tokens, 0);
+  tt_int_op(tok->tp, OP_EQ, K_PROTO);
+  tt_str_op(tok->args[0], OP_EQ, "Link=1-5");
+  tok = smartlist_get(tokens, 1);
+  tt_int_op(tok->tp, OP_EQ, K_P);
+  tt_str_op(tok->args[0], OP_EQ, "accept 80");
+  tok = smartlist_get(tokens, 2);
+  tt_int_op(tok->tp, OP_EQ, K_ROUTER);
+  tt_int_op(tok->n_args, OP_EQ, 2);
+  tok = smartlist_get(tokens, 3);
+  tt_int_op(tok->tp, OP_EQ, K_R);
+  tt_str_op(tok->args[0], OP_EQ, "x");
+  /* Unknown keywords become K_OPT. */
+  tok = smartlist_get(tokens, 4);
+  tt_int_op(tok->tp, OP_EQ, K_OPT);
+  tt_str_op(tok->args[0], OP_EQ, "prx y");
+  /* A line starting with a dash isn't necessarily an object. */
+  tok = smartlist_get(tokens, 5);
+  tt_int_op(tok->tp, OP_EQ, K_OPT);
+  tt_str_op(tok->args[0], OP_EQ, "-notanobject");
+  tt_assert(!tok->object_type);
+  tok = smartlist_get(tokens, 6);
+  tt_int_op(tok->tp, OP_EQ, K_ROUTER);
+  tt_str_op(tok->args[0], OP_EQ, "c");
+
+ done:
+  SMARTLIST_FOREACH(tokens, directory_token_t *, t, token_clear(t));
+  smartlist_free(tokens);
+  memarea_drop_all(area);
+}
+
 static void
 test_parsecommon_get_next_token_success(void *arg)
 {
@@ -580,6 +639,7 @@ struct testcase_t parsecommon_tests[] = {
   PARSECOMMON_TEST(tokenize_string_at_start),
   PARSECOMMON_TEST(tokenize_string_at_end),
   PARSECOMMON_TEST(tokenize_string_no_annotations),
+  PARSECOMMON_TEST(tokenize_string_keywords),
   PARSECOMMON_TEST(get_next_token_success),
   PARSECOMMON_TEST(get_next_token_concat_args),
   PARSECOMMON_TEST(get_next_token_parse_keys),
@@ -3,6 +3,9 @@
 
 #define CIRCUITBUILD_PRIVATE
 #define RELAY_PRIVATE
+#define RELAY_OFFLOAD_PRIVATE
+#define CONNECTION_PRIVATE
+#define CIRCUITLIST_PRIVATE
 #define REPHIST_PRIVATE
 #include "core/or/or.h"
 #include "core/or/circuitbuild.h"
@@ -10,13 +13,28 @@
 #include "core/or/channeltls.h"
 #include "feature/stats/rephist.h"
 #include "core/or/relay.h"
+#include "core/crypto/relay_crypto.h"
+#include "core/or/relay_offload.h"
+#include "core/mainloop/cpuworker.h"
+#include "feature/relay/routermode.h"
+#include "app/config/config.h"
+#include "lib/evloop/workqueue.h"
+#include "core/mainloop/connection.h"
 #include "feature/stats/rephist.h"
 #include "lib/container/order.h"
+#include "lib/crypt_ops/crypto_rand.h"
+#include "lib/buf/buffers.h"
 /* For init/free stuff */
 #include "core/or/scheduler.h"
 
 #include "core/or/cell_st.h"
+#include "core/or/cell_queue_st.h"
+#include "feature/nodelist/networkstatus_st.h"
+#include "core/or/crypt_path_st.h"
+#include "core/or/edge_connection_st.h"
 #include "core/or/or_circuit_st.h"
+#include "core/or/origin_circuit_st.h"
+#include "core/or/relay_crypto_st.h"
 
 /* Test suite stuff */
 #include "test/test.h"
@@ -225,10 +243,533 @@ test_relay_append_cell_to_circuit_queue(void *arg)
   return;
 }
 
+static const char PACKAGE_KEY_MATERIAL[CPATH_KEY_MATERIAL_LEN] =
+  "  'The relay has been chopping onions all day', said Tom tearfully.";
+
+/* Package a stream's inbuf at an exit, and make sure that the cells we
+ * queue come out right at the client. */
+static void
+test_relay_package_raw_inbuf(void *arg)
+{
+  channel_t *nchan = NULL, *pchan = NULL;
+  or_circuit_t *orcirc = NULL;
+  origin_circuit_t *client = NULL;
+  edge_connection_t *conn = NULL;
+  char *data = NULL;
+  const size_t datalen = 11 * RELAY_PAYLOAD_SIZE + 100;
+  size_t offset = 0;
+  int n_cells = 0;
+  packed_cell_t *pc;
+
+  (void)arg;
+
+  MOCK(scheduler_channel_has_waiting_cells,
+       scheduler_channel_has_waiting_cells_mock);
+
+  nchan = new_fake_channel();
+  pchan = new_fake_channel();
+  orcirc = new_fake_orcirc(nchan, pchan);
+  circuitmux_attach_circuit(nchan->cmux, TO_CIRCUIT(orcirc),
+                            CELL_DIRECTION_OUT);
+  circuitmux_attach_circuit(pchan->cmux, TO_CIRCUIT(orcirc),
+                            CELL_DIRECTION_IN);
+  tt_int_op(0, OP_EQ,
+            relay_crypto_init(&orcirc->crypto, PACKAGE_KEY_MATERIAL,
+                              sizeof(PACKAGE_KEY_MATERIAL), 0, 0));
+
+  /* A client that shares keys with the exit. */
+  client = origin_circuit_new();
+  client->base_.purpose = CIRCUIT_PURPOSE_C_GENERAL;
+  {
+    crypt_path_t *hop = tor_malloc_zero(sizeof(*hop));
+    relay_crypto_init(&hop->crypto, PACKAGE_KEY_MATERIAL,
+                      sizeof(PACKAGE_KEY_MATERIAL), 0, 0);
+    hop->magic = CRYPT_PATH_MAGIC;
+    hop->state = CPATH_STATE_OPEN;
+    hop->next = hop->prev = hop;
+    client->cpath = hop;
+  }
+
+  conn = edge_connection_new(CONN_TYPE_EXIT, AF_INET);
+  conn->on_circuit = TO_CIRCUIT(orcirc);
+  conn->stream_id = 77;
+  conn->package_window = STREAMWINDOW_START;
+  orcirc->n_streams = conn;
+
+  data = tor_malloc(datalen);
+  crypto_rand(data, datalen);
+  buf_add(TO_CONN(conn)->inbuf, data, datalen);
+
+  tt_int_op(0, OP_EQ, connection_edge_package_raw_inbuf(conn, 1, NULL));
+  tt_int_op(connection_get_inbuf_len(TO_CONN(conn)), OP_EQ, 0);
+  tt_int_op(orcirc->p_chan_cells.n, OP_EQ, 12);
+  tt_int_op(conn->package_window, OP_EQ, STREAMWINDOW_START - 12);
+  tt_int_op(orcirc->base_.package_window, OP_EQ, CIRCWINDOW_START_MAX - 12);
+
+  while ((pc = cell_queue_pop(&orcirc->p_chan_cells))) {
+    cell_t cell;
+    relay_header_t rh;
+    crypt_path_t *layer_hint = NULL;
+    char recognized = 0;
+    const int hdr = pchan->wide_circ_ids ? 5 : 3;
+
+    memset(&cell, 0, sizeof(cell));
+    cell.command = CELL_RELAY;
+    memcpy(cell.payload, pc->body + hdr, CELL_PAYLOAD_SIZE);
+    packed_cell_free(pc);
+
+    tt_int_op(0, OP_EQ, relay_decrypt_cell(TO_CIRCUIT(client), &cell,
+                                           CELL_DIRECTION_IN,
+                                           &layer_hint, &recognized));
+    tt_int_op(recognized, OP_EQ, 1);
+    relay_header_unpack(&rh, cell.payload);
+    tt_int_op(rh.command, OP_EQ, RELAY_COMMAND_DATA);
+    tt_int_op(rh.stream_id, OP_EQ, 77);
+    tt_int_op(rh.length, OP_EQ,
+              n_cells < 11 ? RELAY_PAYLOAD_SIZE : 100);
+    tt_mem_op(cell.payload + RELAY_HEADER_SIZE, OP_EQ, data + offset,
+              rh.length);
+    offset += rh.length;
+    ++n_cells;
+  }
+  tt_int_op(n_cells, OP_EQ, 12);
+  tt_int_op(offset, OP_EQ, datalen);
+
+ done:
+  UNMOCK(scheduler_channel_has_waiting_cells);
+  if (conn)
+    connection_free_minimal(TO_CONN(conn));
+  if (orcirc) {
+    circuitmux_detach_circuit(nchan->cmux, TO_CIRCUIT(orcirc));
+    circuitmux_detach_circuit(pchan->cmux, TO_CIRCUIT(orcirc));
+    cell_queue_clear(&orcirc->p_chan_cells);
+    relay_crypto_clear(&orcirc->crypto);
+  }
+  tor_free(orcirc);
+  circuit_free_(TO_CIRCUIT(client));
+  free_fake_channel(nchan);
+  free_fake_channel(pchan);
+  tor_free(data);
+}
+
+/* Work that the mocked cpuworker_queue_work() has been given, so that we
+ * can run it in the main thread. */
+static smartlist_t *fake_offload_queue = NULL;
+/* The priority of the last job that the mocked cpuworker_queue_work() got. */
+static workqueue_priority_t fake_offload_last_prio = WQ_PRI_LOW;
+typedef struct fake_offload_ent_t {
+  workqueue_reply_t (*fn)(void *, void *);
+  void (*reply_fn)(void *);
+  void *arg;
+} fake_offload_ent_t;
+
+static workqueue_entry_t *
+mock_offload_queue_work(workqueue_priority_t prio,
+                        workqueue_reply_t (*fn)(void *, void *),
+                        void (*reply_fn)(void *),
+                        void *arg)
+{
+  fake_offload_ent_t *ent = tor_malloc_zero(sizeof(*ent));
+  fake_offload_last_prio = prio;
+  ent->fn = fn;
+  ent->reply_fn = reply_fn;
+  ent->arg = arg;
+  smartlist_add(fake_offload_queue, ent);
+  return (workqueue_entry_t *)ent;
+}
+
+static int
+mock_server_mode_true(const or_options_t *options)
+{
+  (void)options;
+  return 1;
+}
+
+static void
+mock_circuit_mark_for_close(circuit_t *circ, int reason, int line,
+                            const char *file)
+{
+  (void)reason;
+  circ->marked_for_close = line;
+  circ->marked_for_close_file = file;
+}
+
+/* Make a relay cell with a random payload on <b>circ_id</b>. */
+static void
+make_offload_test_cell(cell_t *cell, circid_t circ_id)
+{
+  memset(cell, 0, sizeof(*cell));
+  cell->circ_id = circ_id;
+  cell->command = CELL_RELAY;
+  crypto_rand((char*)cell->payload, CELL_PAYLOAD_SIZE);
+}
+
+/* Once a busy middle circuit's crypto moves to the cpuworkers, make sure that
+ * the cells it forwards and the cells it originates come out in order, with
+ * the same crypto they would have had on the main thread. */
+static void
+test_relay_crypto_offload(void *arg)
+{
+  channel_t *nchan = NULL, *pchan = NULL;
+  or_circuit_t *orcirc = NULL;
+  relay_crypto_t ref;
+  cell_t *expected = NULL;
+  const int n_received = RELAY_OFFLOAD_MIN_CELLS + 2 * RELAY_OFFLOAD_MAX_BATCH;
+  const int n_total = n_received + 1;
+  int i, n_jobs = 0;
+  packed_cell_t *pc;
+
+  (void)arg;
+
+  memset(&ref, 0, sizeof(ref));
+  fake_offload_queue = smartlist_new();
+  MOCK(scheduler_channel_has_waiting_cells,
+       scheduler_channel_has_waiting_cells_mock);
+  MOCK(cpuworker_queue_work, mock_offload_queue_work);
+  MOCK(server_mode, mock_server_mode_true);
+  get_options_mutable()->RelayCryptoOffload = 1;
+
+  nchan = new_fake_channel();
+  pchan = new_fake_channel();
+  orcirc = new_fake_orcirc(nchan, pchan);
+  circuitmux_attach_circuit(nchan->cmux, TO_CIRCUIT(orcirc),
+                            CELL_DIRECTION_OUT);
+  circuitmux_attach_circuit(pchan->cmux, TO_CIRCUIT(orcirc),
+                            CELL_DIRECTION_IN);
+  tt_int_op(0, OP_EQ,
+            relay_crypto_init(&orcirc->crypto, PACKAGE_KEY_MATERIAL,
+                              sizeof(PACKAGE_KEY_MATERIAL), 0, 0));
+  tt_int_op(0, OP_EQ,
+            relay_crypto_init(&ref, PACKAGE_KEY_MATERIAL,
+                              sizeof(PACKAGE_KEY_MATERIAL), 0, 0));
+
+  /* Cells heading back towards the client: the first ones get their
+   * crypto right away; after that, they wait for the cpuworkers. */
+  expected = tor_calloc(n_total, sizeof(cell_t));
+  for (i = 0; i < n_received; ++i) {
+    cell_t cell;
+    char recognized = 0;
+    make_offload_test_cell(&cell, TO_CIRCUIT(orcirc)->n_circ_id);
+    memcpy(&expected[i], &cell, sizeof(cell));
+    relay_crypto_decrypt_at_relay(&ref, &expected[i], CELL_DIRECTION_IN,
+                                  &recognized);
+    tt_int_op(0, OP_EQ, circuit_receive_relay_cell(&cell, TO_CIRCUIT(orcirc),
+                                                   CELL_DIRECTION_IN));
+  }
+  tt_int_op(orcirc->p_chan_cells.n, OP_EQ, RELAY_OFFLOAD_MIN_CELLS - 1);
+  tt_assert(relay_offload_is_active(orcirc));
+  tt_int_op(relay_offload_n_pending(orcirc), OP_EQ,
+            n_received - RELAY_OFFLOAD_MIN_CELLS + 1);
+  tt_int_op(smartlist_len(fake_offload_queue), OP_EQ, 1);
+
+  /* A cell that we originate has to wait its turn too. */
+  {
+    cell_t cell;
+    cell_t *cellp = &expected[n_received];
+    relay_header_t rh;
+    memset(&cell, 0, sizeof(cell));
+    memset(&rh, 0, sizeof(rh));
+    cell.circ_id = orcirc->p_circ_id;
+    cell.command = CELL_RELAY;
+    rh.command = RELAY_COMMAND_DROP;
+    relay_header_pack(cell.payload, &rh);
+    memcpy(cellp, &cell, sizeof(cell));
+    relay_crypto_encrypt_cell_inbound(&ref, cellp);
+    tt_int_op(0, OP_EQ,
+              circuit_package_relay_cell(&cell, TO_CIRCUIT(orcirc),
+                                         CELL_DIRECTION_IN, NULL, 0,
+                                         __FILE__, __LINE__));
+  }
+  tt_int_op(orcirc->p_chan_cells.n, OP_EQ, RELAY_OFFLOAD_MIN_CELLS - 1);
+
+  /* Run the jobs one at a time, the way the threadpool would. */
+  while (smartlist_len(fake_offload_queue)) {
+    fake_offload_ent_t *ent = smartlist_get(fake_offload_queue, 0);
+    smartlist_del_keeporder(fake_offload_queue, 0);
+    tt_int_op(ent->fn(NULL, ent->arg), OP_EQ, WQ_RPL_REPLY);
+    ent->reply_fn(ent->arg);
+    tor_free(ent);
+    ++n_jobs;
+  }
+  tt_int_op(n_jobs, OP_EQ, 4);
+  tt_int_op(relay_offload_n_pending(orcirc), OP_EQ, 0);
+  tt_int_op(orcirc->p_chan_cells.n, OP_EQ, n_total);
+
+  i = 0;
+  while ((pc = cell_queue_pop(&orcirc->p_chan_cells))) {
+    const int hdr = pchan->wide_circ_ids ? 5 : 3;
+    tt_int_op(i, OP_LT, n_total);
+    tt_mem_op(pc->body + hdr, OP_EQ, expected[i].payload, CELL_PAYLOAD_SIZE);
+    packed_cell_free(pc);
+    ++i;
+  }
+  tt_int_op(i, OP_EQ, n_total);
+
+ done:
+  UNMOCK(scheduler_channel_has_waiting_cells);
+  UNMOCK(cpuworker_queue_work);
+  UNMOCK(server_mode);
+  if (fake_offload_queue) {
+    SMARTLIST_FOREACH(fake_offload_queue, fake_offload_ent_t *, ent,
+                      tor_free(ent));
+    smartlist_free(fake_offload_queue);
+  }
+  if (orcirc) {
+    relay_offload_circuit_free(orcirc);
+    circuitmux_detach_circuit(nchan->cmux, TO_CIRCUIT(orcirc));
+    circuitmux_detach_circuit(pchan->cmux, TO_CIRCUIT(orcirc));
+    cell_queue_clear(&orcirc->p_chan_cells);
+    relay_crypto_clear(&orcirc->crypto);
+  }
+  tor_free(orcirc);
+  relay_crypto_clear(&ref);
+  free_fake_channel(nchan);
+  free_fake_channel(pchan);
+  tor_free(expected);
+}
+
+/* Make sure that the cells waiting for a cpuworker count towards our memory
+ * use, obey the circuit queue limit, and can be freed by the OOM handler. */
+static void
+test_relay_crypto_offload_limits(void *arg)
+{
+  channel_t *nchan = NULL, *pchan = NULL;
+  or_circuit_t *orcirc = NULL;
+  networkstatus_t ns;
+  const int max_queue = CIRCWINDOW_START_MAX;
+  size_t per_cell;
+  cell_t cell;
+  int i;
+
+  (void)arg;
+
+  memset(&ns, 0, sizeof(ns));
+  ns.net_params = smartlist_new();
+  fake_offload_queue = smartlist_new();
+  MOCK(scheduler_channel_has_waiting_cells,
+       scheduler_channel_has_waiting_cells_mock);
+  MOCK(cpuworker_queue_work, mock_offload_queue_work);
+  MOCK(server_mode, mock_server_mode_true);
+  MOCK(circuit_mark_for_close_, mock_circuit_mark_for_close);
+  get_options_mutable()->RelayCryptoOffload = 1;
+
+  nchan = new_fake_channel();
+  pchan = new_fake_channel();
+  orcirc = new_fake_orcirc(nchan, pchan);
+  circuitmux_attach_circuit(nchan->cmux, TO_CIRCUIT(orcirc),
+                            CELL_DIRECTION_OUT);
+  circuitmux_attach_circuit(pchan->cmux, TO_CIRCUIT(orcirc),
+                            CELL_DIRECTION_IN);
+  tt_int_op(0, OP_EQ,
+            relay_crypto_init(&orcirc->crypto, PACKAGE_KEY_MATERIAL,
+                              sizeof(PACKAGE_KEY_MATERIAL), 0, 0));
+
+  /* The last of these cells goes to a cpuworker. */
+  for (i = 0; i < RELAY_OFFLOAD_MIN_CELLS; ++i) {
+    make_offload_test_cell(&cell, TO_CIRCUIT(orcirc)->n_circ_id);
+    tt_int_op(0, OP_EQ, circuit_receive_relay_cell(&cell, TO_CIRCUIT(orcirc),
+                                                   CELL_DIRECTION_IN));
+  }
+  tt_assert(relay_offload_is_active(orcirc));
+  tt_int_op(smartlist_len(fake_offload_queue), OP_EQ, 1);
+  tt_int_op(fake_offload_last_prio, OP_EQ, WQ_PRI_MED);
+  per_cell = relay_offload_get_total_allocation();
+  tt_int_op(per_cell, OP_GE, sizeof(cell_t));
+  tt_int_op(cell_queues_get_total_allocation(), OP_EQ,
+            (RELAY_OFFLOAD_MIN_CELLS - 1) * packed_cell_mem_cost() + per_cell);
+
+  /* Lower the queue limit, and fill the pending queue right up to it. */
+  smartlist_add_asprintf(ns.net_params, "circ_max_cell_queue_size=%d",
+                         max_queue);
+  relay_consensus_has_changed(&ns);
+  for (i = 0; i < max_queue; ++i) {
+    make_offload_test_cell(&cell, TO_CIRCUIT(orcirc)->n_circ_id);
+    tt_int_op(0, OP_EQ, circuit_receive_relay_cell(&cell, TO_CIRCUIT(orcirc),
+                                                   CELL_DIRECTION_IN));
+  }
+  tt_assert(! TO_CIRCUIT(orcirc)->marked_for_close);
+  tt_int_op(relay_offload_n_pending(orcirc), OP_EQ, max_queue + 1);
+  tt_int_op(relay_offload_get_total_allocation(), OP_EQ,
+            (max_queue + 1) * per_cell);
+
+  /* One more is too many. */
+  make_offload_test_cell(&cell, TO_CIRCUIT(orcirc)->n_circ_id);
+  tt_int_op(0, OP_EQ, circuit_receive_relay_cell(&cell, TO_CIRCUIT(orcirc),
+                                                 CELL_DIRECTION_IN));
+  tt_assert(TO_CIRCUIT(orcirc)->marked_for_close);
+  tt_int_op(relay_offload_n_pending(orcirc), OP_EQ, max_queue + 1);
+
+  /* The OOM handler frees the waiting cells, but not the ones that a
+   * cpuworker has. */
+  tt_int_op(relay_offload_free_pending(orcirc), OP_EQ, max_queue * per_cell);
+  tt_int_op(relay_offload_n_pending(orcirc), OP_EQ, 1);
+  tt_int_op(relay_offload_get_total_allocation(), OP_EQ, per_cell);
+
+  /* When that job comes back, nothing else gets launched. */
+  {
+    fake_offload_ent_t *ent = smartlist_pop_last(fake_offload_queue);
+    tt_int_op(ent->fn(NULL, ent->arg), OP_EQ, WQ_RPL_REPLY);
+    ent->reply_fn(ent->arg);
+    tor_free(ent);
+  }
+  tt_int_op(smartlist_len(fake_offload_queue), OP_EQ, 0);
+  tt_int_op(relay_offload_get_total_allocation(), OP_EQ, 0);
+
+ done:
+  UNMOCK(scheduler_channel_has_waiting_cells);
+  UNMOCK(cpuworker_queue_work);
+  UNMOCK(server_mode);
+  UNMOCK(circuit_mark_for_close_);
+  if (fake_offload_queue) {
+    SMARTLIST_FOREACH(fake_offload_queue, fake_offload_ent_t *, ent,
+                      tor_free(ent));
+    smartlist_free(fake_offload_queue);
+  }
+  if (orcirc) {
+    relay_offload_circuit_free(orcirc);
+    circuitmux_detach_circuit(nchan->cmux, TO_CIRCUIT(orcirc));
+    circuitmux_detach_circuit(pchan->cmux, TO_CIRCUIT(orcirc));
+    cell_queue_clear(&orcirc->p_chan_cells);
+    relay_crypto_clear(&orcirc->crypto);
+  }
+  tor_free(orcirc);
+  free_fake_channel(nchan);
+  free_fake_channel(pchan);
+  SMARTLIST_FOREACH(ns.net_params, char *, cp, tor_free(cp));
+  smartlist_free(ns.net_params);
+}
+
+/* Make sure that cells waiting for a cpuworker count towards the queue that
+ * blocks our edge streams, and that the streams start reading again once
+ * that backlog has gone. */
+static void
+test_relay_crypto_offload_blocks_streams(void *arg)
+{
+  channel_t *nchan = NULL, *pchan = NULL;
+  or_circuit_t *orcirc = NULL;
+  edge_connection_t *conn = NULL;
+  cell_t cell;
+  int i;
+
+  (void)arg;
+
+  fake_offload_queue = smartlist_new();
+  MOCK(scheduler_channel_has_waiting_cells,
+       scheduler_channel_has_waiting_cells_mock);
+  MOCK(cpuworker_queue_work, mock_offload_queue_work);
+  MOCK(server_mode, mock_server_mode_true);
+  get_options_mutable()->RelayCryptoOffload = 1;
+
+  nchan = new_fake_channel();
+  pchan = new_fake_channel();
+  orcirc = new_fake_orcirc(nchan, pchan);
+  circuitmux_attach_circuit(nchan->cmux, TO_CIRCUIT(orcirc),
+                            CELL_DIRECTION_OUT);
+  circuitmux_attach_circuit(pchan->cmux, TO_CIRCUIT(orcirc),
+                            CELL_DIRECTION_IN);
+  tt_int_op(0, OP_EQ,
+            relay_crypto_init(&orcirc->crypto, PACKAGE_KEY_MATERIAL,
+                              sizeof(PACKAGE_KEY_MATERIAL), 0, 0));
+
+  conn = edge_connection_new(CONN_TYPE_EXIT, AF_INET);
+  conn->on_circuit = TO_CIRCUIT(orcirc);
+  conn->stream_id = 77;
+  orcirc->n_streams = conn;
+
+  /* Cells heading away from the client: the last of these goes to a
+   * cpuworker, and the rest wait behind it. */
+  for (i = 0; i < RELAY_OFFLOAD_MIN_CELLS + CELL_QUEUE_HIGHWATER_SIZE - 2;
+       ++i) {
+    make_offload_test_cell(&cell, orcirc->p_circ_id);
+    tt_int_op(0, OP_EQ, circuit_receive_relay_cell(&cell, TO_CIRCUIT(orcirc),
+                                                   CELL_DIRECTION_OUT));
+  }
+  tt_int_op(relay_offload_n_pending(orcirc), OP_EQ,
+            CELL_QUEUE_HIGHWATER_SIZE - 1);
+  tt_int_op(orcirc->p_chan_cells.n, OP_EQ, 0);
+  tt_int_op(TO_CIRCUIT(orcirc)->streams_blocked_on_p_chan, OP_EQ, 0);
+  tt_int_op(conn->edge_blocked_on_circ, OP_EQ, 0);
+
+  /* One more cell from the stream fills the circuit's queue, even though
+   * nothing is on the p_chan queue yet. */
+  {
+    relay_header_t rh;
+    memset(&cell, 0, sizeof(cell));
+    memset(&rh, 0, sizeof(rh));
+    cell.circ_id = orcirc->p_circ_id;
+    cell.command = CELL_RELAY;
+    rh.command = RELAY_COMMAND_DATA;
+    rh.stream_id = conn->stream_id;
+    relay_header_pack(cell.payload, &rh);
+    tt_int_op(0, OP_EQ,
+              circuit_package_relay_cell(&cell, TO_CIRCUIT(orcirc),
+                                         CELL_DIRECTION_IN, NULL,
+                                         conn->stream_id,
+                                         __FILE__, __LINE__));
+  }
+  tt_int_op(relay_offload_n_pending(orcirc), OP_EQ,
+            CELL_QUEUE_HIGHWATER_SIZE);
+  tt_int_op(orcirc->p_chan_cells.n, OP_EQ, 0);
+  tt_int_op(TO_CIRCUIT(orcirc)->streams_blocked_on_p_chan, OP_EQ, 1);
+  tt_int_op(conn->edge_blocked_on_circ, OP_EQ, 1);
+
+  /* The streams stay blocked until the backlog is gone. */
+  while (smartlist_len(fake_offload_queue)) {
+    fake_offload_ent_t *ent = smartlist_get(fake_offload_queue, 0);
+    smartlist_del_keeporder(fake_offload_queue, 0);
+    tt_int_op(conn->edge_blocked_on_circ, OP_EQ, 1);
+    tt_int_op(ent->fn(NULL, ent->arg), OP_EQ, WQ_RPL_REPLY);
+    ent->reply_fn(ent->arg);
+    tor_free(ent);
+  }
+  tt_int_op(relay_offload_n_pending(orcirc), OP_EQ, 0);
+  tt_int_op(orcirc->p_chan_cells.n, OP_EQ, 1);
+  tt_int_op(TO_CIRCUIT(orcirc)->streams_blocked_on_p_chan, OP_EQ, 0);
+  tt_int_op(conn->edge_blocked_on_circ, OP_EQ, 0);
+
+ done:
+  if (fake_offload_queue) {
+    /* Finish any job that is still out, so that we don't try to cancel a
+     * fake workqueue entry. */
+    while (smartlist_len(fake_offload_queue)) {
+      fake_offload_ent_t *ent = smartlist_get(fake_offload_queue, 0);
+      smartlist_del_keeporder(fake_offload_queue, 0);
+      ent->fn(NULL, ent->arg);
+      ent->reply_fn(ent->arg);
+      tor_free(ent);
+    }
+    smartlist_free(fake_offload_queue);
+  }
+  UNMOCK(scheduler_channel_has_waiting_cells);
+  UNMOCK(cpuworker_queue_work);
+  UNMOCK(server_mode);
+  if (conn)
+    connection_free_minimal(TO_CONN(conn));
+  if (orcirc) {
+    relay_offload_circuit_free(orcirc);
+    circuitmux_detach_circuit(nchan->cmux, TO_CIRCUIT(orcirc));
+    circuitmux_detach_circuit(pchan->cmux, TO_CIRCUIT(orcirc));
+    cell_queue_clear(&TO_CIRCUIT(orcirc)->n_chan_cells);
+    cell_queue_clear(&orcirc->p_chan_cells);
+    relay_crypto_clear(&orcirc->crypto);
+  }
+  tor_free(orcirc);
+  free_fake_channel(nchan);
+  free_fake_channel(pchan);
+}
+
 struct testcase_t relay_tests[] = {
   { "append_cell_to_circuit_queue", test_relay_append_cell_to_circuit_queue,
     TT_FORK, NULL, NULL },
   { "close_circ_rephist", test_relay_close_circuit,
     TT_FORK, NULL, NULL },
+  { "package_raw_inbuf", test_relay_package_raw_inbuf,
+    TT_FORK, NULL, NULL },
+  { "crypto_offload", test_relay_crypto_offload,
+    TT_FORK, NULL, NULL },
+  { "crypto_offload_limits", test_relay_crypto_offload_limits,
+    TT_FORK, NULL, NULL },
+  { "crypto_offload_blocks_streams", test_relay_crypto_offload_blocks_streams,
+    TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
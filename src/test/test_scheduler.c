@@ -17,6 +17,8 @@
 #include "feature/nodelist/networkstatus.h"
 #define SCHEDULER_PRIVATE_
 #include "core/or/scheduler.h"
+#include "core/or/scheduler_stats.h"
+#include "core/or/circuitmux.h"
 
 /* Test suite stuff */
 #include "test/test.h"
@@ -81,6 +83,9 @@ mock_vanilla_networkstatus_get_param(
   (void)default_val;
   (void)min_val;
   (void)max_val;
+  if (strcmp(param_name, "KISTSchedQuantum")==0 ||
+      strcmp(param_name, "KISTSockInfoMaxAge")==0)
+    return default_val;
   // only support KISTSchedRunInterval right now
   tor_assert(strcmp(param_name, "KISTSchedRunInterval")==0);
   return 0;
@@ -95,6 +100,9 @@ mock_kist_networkstatus_get_param(
   (void)default_val;
   (void)min_val;
   (void)max_val;
+  if (strcmp(param_name, "KISTSchedQuantum")==0 ||
+      strcmp(param_name, "KISTSockInfoMaxAge")==0)
+    return default_val;
   // only support KISTSchedRunInterval right now
   tor_assert(strcmp(param_name, "KISTSchedRunInterval")==0);
   return 12;
@@ -832,6 +840,186 @@ test_scheduler_loop_kist(void *arg)
   return;
 }
 
+static int flush_some_cells_n_calls = 0;
+static ssize_t flush_some_cells_max_asked = 0;
+
+static ssize_t
+channel_flush_some_cells_mock_counting(channel_t *chan, ssize_t num_cells)
+{
+  ++flush_some_cells_n_calls;
+  flush_some_cells_max_asked = MAX(flush_some_cells_max_asked, num_cells);
+  return channel_flush_some_cells_mock(chan, num_cells);
+}
+
+static void
+update_socket_info_impl_mock_3_cells(socket_table_ent_t *ent)
+{
+  ent->cwnd = ent->unacked = ent->mss = ent->notsent = 0;
+  ent->limit = 3 * (CELL_MAX_NETWORK_SIZE + TLS_PER_CELL_OVERHEAD);
+}
+
+static void
+test_scheduler_kist_quantum(void *arg)
+{
+  (void) arg;
+
+#ifndef HAVE_KIST_SUPPORT
+  return;
+#endif
+
+  channel_t *ch1 = new_fake_channel();
+
+  MOCK(get_options, mock_get_options);
+  MOCK(channel_flush_some_cells, channel_flush_some_cells_mock_counting);
+  MOCK(channel_more_to_flush, channel_more_to_flush_mock);
+  MOCK(channel_write_to_kernel, channel_write_to_kernel_mock);
+  MOCK(channel_should_write_to_kernel, channel_should_write_to_kernel_mock);
+  MOCK(update_socket_info_impl, update_socket_info_impl_mock);
+  clear_options();
+  mocked_options.KISTSchedRunInterval = 10;
+  mocked_options.KISTSchedQuantum = 4;
+  set_scheduler_options(SCHEDULER_KIST);
+  scheduler_init();
+  tt_int_op(sched_quantum, OP_EQ, 4);
+
+  tt_assert(ch1);
+  ch1->magic = TLS_CHAN_MAGIC;
+  ch1->state = CHANNEL_STATE_OPENING;
+  channel_register(ch1);
+  tt_assert(ch1->registered);
+  channel_change_state_open(ch1);
+  scheduler_channel_has_waiting_cells(ch1);
+  scheduler_channel_wants_writes(ch1);
+  channel_flush_some_cells_mock_set(ch1, 10);
+
+  /* Ten cells go out a quantum at a time: 4, 4, then 2. */
+  the_scheduler->run();
+  tt_int_op(flush_some_cells_n_calls, OP_EQ, 3);
+  tt_int_op(flush_some_cells_max_asked, OP_EQ, 4);
+  tt_int_op(channel_more_to_flush_mock(ch1), OP_EQ, 0);
+  tt_int_op(ch1->scheduler_state, OP_EQ, SCHED_CHAN_WAITING_FOR_CELLS);
+
+  /* The quantum never takes us past the KIST write limit. */
+  MOCK(update_socket_info_impl, update_socket_info_impl_mock_3_cells);
+  flush_some_cells_n_calls = 0;
+  flush_some_cells_max_asked = 0;
+  scheduler_channel_has_waiting_cells(ch1);
+  channel_flush_some_cells_mock_set(ch1, 10);
+  the_scheduler->run();
+  tt_int_op(flush_some_cells_n_calls, OP_EQ, 1);
+  tt_int_op(flush_some_cells_max_asked, OP_EQ, 3);
+  tt_int_op(channel_more_to_flush_mock(ch1), OP_EQ, 7);
+  tt_int_op(ch1->scheduler_state, OP_EQ, SCHED_CHAN_PENDING);
+
+ done:
+  channel_flush_some_cells_mock_free_all();
+  ch1->state = CHANNEL_STATE_CLOSED;
+  ch1->registered = 0;
+  channel_free(ch1);
+  UNMOCK(update_socket_info_impl);
+  UNMOCK(channel_should_write_to_kernel);
+  UNMOCK(channel_write_to_kernel);
+  UNMOCK(channel_more_to_flush);
+  UNMOCK(channel_flush_some_cells);
+  UNMOCK(get_options);
+  scheduler_free_all();
+}
+
+static int update_socket_info_impl_n_calls = 0;
+static uint64_t update_socket_info_impl_limit_cells = 0;
+
+static void
+update_socket_info_impl_mock_counting(socket_table_ent_t *ent)
+{
+  ++update_socket_info_impl_n_calls;
+  ent->cwnd = ent->unacked = ent->mss = ent->notsent = 0;
+  ent->limit = update_socket_info_impl_limit_cells *
+               (CELL_MAX_NETWORK_SIZE + TLS_PER_CELL_OVERHEAD);
+}
+
+static void
+test_scheduler_kist_sock_info_cache(void *arg)
+{
+  (void) arg;
+
+#ifndef HAVE_KIST_SUPPORT
+  return;
+#endif
+
+  channel_t *ch1 = new_fake_channel();
+
+  MOCK(get_options, mock_get_options);
+  MOCK(channel_flush_some_cells, channel_flush_some_cells_mock);
+  MOCK(channel_more_to_flush, channel_more_to_flush_mock);
+  MOCK(channel_write_to_kernel, channel_write_to_kernel_mock);
+  MOCK(channel_should_write_to_kernel, channel_should_write_to_kernel_mock);
+  MOCK(update_socket_info_impl, update_socket_info_impl_mock_counting);
+  clear_options();
+  mocked_options.KISTSchedRunInterval = 10;
+  mocked_options.KISTSchedQuantum = 4;
+  mocked_options.KISTSockInfoMaxAge = 2;
+  set_scheduler_options(SCHEDULER_KIST);
+  scheduler_init();
+  tt_int_op(sched_sock_info_max_age, OP_EQ, 2);
+
+  tt_assert(ch1);
+  ch1->magic = TLS_CHAN_MAGIC;
+  ch1->state = CHANNEL_STATE_OPENING;
+  channel_register(ch1);
+  tt_assert(ch1->registered);
+  channel_change_state_open(ch1);
+  scheduler_channel_wants_writes(ch1);
+
+  /* We ask the kernel on the first run, then keep using what's left of the
+   * limit for two more runs, then ask again. */
+  update_socket_info_impl_limit_cells = 100;
+  for (int run = 1; run <= 4; ++run) {
+    scheduler_channel_has_waiting_cells(ch1);
+    channel_flush_some_cells_mock_set(ch1, 10);
+    the_scheduler->run();
+    tt_int_op(channel_more_to_flush_mock(ch1), OP_EQ, 0);
+    tt_int_op(update_socket_info_impl_n_calls, OP_EQ, run < 4 ? 1 : 2);
+  }
+  tt_u64_op(sock_info_n_refreshed, OP_EQ, 2);
+  tt_u64_op(sock_info_n_reused, OP_EQ, 2);
+
+  /* Once less than a quantum of the limit is left, we ask again, even if
+   * the limit is recent. */
+  update_socket_info_impl_limit_cells = 12;
+  for (int run = 5; run <= 8; ++run) {
+    const int expected[] = { 2, 2, 3, 4 };
+    scheduler_channel_has_waiting_cells(ch1);
+    channel_flush_some_cells_mock_set(ch1, 10);
+    the_scheduler->run();
+    tt_int_op(update_socket_info_impl_n_calls, OP_EQ, expected[run - 5]);
+  }
+
+  /* With no max age, we ask every time. */
+  mocked_options.KISTSockInfoMaxAge = 0;
+  the_scheduler->on_new_options();
+  update_socket_info_impl_limit_cells = 100;
+  scheduler_channel_has_waiting_cells(ch1);
+  channel_flush_some_cells_mock_set(ch1, 10);
+  the_scheduler->run();
+  scheduler_channel_has_waiting_cells(ch1);
+  channel_flush_some_cells_mock_set(ch1, 10);
+  the_scheduler->run();
+  tt_int_op(update_socket_info_impl_n_calls, OP_EQ, 6);
+
+ done:
+  channel_flush_some_cells_mock_free_all();
+  ch1->state = CHANNEL_STATE_CLOSED;
+  ch1->registered = 0;
+  channel_free(ch1);
+  UNMOCK(update_socket_info_impl);
+  UNMOCK(channel_should_write_to_kernel);
+  UNMOCK(channel_write_to_kernel);
+  UNMOCK(channel_more_to_flush);
+  UNMOCK(channel_flush_some_cells);
+  UNMOCK(get_options);
+  scheduler_free_all();
+}
+
 static void
 test_scheduler_channel_states(void *arg)
 {
@@ -1265,6 +1453,53 @@ test_scheduler_kist_pending_list(void *arg)
   UNMOCK(channel_should_write_to_kernel);
 }
 
+static void
+test_scheduler_stats(void *arg)
+{
+  circuitmux_t *cmux = NULL;
+  char *answer = NULL;
+  const char *errmsg = NULL;
+  (void) arg;
+
+  /* Cells and runs show up in GETINFO. */
+  scheduler_stats_reset();
+  cmux = circuitmux_alloc();
+  scheduler_stats_note_run_start(SCHEDULER_KIST);
+  scheduler_stats_note_cell_delay(cmux, 3);
+  scheduler_stats_note_cell_delay(cmux, 7);
+  scheduler_stats_note_run_end(250);
+
+  getinfo_helper_sched_stats(NULL, "sched-stats/cell-delay", &answer,
+                             &errmsg);
+  tt_assert(answer);
+  tt_assert(strstr(answer, "policy=Other count=2 mean=5 p50=3 p90=7 "
+                   "p99=7 max=7 buckets=3:1,7:1\n"));
+  tt_assert(strstr(answer, "scheduler=KIST count=2 "));
+  tt_assert(strstr(answer, "scheduler=Vanilla count=0 "));
+  tor_free(answer);
+
+  getinfo_helper_sched_stats(NULL, "sched-stats/run-cells", &answer,
+                             &errmsg);
+  tt_assert(answer);
+  tt_assert(strstr(answer, "scheduler=KIST count=1 mean=2 "));
+  tor_free(answer);
+
+  getinfo_helper_sched_stats(NULL, "sched-stats/run-usec", &answer,
+                             &errmsg);
+  tt_assert(answer);
+  tt_assert(strstr(answer, "scheduler=KIST count=1 mean=250 "));
+  tor_free(answer);
+
+  getinfo_helper_sched_stats(NULL, "sched-stats/nonesuch", &answer,
+                             &errmsg);
+  tt_ptr_op(answer, OP_EQ, NULL);
+
+ done:
+  tor_free(answer);
+  circuitmux_free(cmux);
+  scheduler_stats_reset();
+}
+
 struct testcase_t scheduler_tests[] = {
   { "compare_channels", test_scheduler_compare_channels,
     TT_FORK, NULL, NULL },
@@ -1272,10 +1507,14 @@ struct testcase_t scheduler_tests[] = {
   { "initfree", test_scheduler_initfree, TT_FORK, NULL, NULL },
   { "loop_vanilla", test_scheduler_loop_vanilla, TT_FORK, NULL, NULL },
   { "loop_kist", test_scheduler_loop_kist, TT_FORK, NULL, NULL },
+  { "kist_quantum", test_scheduler_kist_quantum, TT_FORK, NULL, NULL },
+  { "kist_sock_info_cache", test_scheduler_kist_sock_info_cache, TT_FORK,
+    NULL, NULL },
   { "ns_changed", test_scheduler_ns_changed, TT_FORK, NULL, NULL},
   { "should_use_kist", test_scheduler_can_use_kist, TT_FORK, NULL, NULL },
   { "kist_pending_list", test_scheduler_kist_pending_list, TT_FORK,
     NULL, NULL },
+  { "stats", test_scheduler_stats, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
 
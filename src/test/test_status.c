@@ -347,7 +347,7 @@ NS(test_main)(void *arg)
   actual = log_heartbeat(0);
 
   tt_int_op(actual, OP_EQ, expected);
-  tt_int_op(CALLED(logv), OP_EQ, 6);
+  tt_int_op(CALLED(logv), OP_EQ, 7);
 
   done:
     NS_UNMOCK(tls_get_write_overhead_ratio);
@@ -449,12 +449,21 @@ NS(logv)(int severity, log_domain_mask_t domain,
     case 5:
       tt_int_op(severity, OP_EQ, LOG_NOTICE);
       tt_int_op(domain, OP_EQ, LD_HEARTBEAT);
-      tt_str_op(format, OP_EQ, "DoS mitigation since startup:%s%s%s%s");
+      tt_str_op(format, OP_EQ, "DoS mitigation since startup:%s%s%s%s%s");
       tt_str_op(va_arg(ap, char *), OP_EQ,
                 " 0 circuits killed with too many cells.");
       tt_str_op(va_arg(ap, char *), OP_EQ, " [cc not enabled]");
       tt_str_op(va_arg(ap, char *), OP_EQ, " [conn not enabled]");
       tt_str_op(va_arg(ap, char *), OP_EQ, "");
+      tt_str_op(va_arg(ap, char *), OP_EQ,
+                " 0 client addresses tracked in 0 kB.");
+      break;
+    case 6:
+      tt_int_op(severity, OP_EQ, LOG_NOTICE);
+      tt_int_op(domain, OP_EQ, LD_HEARTBEAT);
+      tt_ptr_op(strstr(funcname, "packed_cell_pool_log_heartbeat"),
+                OP_NE, NULL);
+      tt_int_op(va_arg(ap, size_t), OP_EQ, 0);  /* cells in use */
       break;
     default:
       tt_abort_msg("unexpected call to logv()");  // TODO: prettyprint args
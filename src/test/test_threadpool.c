@@ -0,0 +1,376 @@
+/* Copyright (c) 2019, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+#define CIRCUITLIST_PRIVATE
+#define CPUWORKER_PRIVATE
+#define WORKQUEUE_PRIVATE
+#include "orconfig.h"
+#include "core/or/or.h"
+#include "core/crypto/onion_ntor.h"
+#include "core/mainloop/cpuworker.h"
+#include "core/or/circuitlist.h"
+#include "core/or/onion.h"
+#include "feature/relay/onion_queue.h"
+#include "lib/evloop/workqueue.h"
+#include "lib/thread/threads.h"
+#include "lib/time/compat_time.h"
+#include "test/fakechans.h"
+#include "test/test.h"
+
+#include "core/or/or_circuit_st.h"
+
+/* Every thread in the pool runs one of these "gate" work items until the test
+ * releases gate_lock.  While they do, the test decides which queued work
+ * each thread would take next, without any help from the scheduler. */
+static tor_mutex_t gate_lock;
+static atomic_counter_t n_in_gate;
+
+static workqueue_reply_t
+gate_fn(void *state, void *arg)
+{
+  (void)state;
+  (void)arg;
+  atomic_counter_add(&n_in_gate, 1);
+  tor_mutex_acquire(&gate_lock);
+  tor_mutex_release(&gate_lock);
+  return WQ_RPL_REPLY;
+}
+
+static workqueue_reply_t
+noop_fn(void *state, void *arg)
+{
+  (void)state;
+  (void)arg;
+  return WQ_RPL_REPLY;
+}
+
+static void
+noop_reply_fn(void *arg)
+{
+  (void)arg;
+}
+
+static void *
+new_state(void *arg)
+{
+  (void)arg;
+  return NULL;
+}
+
+static void
+free_state(void *state)
+{
+  (void)state;
+}
+
+/* Start a two-thread pool, and wait until both threads are stuck on a gate
+ * item.  Thread 1 is one of the pool's strict threads, so it never passes
+ * over higher-priority work by chance. */
+static threadpool_t *
+start_gated_pool(void)
+{
+  threadpool_t *pool;
+  int i;
+
+  tor_mutex_init_nonrecursive(&gate_lock);
+  atomic_counter_init(&n_in_gate);
+  tor_mutex_acquire(&gate_lock);
+
+  pool = threadpool_new(2, replyqueue_new(0), new_state, free_state, NULL);
+  if (!pool)
+    return NULL;
+  threadpool_queue_work(pool, gate_fn, noop_reply_fn, NULL);
+  threadpool_queue_work(pool, gate_fn, noop_reply_fn, NULL);
+  for (i = 0; i < 10000 && atomic_counter_get(&n_in_gate) < 2; ++i)
+    tor_sleep_msec(1);
+  if (atomic_counter_get(&n_in_gate) < 2)
+    return NULL;
+  return pool;
+}
+
+/* Release the threads that start_gated_pool() blocked. */
+static void
+release_gated_pool(void)
+{
+  tor_mutex_release(&gate_lock);
+}
+
+/* Work is handed to the threads round-robin.  The two gate items used up the
+ * first two turns, so from here on each queued item goes to thread 1, then
+ * thread 0, then thread 1 again, and so on. */
+#define QUEUE(pool, prio, label)                                        \
+  threadpool_queue_work_priority((pool), (prio), noop_fn, noop_reply_fn, \
+                                 (void *)(label))
+
+static void
+test_threadpool_steal_fifo(void *arg)
+{
+  threadpool_t *pool;
+  workqueue_priority_t prio;
+  const char *a = "a", *b = "b", *c = "c", *d = "d";
+  (void)arg;
+
+  pool = start_gated_pool();
+  tt_assert(pool);
+
+  QUEUE(pool, WQ_PRI_HIGH, a); /* thread 1 */
+  QUEUE(pool, WQ_PRI_HIGH, b); /* thread 0 */
+  QUEUE(pool, WQ_PRI_HIGH, c); /* thread 1 */
+  QUEUE(pool, WQ_PRI_HIGH, d); /* thread 0 */
+
+  /* Thread 1 takes its own work first, oldest first, and then steals
+   * thread 0's, in the same order. */
+  tt_ptr_op(threadpool_take_next_work_for_thread(pool, 1, &prio), OP_EQ, a);
+  tt_ptr_op(threadpool_take_next_work_for_thread(pool, 1, &prio), OP_EQ, c);
+  tt_ptr_op(threadpool_take_next_work_for_thread(pool, 1, &prio), OP_EQ, b);
+  tt_ptr_op(threadpool_take_next_work_for_thread(pool, 1, &prio), OP_EQ, d);
+  tt_ptr_op(threadpool_take_next_work_for_thread(pool, 1, &prio), OP_EQ,
+            NULL);
+  tt_ptr_op(threadpool_take_next_work_for_thread(pool, 0, &prio), OP_EQ,
+            NULL);
+
+ done:
+  release_gated_pool();
+}
+
+static void
+test_threadpool_steal_priority(void *arg)
+{
+  threadpool_t *pool;
+  workqueue_priority_t prio;
+  const char *low1 = "low1", *high0 = "high0", *med1 = "med1",
+    *low0 = "low0", *high1 = "high1";
+  (void)arg;
+
+  pool = start_gated_pool();
+  tt_assert(pool);
+
+  QUEUE(pool, WQ_PRI_LOW, low1);   /* thread 1 */
+  QUEUE(pool, WQ_PRI_HIGH, high0); /* thread 0 */
+  QUEUE(pool, WQ_PRI_MED, med1);   /* thread 1 */
+  QUEUE(pool, WQ_PRI_LOW, low0);   /* thread 0 */
+  QUEUE(pool, WQ_PRI_HIGH, high1); /* thread 1 */
+
+  /* Thread 1 runs all of its own work, highest priority first, before it
+   * steals anything.  Then it steals from thread 0 in the same order. */
+  tt_ptr_op(threadpool_take_next_work_for_thread(pool, 1, &prio), OP_EQ,
+            high1);
+  tt_int_op(prio, OP_EQ, WQ_PRI_HIGH);
+  tt_ptr_op(threadpool_take_next_work_for_thread(pool, 1, &prio), OP_EQ,
+            med1);
+  tt_int_op(prio, OP_EQ, WQ_PRI_MED);
+  tt_ptr_op(threadpool_take_next_work_for_thread(pool, 1, &prio), OP_EQ,
+            low1);
+  tt_int_op(prio, OP_EQ, WQ_PRI_LOW);
+  tt_ptr_op(threadpool_take_next_work_for_thread(pool, 1, &prio), OP_EQ,
+            high0);
+  tt_int_op(prio, OP_EQ, WQ_PRI_HIGH);
+  tt_ptr_op(threadpool_take_next_work_for_thread(pool, 1, &prio), OP_EQ,
+            low0);
+  tt_int_op(prio, OP_EQ, WQ_PRI_LOW);
+  tt_ptr_op(threadpool_take_next_work_for_thread(pool, 1, &prio), OP_EQ,
+            NULL);
+
+ done:
+  release_gated_pool();
+}
+
+#undef QUEUE
+
+/* The cpuworkers' batches go to a gated pool, so they stay queued until the
+ * test takes or cancels them.  The pool only ever runs noop_fn. */
+static threadpool_t *onion_pool = NULL;
+static int n_batches_queued = 0;
+
+static workqueue_entry_t *
+mock_cpuworker_queue_work(workqueue_priority_t priority,
+                          workqueue_reply_t (*fn)(void *, void *),
+                          void (*reply_fn)(void *),
+                          void *arg)
+{
+  (void)fn;
+  (void)reply_fn;
+  ++n_batches_queued;
+  return threadpool_queue_work_priority(onion_pool, priority, noop_fn,
+                                        noop_reply_fn, arg);
+}
+
+static int last_close_reason = 0;
+
+static void
+mock_circuit_mark_for_close(circuit_t *circ, int reason, int line,
+                            const char *file)
+{
+  circ->marked_for_close = line;
+  circ->marked_for_close_file = file;
+  last_close_reason = reason;
+}
+
+/* Queue an ntor onionskin from <b>chan</b>, and return its circuit. */
+static or_circuit_t *
+queue_test_onionskin(channel_t *chan)
+{
+  uint8_t buf[NTOR_ONIONSKIN_LEN] = {0};
+  or_circuit_t *circ = or_circuit_new(0, NULL);
+  create_cell_t *create = tor_malloc_zero(sizeof(create_cell_t));
+
+  TO_CIRCUIT(circ)->purpose = CIRCUIT_PURPOSE_OR;
+  circ->p_chan = chan;
+  create_cell_init(create, CELL_CREATE2, ONION_HANDSHAKE_TYPE_NTOR,
+                   NTOR_ONIONSKIN_LEN, buf);
+  if (onion_pending_add(circ, create) < 0)
+    tor_free(create);
+  return circ;
+}
+
+#define N_BATCH_CIRCS 5
+
+static void
+test_threadpool_onionskin_batch(void *arg)
+{
+  or_circuit_t *circs[N_BATCH_CIRCS];
+  channel_t *chan = new_fake_channel();
+  cpuworker_batch_t *batch;
+  workqueue_priority_t prio;
+  int i;
+  (void)arg;
+
+  memset(circs, 0, sizeof(circs));
+  MOCK(cpuworker_queue_work, mock_cpuworker_queue_work);
+  MOCK(circuit_mark_for_close_, mock_circuit_mark_for_close);
+  onion_pool = start_gated_pool();
+  tt_assert(onion_pool);
+  cpuworker_set_limits_for_testing(2, 64);
+
+  for (i = 0; i < N_BATCH_CIRCS; ++i)
+    circs[i] = queue_test_onionskin(chan);
+  tt_int_op(onion_num_pending(ONION_HANDSHAKE_TYPE_NTOR), OP_EQ,
+            N_BATCH_CIRCS);
+
+  /* With two threads, the first batch takes half the queue.  The rest are
+   * split the same way as the queue drains. */
+  queue_pending_tasks();
+  tt_int_op(onion_num_pending(ONION_HANDSHAKE_TYPE_NTOR), OP_EQ, 0);
+  tt_int_op(n_batches_queued, OP_EQ, 3);
+  tt_assert(circs[0]->workqueue_entry);
+  tt_ptr_op(circs[1]->workqueue_entry, OP_EQ, circs[0]->workqueue_entry);
+  tt_ptr_op(circs[2]->workqueue_entry, OP_EQ, circs[0]->workqueue_entry);
+  tt_assert(circs[3]->workqueue_entry);
+  tt_ptr_op(circs[3]->workqueue_entry, OP_NE, circs[0]->workqueue_entry);
+  tt_assert(circs[4]->workqueue_entry);
+  tt_ptr_op(circs[4]->workqueue_entry, OP_NE, circs[3]->workqueue_entry);
+
+  batch = workqueue_entry_get_arg(circs[0]->workqueue_entry);
+  tt_int_op(batch->n_jobs, OP_EQ, 3);
+  for (i = 0; i < 3; ++i)
+    tt_ptr_op(batch->jobs[i].circ, OP_EQ, circs[i]);
+
+  /* A worker starts on the first batch, so cancelling one of its circuits
+   * just forgets that circuit's answer. */
+  tt_ptr_op(threadpool_take_next_work_for_thread(onion_pool, 1, &prio),
+            OP_EQ, batch);
+  tt_int_op(prio, OP_EQ, WQ_PRI_HIGH);
+  cpuworker_cancel_circ_handshake(circs[2]);
+  tt_ptr_op(circs[2]->workqueue_entry, OP_EQ, NULL);
+  tt_ptr_op(batch->jobs[2].circ, OP_EQ, NULL);
+
+  /* Every job gets a reply; a failed handshake closes its circuit, and the
+   * circuit that was already closing is left alone. */
+  TO_CIRCUIT(circs[1])->marked_for_close = 1;
+  for (i = 0; i < batch->n_jobs; ++i) {
+    memset(&batch->jobs[i].u.reply, 0, sizeof(cpuworker_reply_t));
+    batch->jobs[i].u.reply.magic = CPUWORKER_REPLY_MAGIC;
+  }
+  cpuworker_onion_handshake_replyfn(batch);
+  tt_ptr_op(circs[0]->workqueue_entry, OP_EQ, NULL);
+  tt_assert(TO_CIRCUIT(circs[0])->marked_for_close);
+  tt_int_op(last_close_reason, OP_EQ, END_CIRC_REASON_TORPROTOCOL);
+  tt_ptr_op(circs[1]->workqueue_entry, OP_EQ, NULL);
+  tt_int_op(TO_CIRCUIT(circs[1])->marked_for_close, OP_EQ, 1);
+  tt_assert(! TO_CIRCUIT(circs[2])->marked_for_close);
+
+  /* Freeing a circuit cancels its batch, too. */
+  for (i = 3; i < N_BATCH_CIRCS; ++i) {
+    circs[i]->p_chan = NULL;
+    circuit_free_(TO_CIRCUIT(circs[i]));
+    circs[i] = NULL;
+  }
+  tt_ptr_op(threadpool_take_next_work_for_thread(onion_pool, 1, &prio),
+            OP_EQ, NULL);
+  tt_u64_op(cpuworker_estimated_usec_in_flight(), OP_EQ, 0);
+
+ done:
+  for (i = 0; i < N_BATCH_CIRCS; ++i) {
+    if (!circs[i])
+      continue;
+    circs[i]->p_chan = NULL;
+    circuit_free_(TO_CIRCUIT(circs[i]));
+  }
+  if (onion_pool)
+    release_gated_pool();
+  clear_pending_onions();
+  free_fake_channel(chan);
+  UNMOCK(cpuworker_queue_work);
+  UNMOCK(circuit_mark_for_close_);
+}
+
+static void
+test_threadpool_onionskin_batch_cancel(void *arg)
+{
+  or_circuit_t *circ1 = NULL, *circ2 = NULL;
+  channel_t *chan = new_fake_channel();
+  workqueue_entry_t *ent;
+  workqueue_priority_t prio;
+  (void)arg;
+
+  MOCK(cpuworker_queue_work, mock_cpuworker_queue_work);
+  onion_pool = start_gated_pool();
+  tt_assert(onion_pool);
+  cpuworker_set_limits_for_testing(1, 64);
+
+  circ1 = queue_test_onionskin(chan);
+  circ2 = queue_test_onionskin(chan);
+  queue_pending_tasks();
+  tt_int_op(n_batches_queued, OP_EQ, 1);
+  ent = circ1->workqueue_entry;
+  tt_assert(ent);
+  tt_ptr_op(circ2->workqueue_entry, OP_EQ, ent);
+  tt_u64_op(cpuworker_estimated_usec_in_flight(), OP_GT, 0);
+
+  /* While the other circuit still wants its answer, the batch stays. */
+  cpuworker_cancel_circ_handshake(circ1);
+  tt_ptr_op(circ1->workqueue_entry, OP_EQ, NULL);
+  tt_ptr_op(circ2->workqueue_entry, OP_EQ, ent);
+  tt_u64_op(cpuworker_estimated_usec_in_flight(), OP_GT, 0);
+
+  /* Once nobody wants it, it comes off the queue. */
+  cpuworker_cancel_circ_handshake(circ2);
+  tt_ptr_op(circ2->workqueue_entry, OP_EQ, NULL);
+  tt_u64_op(cpuworker_estimated_usec_in_flight(), OP_EQ, 0);
+  tt_ptr_op(threadpool_take_next_work_for_thread(onion_pool, 1, &prio),
+            OP_EQ, NULL);
+
+ done:
+  if (onion_pool)
+    release_gated_pool();
+  if (circ1) {
+    circ1->p_chan = NULL;
+    circuit_free_(TO_CIRCUIT(circ1));
+  }
+  if (circ2) {
+    circ2->p_chan = NULL;
+    circuit_free_(TO_CIRCUIT(circ2));
+  }
+  clear_pending_onions();
+  free_fake_channel(chan);
+  UNMOCK(cpuworker_queue_work);
+}
+
+struct testcase_t threadpool_tests[] = {
+  { "steal_fifo", test_threadpool_steal_fifo, TT_FORK, NULL, NULL },
+  { "steal_priority", test_threadpool_steal_priority, TT_FORK, NULL, NULL },
+  { "onionskin_batch", test_threadpool_onionskin_batch, TT_FORK, NULL, NULL },
+  { "onionskin_batch_cancel", test_threadpool_onionskin_batch_cancel,
+    TT_FORK, NULL, NULL },
+  END_OF_TESTCASES
+};
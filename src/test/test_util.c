@@ -35,6 +35,7 @@
 #include "lib/intmath/weakrng.h"
 #include "lib/thread/numcpus.h"
 #include "lib/math/fp.h"
+#include "lib/math/histogram.h"
 #include "lib/math/laplace.h"
 #include "lib/meminfo/meminfo.h"
 #include "lib/time/tvdiff.h"
@@ -5037,6 +5038,68 @@ test_util_round_to_next_multiple_of(void *arg)
   ;
 }
 
+static void
+test_util_log_histogram(void *arg)
+{
+  log_histogram_t *hist = NULL;
+  uint32_t v;
+  int i;
+  (void)arg;
+
+  /* Buckets are contiguous, in order, and no more than 25% wide. */
+  tt_int_op(log_histogram_bucket(0), OP_EQ, 0);
+  tt_int_op(log_histogram_bucket(3), OP_EQ, 3);
+  tt_int_op(log_histogram_bucket(4), OP_EQ, 4);
+  tt_int_op(log_histogram_bucket(8), OP_EQ, 8);
+  tt_int_op(log_histogram_bucket(UINT32_MAX), OP_EQ,
+            LOG_HISTOGRAM_N_BUCKETS - 1);
+  tt_u64_op(log_histogram_bucket_max(LOG_HISTOGRAM_N_BUCKETS - 1), OP_EQ,
+            UINT32_MAX);
+  for (i = 0; i < LOG_HISTOGRAM_N_BUCKETS - 1; ++i) {
+    v = log_histogram_bucket_max(i);
+    tt_int_op(log_histogram_bucket(v), OP_EQ, i);
+    tt_int_op(log_histogram_bucket(v + 1), OP_EQ, i + 1);
+    if (i >= 4)
+      tt_u64_op(v - log_histogram_bucket_max(i - 1), OP_LE,
+                (log_histogram_bucket_max(i - 1) + 1) / 4);
+  }
+
+  /* Percentiles come out right to within a bucket. */
+  hist = tor_malloc_zero(sizeof(*hist));
+  tt_int_op(log_histogram_percentile(hist, 50), OP_EQ, 0);
+  for (v = 1; v <= 1000; ++v)
+    log_histogram_add(hist, v);
+  tt_u64_op(hist->n, OP_EQ, 1000);
+  tt_int_op(hist->max, OP_EQ, 1000);
+  tt_int_op(log_histogram_percentile(hist, 50), OP_GE, 500);
+  tt_int_op(log_histogram_percentile(hist, 50), OP_LE, 500 * 5 / 4);
+  tt_int_op(log_histogram_percentile(hist, 99), OP_GE, 990);
+  tt_int_op(log_histogram_percentile(hist, 99), OP_LE, 1000);
+  tt_int_op(log_histogram_percentile(hist, 100), OP_EQ, 1000);
+
+  tt_u64_op(log_histogram_mean(hist), OP_EQ, 500);
+
+  /* Halving forgets old values, so that new ones count for more. */
+  log_histogram_halve(hist);
+  tt_u64_op(hist->n, OP_LE, 500);
+  tt_u64_op(hist->n, OP_GE, 450);
+  for (i = 0; i < 2000; ++i)
+    log_histogram_add(hist, 5000);
+  tt_int_op(log_histogram_percentile(hist, 50), OP_GE, 5000);
+  tt_int_op(hist->max, OP_EQ, 5000);
+
+  /* Halving a histogram with only singletons empties it. */
+  memset(hist, 0, sizeof(*hist));
+  log_histogram_add(hist, 7);
+  log_histogram_halve(hist);
+  tt_u64_op(hist->n, OP_EQ, 0);
+  tt_u64_op(hist->sum, OP_EQ, 0);
+  tt_int_op(hist->max, OP_EQ, 0);
+
+ done:
+  tor_free(hist);
+}
+
 static void
 test_util_laplace(void *arg)
 {
@@ -6174,6 +6237,7 @@ struct testcase_t util_tests[] = {
   UTIL_LEGACY(di_ops),
   UTIL_TEST(di_map, 0),
   UTIL_TEST(round_to_next_multiple_of, 0),
+  UTIL_TEST(log_histogram, 0),
   UTIL_TEST(laplace, 0),
   UTIL_TEST(clamp_double_to_int64, 0),
   UTIL_TEST(find_str_at_start_of_line, 0),
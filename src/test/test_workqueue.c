@@ -25,6 +25,7 @@ static int opt_n_inflight = 1000;
 static int opt_n_lowwater = 250;
 static int opt_n_cancel = 0;
 static int opt_ratio_rsa = 5;
+static int opt_max_replies = 0;
 
 #ifdef TRACK_RESPONSES
 tor_mutex_t bitmap_mutex;
@@ -329,6 +330,7 @@ help(void)
      "  -L <lowwater> Add items whenever fewer than this many are pending\n"
      "  -C <cancel>   Try to cancel N items of every batch that we add\n"
      "  -R <ratio>    Make one out of this many items be a slow (RSA) one\n"
+     "  -M <max>      Handle no more than this many replies per callback\n"
      "  --no-{eventfd2,eventfd,pipe2,pipe,socketpair}\n"
      "                Disable one of the alert_socket backends.");
 }
@@ -357,6 +359,8 @@ main(int argc, char **argv)
       opt_ratio_rsa = atoi(argv[++i]);
     } else if (!strcmp(argv[i], "-C") && i+1<argc) {
       opt_n_cancel = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-M") && i+1<argc) {
+      opt_max_replies = atoi(argv[++i]);
     } else if (!strcmp(argv[i], "--no-eventfd2")) {
       as_flags |= ASOCKS_NOEVENTFD2;
     } else if (!strcmp(argv[i], "--no-eventfd")) {
@@ -379,7 +383,7 @@ main(int argc, char **argv)
   if (opt_n_threads < 1 ||
       opt_n_items < 1 || opt_n_inflight < 1 || opt_n_lowwater < 0 ||
       opt_n_cancel > opt_n_inflight || opt_n_inflight > MAX_INFLIGHT ||
-      opt_ratio_rsa < 0) {
+      opt_ratio_rsa < 0 || opt_max_replies < 0) {
     help();
     return 1;
   }
@@ -404,6 +408,7 @@ main(int argc, char **argv)
     return 77; // 77 means "skipped".
 
   tor_assert(rq);
+  replyqueue_set_max_per_process(rq, (unsigned) opt_max_replies);
   tp = threadpool_new(opt_n_threads,
                       rq, new_state, free_state, NULL);
   tor_assert(tp);